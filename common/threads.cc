@@ -3,6 +3,17 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include "tbb/blocked_range.h"
+#include "tbb/global_control.h"
+#include "tbb/parallel_for.h"
+#include "tbb/task_arena.h"
+#include "tbb/task_scheduler_observer.h"
 
 #include <common/log.hh>
 #include <common/threads.hh>
@@ -15,35 +26,98 @@
 [[noreturn]] void Error(const char *error, ...)
     __attribute__((format(printf,1,2),noreturn));
 
+int numthreads = 1;
+bool threadaffinity = false;
+
 /* Make the locks no-ops if we aren't running threads */
-static bool threads_active = false;
+static std::atomic<int> threads_active { 0 };
+static std::mutex crit;
+
+/*
+ * Dispatch and progress state of one RunThreadsOn / ParallelFor call.
+ * Each call has its own, so work started from inside thread work doesn't
+ * clobber the caller's. Work is handed out with an atomic counter; the
+ * lock is only taken when a worker crosses the next progress step (at most
+ * 50 times per run). Only the outermost call prints progress dots.
+ */
+struct threadwork_t {
+    std::atomic<int> dispatch { 0 };
+    std::atomic<int> progress_next { 0 };
+    int workcount = 0;
+    int oldpercent = -1;    /* protected by ThreadLock */
+    bool progress = false;
+};
+
+/* the work the calling thread is running items of */
+static thread_local threadwork_t *current_work = nullptr;
+/* the work printing progress dots, if any */
+static std::atomic<threadwork_t *> progress_work { nullptr };
 
-static int dispatch;
-static int workcount;
-static int oldpercent = -1;
+void
+ThreadLock(void)
+{
+    if (threads_active)
+        crit.lock();
+}
+
+void
+ThreadUnlock(void)
+{
+    if (threads_active)
+        crit.unlock();
+}
+
+/*
+ * Print progress dots up to the given work item and work out the item at
+ * which the next dot is due.  Must be called with the lock held.
+ */
+static void
+ThreadProgress_Locked(threadwork_t *work, int current)
+{
+    int percent;
+
+    if (!work->progress || work->workcount <= 0) {
+        work->progress_next = INT_MAX;
+        return;
+    }
+
+    percent = static_cast<int>(50LL * current / work->workcount);
+    while (work->oldpercent < percent) {
+        work->oldpercent++;
+        logprint_locked__("%c", (work->oldpercent % 5) ? '.' : '0' + (work->oldpercent / 5));
+    }
+
+    work->progress_next = static_cast<int>(((work->oldpercent + 1LL) * work->workcount + 49) / 50);
+}
+
+static void
+ThreadProgress(threadwork_t *work, int current)
+{
+    if (current < work->progress_next.load(std::memory_order_relaxed))
+        return;
+
+    ThreadLock();
+    ThreadProgress_Locked(work, current);
+    ThreadUnlock();
+}
 
 /*
  * =============
  * GetThreadWork
+ *
+ * Only valid inside a RunThreadsOn func.
  * =============
  */
 int
 GetThreadWork_Locked__(void)
 {
-    int ret;
-    int percent;
+    threadwork_t *work = current_work;
+    const int ret = work->dispatch.fetch_add(1, std::memory_order_relaxed);
 
-    if (dispatch == workcount)
+    if (ret >= work->workcount)
         return -1;
-
-    percent = 50 * dispatch / workcount;
-    while (oldpercent < percent) {
-        oldpercent++;
-        logprint_locked__("%c", (oldpercent % 5) ? '.' : '0' + (oldpercent / 5));
-    }
-
-    ret = dispatch;
-    dispatch++;
+    if (ret >= work->progress_next.load(std::memory_order_relaxed))
+        ThreadProgress_Locked(work, ret);
 
     return ret;
 }
@@ -51,11 +125,12 @@ GetThreadWork_Locked__(void)
 int
 GetThreadWork(void)
 {
-    int ret;
+    threadwork_t *work = current_work;
+    const int ret = work->dispatch.fetch_add(1, std::memory_order_relaxed);
 
-    ThreadLock();
-    ret = GetThreadWork_Locked__();
-    ThreadUnlock();
+    if (ret >= work->workcount)
+        return -1;
+    ThreadProgress(work, ret);
 
     return ret;
 }
@@ -63,25 +138,24 @@ GetThreadWork(void)
 void
 InterruptThreadProgress__(void)
 {
-    if (oldpercent != -1) {
+    threadwork_t *work = progress_work;
+
+    if (work && work->oldpercent != -1) {
         logprint_locked__("\\\n");
-        oldpercent = -1;
+        work->oldpercent = -1;
+        work->progress_next = 0;
     }
 }
 
 /*
  * ===================================================================
- *                              WIN32
+ *                          PLATFORM SPECIFIC
  * ===================================================================
  */
 #ifdef USE_WIN32THREADS
-#define HAVE_THREADS
 
 #include <windows.h>
 
-int numthreads = 1;
-CRITICAL_SECTION crit;
-
 void
 LowerProcessPriority(void)
 {
@@ -98,102 +172,21 @@ GetDefaultThreads(void)
     return info.dwNumberOfProcessors;
 }
 
-void
-ThreadLock(void)
+static void
+PinCurrentThread(int slot)
 {
-    if (threads_active)
-        EnterCriticalSection(&crit);
-}
+    const int cpus = GetDefaultThreads();
+    const int cpu = (slot % cpus) % (8 * sizeof(DWORD_PTR));
 
-void
-ThreadUnlock(void)
-{
-    if (threads_active)
-        LeaveCriticalSection(&crit);
+    SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu);
 }
 
-using functype = void *(*)(void *);
-
-struct threadInfo {
-    functype func;
-    void *arg;
-};
-
-// necessary for calling convention reasons
-DWORD WINAPI ThreadWrapper(LPVOID lpParam) {
-    threadInfo* info = (threadInfo*)lpParam;
-    info->func(info->arg);
-    return 0;
-}
-
-/*
- * =============
- * RunThreadsOn
- * =============
- */
-void
-RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
-{
-    uintptr_t i; /* avoid warning due to cast for the CreateThread API */
-    DWORD *threadid;
-    HANDLE *threadhandle;
-
-    dispatch = start;
-    workcount = workcnt;
-    oldpercent = -1;
-
-    threadid = static_cast<DWORD *>(malloc(sizeof(*threadid) * numthreads));
-    threadhandle = static_cast<HANDLE *>(malloc(sizeof(*threadhandle) * numthreads));
-
-    if (!threadid || !threadhandle)
-        Error("Failed to allocate memory for threads");
-
-    threadInfo info;
-    info.func = func;
-    info.arg = arg;
-
-    /* run threads in parallel */
-    InitializeCriticalSection(&crit);
-    threads_active = true;
-    for (i = 0; i < numthreads; i++) {
-        threadhandle[i] = CreateThread(NULL,
-                                       0,
-                                       ThreadWrapper,
-                                       (LPVOID)&info,
-                                       0,
-                                       &threadid[i]);
-    }
-
-    for (i = 0; i < numthreads; i++)
-        WaitForSingleObject(threadhandle[i], INFINITE);
-
-    threads_active = false;
-    oldpercent = -1;
-    DeleteCriticalSection(&crit);
-
-    logprint("\n");
-
-    free(threadhandle);
-    free(threadid);
-}
-
-#endif /* USE_WIN32THREADS */
-
-/*
- * ===================================================================
- *                               PTHREADS
- * ===================================================================
- */
-
-#ifdef USE_PTHREADS
-#define HAVE_THREADS
+#elif defined(USE_PTHREADS)
 
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 
-int numthreads = 1;
-pthread_mutex_t *my_mutex;
-
 void
 LowerProcessPriority(void)
 {
@@ -216,115 +209,184 @@ GetDefaultThreads(void)
     return threads;
 }
 
-void
-ThreadLock(void)
+static void
+PinCurrentThread(int slot)
 {
-    if (threads_active)
-        pthread_mutex_lock(my_mutex);
-}
+#if defined(__linux__)
+    cpu_set_t set;
 
-void
-ThreadUnlock(void)
-{
-    if (threads_active)
-        pthread_mutex_unlock(my_mutex);
+    CPU_ZERO(&set);
+    CPU_SET(slot % GetDefaultThreads(), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)slot; /* macOS has no hard affinity API */
+#endif
 }
 
+#else
+
+void LowerProcessPriority(void) {}
+int GetDefaultThreads(void) { return 1; }
+static void PinCurrentThread(int slot) { (void)slot; }
+
+#endif
 
 /*
- * =============
- * RunThreadsOn
- * =============
+ * ===================================================================
+ *                            THREAD POOL
+ * ===================================================================
  */
-void
-RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
-{
-    pthread_t *threads;
-    pthread_mutexattr_t mattrib;
-    pthread_attr_t attrib;
-    int status;
-    int i;
-
-    dispatch = start;
-    workcount = workcnt;
-    oldpercent = -1;
-
-    status = pthread_mutexattr_init(&mattrib);
-    if (status)
-        Error("pthread_mutexattr_init failed");
-
-    my_mutex = static_cast<pthread_mutex_t *>(malloc(sizeof(*my_mutex)));
-    if (!my_mutex)
-        Error("failed to allocate memory for thread mutex");
-    status = pthread_mutex_init(my_mutex, &mattrib);
-    if (status)
-        Error("pthread_mutex_init failed");
-
-    status = pthread_attr_init(&attrib);
-    if (status)
-        Error("pthread_attr_init failed");
-
-    threads = static_cast<pthread_t *>(malloc(sizeof(*threads) * numthreads));
-    if (!threads)
-        Error("failed to allocate memory for threads");
-
-    threads_active = true;
-
-    for (i = 0; i < numthreads; i++) {
-        status = pthread_create(&threads[i], &attrib, func, arg);
-        if (status)
-            Error("pthread_create failed");
+
+/* Pins each thread to a CPU as it joins the pool arena */
+class affinity_observer_t : public tbb::task_scheduler_observer {
+public:
+    affinity_observer_t(tbb::task_arena &arena)
+        : tbb::task_scheduler_observer(arena) {
+        observe(true);
     }
 
-    for (i = 0; i < numthreads; i++) {
-        status = pthread_join(threads[i], NULL);
-        if (status)
-            Error("pthread_join failed");
+    /* the thread that started the work joins the arena too, leave it alone */
+    void on_scheduler_entry(bool is_worker) override {
+        if (is_worker)
+            PinCurrentThread(tbb::this_task_arena::current_thread_index());
     }
+};
 
-    threads_active = false;
-    oldpercent = -1;
+/*
+ * The pool lives for the rest of the process so that worker threads are
+ * created once rather than per phase.  It is rebuilt only if numthreads
+ * or threadaffinity change between phases.
+ */
+struct threadpool_t {
+    int concurrency = 0;
+    bool affinity = false;
+    std::unique_ptr<tbb::global_control> limit; /* allow more threads than cores */
+    std::unique_ptr<tbb::task_arena> arena;
+    std::unique_ptr<affinity_observer_t> observer; /* destroyed first */
+};
 
-    status = pthread_mutex_destroy(my_mutex);
-    if (status)
-        Error("pthread_mutex_destroy failed");
+static threadpool_t threadpool;
 
-    free(threads);
-    free(my_mutex);
+static tbb::task_arena &
+ThreadPool(void)
+{
+    const int concurrency = (numthreads > 1) ? numthreads : 1;
+
+    if (!threadpool.arena || threadpool.concurrency != concurrency
+        || threadpool.affinity != threadaffinity) {
+        threadpool.observer.reset();
+        threadpool.arena.reset();
+        threadpool.limit = std::make_unique<tbb::global_control>(
+            tbb::global_control::max_allowed_parallelism, concurrency);
+        threadpool.arena = std::make_unique<tbb::task_arena>(concurrency);
+        threadpool.arena->initialize();
+        threadpool.concurrency = concurrency;
+        threadpool.affinity = threadaffinity;
+        if (threadaffinity)
+            threadpool.observer = std::make_unique<affinity_observer_t>(*threadpool.arena);
+    }
 
-    logprint("\n");
+    return *threadpool.arena;
 }
 
-#endif /* USE_PTHREADS */
+int
+GetThreadNum(void)
+{
+    const int slot = tbb::this_task_arena::current_thread_index();
 
-/*
- * =======================================================================
- *                                SINGLE THREAD
- * =======================================================================
- */
+    if (slot < 0 || slot >= threadpool.concurrency)
+        return 0;
+    return slot;
+}
 
-#ifndef HAVE_THREADS
+static void
+BeginThreadWork(threadwork_t *work, int start, int workcnt)
+{
+    work->dispatch = start;
+    work->workcount = workcnt;
+    work->oldpercent = -1;
+    work->progress_next = 0;
+    work->progress = (threads_active.fetch_add(1) == 0);
+    if (work->progress)
+        progress_work = work;
+}
 
-int numthreads = 1;
+static void
+EndThreadWork(threadwork_t *work)
+{
+    if (work->progress)
+        progress_work = nullptr;
+    threads_active--;
 
-void ThreadLock(void) {}
-void ThreadUnlock(void) {}
+    if (work->progress)
+        logprint("\n");
+}
+
+/* runs body with work as the calling thread's current work */
+template <class F>
+static void
+WithThreadWork(threadwork_t *work, const F &body)
+{
+    threadwork_t *outer = current_work;
+    current_work = work;
+    body();
+    current_work = outer;
+}
 
 /*
  * =============
  * RunThreadsOn
+ *
+ * Compatibility shim: runs numthreads copies of func on the pool, each of
+ * which pulls work items with GetThreadWork until it returns -1.
  * =============
  */
 void
 RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
 {
-    dispatch = start;
-    workcount = workcnt;
-    oldpercent = -1;
-
-    func(arg);
+    tbb::task_arena &arena = ThreadPool();
+    const int workers = arena.max_concurrency();
+    threadwork_t work;
+
+    BeginThreadWork(&work, start, workcnt);
+    arena.execute([&]() {
+        tbb::parallel_for(0, workers, [&](int) {
+            WithThreadWork(&work, [&]() { func(arg); });
+        }, tbb::simple_partitioner());
+    });
+    EndThreadWork(&work);
+}
 
-    logprint("\n");
+void
+ParallelForRange(int start, int workcnt, int grainsize,
+                 const std::function<void(int, int)> &func)
+{
+    tbb::task_arena &arena = ThreadPool();
+    std::atomic<int> done { start };
+    threadwork_t work;
+
+    BeginThreadWork(&work, start, workcnt);
+    arena.execute([&]() {
+        auto body = [&](const tbb::blocked_range<int> &range) {
+            func(range.begin(), range.end());
+            ThreadProgress(&work, done.fetch_add(static_cast<int>(range.size()),
+                                                 std::memory_order_relaxed));
+        };
+        if (grainsize > 0) {
+            tbb::parallel_for(tbb::blocked_range<int>(start, workcnt, grainsize),
+                              body, tbb::simple_partitioner());
+        } else {
+            tbb::parallel_for(tbb::blocked_range<int>(start, workcnt), body);
+        }
+    });
+    EndThreadWork(&work);
 }
 
-#endif
+void
+ParallelFor(int start, int workcnt, const std::function<void(int)> &func)
+{
+    ParallelForRange(start, workcnt, 0, [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+            func(i);
+    });
+}
@@ -22,6 +22,7 @@
 
 #include <common/aabb.hh>
 
+#include <algorithm>
 #include <utility> // for std::pair
 #include <vector>
 #include <set>
@@ -110,14 +111,16 @@ private:
         node->m_leafNode = false;
     }
     
-    void queryTouchingBBox(octree_nodeid thisNode, const aabb3f &query, std::set<T> &dest) const {
+    // Container is a std::set, or a std::vector that may collect duplicates
+    template <class Container>
+    void queryTouchingBBox(octree_nodeid thisNode, const aabb3f &query, Container &dest) const {
         const octree_node_t<T> *node = &m_nodes[thisNode];
         
         if (node->m_leafNode) {
             // Test all objects
             for (const auto &boxObjPair : node->m_leafObjects) {
                 if (!query.disjoint(boxObjPair.first)) {
-                    dest.insert(boxObjPair.second);
+                    dest.insert(dest.end(), boxObjPair.second);
                 }
             }
             return;
@@ -181,6 +184,14 @@ public:
         return res_vec;
     }
     
+    // same as above, but fills dest reusing its storage (sorted, no duplicates)
+    void queryTouchingBBox(const aabb3f &query, std::vector<T> *dest) const {
+        dest->clear();
+        queryTouchingBBox(0, query, *dest);
+        std::sort(dest->begin(), dest->end());
+        dest->erase(std::unique(dest->begin(), dest->end()), dest->end());
+    }
+    
     octree_t(const aabb3f &box) {
         this->m_nodes.push_back(octree_node_t<T>(box, 0));
     }
@@ -3,7 +3,10 @@
 #ifndef __COMMON_THREADS_H__
 #define __COMMON_THREADS_H__
 
+#include <functional>
+
 extern int numthreads;
+extern bool threadaffinity; /* pin pool threads to CPUs (-threadaffinity) */
 
 void LowerProcessPriority(void);
 int GetDefaultThreads(void);
@@ -14,6 +17,21 @@ void RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg);
 void ThreadLock(void);
 void ThreadUnlock(void);
 
+/*
+ * Persistent work-stealing thread pool.
+ *
+ * ParallelFor calls func(i) for each i in [start, workcnt), ParallelForRange
+ * calls func(begin, end) on sub-ranges of at most grainsize items
+ * (0 = let the scheduler pick). Both block until all work is done and
+ * print the usual progress dots.
+ */
+void ParallelFor(int start, int workcnt, const std::function<void(int)> &func);
+void ParallelForRange(int start, int workcnt, int grainsize,
+                      const std::function<void(int, int)> &func);
+
+/* Index of the calling pool thread in [0, numthreads); 0 outside the pool */
+int GetThreadNum(void);
+
 /* Call if needing to print to stdout - should be called with lock held */
 void InterruptThreadProgress__(void);
 
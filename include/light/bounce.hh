@@ -24,8 +24,9 @@
 #include <common/cmdlib.hh>
 #include <common/mathlib.hh>
 
+#include <light/light.hh>
+
 #include <vector>
-#include <map>
 
 #include <common/qvec.hh>
 
@@ -33,7 +34,7 @@ typedef struct {
     std::vector<qvec3f> poly;
     std::vector<qvec4f> poly_edgeplanes;
     qvec3f pos;
-    std::map<int, qvec3f> colorByStyle;
+    stylecolors_t colorByStyle;
     qvec3f componentwiseMaxColor; // cached maximum color in the colorByStyle, used for culling so we don't need to loop through colorByStyle
     qvec3f surfnormal;
     float area;
@@ -43,10 +44,42 @@ typedef struct {
     vec3_t maxs;
 } bouncelight_t;
 
+/*
+ * Node of the light tree over the bounce lights. A node can stand in for all
+ * of the bounce lights below it: `light` is an aggregate with the position and
+ * normal of the brightest one, the summed area, and area-weighted colors.
+ */
+typedef struct {
+    int children[2];    // node indices, -1 for a leaf
+    int vplnum;         // leaf only: index into BounceLights()
+    bouncelight_t light;
+    
+    /* bounds of the bounce light positions, for distance bounds */
+    vec3_t mins;
+    vec3_t maxs;
+} bouncelightnode_t;
+
+/// read-only run of bounce light numbers (indices into BounceLights())
+class bouncelightnums_t {
+private:
+    const int *m_begin;
+    const int *m_end;
+    
+public:
+    bouncelightnums_t(const int *b, const int *e) : m_begin(b), m_end(e) { }
+    
+    const int *begin() const { return m_begin; }
+    const int *end() const { return m_end; }
+    size_t size() const { return static_cast<size_t>(m_end - m_begin); }
+    bool empty() const { return m_begin == m_end; }
+    int operator[](size_t i) const { return m_begin[i]; }
+};
+
 // public functions
 
 const std::vector<bouncelight_t> &BounceLights();
-const std::vector<int> &BounceLightsForFaceNum(int facenum);
+const std::vector<bouncelightnode_t> &BounceLightTree(); // root is node 0
+bouncelightnums_t BounceLightsForFaceNum(int facenum);
 void MakeTextureColors (const mbsp_t *bsp);
 void MakeBounceLights (const globalconfig_t &cfg, const mbsp_t *bsp);
 void Face_LookupTextureColor (const mbsp_t *bsp, const bsp2_dface_t *face, vec3_t color); //mxd
@@ -172,6 +172,14 @@ public:
 std::string TargetnameForLightStyle(int style);
 const std::vector<light_t>& GetLights();
 const std::vector<sun_t>& GetSuns();
+/* -skydome: the domes, the upper hemisphere ray directions and the azimuth of one grid cell */
+const std::vector<skydome_t>& GetSkyDomes();
+const std::vector<qvec3f>& GetSkyDomeDirs();
+float SkyDome_AngleStep();
+/* index of the face's texture among the domes' _suntexture names, or -1 */
+int SkyDome_TextureForFace(int facenum);
+/* fills result with the indices into GetLights() of lights that may reach the given box, ascending */
+void LightsTouchingBounds(const vec3_t mins, const vec3_t maxs, std::vector<int> *result);
 
 const entdict_t *FindEntDictWithKeyPair(const std::string &key, const std::string &value);
 const char *ValueForKey(const light_t *ent, const char *key);
@@ -184,7 +192,7 @@ void LoadEntities(const globalconfig_t &cfg, const mbsp_t *bsp);
 void SetupLights(const globalconfig_t &cfg, const mbsp_t *bsp);
 bool ParseLightsFile(const char *fname);
 void WriteEntitiesToString(const globalconfig_t &cfg, mbsp_t *bsp);
-void EstimateVisibleBoundsAtPoint(const vec3_t point, vec3_t mins, vec3_t maxs);
+void EstimateVisibleBoundsAtPoint(const mbsp_t *bsp, const vec3_t point, vec3_t mins, vec3_t maxs);
 
 bool EntDict_CheckNoEmptyValues(const mbsp_t *bsp, const entdict_t &entdict);
 
@@ -35,6 +35,8 @@
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
+#include <algorithm>
 #include <cassert>
 #include <limits>
 #include <sstream>
@@ -73,6 +75,23 @@ public:
     float anglescale;
     int style;
     std::string suntexture;
+    int dome = -1;      // index into GetSkyDomes() if this sun is lit by LightFace_SkyDomes
+};
+
+/**
+ * A "_sunlight2" / "_sunlight3" dome lit in one pass by -skydome: every sample
+ * point traces one shared set of hemisphere rays for all the domes instead of
+ * one ray per dome sun.
+ */
+class skydome_t {
+public:
+    bool lower;         // _sunlight3, lit from below
+    vec_t light;        // total for the dome, split evenly over the rays
+    vec3_t color;
+    qboolean dirt;
+    float anglescale;
+    int style;
+    int suntexture;     // SkyDome_TextureForFace() value to match, -1 for any sky
 };
 
 /* for vanilla this would be 18. some engines allow higher limits though, which will be needed if we're scaling lightmap resolution. */
@@ -91,11 +110,74 @@ class globalconfig_t;
 class lightmap_t {
 public:
     int style;
-    lightsample_t *samples; // malloc'ed array of numpoints   //FIXME: this is stupid, we shouldn't need to allocate extra data here for -extra4
+    lightsample_t *samples; // array of numpoints, owned by the thread's lightsurf arena   //FIXME: this is stupid, we shouldn't need to allocate extra data here for -extra4
 };
 
 using lightmapdict_t = std::vector<lightmap_t>;
 
+/* styles a stylecolors_t holds without allocating; a bounce patch rarely sees more than a couple */
+#define STYLECOLORS_INLINE 16
+
+/**
+ * Small style -> color table, kept sorted by style so it iterates like the
+ * std::map<int, qvec3f> it replaced. Used for the direct light gathered at
+ * bounce patches and the colors bounce lights emit. Entries live in a fixed
+ * inline array until there are more than STYLECOLORS_INLINE of them, then
+ * all of them move to the heap.
+ */
+class stylecolors_t {
+public:
+    using value_type = std::pair<int, qvec3f>;
+
+private:
+    int m_count = 0;
+    value_type m_entries[STYLECOLORS_INLINE];
+    std::vector<value_type> m_spill; // every entry once the inline array overflows
+
+    const value_type *data() const { return m_spill.empty() ? m_entries : m_spill.data(); }
+    value_type *data() { return m_spill.empty() ? m_entries : m_spill.data(); }
+
+public:
+    const value_type *begin() const { return data(); }
+    const value_type *end() const { return data() + m_count; }
+    value_type *begin() { return data(); }
+    value_type *end() { return data() + m_count; }
+    int size() const { return m_count; }
+    bool empty() const { return m_count == 0; }
+
+    const value_type *find(int style) const {
+        for (const value_type &entry : *this) {
+            if (entry.first == style)
+                return &entry;
+        }
+        return end();
+    }
+
+    /* Adds color to the entry for style, creating it if needed */
+    void add(int style, const qvec3f &color) {
+        value_type *entries = data();
+        int i = 0;
+        for (; i < m_count && entries[i].first < style; i++)
+            ;
+        if (i < m_count && entries[i].first == style) {
+            entries[i].second = entries[i].second + color;
+            return;
+        }
+
+        if (m_spill.empty() && m_count < STYLECOLORS_INLINE) {
+            std::copy_backward(m_entries + i, m_entries + m_count, m_entries + m_count + 1);
+            m_entries[i] = value_type(style, color);
+            m_count++;
+            return;
+        }
+
+        if (m_spill.empty())
+            m_spill.assign(m_entries, m_entries + m_count);
+        m_spill.insert(m_spill.begin() + i, value_type(style, color));
+        m_count++;
+    }
+};
+
 /*Warning: this stuff needs explicit initialisation*/
 typedef struct {
     const globalconfig_t *cfg;
@@ -121,16 +203,16 @@ typedef struct {
     vec3_t midpoint;
     
     int numpoints;
-    vec3_t *points; // malloc'ed array of numpoints
-    vec3_t *normals; // malloc'ed array of numpoints
-    bool *occluded; // malloc'ed array of numpoints
-    int *realfacenums; // malloc'ed array of numpoints
+    vec3_t *points; // array of numpoints, owned by the thread's lightsurf arena
+    vec3_t *normals; // array of numpoints, owned by the thread's lightsurf arena
+    bool *occluded; // array of numpoints, owned by the thread's lightsurf arena
+    int *realfacenums; // array of numpoints, owned by the thread's lightsurf arena
     
     /*
      raw ambient occlusion amount per sample point, 0-1, where 1 is
      fully occluded. dirtgain/dirtscale are not applied yet
      */
-    vec_t *occlusion; // malloc'ed array of numpoints
+    vec_t *occlusion; // array of numpoints, owned by the thread's lightsurf arena
     
     /* for sphere culling */
     vec3_t origin;
@@ -149,6 +231,9 @@ typedef struct {
     /* for lit water. receive light from either front or back. */
     bool twosided;
     
+    /* PVS bits of the leafs the samples can be in, for -pvscull. empty = don't cull */
+    std::vector<int> pvsbits;
+    
     // ray batch stuff
     raystream_occlusion_t *occlusion_stream;
     raystream_intersection_t *intersection_stream;
@@ -191,6 +276,9 @@ extern int softsamples;
 extern const vec3_t vec3_white;
 extern float surflight_subdivide;
 extern int sunsamples;
+extern int skydome_samples;
+extern int surflight_samples;
+extern tracer_t tracer;
 
 extern int dump_facenum;
 extern bool dump_face;
@@ -277,6 +365,7 @@ public:
     /* dirt */
     lockable_bool_t globalDirt;          // apply dirt to all lights (unless they override it) + sunlight + minlight?
     lockable_vec_t dirtMode, dirtDepth, dirtScale, dirtGain, dirtAngle;
+    lockable_vec_t dirtThreshold;   // adaptive dirt: stop tracing a sample once its occlusion is known to +/- this, 0 = trace all vectors
     
     lockable_bool_t minlightDirt;   // apply dirt to minlight?
     
@@ -288,6 +377,7 @@ public:
     lockable_bool_t bounce;
     lockable_bool_t bouncestyled;
     lockable_vec_t bouncescale, bouncecolorscale;
+    lockable_vec_t bouncecuterror;
     
     /* Q2 surface lights (mxd) */
     lockable_vec_t surflightscale;
@@ -329,6 +419,7 @@ public:
         dirtScale {"dirtscale", 1.0f, 0.0f, 100.0f},
         dirtGain {"dirtgain", 1.0f, 0.0f, 100.0f},
         dirtAngle {"dirtangle", 88.0f, 0.0f, 90.0f},
+        dirtThreshold {"dirtthreshold", 0.0f, 0.0f, 1.0f},
         minlightDirt {"minlight_dirt", false},
 
         /* phong */
@@ -340,6 +431,7 @@ public:
         bouncestyled {"bouncestyled", false},
         bouncescale {"bouncescale", 1.0f, 0.0f, 100.0f},
         bouncecolorscale {"bouncecolorscale", 0.0f, 0.0f, 1.0f},
+        bouncecuterror {"bouncecuterror", 0.0f, 0.0f, 1.0f},
 
         /* Q2 surface lights (mxd) */
         surflightscale       { "surflightscale", 0.3f }, // Strange defaults to match arghrad3 look...
@@ -373,10 +465,10 @@ public:
             &spotlightautofalloff, //mxd
             &compilerstyle_start,
             &globalDirt,
-            &dirtMode, &dirtDepth, &dirtScale, &dirtGain, &dirtAngle,
+            &dirtMode, &dirtDepth, &dirtScale, &dirtGain, &dirtAngle, &dirtThreshold,
             &minlightDirt,
             &phongallowed,
-            &bounce, &bouncestyled, &bouncescale, &bouncecolorscale,
+            &bounce, &bouncestyled, &bouncescale, &bouncecolorscale, &bouncecuterror,
             &surflightscale, &surflightbouncescale, &surflightsubdivision, //mxd
             &sunlight,
             &sunlight_color,
@@ -399,6 +491,7 @@ public:
 extern uint8_t *filebase;
 extern uint8_t *lit_filebase;
 extern uint8_t *lux_filebase;
+extern int lit_filesize;
 
 extern int oversample;
 extern int write_litfile;
@@ -407,6 +500,12 @@ extern qboolean onlyents;
 extern qboolean scaledonly;
 extern surfflags_t *extended_texinfo_flags;
 extern qboolean novisapprox;
+extern bool pvscull;
+extern bool sortrays;
+extern bool lightcache;
+extern bool adaptive;
+extern float adaptive_threshold;
+extern bool texturefilter;
 extern bool nolights;
 extern bool litonly;
 
@@ -418,7 +517,7 @@ extern char mapfilename[1024];
 lockable_setting_t *FindSetting(std::string name);
 void SetGlobalSetting(std::string name, std::string value, bool cmdline);
 void FixupGlobalSettings(void);
-void GetFileSpace(uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int size);
+void GetFileSpace(int facenum, bool facesup, uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int size);
 void GetFileSpace_PreserveOffsetInBsp(uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int lightofs);
 const modelinfo_t *ModelInfoForModel(const mbsp_t *bsp, int modelnum);
 /**
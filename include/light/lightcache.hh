@@ -0,0 +1,126 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#ifndef __LIGHT_LIGHTCACHE_H__
+#define __LIGHT_LIGHTCACHE_H__
+
+#include <common/cmdlib.hh>
+#include <common/mathlib.hh>
+#include <common/bspfile.hh>
+#include <light/light.hh>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Incremental relighting (-lightcache).
+ *
+ * For every lightmapped face (and facesup_t) the light and sun contributions
+ * are recorded exactly as LightFace_Entity / LightFace_Sky added them to the
+ * lightmaps, and written to <map>.lightcache after lighting. On the next run
+ * a light whose settings hash is unchanged, on a face whose sample points are
+ * unchanged, is replayed from the cache instead of being traced. Replaying
+ * repeats the same additions in the same order, so the result is identical
+ * to a full relight.
+ *
+ * Anything that affects every light (geometry, textures, non-light entities,
+ * global settings) is folded into one global key; if that changes the whole
+ * cache is dropped. Surface lights, -skydome domes, bounce, minlight and
+ * dirt are always recomputed.
+ */
+
+/* FNV-1a, used for all the cache keys */
+class lightcache_hash_t {
+private:
+    uint64_t _value = 14695981039346656037ULL;
+
+public:
+    void add(const void *data, size_t size) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < size; i++) {
+            _value ^= bytes[i];
+            _value *= 1099511628211ULL;
+        }
+    }
+    void addInt(int64_t v) { add(&v, sizeof(v)); }
+    void addFloat(float v) { add(&v, sizeof(v)); }
+    void addFloats(const float *v, int count) { add(v, sizeof(*v) * count); }
+    void addVecs(const vec_t *v, int count) { add(v, sizeof(*v) * count); }
+    void addString(const std::string &s) { addInt(s.size()); add(s.data(), s.size()); }
+    uint64_t value() const { return _value; }
+};
+
+/* one lightmap addition: samples[point] += color / direction in style */
+typedef struct {
+    int32_t style;
+    int32_t point;
+    vec3_t color;
+    vec3_t direction;
+} lightcache_sample_t;
+
+/* everything one light or sun added to one face */
+typedef struct {
+    uint64_t key;
+    bool traced;        // false if the light was culled before touching the lightmaps
+    int32_t style;      // style of the first Lightmap_ForStyle call
+    std::vector<lightcache_sample_t> samples;
+} lightcache_source_t;
+
+typedef struct {
+    uint64_t key;       // 0 = no entry
+    std::vector<lightcache_source_t> sources;
+} lightcache_face_t;
+
+/* index of a face / facesup_t entry in the cache */
+static inline int LightCache_Slot(int facenum, bool facesup) { return facenum * 2 + (facesup ? 1 : 0); }
+
+/* key for everything apart from the lights, suns and the face itself */
+uint64_t LightCache_GlobalKey(const mbsp_t *bsp, globalconfig_t &cfg);
+/* compute the keys and load the previous run's cache, if it is still valid */
+void LightCache_Load(const mbsp_t *bsp, globalconfig_t &cfg, const char *filename);
+void LightCache_Save(const char *filename);
+bool LightCache_Active();
+
+uint64_t LightCache_LightKey(int lightnum);
+uint64_t LightCache_SunKey(int sunnum);
+uint64_t LightCache_FaceKey(const lightsurf_t *lightsurf);
+
+/* entry recorded by the previous run for this slot, or nullptr if its key differs */
+lightcache_face_t *LightCache_PreviousFace(int slot, uint64_t key);
+/* entry to record this run's contributions in, reset to the given key */
+lightcache_face_t *LightCache_NewFace(int slot, uint64_t key);
+
+/*
+ * Ambient occlusion cache (-dirtcache).
+ *
+ * lightsurf->occlusion only depends on the geometry, the shadow casting
+ * entities and the dirt settings, so it is saved to <map>.dirtcache and
+ * reused for faces whose sample points haven't moved.
+ */
+/* key for everything the dirt depends on apart from the sample points */
+uint64_t DirtCache_GlobalKey(const mbsp_t *bsp, const globalconfig_t &cfg);
+void DirtCache_Load(const mbsp_t *bsp, const globalconfig_t &cfg, const char *filename);
+void DirtCache_Save(const char *filename);
+bool DirtCache_Active();
+
+uint64_t DirtCache_FaceKey(const lightsurf_t *lightsurf);
+/* copies the cached occlusion for the slot into occlusion, false if there is none */
+bool DirtCache_Lookup(int slot, uint64_t key, vec_t *occlusion, int numpoints);
+void DirtCache_Store(int slot, uint64_t key, const vec_t *occlusion, int numpoints);
+
+#endif /* __LIGHT_LIGHTCACHE_H__ */
@@ -44,6 +44,13 @@ extern std::atomic<uint32_t> total_light_rays, total_light_ray_hits, total_sampl
 extern std::atomic<uint32_t> total_bounce_rays, total_bounce_ray_hits;
 extern std::atomic<uint32_t> total_surflight_rays, total_surflight_ray_hits; //mxd
 extern std::atomic<uint32_t> fully_transparent_lightmaps;
+extern std::atomic<uint32_t> total_pvs_culled_pairs;
+extern std::atomic<uint32_t> total_lightcache_reused, total_lightcache_missed;
+extern std::atomic<uint32_t> total_dirtcache_reused, total_dirtcache_missed;
+extern std::atomic<uint64_t> total_dirt_rays, total_dirt_rays_saved;
+extern std::atomic<uint32_t> total_adaptive_texels, total_adaptive_refined;
+extern std::atomic<uint32_t> total_multiscale_texels, total_multiscale_traced;
+extern std::atomic<uint64_t> total_skydome_rays;
 
 class faceextents_t {
 private:
@@ -77,9 +84,21 @@ void WorldToTexCoord(const vec3_t world, const gtexinfo_t *tex, vec_t coord[2]);
 void PrintFaceInfo(const bsp2_dface_t *face, const mbsp_t *bsp);
 // FIXME: remove light param. add normal param and dir params.
 vec_t GetLightValue(const globalconfig_t &cfg, const light_t *entity, vec_t dist);
-std::map<int, qvec3f> GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t origin, const vec3_t normal);
+float GetLightDist(const globalconfig_t &cfg, const light_t *entity, vec_t desiredLight);
+void GetLightContrib(const globalconfig_t &cfg, const light_t *entity, const vec3_t surfnorm, const vec3_t surfpoint, bool twosided,
+                     vec3_t color_out, vec3_t surfpointToLightDir_out, vec3_t normalmap_addition_out, float *dist_out);
+void LightSamples_Entity(const globalconfig_t &cfg, const light_t *entity, bool twosided,
+                         int numpoints, const vec3_t *points, const vec3_t *normals,
+                         vec_t *add_out, vec3_t *dir_out, vec_t *dist_out);
+stylecolors_t GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t origin, const vec3_t normal);
 void SetupDirt(globalconfig_t &cfg);
 float DirtAtPoint(const globalconfig_t &cfg, raystream_intersection_t *rs, const vec3_t point, const vec3_t normal, const modelinfo_t *selfshadow);
+float EstimateLightFaceCost(const mbsp_t *bsp, const bsp2_dface_t *face, const facesup_t *facesup, const globalconfig_t &cfg);
+void SetupPVSCulling(const mbsp_t *bsp);
+void SetupPVSBounds(const mbsp_t *bsp);
+bool PVS_VisibleBoundsAtPoint(const mbsp_t *bsp, const vec3_t point, vec3_t mins, vec3_t maxs);
 void LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globalconfig_t &cfg);
+// lights both the face and its facesup_t, which has a different lightmap scale
+void LightFace_MultiScale(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globalconfig_t &cfg);
 
 #endif /* __LIGHT_LTFACE_H__ */
@@ -45,6 +45,10 @@ enum class hittype_t : uint8_t {
 
 uint32_t clamp_texcoord(vec_t in, uint32_t width);
 color_rgba SampleTexture(const bsp2_dface_t *face, const mbsp_t *bsp, const vec3_t point); //mxd. Palette index -> RGBA
+// table lookups for the ray filters, valid after MakeTnodes. faces without a texture are opaque / return 0.
+// without -texturefilter the tables are empty, and SampleTexture keeps returning 0 like the old stub
+bool Face_TexelOpaque(int facenum, const vec3_t point);
+color_rgba Face_SampleTexel(int facenum, const vec3_t point);
 
 class modelinfo_t;
 
@@ -80,6 +84,16 @@ public:
     virtual void getPushedRayNormalContrib(size_t j, vec3_t out) = 0;
     virtual int getPushedRayDynamicStyle(size_t j) = 0;
     virtual void clearPushedRays() = 0;
+    
+    /**
+     * Bulk accessors: arrays of numPushedRays() entries in push order, valid
+     * until the next pushRay() or clearPushedRays(). Lets the caller walk a
+     * traced batch without a virtual call per ray.
+     */
+    virtual const int *getPushedRayPointIndices() = 0;
+    virtual const vec3_t *getPushedRayColors() = 0;
+    virtual const vec3_t *getPushedRayNormalContribs() = 0;
+    virtual const int *getPushedRayDynamicStyles() = 0;
 
 public:
     void pushRay(int i, const qvec3f &origin, const qvec3f &dir, float dist) {
@@ -102,6 +116,7 @@ public:
     virtual float getPushedRayHitDist(size_t j) = 0;
     virtual hittype_t getPushedRayHitType(size_t j) = 0;
     virtual const bsp2_dface_t *getPushedRayHitFace(size_t j) = 0;
+    virtual const hittype_t *getPushedRayHitTypes() = 0; // bulk accessor, see above
 
     virtual ~raystream_intersection_t() = default;
 };
@@ -110,6 +125,7 @@ class raystream_occlusion_t : public virtual raystream_common_t {
 public:
     virtual void tracePushedRaysOcclusion(const modelinfo_t *self) = 0;
     virtual bool getPushedRayOccluded(size_t j) = 0;
+    virtual const bool *getPushedRaysOccluded() = 0; // bulk accessor, see above
 
     virtual ~raystream_occlusion_t() = default;
 };
@@ -117,6 +133,52 @@ public:
 raystream_intersection_t *MakeIntersectionRayStream(int maxrays);
 raystream_occlusion_t *MakeOcclusionRayStream(int maxrays);
 
+/* ray tracing backend used by the functions above (-tracer) */
+enum class tracer_t {
+    EMBREE,
+    BVH
+};
+
 void MakeTnodes(const mbsp_t *bsp);
 
+/*
+ * Shared by the tracer backends
+ *
+ * Ray / geometry masks: a hit is only considered when the ray's mask and the
+ * geometry's mask share a bit, which lets _shadowworldonly and _shadowself
+ * models be skipped by the rays they don't shadow without running a filter.
+ */
+constexpr unsigned TRACE_MASK_ALWAYS = 1;           // seen by every ray
+constexpr unsigned TRACE_MASK_WORLDONLY = 2;        // _shadowworldonly, seen by rays from the world
+constexpr int TRACE_MASK_SELF_FIRST = 2;            // bit of the first _shadowself model
+constexpr int TRACE_MAX_SELF_MASKS = 32 - TRACE_MASK_SELF_FIRST;
+
+/* the shadow casting faces, sorted by how rays treat them */
+struct tracefaces_t {
+    std::vector<const bsp2_dface_t *> sky;          // always occludes, hittype_t::SKY
+    std::vector<const bsp2_dface_t *> solid;        // always occludes
+    std::vector<const bsp2_dface_t *> filter;       // fences, glass and the rest: Trace_FilterHit decides
+    std::vector<const bsp2_dface_t *> switchable;   // never occludes, records the model's switchshadstyle
+    std::vector<const bsp2_dface_t *> worldonly;    // masked with TRACE_MASK_WORLDONLY
+    std::vector<std::vector<const bsp2_dface_t *>> self; // _shadowself models, masked with bit TRACE_MASK_SELF_FIRST + index
+    std::vector<polylib::winding_t *> skipwindings; // shadow casting skip-textured bmodels, always occludes
+    std::vector<unsigned> raymasks;                 // mask for rays cast from each model
+};
+
+void Trace_ClassifyFaces(const mbsp_t *bsp, bool usemasks, tracefaces_t *out);
+void Trace_FreeFaces(tracefaces_t *faces);
+
+/* what a hit on tracefaces_t::filter geometry does to the ray */
+struct filterhit_t {
+    bool accept;        // the hit blocks the ray
+    int dynamicstyle;   // non-zero if the ray passed a switchable shadow with this style
+    bool glass;         // tint the ray with Trace_TintRayColor
+    float opacity;
+    vec3_t glasscolor;
+};
+
+filterhit_t Trace_FilterHit(const modelinfo_t *self, const modelinfo_t *hit_modelinfo, const bsp2_dface_t *face,
+                            const vec3_t hitpoint, const vec3_t raydir, const vec3_t hitnormal);
+void Trace_TintRayColor(vec3_t color, float opacity, const vec3_t glasscolor);
+
 #endif /* __LIGHT_TRACE_H__ */
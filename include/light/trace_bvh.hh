@@ -0,0 +1,44 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#ifndef __LIGHT_TRACE_BVH_H__
+#define __LIGHT_TRACE_BVH_H__
+
+#include <common/cmdlib.hh>
+#include <common/mathlib.hh>
+#include <common/bspfile.hh>
+#include <common/log.hh>
+#include <common/threads.hh>
+#include <common/polylib.hh>
+
+#include "trace.hh"
+
+/*
+ * Built-in ray tracer (-tracer bvh), for builds without Embree.
+ *
+ * A 4-wide BVH over the same faces Embree_TraceInit uses (Trace_ClassifyFaces),
+ * with the same mask and filter semantics. Child boxes are tested four at a
+ * time with SSE where available.
+ */
+void BVH_TraceInit(const mbsp_t *bsp);
+hitresult_t BVH_TestSky(const vec3_t start, const vec3_t dirn, const modelinfo_t *self, const bsp2_dface_t **face_out);
+hitresult_t BVH_TestLight(const vec3_t start, const vec3_t stop, const modelinfo_t *self);
+
+raystream_occlusion_t *BVH_MakeOcclusionRayStream(int maxrays);
+raystream_intersection_t *BVH_MakeIntersectionRayStream(int maxrays);
+
+#endif /* __LIGHT_TRACE_BVH_H__ */
@@ -44,55 +44,45 @@
 using namespace std;
 using namespace polylib;
 
-mutex radlights_lock;
 map<string, qvec3f> texturecolors;
 static std::vector<bouncelight_t> radlights;
-std::map<int, std::vector<int>> radlightsByFacenum;
+static std::vector<bouncelightnode_t> radlighttree;
 
-class patch_t {
-public:
-    winding_t *w;
-    vec3_t center;
-    vec3_t samplepoint; // 1 unit above center
-    plane_t plane;
-    std::map<int, qvec3f> lightByStyle;
+/* bounce light numbers for face i are radlightsByFacenum[radlightsFaceOffsets[i] .. radlightsFaceOffsets[i + 1] - 1] */
+static std::vector<int> radlightsFaceOffsets;
+static std::vector<int> radlightsByFacenum;
+
+/* area-weighted direct light over the 64-unit patches of one face */
+struct patch_sum_t {
+    const mbsp_t *bsp;
+    const globalconfig_t *cfg;
+    stylecolors_t sum;
+    float totalarea;
 };
 
-static unique_ptr<patch_t>
-MakePatch (const mbsp_t *bsp, const globalconfig_t &cfg, winding_t *w)
+static void SaveWindingFn(winding_t *w, void *userinfo)
 {
-    unique_ptr<patch_t> p { new patch_t };
-    p->w = w;
+    patch_sum_t *args = static_cast<patch_sum_t *>(userinfo);
     
-    // cache some stuff
-    WindingCenter(p->w, p->center);
-    WindingPlane(p->w, p->plane.normal, &p->plane.dist);
+    vec3_t center, samplepoint;
+    plane_t plane;
+    WindingCenter(w, center);
+    WindingPlane(w, plane.normal, &plane.dist);
     
-    // nudge the cernter point 1 unit off
-    VectorMA(p->center, 1.0f, p->plane.normal, p->samplepoint);
+    // nudge the center point 1 unit off
+    VectorMA(center, 1.0f, plane.normal, samplepoint);
     
     // calculate direct light
+    const stylecolors_t lightByStyle = GetDirectLighting(args->bsp, *args->cfg, samplepoint, plane.normal);
     
-    p->lightByStyle = GetDirectLighting(bsp, cfg, p->samplepoint, p->plane.normal);
+    const float patcharea = WindingArea(w);
+    args->totalarea += patcharea;
     
-    return p;
-}
-
-struct make_bounce_lights_args_t {
-    const mbsp_t *bsp;
-    const globalconfig_t *cfg;
-};
-
-struct save_winding_args_t {
-    vector<unique_ptr<patch_t>> *patches;
-    const mbsp_t *bsp;
-    const globalconfig_t *cfg;
-};
-
-static void SaveWindingFn(winding_t *w, void *userinfo)
-{
-    save_winding_args_t *args = static_cast<save_winding_args_t *>(userinfo);
-    args->patches->push_back(MakePatch(args->bsp, *args->cfg, w));
+    for (const auto &styleColor : lightByStyle) {
+        args->sum.add(styleColor.first, styleColor.second * patcharea);
+    }
+    
+    free(w);
 }
 
 static bool
@@ -134,97 +124,8 @@ Face_LookupTextureColor(const mbsp_t *bsp, const bsp2_dface_t *face, vec3_t colo
     }
 }
 
-static void
-AddBounceLight(const vec3_t pos, const std::map<int, qvec3f> &colorByStyle, const vec3_t surfnormal, vec_t area, const bsp2_dface_t *face, const mbsp_t *bsp);
-
-static void *
-MakeBounceLightsThread (void *arg)
-{
-    const mbsp_t *bsp = static_cast<make_bounce_lights_args_t *>(arg)->bsp;
-    const globalconfig_t &cfg = *static_cast<make_bounce_lights_args_t *>(arg)->cfg;
-    
-    while (1) {
-        int i = GetThreadWork();
-        if (i == -1)
-            break;
-    
-        const bsp2_dface_t *face = BSP_GetFace(bsp, i);
-        
-        if (!Face_ShouldBounce(bsp, face)) {
-            continue;
-        }
-        
-        vector<unique_ptr<patch_t>> patches;
-        
-        winding_t *winding = WindingFromFace(bsp, face);
-        // grab some info about the face winding
-        const float facearea = WindingArea(winding);
-        
-        plane_t faceplane;
-        WindingPlane(winding, faceplane.normal, &faceplane.dist);
-        
-        vec3_t facemidpoint;
-        WindingCenter(winding, facemidpoint);
-        VectorMA(facemidpoint, 1, faceplane.normal, facemidpoint); // lift 1 unit
-        
-        save_winding_args_t args;
-        args.patches = &patches;
-        args.bsp = bsp;
-        args.cfg = &cfg;
-        
-        DiceWinding(winding, 64.0f, SaveWindingFn, &args);
-        winding = nullptr; // DiceWinding frees winding
-        
-        // average them, area weighted
-        map<int, qvec3f> sum;
-        float totalarea = 0;
-        
-        for (const auto &patch : patches) {
-            const float patcharea = WindingArea(patch->w);
-            totalarea += patcharea;
-            
-            for (const auto &styleColor : patch->lightByStyle) {
-                sum[styleColor.first] = sum[styleColor.first] + (styleColor.second * patcharea);
-            }
-//              printf("  %f %f %f\n", patch->directlight[0], patch->directlight[1], patch->directlight[2]);
-        }
-        
-        for (auto &styleColor : sum) {
-            styleColor.second *= (1.0/totalarea);
-        }
-        
-        // avoid small, or zero-area patches ("sum" would be nan)
-        if (totalarea < 1) {
-            continue;
-        }
-    
-        vec3_t texturecolor;
-        Face_LookupTextureColor(bsp, face, texturecolor);
-        
-        // lerp between gray and the texture color according to `bouncecolorscale`
-        const vec3_t gray = {127, 127, 127};
-        vec3_t blendedcolor = {0, 0, 0};
-        VectorMA(blendedcolor, cfg.bouncecolorscale.floatValue(), texturecolor, blendedcolor);
-        VectorMA(blendedcolor, 1-cfg.bouncecolorscale.floatValue(), gray, blendedcolor);
-        
-        // final colors to emit
-        map<int, qvec3f> emitcolors;
-        for (const auto &styleColor : sum) {
-            qvec3f emitcolor(0);
-            for (int k=0; k<3; k++) {
-                emitcolor[k] = (styleColor.second[k] / 255.0f) * (blendedcolor[k] / 255.0f);
-            }
-            emitcolors[styleColor.first] = emitcolor;
-        }
-
-        AddBounceLight(facemidpoint, emitcolors, faceplane.normal, facearea, face, bsp);
-    }
-    
-    return NULL;
-}
-
-static void
-AddBounceLight(const vec3_t pos, const std::map<int, qvec3f> &colorByStyle, const vec3_t surfnormal, vec_t area, const bsp2_dface_t *face, const mbsp_t *bsp)
+static bouncelight_t
+MakeBounceLight(const vec3_t pos, const stylecolors_t &colorByStyle, const vec3_t surfnormal, vec_t area, const bsp2_dface_t *face, const mbsp_t *bsp)
 {
     for (const auto &styleColor : colorByStyle) {
         Q_assert(styleColor.second[0] >= 0);
@@ -254,14 +155,73 @@ AddBounceLight(const vec3_t pos, const std::map<int, qvec3f> &colorByStyle, cons
     VectorSet(l.maxs, 0, 0, 0);
     
     if (!novisapprox) {
-        EstimateVisibleBoundsAtPoint(pos, l.mins, l.maxs);
+        EstimateVisibleBoundsAtPoint(bsp, pos, l.mins, l.maxs);
+    }
+    
+    return l;
+}
+
+/*
+ * Dices the face into 64-unit patches, gathers the direct light reaching
+ * them, and returns false if the face doesn't emit a bounce light.
+ */
+static bool
+MakeBounceLightForFace(const globalconfig_t &cfg, const mbsp_t *bsp, const bsp2_dface_t *face, bouncelight_t *out)
+{
+    if (!Face_ShouldBounce(bsp, face)) {
+        return false;
     }
     
-    unique_lock<mutex> lck { radlights_lock };
-    radlights.push_back(l);
+    winding_t *winding = WindingFromFace(bsp, face);
+    // grab some info about the face winding
+    const float facearea = WindingArea(winding);
+    
+    plane_t faceplane;
+    WindingPlane(winding, faceplane.normal, &faceplane.dist);
+    
+    vec3_t facemidpoint;
+    WindingCenter(winding, facemidpoint);
+    VectorMA(facemidpoint, 1, faceplane.normal, facemidpoint); // lift 1 unit
+    
+    // average the patches, area weighted
+    patch_sum_t args {};
+    args.bsp = bsp;
+    args.cfg = &cfg;
+    args.totalarea = 0;
     
-    const int lastBounceLightIndex = static_cast<int>(radlights.size()) - 1;
-    radlightsByFacenum[Face_GetNum(bsp, face)].push_back(lastBounceLightIndex);
+    DiceWinding(winding, 64.0f, SaveWindingFn, &args);
+    winding = nullptr; // DiceWinding frees winding
+    
+    for (auto &styleColor : args.sum) {
+        styleColor.second *= (1.0/args.totalarea);
+    }
+    
+    // avoid small, or zero-area patches ("sum" would be nan)
+    if (args.totalarea < 1) {
+        return false;
+    }
+
+    vec3_t texturecolor;
+    Face_LookupTextureColor(bsp, face, texturecolor);
+    
+    // lerp between gray and the texture color according to `bouncecolorscale`
+    const vec3_t gray = {127, 127, 127};
+    vec3_t blendedcolor = {0, 0, 0};
+    VectorMA(blendedcolor, cfg.bouncecolorscale.floatValue(), texturecolor, blendedcolor);
+    VectorMA(blendedcolor, 1-cfg.bouncecolorscale.floatValue(), gray, blendedcolor);
+    
+    // final colors to emit
+    stylecolors_t emitcolors;
+    for (const auto &styleColor : args.sum) {
+        qvec3f emitcolor(0);
+        for (int k=0; k<3; k++) {
+            emitcolor[k] = (styleColor.second[k] / 255.0f) * (blendedcolor[k] / 255.0f);
+        }
+        emitcolors.add(styleColor.first, emitcolor);
+    }
+
+    *out = MakeBounceLight(facemidpoint, emitcolors, faceplane.normal, facearea, face, bsp);
+    return true;
 }
 
 const std::vector<bouncelight_t> &BounceLights()
@@ -269,15 +229,19 @@ const std::vector<bouncelight_t> &BounceLights()
     return radlights;
 }
 
-const std::vector<int> &BounceLightsForFaceNum(int facenum)
+const std::vector<bouncelightnode_t> &BounceLightTree()
+{
+    return radlighttree;
+}
+
+bouncelightnums_t BounceLightsForFaceNum(int facenum)
 {
-    const auto &vec = radlightsByFacenum.find(facenum);
-    if (vec != radlightsByFacenum.end()) {
-        return vec->second;
+    if (facenum < 0 || facenum + 1 >= static_cast<int>(radlightsFaceOffsets.size())) {
+        return bouncelightnums_t(nullptr, nullptr);
     }
     
-    static std::vector<int> empty;
-    return empty;
+    const int *base = radlightsByFacenum.data();
+    return bouncelightnums_t(base + radlightsFaceOffsets[facenum], base + radlightsFaceOffsets[facenum + 1]);
 }
 
 // Returns color in [0,255]
@@ -323,14 +287,153 @@ MakeTextureColors (const mbsp_t *bsp)
     }
 }
 
+/*
+ * =============
+ * MakeBounceLightTree
+ *
+ * Builds a binary tree over the bounce lights, splitting at the median
+ * position along the longest axis. LightFace_Bounce uses it to evaluate
+ * distant groups of bounce lights as a single light (-bouncecuterror).
+ * =============
+ */
+static float
+BounceLight_Intensity(const bouncelight_t &vpl)
+{
+    return vpl.area * (vpl.componentwiseMaxColor[0] + vpl.componentwiseMaxColor[1] + vpl.componentwiseMaxColor[2]);
+}
+
+static int
+MakeBounceLightTree_r(std::vector<int>::iterator first, std::vector<int>::iterator last)
+{
+    // reserve our slot first so the root ends up as node 0
+    const int nodenum = static_cast<int>(radlighttree.size());
+    radlighttree.emplace_back();
+    
+    bouncelightnode_t node {};
+    node.children[0] = node.children[1] = -1;
+    node.vplnum = -1;
+    
+    ClearBounds(node.mins, node.maxs);
+    for (auto it = first; it != last; ++it) {
+        vec3_t pos;
+        glm_to_vec3_t(radlights[*it].pos, pos);
+        AddPointToBounds(pos, node.mins, node.maxs);
+    }
+    
+    if (last - first == 1) {
+        node.vplnum = *first;
+        node.light = radlights[*first];
+        node.light.poly.clear();
+        node.light.poly_edgeplanes.clear();
+        radlighttree[nodenum] = std::move(node);
+        return nodenum;
+    }
+    
+    int axis = 0;
+    for (int i = 1; i < 3; i++) {
+        if (node.maxs[i] - node.mins[i] > node.maxs[axis] - node.mins[axis])
+            axis = i;
+    }
+    
+    const auto mid = first + (last - first) / 2;
+    std::nth_element(first, mid, last, [axis](int a, int b) {
+        const float pa = radlights[a].pos[axis];
+        const float pb = radlights[b].pos[axis];
+        return (pa != pb) ? (pa < pb) : (a < b);
+    });
+    
+    node.children[0] = MakeBounceLightTree_r(first, mid);
+    node.children[1] = MakeBounceLightTree_r(mid, last);
+    
+    const bouncelight_t &a = radlighttree[node.children[0]].light;
+    const bouncelight_t &b = radlighttree[node.children[1]].light;
+    const bouncelight_t &rep = (BounceLight_Intensity(a) >= BounceLight_Intensity(b)) ? a : b;
+    
+    bouncelight_t &l = node.light;
+    l.pos = rep.pos;
+    l.surfnormal = rep.surfnormal;
+    l.area = a.area + b.area;
+    
+    // area-weighted so that area * color is the sum over the children
+    for (const bouncelight_t *child : { &a, &b }) {
+        const float weight = child->area / l.area;
+        for (const auto &styleColor : child->colorByStyle) {
+            l.colorByStyle.add(styleColor.first, styleColor.second * weight);
+        }
+    }
+    
+    // upper bound for culling, rather than the max of the averaged colors
+    l.componentwiseMaxColor = (a.componentwiseMaxColor * a.area + b.componentwiseMaxColor * b.area) / l.area;
+    
+    ClearBounds(l.mins, l.maxs);
+    AddPointToBounds(a.mins, l.mins, l.maxs);
+    AddPointToBounds(a.maxs, l.mins, l.maxs);
+    AddPointToBounds(b.mins, l.mins, l.maxs);
+    AddPointToBounds(b.maxs, l.mins, l.maxs);
+    
+    radlighttree[nodenum] = std::move(node);
+    return nodenum;
+}
+
+static void
+MakeBounceLightTree()
+{
+    radlighttree.clear();
+    if (radlights.empty())
+        return;
+    
+    std::vector<int> vplnums(radlights.size());
+    for (size_t i = 0; i < radlights.size(); i++)
+        vplnums[i] = static_cast<int>(i);
+    
+    radlighttree.reserve(2 * radlights.size() - 1);
+    MakeBounceLightTree_r(vplnums.begin(), vplnums.end());
+    
+    logprint("%d bounce light tree nodes\n", static_cast<int>(radlighttree.size()));
+}
+
 void
 MakeBounceLights (const globalconfig_t &cfg, const mbsp_t *bsp)
 {
     logprint("--- MakeBounceLights ---\n");
     
-    make_bounce_lights_args_t args { bsp, &cfg }; //mxd. https://clang.llvm.org/extra/clang-tidy/checks/cppcoreguidelines-pro-type-member-init.html
+    // each thread appends to its own buffer, tagged with the face number
+    std::vector<std::vector<std::pair<int, bouncelight_t>>> threadlights(qmax(numthreads, 1));
+    
+    ParallelFor(0, bsp->numfaces, [&](int i) {
+        bouncelight_t l;
+        if (MakeBounceLightForFace(cfg, bsp, BSP_GetFace(bsp, i), &l)) {
+            threadlights[GetThreadNum()].emplace_back(i, std::move(l));
+        }
+    });
+    
+    // merge in face order, so the result doesn't depend on scheduling
+    std::vector<std::pair<int, bouncelight_t> *> merged;
+    for (auto &buffer : threadlights) {
+        for (auto &facelight : buffer) {
+            merged.push_back(&facelight);
+        }
+    }
+    std::sort(merged.begin(), merged.end(), [](const std::pair<int, bouncelight_t> *a, const std::pair<int, bouncelight_t> *b) {
+        return a->first < b->first;
+    });
+    
+    radlights.clear();
+    radlights.reserve(merged.size());
+    radlightsFaceOffsets.assign(bsp->numfaces + 1, 0);
+    radlightsByFacenum.clear();
+    radlightsByFacenum.reserve(merged.size());
+    for (auto *facelight : merged) {
+        radlightsFaceOffsets[facelight->first + 1]++;
+        radlightsByFacenum.push_back(static_cast<int>(radlights.size()));
+        radlights.push_back(std::move(facelight->second));
+    }
+    for (int i = 0; i < bsp->numfaces; i++) {
+        radlightsFaceOffsets[i + 1] += radlightsFaceOffsets[i];
+    }
     
-    RunThreadsOn(0, bsp->numfaces, MakeBounceLightsThread, (void *)&args);
-
     logprint("%d bounce lights created\n", static_cast<int>(radlights.size()));
+    
+    if (cfg.bouncecuterror.floatValue() > 0)
+        MakeBounceLightTree();
 }
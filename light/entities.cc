@@ -19,6 +19,7 @@
 
 #include <algorithm>
 #include <cstring>
+#include <memory>
 #include <sstream>
 #include <common/cmdlib.hh>
 
@@ -26,12 +27,17 @@
 #include <light/entities.hh>
 #include <light/ltface.hh>
 #include <common/bsputils.hh>
+#include <common/octree.hh>
 
 using strings = std::vector<std::string>;
 
 
 std::vector<light_t> all_lights;
 std::vector<sun_t> all_suns;
+std::vector<skydome_t> all_skydomes;
+static std::vector<qvec3f> skydome_dirs;
+static float skydome_anglestep;
+static std::vector<int> skydome_facetextures;
 std::vector<entdict_t> entdicts;
 static std::vector<entdict_t> radlights;
 
@@ -43,6 +49,22 @@ const std::vector<sun_t>& GetSuns() {
     return all_suns;
 }
 
+const std::vector<skydome_t>& GetSkyDomes() {
+    return all_skydomes;
+}
+
+const std::vector<qvec3f>& GetSkyDomeDirs() {
+    return skydome_dirs;
+}
+
+float SkyDome_AngleStep() {
+    return skydome_anglestep;
+}
+
+int SkyDome_TextureForFace(int facenum) {
+    return skydome_facetextures.empty() ? -1 : skydome_facetextures[facenum];
+}
+
 /* surface lights */
 static void MakeSurfaceLights(const mbsp_t *bsp);
 
@@ -401,7 +423,7 @@ Dirt_ResolveFlag(const globalconfig_t &cfg, int dirtInt)
  * =============
  */
 static void
-AddSun(const globalconfig_t &cfg, vec3_t sunvec, vec_t light, const vec3_t color, int dirtInt, float sun_anglescale, const int style, const std::string& suntexture)
+AddSun(const globalconfig_t &cfg, vec3_t sunvec, vec_t light, const vec3_t color, int dirtInt, float sun_anglescale, const int style, const std::string& suntexture, const int dome = -1)
 {
     if (light == 0.0f)
         return;
@@ -416,6 +438,7 @@ AddSun(const globalconfig_t &cfg, vec3_t sunvec, vec_t light, const vec3_t color
     sun.dirt = Dirt_ResolveFlag(cfg, dirtInt);
     sun.style = style;
     sun.suntexture = suntexture;
+    sun.dome = dome;
 
     // add to list
     all_suns.push_back(sun);
@@ -529,6 +552,81 @@ SetupSuns(const globalconfig_t &cfg)
     }
 }
 
+/*
+ * =============
+ * AddSkyDome
+ *
+ * Records one hemisphere of a dome for -skydome. suntextures collects the
+ * distinct _suntexture names so sky hits can be matched by index.
+ * =============
+ */
+static int
+AddSkyDome(const globalconfig_t &cfg, bool lower, vec_t light, const vec3_t color, int dirtInt, float anglescale, const int style, const std::string& suntexture,
+           std::vector<std::string> *suntextures)
+{
+    if (skydome_samples <= 0 || light <= 0)
+        return -1;
+
+    skydome_t dome {};
+    dome.lower = lower;
+    dome.light = light;
+    VectorCopy(color, dome.color);
+    dome.dirt = Dirt_ResolveFlag(cfg, dirtInt);
+    dome.anglescale = anglescale;
+    dome.style = style;
+    dome.suntexture = -1;
+    if (!suntexture.empty()) {
+        auto it = std::find(suntextures->begin(), suntextures->end(), suntexture);
+        dome.suntexture = static_cast<int>(it - suntextures->begin());
+        if (it == suntextures->end())
+            suntextures->push_back(suntexture);
+    }
+
+    all_skydomes.push_back(dome);
+    return static_cast<int>(all_skydomes.size()) - 1;
+}
+
+/*
+ * =============
+ * SetupSkyDomeDirs
+ *
+ * The rays -skydome traces for each sample point, pointing into the upper
+ * hemisphere (the lower hemisphere mirrors them). They are SetupSkyDome's
+ * suns for -sunsamples n: the same staggered elevation x azimuth rows plus
+ * the vertical one, each standing for an equal share of the dome's light, so
+ * -skydome lights a face like the legacy dome. LightFace_SkyDomes rotates
+ * them by a different fraction of a row step for each sample point.
+ * =============
+ */
+static void
+SetupSkyDomeDirs(void)
+{
+    /* same count and spacing as SetupSkyDome */
+    const int iterations = qmax(static_cast<int>(rint(sqrt((skydome_samples - 1) / 4))) + 1, 2);
+    const int elevationSteps = iterations - 1;
+    const int angleSteps = elevationSteps * 4;
+    const float elevationStep = DEG2RAD(90.0f / (elevationSteps + 1));  /* skip elevation 0 */
+    const float angleStep = DEG2RAD(360.0f / angleSteps);
+
+    skydome_dirs.clear();
+    skydome_anglestep = angleStep;
+    float angle = 0.0f;
+    float elevation = elevationStep * 0.5f;
+    for (int i = 0; i < elevationSteps; i++) {
+        for (int j = 0; j < angleSteps; j++) {
+            skydome_dirs.push_back(qvec3f(cos(angle) * cos(elevation),
+                                          sin(angle) * cos(elevation),
+                                          sin(elevation)));
+            angle += angleStep;
+        }
+        elevation += elevationStep;
+        angle += angleStep / elevationSteps;
+    }
+
+    /* the vertical sun */
+    skydome_dirs.push_back(qvec3f(0, 0, 1));
+}
+
 /*
  * =============
  * SetupSkyDome
@@ -542,7 +640,8 @@ SetupSuns(const globalconfig_t &cfg)
  */
 static void
 SetupSkyDome(const globalconfig_t &cfg, float upperLight, const vec3_t upperColor, const int upperDirt, const float upperAnglescale, const int upperStyle, const std::string& upperSuntexture,
-                                        float lowerLight, const vec3_t lowerColor, const int lowerDirt, const float lowerAnglescale, const int lowerStyle, const std::string& lowerSuntexture)
+                                        float lowerLight, const vec3_t lowerColor, const int lowerDirt, const float lowerAnglescale, const int lowerStyle, const std::string& lowerSuntexture,
+                                        std::vector<std::string> *suntextures)
 {
         int i, j, numSuns;
         int angleSteps, elevationSteps;
@@ -573,6 +672,10 @@ SetupSkyDome(const globalconfig_t &cfg, float upperLight, const vec3_t upperColo
         const float sunlight2value = upperLight / numSuns;
         const float sunlight3value = lowerLight / numSuns;
 
+        /* with -skydome the suns are only kept for bounce, the faces are lit by the dome */
+        const int upperDome = AddSkyDome(cfg, false, upperLight, upperColor, upperDirt, upperAnglescale, upperStyle, upperSuntexture, suntextures);
+        const int lowerDome = AddSkyDome(cfg, true, lowerLight, lowerColor, lowerDirt, lowerAnglescale, lowerStyle, lowerSuntexture, suntextures);
+
         /* iterate elevation */
         elevation = elevationStep * 0.5f;
         angle = 0.0f;
@@ -588,14 +691,14 @@ SetupSkyDome(const globalconfig_t &cfg, float upperLight, const vec3_t upperColo
 
                         /* insert top hemisphere light */
                         if (sunlight2value > 0) {
-                            AddSun(cfg, direction, sunlight2value, upperColor, upperDirt, upperAnglescale, upperStyle, upperSuntexture);
+                            AddSun(cfg, direction, sunlight2value, upperColor, upperDirt, upperAnglescale, upperStyle, upperSuntexture, upperDome);
                         }
 
                         direction[ 2 ] = -direction[ 2 ];
                     
                         /* insert bottom hemisphere light */
                         if (sunlight3value > 0) {
-                            AddSun(cfg, direction, sunlight3value, lowerColor, lowerDirt, lowerAnglescale, lowerStyle, lowerSuntexture);
+                            AddSun(cfg, direction, sunlight3value, lowerColor, lowerDirt, lowerAnglescale, lowerStyle, lowerSuntexture, lowerDome);
                         }
                     
                         /* move */
@@ -611,22 +714,24 @@ SetupSkyDome(const globalconfig_t &cfg, float upperLight, const vec3_t upperColo
         VectorSet( direction, 0.0f, 0.0f, -1.0f );
 
         if (sunlight2value > 0) {
-            AddSun(cfg, direction, sunlight2value, upperColor, upperDirt, upperAnglescale, upperStyle, upperSuntexture);
+            AddSun(cfg, direction, sunlight2value, upperColor, upperDirt, upperAnglescale, upperStyle, upperSuntexture, upperDome);
         }
     
         VectorSet( direction, 0.0f, 0.0f, 1.0f );
     
         if (sunlight3value > 0) {
-            AddSun(cfg, direction, sunlight3value, lowerColor, lowerDirt, lowerAnglescale, lowerStyle, lowerSuntexture);
+            AddSun(cfg, direction, sunlight3value, lowerColor, lowerDirt, lowerAnglescale, lowerStyle, lowerSuntexture, lowerDome);
         }
 }
 
 static void
-SetupSkyDomes(const globalconfig_t &cfg)
+SetupSkyDomes(const globalconfig_t &cfg, const mbsp_t *bsp)
 {
+    std::vector<std::string> suntextures;
+
     // worldspawn "legacy" skydomes
     SetupSkyDome(cfg, cfg.sunlight2.floatValue(), *cfg.sunlight2_color.vec3Value(), cfg.sunlight2_dirt.intValue(), cfg.global_anglescale.floatValue(), 0, "",
-                      cfg.sunlight3.floatValue(), *cfg.sunlight3_color.vec3Value(), cfg.sunlight2_dirt.intValue(), cfg.global_anglescale.floatValue(), 0, "");
+                      cfg.sunlight3.floatValue(), *cfg.sunlight3_color.vec3Value(), cfg.sunlight2_dirt.intValue(), cfg.global_anglescale.floatValue(), 0, "", &suntextures);
 
     // new per-entity sunlight2/3 skydomes
     for (light_t &entity : all_lights) {
@@ -634,17 +739,36 @@ SetupSkyDomes(const globalconfig_t &cfg)
             if (entity.sunlight2.boolValue()) {
                 // Add the upper dome, like sunlight2 (pointing down)
                 SetupSkyDome(cfg, entity.light.floatValue(), *entity.color.vec3Value(), entity.dirt.intValue(), entity.anglescale.floatValue(), entity.style.intValue(), entity.suntexture.stringValue(), 
-                                  0, vec3_origin, 0, 0, 0, "");
+                                  0, vec3_origin, 0, 0, 0, "", &suntextures);
             } else {
                 // Add the lower dome, like sunlight3 (pointing up)
                 SetupSkyDome(cfg, 0, vec3_origin, 0, 0, 0, "",
-                                  entity.light.floatValue(), *entity.color.vec3Value(), entity.dirt.intValue(), entity.anglescale.floatValue(), entity.style.intValue(), entity.suntexture.stringValue());                
+                                  entity.light.floatValue(), *entity.color.vec3Value(), entity.dirt.intValue(), entity.anglescale.floatValue(), entity.style.intValue(), entity.suntexture.stringValue(), &suntextures);                
             }
             
             // Disable the light itself...
             entity.light.setFloatValue(0.0f);
         }
     }
+
+    if (all_skydomes.empty())
+        return;
+
+    SetupSkyDomeDirs();
+
+    /* face -> index into suntextures, so sky hits are matched without comparing names */
+    if (!suntextures.empty()) {
+        skydome_facetextures.assign(bsp->numfaces, -1);
+        for (int i = 0; i < bsp->numfaces; i++) {
+            const char *name = Face_TextureName(bsp, &bsp->dfaces[i]);
+            auto it = std::find(suntextures.begin(), suntextures.end(), name);
+            if (it != suntextures.end())
+                skydome_facetextures[i] = static_cast<int>(it - suntextures.begin());
+        }
+    }
+
+    logprint("SetupSkyDomes: %d domes, %d rays per hemisphere\n",
+             static_cast<int>(all_skydomes.size()), static_cast<int>(skydome_dirs.size()));
 }
 
 /*
@@ -1112,29 +1236,51 @@ FixLightsOnFaces(const mbsp_t *bsp)
     }
 }
 
-void EstimateVisibleBoundsAtPoint(const vec3_t point, vec3_t mins, vec3_t maxs)
+/*
+ * Distance beyond which the light contributes less than fadegate, or
+ * VECT_MAX if it can reach anywhere.
+ */
+static float
+LightFalloffRadius(const globalconfig_t &cfg, const light_t &light)
+{
+    if (light.getFormula() == LF_LINEAR && light.falloff.floatValue() > 0)
+        return light.falloff.floatValue(); //mxd. see GetLightValue
+    
+    return GetLightDist(cfg, &light, fadegate);
+}
+
+/*
+ * The ray estimate fires a 32x32 grid of rays. Every ray is needed: stopping
+ * early once the bounds stop growing changes the lighting of unvis'd maps.
+ */
+#define VISBOUNDS_GRID 32
+
+static void
+EstimateVisibleBoundsWithRays(const vec3_t point, vec3_t mins, vec3_t maxs)
 {
-    const int N = 32;
-    const int N2 = N*N;
+    static thread_local std::unique_ptr<raystream_intersection_t> rs;
     
-    raystream_intersection_t *rs = MakeIntersectionRayStream(N2);
+    if (!rs)
+        rs.reset(MakeIntersectionRayStream(VISBOUNDS_GRID * VISBOUNDS_GRID));
     
-    AABB_Init(mins, maxs, point);
-    for (int x=0; x<N; x++) {
-        for (int y=0; y<N; y++) {
-            const vec_t u1 = static_cast<float>(x) / static_cast<float>(N - 1);
-            const vec_t u2 = static_cast<float>(y) / static_cast<float>(N - 1);
+    rs->clearPushedRays();
+    for (int x = 0; x < VISBOUNDS_GRID; x++) {
+        for (int y = 0; y < VISBOUNDS_GRID; y++) {
+            const vec_t u1 = static_cast<float>(x) / static_cast<float>(VISBOUNDS_GRID - 1);
+            const vec_t u2 = static_cast<float>(y) / static_cast<float>(VISBOUNDS_GRID - 1);
             
             vec3_t dir;
             UniformPointOnSphere(dir, u1, u2);
-        
+            
             rs->pushRay(0, point, dir, 65536.0f);
         }
     }
     
     rs->tracePushedRaysIntersection(nullptr);
     
-    for (int i=0; i<N2; i++) {
+    AABB_Init(mins, maxs, point);
+    const int numrays = rs->numPushedRays();
+    for (int i = 0; i < numrays; i++) {
         const float dist = rs->getPushedRayHitDist(i);
         vec3_t dir;
         rs->getPushedRayDir(i, dir);
@@ -1151,6 +1297,17 @@ void EstimateVisibleBoundsAtPoint(const vec3_t point, vec3_t mins, vec3_t maxs)
     AABB_Size(mins, maxs, size);
     VectorScale(size, 0.25, size);
     AABB_Grow(mins, maxs, size);
+}
+
+/*
+ * Estimates the bounds of what's visible from point, for culling lights
+ * in LightFace. Uses the PVS if the bsp is vis'd, otherwise casts rays.
+ */
+void EstimateVisibleBoundsAtPoint(const mbsp_t *bsp, const vec3_t point, vec3_t mins, vec3_t maxs)
+{
+    if (!PVS_VisibleBoundsAtPoint(bsp, point, mins, maxs)) {
+        EstimateVisibleBoundsWithRays(point, mins, maxs);
+    }
     
     /*
     logprint("light at %f %f %f has mins %f %f %f maxs %f %f %f\n",
@@ -1164,35 +1321,100 @@ void EstimateVisibleBoundsAtPoint(const vec3_t point, vec3_t mins, vec3_t maxs)
            maxs[1],
            maxs[2]);
     */
-    
-    delete rs;
 }
 
-static void EstimateLightAABB(light_t *light)
+void EstimateLightVisibility(const mbsp_t *bsp)
 {
-    EstimateVisibleBoundsAtPoint(*light->origin.vec3Value(), light->mins, light->maxs);
+    if (novisapprox)
+        return;
+    
+    logprint("--- EstimateLightVisibility ---\n");
+    
+    SetupPVSBounds(bsp);
+    
+    ParallelFor(0, static_cast<int>(all_lights.size()), [&](int i) {
+        light_t &light = all_lights.at(i);
+        EstimateVisibleBoundsAtPoint(bsp, *light.origin.vec3Value(), light.mins, light.maxs);
+    });
 }
 
-static void *EstimateLightAABBThread(void *arg)
+/*
+ * Spatial index over the volumes lights can affect, so LightFace only
+ * considers lights near the face. Lights with no bounded volume (e.g.
+ * infinite falloff with -novisapprox) are kept in a separate list and
+ * always returned.
+ */
+static std::unique_ptr<octree_t<int>> light_octree;
+static std::vector<int> unbounded_lights;
+
+/*
+ * Returns false if the light can reach anywhere. Otherwise, any point the
+ * light contributes more than fadegate to lies in mins/maxs, and any
+ * lightsurf it isn't culled from (see CullLight) touches mins/maxs.
+ */
+static bool
+LightInfluenceBounds(const globalconfig_t &cfg, const light_t &light, vec3_t mins, vec3_t maxs)
 {
-    while (1) {
-        const int i = GetThreadWork();
-        if (i == -1)
-            break;
-        
-        EstimateLightAABB(&all_lights.at(i));
+    const float radius = LightFalloffRadius(cfg, light);
+    const bool bounded = (radius < VECT_MAX);
+    
+    if (novisapprox) {
+        if (!bounded)
+            return false;
+    } else {
+        vec3_t size;
+        AABB_Size(light.mins, light.maxs, size);
+        if (!bounded || size[0] * size[1] * size[2] < 8.0f * radius * radius * radius) {
+            // the estimated visible bounds are tighter
+            VectorCopy(light.mins, mins);
+            VectorCopy(light.maxs, maxs);
+            return true;
+        }
     }
-    return nullptr;
+    
+    const vec_t *origin = *light.origin.vec3Value();
+    for (int i = 0; i < 3; i++) {
+        mins[i] = origin[i] - radius;
+        maxs[i] = origin[i] + radius;
+    }
+    return true;
 }
 
-void EstimateLightVisibility(void)
+static void
+BuildLightIndex(const globalconfig_t &cfg)
 {
-    if (novisapprox)
-        return;
+    std::vector<std::pair<aabb3f, int>> objects;
     
-    logprint("--- EstimateLightVisibility ---\n");
+    unbounded_lights.clear();
+    for (int i = 0; i < static_cast<int>(all_lights.size()); i++) {
+        vec3_t mins, maxs;
+        if (!LightInfluenceBounds(cfg, all_lights[i], mins, maxs)) {
+            unbounded_lights.push_back(i);
+            continue;
+        }
+        objects.emplace_back(aabb3f(vec3_t_to_glm(mins), vec3_t_to_glm(maxs)), i);
+    }
+    
+    light_octree = std::make_unique<octree_t<int>>(makeOctree(objects));
+    
+    logprint("SetupLights: indexed %d lights, %d unbounded\n",
+             static_cast<int>(objects.size()), static_cast<int>(unbounded_lights.size()));
+}
+
+/*
+ * result keeps its storage between calls, so callers lighting many faces
+ * can reuse one vector.
+ */
+void
+LightsTouchingBounds(const vec3_t mins, const vec3_t maxs, std::vector<int> *result)
+{
+    light_octree->queryTouchingBBox(aabb3f(vec3_t_to_glm(mins), vec3_t_to_glm(maxs)), result);
     
-    RunThreadsOn(0, static_cast<int>(all_lights.size()), EstimateLightAABBThread, nullptr);
+    if (!unbounded_lights.empty()) {
+        /* unbounded lights aren't in the octree */
+        result->insert(result->end(), unbounded_lights.begin(), unbounded_lights.end());
+        std::sort(result->begin(), result->end());
+    }
 }
 
 void
@@ -1214,9 +1436,10 @@ SetupLights(const globalconfig_t &cfg, const mbsp_t *bsp)
     MatchTargets();
     SetupSpotlights(cfg);
     SetupSuns(cfg);
-    SetupSkyDomes(cfg);
+    SetupSkyDomes(cfg, bsp);
     FixLightsOnFaces(bsp);
-    EstimateLightVisibility();
+    EstimateLightVisibility(bsp);
+    BuildLightIndex(cfg);
     
     logprint("Final count: %d lights, %d suns in use.\n",
              static_cast<int>(all_lights.size()),
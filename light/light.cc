@@ -19,6 +19,7 @@
 
 #include <cstdint>
 #include <cassert>
+#include <climits>
 #include <cstdio>
 #include <iostream>
 
@@ -29,11 +30,12 @@
 #include <light/imglib.hh> //mxd
 #include <light/entities.hh>
 #include <light/ltface.hh>
+#include <light/lightcache.hh>
 
 #include <common/polylib.hh>
 #include <common/bsputils.hh>
 
-#if defined(HAVE_EMBREE) && defined (__SSE2__)
+#if defined (__SSE2__)
 #include <xmmintrin.h>
 //#include <pmmintrin.h>
 #endif
@@ -60,33 +62,44 @@ int softsamples = 0;
 
 const vec3_t vec3_white = { 255, 255, 255 };
 float surflight_subdivide = 128.0f;
+int surflight_samples = 0;
 int sunsamples = 64;
+int skydome_samples = 0;
+#ifdef HAVE_EMBREE
+tracer_t tracer = tracer_t::EMBREE;
+#else
+tracer_t tracer = tracer_t::BVH;
+#endif
 qboolean scaledonly = false;
 
 qboolean surflight_dump = false;
 
 static facesup_t *faces_sup;    //lit2/bspx stuff
 
-/// start of lightmap data
+/*
+ * Final lightmap data, allocated by AssignFileSpace once every face is lit
+ * and sized for exactly what the faces produced (or from the .bsp's
+ * lightdatasize with -litonly). Buffers that won't be written stay null.
+ * The bsp's lighting lump takes over filebase (lit_filebase for Q2/HL
+ * colored lightmaps) without a copy.
+ */
+
+/// greyscale lightmap data
 uint8_t *filebase;
-/// offset of start of free space after data (should be kept a multiple of 4)
+static bool grey_needed;
+/// size of the greyscale data, lit / lux data is 3 times as large
 static int file_p;
-/// offset of end of free space for lightmap data
-static int file_end;
 
-/// start of litfile data
+/// litfile data
 uint8_t *lit_filebase;
-/// offset of start of free space after litfile data (should be kept a multiple of 12)
-static int lit_file_p;
-/// offset of end of space for litfile data
-static int lit_file_end;
+static bool lit_needed;
 
-/// start of luxfile data
+/// luxfile data
 uint8_t *lux_filebase;
-/// offset of start of free space after luxfile data (should be kept a multiple of 12)
-static int lux_file_p;
-/// offset of end of space for luxfile data
-static int lux_file_end;
+static bool lux_needed;
+
+/// bytes in lit_filebase and lux_filebase, 3 per lightmap sample
+int lit_filesize;
 
 std::vector<modelinfo_t *> modelinfo;
 std::vector<const modelinfo_t *> tracelist;
@@ -99,6 +112,13 @@ int write_litfile = 0;  /* 0 for none, 1 for .lit, 2 for bspx, 3 for both */
 int write_luxfile = 0;  /* 0 for none, 1 for .lux, 2 for bspx, 3 for both */
 qboolean onlyents = false;
 qboolean novisapprox = false;
+bool pvscull = false;
+bool sortrays = false;
+bool lightcache = false;
+bool dirtcache = false;
+bool adaptive = false;
+float adaptive_threshold = 8.0f;
+bool texturefilter = false;
 bool nolights = false;
 bool debug_highlightseams = false;
 debugmode_t debugmode = debugmode_none;
@@ -172,39 +192,131 @@ PrintOptionsSummary(void)
 }
 
 /*
- * Return space for the lightmap and colourmap at the same time so it can
- * be done in a thread-safe manner.
+ * Lightmap output for each face (index facenum * 2) and its facesup_t
+ * (index facenum * 2 + 1). Each entry is only touched by the thread
+ * lighting that face, so no locking is needed. AssignFileSpace packs them
+ * into filebase / lit_filebase / lux_filebase in face order once lighting
+ * is done, so the layout doesn't depend on thread timing.
+ */
+struct facelightdata_t {
+    int size = 0;               // greyscale pixels, rounded up to a multiple of 4
+    std::vector<uint8_t> data;  // greyscale, color and delux data, each only if needed
+};
+
+static std::vector<facelightdata_t> facelightdata;
+
+/* bytes of facelightdata_t::data per greyscale pixel */
+static int
+FaceLightData_Stride(void)
+{
+    return (grey_needed ? 1 : 0) + (lit_needed ? 3 : 0) + (lux_needed ? 3 : 0);
+}
+
+/*
+ * Return space for the lightmap, colourmap and deluxemap of a face.
  *
  * size is the number of greyscale pixels = number of bytes to allocate
- * and return in *lightdata
+ * and return in *lightdata. Buffers that aren't being written are returned
+ * as nullptr. The face's lightofs is set by AssignFileSpace.
  */
 void
-GetFileSpace(uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int size)
+GetFileSpace(int facenum, bool facesup, uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int size)
 {
-    ThreadLock();
-
-    *lightdata = filebase + file_p;
-    *colordata = lit_filebase + lit_file_p;
-    *deluxdata = lux_filebase + lux_file_p;
+    facelightdata_t &entry = facelightdata.at(facenum * 2 + (facesup ? 1 : 0));
 
     // if size isn't a multiple of 4, round up to the next multiple of 4
     if ((size % 4) != 0) {
         size += (4 - (size % 4));
     }
 
-    // increment the next writing offsets, aligning them to 4 uint8_t boundaries (file_p)
-    // and 12-uint8_t boundaries (lit_file_p/lux_file_p)
-    file_p += size;
-    lit_file_p += 3 * size;
-    lux_file_p += 3 * size;
+    entry.size = size;
+    entry.data.assign(FaceLightData_Stride() * size, 0);
+
+    uint8_t *p = entry.data.data();
+    *lightdata = grey_needed ? p : nullptr;
+    p += grey_needed ? size : 0;
+    *colordata = lit_needed ? p : nullptr;
+    p += lit_needed ? 3 * size : 0;
+    *deluxdata = lux_needed ? p : nullptr;
+}
+
+/*
+ * =============
+ * AssignFileSpace
+ *
+ * Assigns lightmap offsets in face order (each face followed by its
+ * facesup_t) with a prefix sum over the sizes, allocates the output
+ * buffers for the total and copies the face data into place.
+ * =============
+ */
+static void
+AssignFileSpace(mbsp_t *bsp)
+{
+    std::vector<int> offsets(facelightdata.size());
+
+    // prefix sum, offsets stay aligned to 4 greyscale / 12 color bytes
+    int64_t total = 0;
+    for (size_t i = 0; i < facelightdata.size(); i++) {
+        offsets[i] = static_cast<int>(total);
+        total += facelightdata[i].size;
+    }
+    if (3 * total > INT_MAX)
+        Error("%s: lightmap data too large (%lld bytes)", __func__, static_cast<long long>(total));
+    file_p = static_cast<int>(total);
+    lit_filesize = 3 * file_p;
+
+    // malloc, not calloc: the face data covers every byte
+    if (grey_needed)
+        filebase = static_cast<uint8_t *>(malloc(qmax(file_p, 1)));
+    if (lit_needed)
+        lit_filebase = static_cast<uint8_t *>(malloc(qmax(lit_filesize, 1)));
+    if (lux_needed)
+        lux_filebase = static_cast<uint8_t *>(malloc(qmax(lit_filesize, 1)));
+    if ((grey_needed && !filebase) || (lit_needed && !lit_filebase) || (lux_needed && !lux_filebase))
+        Error("%s: allocation of %d lightmap bytes failed.", __func__, file_p * FaceLightData_Stride());
+
+    const bool rgb = bsp->loadversion->game->has_rgb_lightmap;
+
+    ParallelFor(0, static_cast<int>(facelightdata.size()), [&](int i) {
+        facelightdata_t &entry = facelightdata[i];
+        if (!entry.size)
+            return;
+
+        const int size = entry.size;
+        const int ofs = offsets[i];
+        const uint8_t *p = entry.data.data();
+        if (grey_needed) {
+            memcpy(filebase + ofs, p, size);
+            p += size;
+        }
+        if (lit_needed) {
+            memcpy(lit_filebase + 3 * ofs, p, 3 * size);
+            p += 3 * size;
+        }
+        if (lux_needed)
+            memcpy(lux_filebase + 3 * ofs, p, 3 * size);
+
+        // Q2/HL native colored lightmaps
+        const int lightofs = rgb ? 3 * ofs : ofs;
+        const int facenum = i / 2;
+        if (i % 2)
+            faces_sup[facenum].lightofs = lightofs;
+        else
+            bsp->dfaces[facenum].lightofs = lightofs;
 
-    ThreadUnlock();
+        entry = facelightdata_t {};
+    });
 
-    if (file_p > file_end)
-        Error("%s: overrun", __func__);
+    // faces_sup sharing the face's lightmap (see LightThread)
+    if (faces_sup && !scaledonly) {
+        for (int i = 0; i < bsp->numfaces; i++) {
+            const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, i);
+            if (face_modelinfo && faces_sup[i].lmscale == face_modelinfo->lightmapscale)
+                faces_sup[i].lightofs = bsp->dfaces[i].lightofs;
+        }
+    }
 
-    if (lit_file_p > lit_file_end)
-        Error("%s: overrun", __func__);
+    facelightdata.clear();
 }
 
 /**
@@ -214,17 +326,15 @@ GetFileSpace(uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int
 void GetFileSpace_PreserveOffsetInBsp(uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int lightofs) {
     Q_assert(lightofs >= 0);
 
-    *lightdata = filebase + lightofs;
+    *lightdata = filebase ? filebase + lightofs : nullptr;
 
     if (colordata) {
-        *colordata = lit_filebase + (lightofs * 3);
+        *colordata = lit_filebase ? lit_filebase + (lightofs * 3) : nullptr;
     }
 
     if (deluxdata) {
-        *deluxdata = lux_filebase + (lightofs * 3);
+        *deluxdata = lux_filebase ? lux_filebase + (lightofs * 3) : nullptr;
     }
-
-    // NOTE: file_p et. al. are not updated, since we're not dynamically allocating the lightmaps
 }
 
 const modelinfo_t *ModelInfoForModel(const mbsp_t *bsp, int modelnum)
@@ -250,21 +360,142 @@ const modelinfo_t *ModelInfoForFace(const mbsp_t *bsp, int facenum)
     return modelinfo.at(i);
 }
 
+/*
+ * Faces in the order LightThread processes them (most expensive first),
+ * with the predicted cost and measured time of each face for tuning the
+ * cost model.
+ */
+static std::vector<int> faceorder;
+static std::vector<float> faces_predictedcost;
+static std::vector<double> faces_actualtime;
+
+static float
+EstimateFaceCost(const mbsp_t *bsp, int facenum)
+{
+    const bsp2_dface_t *f = BSP_GetFace(const_cast<mbsp_t *>(bsp), facenum);
+    const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, facenum);
+    if (face_modelinfo == NULL)
+        return 0;
+
+    /* mirror the LightFace calls made by LightThread */
+    if (!faces_sup)
+        return EstimateLightFaceCost(bsp, f, nullptr, cfg_static);
+    if (scaledonly)
+        return EstimateLightFaceCost(bsp, f, faces_sup + facenum, cfg_static);
+    if (faces_sup[facenum].lmscale == face_modelinfo->lightmapscale)
+        return EstimateLightFaceCost(bsp, f, nullptr, cfg_static);
+    // LightFace_MultiScale mostly traces the finer of the two
+    return qmax(EstimateLightFaceCost(bsp, f, nullptr, cfg_static),
+                EstimateLightFaceCost(bsp, f, faces_sup + facenum, cfg_static));
+}
+
+/*
+ * =============
+ * ScheduleFaces
+ *
+ * Orders faces by estimated cost, largest first, so the big heavily-lit
+ * faces don't end up being the last ones processed while other threads
+ * sit idle.
+ * =============
+ */
+static void
+ScheduleFaces(const mbsp_t *bsp)
+{
+    faces_predictedcost.assign(bsp->numfaces, 0.0f);
+    faces_actualtime.assign(bsp->numfaces, 0.0);
+
+    logprint("--- ScheduleFaces ---\n");
+    ParallelFor(0, bsp->numfaces, [&](int facenum) {
+        faces_predictedcost[facenum] = EstimateFaceCost(bsp, facenum);
+    });
+
+    faceorder.resize(bsp->numfaces);
+    for (int i = 0; i < bsp->numfaces; i++)
+        faceorder[i] = i;
+    std::stable_sort(faceorder.begin(), faceorder.end(), [](int a, int b) {
+        return faces_predictedcost[a] > faces_predictedcost[b];
+    });
+}
+
+/*
+ * =============
+ * PrintFaceCostStats
+ *
+ * Compares the predicted face costs with the measured time per face.
+ * =============
+ */
+static void
+PrintFaceCostStats(const mbsp_t *bsp)
+{
+    double sum_p = 0, sum_a = 0, sum_pp = 0, sum_aa = 0, sum_pa = 0;
+    double total_time = 0;
+    int n = 0;
+
+    for (int i = 0; i < bsp->numfaces; i++) {
+        const double p = faces_predictedcost[i];
+        const double a = faces_actualtime[i];
+        total_time += a;
+        if (p <= 0)
+            continue;
+        sum_p += p;
+        sum_a += a;
+        sum_pp += p * p;
+        sum_aa += a * a;
+        sum_pa += p * a;
+        n++;
+    }
+    if (n < 2)
+        return;
+
+    const double cov = sum_pa - sum_p * sum_a / n;
+    const double var_p = sum_pp - sum_p * sum_p / n;
+    const double var_a = sum_aa - sum_a * sum_a / n;
+    const double correlation = (var_p > 0 && var_a > 0) ? cov / sqrt(var_p * var_a) : 0.0;
+
+    /* time spent on the faces predicted to be the top 1% most expensive */
+    const int top = qmax(1, bsp->numfaces / 100);
+    double top_time = 0;
+    for (int i = 0; i < top; i++)
+        top_time += faces_actualtime[faceorder[i]];
+
+    logprint("Face cost model: %d faces, predicted/actual correlation %.3f, "
+             "top 1%% predicted faces took %.1f%% of face time\n",
+             n, correlation, total_time > 0 ? 100.0 * top_time / total_time : 0.0);
+
+    if (verbose_log) {
+        std::vector<int> byactual(faceorder);
+        std::sort(byactual.begin(), byactual.end(), [](int a, int b) {
+            return faces_actualtime[a] > faces_actualtime[b];
+        });
+        std::vector<int> rank(bsp->numfaces);
+        for (int i = 0; i < bsp->numfaces; i++)
+            rank[faceorder[i]] = i;
+        for (int i = 0; i < qmin(10, bsp->numfaces); i++) {
+            const int facenum = byactual[i];
+            logprint("    face %d: %.3fs, predicted cost %g (rank %d)\n",
+                     facenum, faces_actualtime[facenum], faces_predictedcost[facenum], rank[facenum]);
+        }
+    }
+}
+
 static void *
 LightThread(void *arg)
 {
     const mbsp_t *bsp = (const mbsp_t *)arg;
 
-#if defined(HAVE_EMBREE) && defined (__SSE2__)
+#if defined (__SSE2__)
     _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 //    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
 #endif
 
     while (1) {
-        const int facenum = GetThreadWork();
-        if (facenum == -1)
+        const int work = GetThreadWork();
+        if (work == -1)
             break;
 
+        const int facenum = faceorder[work];
+        const double start = I_FloatTime();
+
         bsp2_dface_t *f = const_cast<bsp2_dface_t*>(BSP_GetFace(const_cast<mbsp_t *>(bsp), facenum));
         
         /* Find the correct model offset */
@@ -286,15 +517,16 @@ LightThread(void *arg)
         else if (faces_sup[facenum].lmscale == face_modelinfo->lightmapscale)
         {
             LightFace(bsp, f, nullptr, cfg_static);
-            faces_sup[facenum].lightofs = f->lightofs;
+            // lightofs is shared by AssignFileSpace
             for (int i = 0; i < MAXLIGHTMAPS; i++)
                 faces_sup[facenum].styles[i] = f->styles[i];
         }
         else
         {
-            LightFace(bsp, f, nullptr, cfg_static);
-            LightFace(bsp, f, faces_sup + facenum, cfg_static);
+            LightFace_MultiScale(bsp, f, faces_sup + facenum, cfg_static);
         }
+
+        faces_actualtime[facenum] = I_FloatTime() - start;
     }
 
     return NULL;
@@ -388,30 +620,22 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
     logprint("--- LightWorld ---\n" );
     
     mbsp_t *const bsp = &bspdata->data.mbsp;
-    free(filebase);
-    free(lit_filebase);
-    free(lux_filebase);
-
-    /* greyscale data stored in a separate buffer */
-    filebase = (uint8_t *)calloc(MAX_MAP_LIGHTING, 1);
-    if (!filebase)
-        Error("%s: allocation of %i bytes failed.", __func__, MAX_MAP_LIGHTING);
-    file_p = 0;
-    file_end = MAX_MAP_LIGHTING;
-
-    /* litfile data stored in a separate buffer */
-    lit_filebase = (uint8_t *)calloc(MAX_MAP_LIGHTING*3, 1);
-    if (!lit_filebase)
-        Error("%s: allocation of %i bytes failed.", __func__, MAX_MAP_LIGHTING*3);
-    lit_file_p = 0;
-    lit_file_end = (MAX_MAP_LIGHTING*3);
-
-    /* lux data stored in a separate buffer */
-    lux_filebase = (uint8_t *)calloc(MAX_MAP_LIGHTING*3, 1);
-    if (!lux_filebase)
-        Error("%s: allocation of %i bytes failed.", __func__, MAX_MAP_LIGHTING*3);
-    lux_file_p = 0;
-    lux_file_end = (MAX_MAP_LIGHTING*3);
+    /* only produce the output that is going to be written */
+    const bool rgb = bsp->loadversion->game->has_rgb_lightmap;
+    grey_needed = !rgb && !litonly;
+    lit_needed = rgb || write_litfile != 0;
+    lux_needed = write_luxfile != 0 || write_litfile == ~0;
+    
+    if (litonly) {
+        /* -litonly writes into the offsets already in the bsp */
+        if (lit_needed)
+            lit_filebase = static_cast<uint8_t *>(calloc(qmax(bsp->lightdatasize * 3, 1), 1));
+        if (lux_needed)
+            lux_filebase = static_cast<uint8_t *>(calloc(qmax(bsp->lightdatasize * 3, 1), 1));
+        lit_filesize = bsp->lightdatasize * 3;
+        if ((lit_needed && !lit_filebase) || (lux_needed && !lux_filebase))
+            Error("%s: allocation of %i bytes failed.", __func__, bsp->lightdatasize * 3);
+    }
 
     if (forcedscale)
         BSPX_AddLump(bspdata, "LMSHIFT", NULL, 0);
@@ -453,10 +677,46 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
     info.bsp = bsp;
     RunThreadsOn(0, info.all_batches.size(), LightBatchThread, &info);
 #else
+    if (pvscull)
+        SetupPVSCulling(bsp);
+
+    /* the cache only holds regular lighting, debug modes always relight */
+    char lightcachename[1024];
+    /* -adaptive lights subsets of the sample points, which the cache entries don't describe */
+    if ((lightcache || dirtcache) && adaptive && oversample > 1 && debugmode == debugmode_none)
+        Error("-lightcache and -dirtcache can't be combined with -adaptive");
+    const bool uselightcache = lightcache && debugmode == debugmode_none;
+    if (uselightcache) {
+        q_snprintf(lightcachename, sizeof(lightcachename) - 16, "%s", mapfilename);
+        StripExtension(lightcachename);
+        DefaultExtension(lightcachename, ".lightcache");
+        LightCache_Load(bsp, cfg_static, lightcachename);
+    }
+
+    char dirtcachename[1024];
+    const bool usedirtcache = dirtcache && dirt_in_use;
+    if (usedirtcache) {
+        q_snprintf(dirtcachename, sizeof(dirtcachename) - 16, "%s", mapfilename);
+        StripExtension(dirtcachename);
+        DefaultExtension(dirtcachename, ".dirtcache");
+        DirtCache_Load(bsp, cfg_static, dirtcachename);
+    }
+
+    ScheduleFaces(bsp);
+    facelightdata.assign(bsp->numfaces * 2, facelightdata_t {});
     logprint("--- LightThread ---\n"); //mxd
     RunThreadsOn(0, bsp->numfaces, LightThread, bsp);
+    PrintFaceCostStats(bsp);
+
+    if (uselightcache)
+        LightCache_Save(lightcachename);
+    if (usedirtcache)
+        DirtCache_Save(dirtcachename);
 #endif
 
+    if (!litonly)
+        AssignFileSpace(bsp);
+
     if (bouncerequired || isQuake2map) { //mxd. Print some extra stats...
         logprint("Indirect lights: %i bounce lights, %i surface lights (%i light points) in use.\n",
                  static_cast<int>(BounceLights().size()),
@@ -466,17 +726,17 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
 
     logprint("Lighting Completed.\n\n");
 
-    // Transfer greyscale lightmap (or color lightmap for Q2/HL) to the bsp and update lightdatasize
+    // Hand the greyscale lightmap (or color lightmap for Q2/HL) to the bsp and update lightdatasize
     if (!litonly) {
         free(bsp->dlightdata);
-        if (bsp->loadversion->game->has_rgb_lightmap) {
-            bsp->lightdatasize = lit_file_p;
-            bsp->dlightdata = (uint8_t *)malloc(bsp->lightdatasize);
-            memcpy(bsp->dlightdata, lit_filebase, bsp->lightdatasize);
+        if (rgb) {
+            // lit_filebase stays pointing at it for the .lit / bspx output
+            bsp->lightdatasize = lit_filesize;
+            bsp->dlightdata = lit_filebase;
         } else {
             bsp->lightdatasize = file_p;
-            bsp->dlightdata = (uint8_t *)malloc(bsp->lightdatasize);
-            memcpy(bsp->dlightdata, filebase, bsp->lightdatasize);
+            bsp->dlightdata = filebase;
+            filebase = nullptr;
         }
     } else {
         // NOTE: bsp->lightdatasize is already valid in the -litonly case
@@ -770,11 +1030,21 @@ static void PrintUsage()
 "\n"
 "Performance options:\n"
 "  -threads n          set the number of threads\n"
+"  -threadaffinity     pin worker threads to CPUs\n"
+"  -tracer embree|bvh  ray tracer to use, default embree if compiled in\n"
 "  -extra              2x supersampling\n"
 "  -extra4             4x supersampling, slowest, use for final compile\n"
+"  -adaptive [n]       with -extra/-extra4, only supersample texels that differ\n"
+"                      from their neighbours' average by more than n (default 8)\n"
 "  -gate n             cutoff lights at this brightness level\n"
 "  -sunsamples n       set samples for _sunlight2, default 64\n"
+"  -skydome n          light _sunlight2/3 domes in one pass with n rays per\n"
+"                      hemisphere instead of one ray per dome sun\n"
 "  -surflight_subdivide  surface light subdivision size\n"
+"  -surflight_samples n  trace n importance sampled surface light rays per\n"
+"                      sample point instead of one per surface light point\n"
+"  -lightcache         reuse unchanged lights from the previous run's .lightcache\n"
+"  -dirtcache          reuse dirt from the previous run's .dirtcache\n"
 "\n"
 "Output format options:\n"
 "  -lit                write .lit file\n"
@@ -789,6 +1059,8 @@ static void PrintUsage()
 "  -bouncedebug        only save bounced lighting to the lightmap\n"
 "  -surflight_dump     dump surface lights to a .map file\n"
 "  -novisapprox        disable approximate visibility culling of lights\n"
+"  -pvscull            skip lights the bsp's PVS says a face can't see\n"
+"  -sortrays           sort ray batches in Morton order before tracing\n"
 "\n"
 "Experimental options:\n"
 "  -lit2               write .lit2 file\n"
@@ -797,6 +1069,8 @@ static void PrintUsage()
 "  -bspxlit            writes rgb data into the bsp itself\n"
 "  -bspx               writes both rgb and directions data into the bsp itself\n"
 "  -novanilla          implies -bspxlit. don't write vanilla lighting\n"
+"  -texturefilter      fences shadow by their texture alpha, glass is tinted\n"
+"                      by its texture\n"
 "  -radlights filename.rad loads a <surfacename> <r> <g> <b> <intensity> file\n");
     
     printf("\n");
@@ -956,12 +1230,35 @@ light_main(int argc, const char **argv)
     for (i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-threads")) {
             numthreads = ParseInt(&i, argc, argv);
+        } else if (!strcmp(argv[i], "-tracer")) {
+            const char *name = ParseString(&i, argc, argv);
+            if (!Q_strcasecmp(name, "embree")) {
+#ifdef HAVE_EMBREE
+                tracer = tracer_t::EMBREE;
+#else
+                Error("-tracer embree: light was built without Embree");
+#endif
+            } else if (!Q_strcasecmp(name, "bvh")) {
+                tracer = tracer_t::BVH;
+            } else {
+                Error("-tracer: unknown tracer \"%s\", expected embree or bvh", name);
+            }
+            logprint("using the %s ray tracer\n", (tracer == tracer_t::BVH) ? "built-in bvh" : "embree");
+        } else if (!strcmp(argv[i], "-threadaffinity")) {
+            threadaffinity = true;
+            logprint("thread affinity enabled\n");
         } else if (!strcmp(argv[i], "-extra")) {
             oversample = 2;
             logprint("extra 2x2 sampling enabled\n");
         } else if (!strcmp(argv[i], "-extra4")) {
             oversample = 4;
             logprint("extra 4x4 sampling enabled\n");
+        } else if (!strcmp(argv[i], "-adaptive")) {
+            adaptive = true;
+            vec_t threshold;
+            if (ParseVecOptional(&threshold, &i, argc, argv))
+                adaptive_threshold = threshold;
+            logprint("adaptive supersampling enabled, threshold %g\n", adaptive_threshold);
         } else if (!strcmp(argv[i], "-gate")) {
             fadegate = ParseVec(&i, argc, argv);
             if (fadegate > 1) {
@@ -986,6 +1283,9 @@ light_main(int argc, const char **argv)
             write_luxfile |= 2;
         } else if (!strcmp(argv[i], "-novanilla")) {
             scaledonly = true;
+        } else if (!strcmp(argv[i], "-texturefilter")) {
+            texturefilter = true;
+            logprint("fence and glass texture sampling enabled\n");
         } else if ( !strcmp( argv[ i ], "-radlights" ) ) {
             if (!ParseLightsFile(argv[++i]))
                 logprint( "Unable to read surfacelights file %s\n", argv[i] );
@@ -1016,12 +1316,20 @@ light_main(int argc, const char **argv)
             surflight_subdivide = ParseVec(&i, argc, argv);
             surflight_subdivide = qmin(qmax(surflight_subdivide, 64.0f), 2048.0f);
             logprint( "Using surface light subdivision size of %f\n", surflight_subdivide);
+        } else if (!strcmp(argv[i], "-surflight_samples")) {
+            surflight_samples = ParseInt(&i, argc, argv);
+            surflight_samples = qmin(qmax(surflight_samples, 1), 4096);
+            logprint("Using %d importance sampled surface light rays per sample point\n", surflight_samples);
         } else if ( !strcmp( argv[ i ], "-surflight_dump" ) ) {
             surflight_dump = true;
         } else if ( !strcmp( argv[ i ], "-sunsamples" ) ) {
             sunsamples = ParseInt(&i, argc, argv);
             sunsamples = qmin(qmax(sunsamples, 8), 2048);
             logprint( "Using sunsamples of %d\n", sunsamples);
+        } else if (!strcmp(argv[i], "-skydome")) {
+            skydome_samples = ParseInt(&i, argc, argv);
+            skydome_samples = qmin(qmax(skydome_samples, 4), 2048);
+            logprint("single pass sky domes enabled, %d rays per hemisphere\n", skydome_samples);
         } else if ( !strcmp( argv[ i ], "-onlyents" ) ) {
             onlyents = true;
             logprint( "Onlyents mode enabled\n" );
@@ -1037,6 +1345,18 @@ light_main(int argc, const char **argv)
         } else if ( !strcmp( argv[ i ], "-novisapprox" ) ) {
             novisapprox = true;
             logprint( "Skipping approximate light visibility\n" );
+        } else if ( !strcmp( argv[ i ], "-sortrays" ) ) {
+            sortrays = true;
+            logprint( "Sorting ray batches for coherence\n" );
+        } else if ( !strcmp( argv[ i ], "-lightcache" ) ) {
+            lightcache = true;
+            logprint( "Reusing unchanged lights from the light cache\n" );
+        } else if ( !strcmp( argv[ i ], "-dirtcache" ) ) {
+            dirtcache = true;
+            logprint( "Reusing dirt from the dirt cache\n" );
+        } else if ( !strcmp( argv[ i ], "-pvscull" ) ) {
+            pvscull = true;
+            logprint( "Culling lights using the bsp's PVS\n" );
         } else if ( !strcmp( argv[ i ], "-nolights" ) ) {
             nolights = true;
             logprint( "Skipping all light entities (sunlight / minlight only)\n" );
@@ -1230,11 +1550,11 @@ light_main(int argc, const char **argv)
             if (write_litfile & 1)
                 WriteLitFile(bsp, faces_sup, source, LIT_VERSION);
             if (write_litfile & 2)
-                BSPX_AddLump(&bspdata, "RGBLIGHTING", lit_filebase, bsp->lightdatasize*3);
+                BSPX_AddLump(&bspdata, "RGBLIGHTING", lit_filebase, lit_filesize);
             if (write_luxfile & 1)
                 WriteLuxFile(bsp, source, LIT_VERSION);
             if (write_luxfile & 2)
-                BSPX_AddLump(&bspdata, "LIGHTINGDIR", lux_filebase, bsp->lightdatasize*3);
+                BSPX_AddLump(&bspdata, "LIGHTINGDIR", lux_filebase, lit_filesize);
         }
     }
 
@@ -1267,7 +1587,31 @@ light_main(int argc, const char **argv)
     logprint("%f bounce lights tested, %f hits per sample point\n",
              static_cast<double>(total_bounce_rays) / static_cast<double>(total_samplepoints),
              static_cast<double>(total_bounce_ray_hits) / static_cast<double>(total_samplepoints));
+    if (total_skydome_rays)
+        logprint("%f sky dome rays per sample point\n",
+                 static_cast<double>(total_skydome_rays) / static_cast<double>(total_samplepoints));
     logprint("%d empty lightmaps\n", static_cast<int>(fully_transparent_lightmaps));
+    if (pvscull)
+        logprint("%u light/face pairs rejected by the PVS\n", static_cast<unsigned>(total_pvs_culled_pairs));
+    if (lightcache)
+        logprint("%u light/face pairs reused from the light cache, %u recomputed\n",
+                 static_cast<unsigned>(total_lightcache_reused), static_cast<unsigned>(total_lightcache_missed));
+    if (total_adaptive_texels)
+        logprint("%u of %u texels (%.1f%%) supersampled by -adaptive\n",
+                 static_cast<unsigned>(total_adaptive_refined), static_cast<unsigned>(total_adaptive_texels),
+                 100.0 * total_adaptive_refined / total_adaptive_texels);
+    if (total_multiscale_texels)
+        logprint("%u of %u texels (%.1f%%) of the coarser lightmap scale traced, the rest filtered from the finer one\n",
+                 static_cast<unsigned>(total_multiscale_traced), static_cast<unsigned>(total_multiscale_texels),
+                 100.0 * total_multiscale_traced / total_multiscale_texels);
+    if (dirt_in_use && total_dirt_rays_saved)
+        logprint("%llu dirt rays traced, %llu (%.1f%%) saved by adaptive dirt\n",
+                 static_cast<unsigned long long>(total_dirt_rays),
+                 static_cast<unsigned long long>(total_dirt_rays_saved),
+                 100.0 * total_dirt_rays_saved / (total_dirt_rays + total_dirt_rays_saved));
+    if (dirtcache && dirt_in_use)
+        logprint("%u faces' dirt reused from the dirt cache, %u recomputed\n",
+                 static_cast<unsigned>(total_dirtcache_reused), static_cast<unsigned>(total_dirtcache_missed));
     close_log();
     
     return 0;
@@ -0,0 +1,678 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/light.hh>
+#include <light/entities.hh>
+#include <light/lightcache.hh>
+
+#include <common/bsputils.hh>
+#include <common/entdata.h>
+
+#include <cstdio>
+#include <cstring>
+
+#define LIGHTCACHE_VERSION 1
+
+static const char lightcache_ident[8] = { 'L', 'T', 'C', 'A', 'C', 'H', 'E', '1' };
+
+typedef struct {
+    char ident[8];
+    int32_t version;
+    int32_t numslots;
+    uint64_t globalkey;
+} lightcache_header_t;
+
+static bool lightcache_active = false;
+static uint64_t lightcache_globalkey;
+static std::vector<uint64_t> lightcache_lightkeys;
+static std::vector<uint64_t> lightcache_sunkeys;
+
+/* entries loaded from the previous run, and the ones recorded by this run */
+static std::vector<lightcache_face_t> lightcache_previous;
+static std::vector<lightcache_face_t> lightcache_next;
+
+/*
+ * Hashes the values of a settings dictionary. Floats are hashed exactly
+ * rather than through stringValue(), which rounds to 6 digits.
+ */
+static void
+LightCache_AddSettings(lightcache_hash_t *hash, const settingsdict_t &settings, bool skipsun)
+{
+    for (const lockable_setting_t *setting : settings.allSettings()) {
+        /* the sun settings only reach the lightmaps through GetSuns(), which have their own keys */
+        if (skipsun && setting->primaryName().compare(0, 3, "sun") == 0)
+            continue;
+
+        hash->addString(setting->primaryName());
+        if (const auto *vecsetting = dynamic_cast<const lockable_vec_t *>(setting)) {
+            hash->addFloat(vecsetting->floatValue());
+        } else if (const auto *vec3setting = dynamic_cast<const lockable_vec3_t *>(setting)) {
+            hash->addVecs(*vec3setting->vec3Value(), 3);
+        } else {
+            hash->addString(setting->stringValue());
+        }
+    }
+}
+
+/*
+ * Hashes the geometry rays are traced against and the textures (fence alpha,
+ * projected textures). Structs are hashed field by field so padding bytes
+ * don't leak in, and the lighting fields of the faces/leafs are skipped
+ * since they are rewritten by every run. The key must come out the same
+ * for two runs on the same bsp.
+ */
+static void
+LightCache_AddGeometry(lightcache_hash_t *out, const mbsp_t *bsp)
+{
+    lightcache_hash_t &hash = *out;
+
+    hash.addInt(sizeof(vec_t));
+    hash.addInt(bsp->loadversion->game->id);
+
+    hash.addInt(bsp->numvertexes);
+    for (int i = 0; i < bsp->numvertexes; i++)
+        hash.addFloats(bsp->dvertexes[i].point, 3);
+
+    hash.addInt(bsp->numplanes);
+    for (int i = 0; i < bsp->numplanes; i++) {
+        hash.addFloats(bsp->dplanes[i].normal, 3);
+        hash.addFloat(bsp->dplanes[i].dist);
+    }
+
+    hash.addInt(bsp->numedges);
+    for (int i = 0; i < bsp->numedges; i++) {
+        hash.addInt(bsp->dedges[i].v[0]);
+        hash.addInt(bsp->dedges[i].v[1]);
+    }
+
+    hash.addInt(bsp->numsurfedges);
+    hash.add(bsp->dsurfedges, sizeof(*bsp->dsurfedges) * bsp->numsurfedges);
+
+    hash.addInt(bsp->numfaces);
+    for (int i = 0; i < bsp->numfaces; i++) {
+        const bsp2_dface_t *face = &bsp->dfaces[i];
+        hash.addInt(face->planenum);
+        hash.addInt(face->side);
+        hash.addInt(face->firstedge);
+        hash.addInt(face->numedges);
+        hash.addInt(face->texinfo);
+    }
+
+    hash.addInt(bsp->numtexinfo);
+    for (int i = 0; i < bsp->numtexinfo; i++) {
+        const gtexinfo_t *texinfo = &bsp->texinfo[i];
+        const surfflags_t &flags = extended_texinfo_flags[i];
+        hash.addFloats(&texinfo->vecs[0][0], 8);
+        hash.addInt(texinfo->flags.native);
+        hash.addInt(texinfo->miptex);
+        hash.addInt(texinfo->value);
+        hash.addString(std::string(texinfo->texture, strnlen(texinfo->texture, sizeof(texinfo->texture))));
+        hash.addInt(texinfo->nexttexinfo);
+        hash.addInt(flags.extended);
+        hash.addInt(flags.phong_angle);
+        hash.addInt(flags.minlight);
+        hash.add(flags.minlight_color.data(), flags.minlight_color.size());
+        hash.addInt(flags.phong_angle_concave);
+        hash.addInt(flags.light_alpha);
+    }
+
+    hash.addInt(bsp->nummodels);
+    for (int i = 0; i < bsp->nummodels; i++) {
+        const dmodelh2_t *model = &bsp->dmodels[i];
+        hash.addFloats(model->mins, 3);
+        hash.addFloats(model->maxs, 3);
+        hash.addFloats(model->origin, 3);
+        hash.add(model->headnode, sizeof(model->headnode));
+        hash.addInt(model->visleafs);
+        hash.addInt(model->firstface);
+        hash.addInt(model->numfaces);
+    }
+
+    hash.addInt(bsp->numnodes);
+    for (int i = 0; i < bsp->numnodes; i++) {
+        const bsp2_dnode_t *node = &bsp->dnodes[i];
+        hash.addInt(node->planenum);
+        hash.addInt(node->children[0]);
+        hash.addInt(node->children[1]);
+    }
+
+    hash.addInt(bsp->numleafs);
+    for (int i = 0; i < bsp->numleafs; i++) {
+        const mleaf_t *leaf = &bsp->dleafs[i];
+        hash.addInt(leaf->contents);
+        hash.addInt(leaf->visofs);
+        hash.addInt(leaf->cluster);
+        hash.addInt(leaf->firstmarksurface);
+        hash.addInt(leaf->nummarksurfaces);
+    }
+
+    hash.addInt(bsp->numleaffaces);
+    hash.add(bsp->dleaffaces, sizeof(*bsp->dleaffaces) * bsp->numleaffaces);
+
+    hash.addInt(bsp->visdatasize);
+    hash.add(bsp->dvisdata, bsp->visdatasize);
+    hash.addInt(bsp->texdatasize);
+    hash.add(bsp->dtexdata, bsp->texdatasize);
+
+    /*
+     * The RGBA textures are built by LoadOrConvertTextures on every run, and
+     * the bytes after each name's terminator are whatever malloc returned,
+     * so only the names, sizes and pixels are hashed.
+     */
+    const dmiptexlump_t *rgbalump = bsp->rgbatexdatasize ? bsp->drgbatexdata : nullptr;
+    hash.addInt(rgbalump ? rgbalump->nummiptex : 0);
+    for (int i = 0; rgbalump && i < rgbalump->nummiptex; i++) {
+        const int ofs = rgbalump->dataofs[i];
+        hash.addInt(ofs < 0 ? -1 : 0);
+        if (ofs < 0)
+            continue;
+
+        const rgba_miptex_t *miptex = reinterpret_cast<const rgba_miptex_t *>(reinterpret_cast<const uint8_t *>(rgbalump) + ofs);
+        hash.addString(std::string(miptex->name, strnlen(miptex->name, sizeof(miptex->name))));
+        hash.addInt(miptex->width);
+        hash.addInt(miptex->height);
+        hash.add(reinterpret_cast<const uint8_t *>(miptex) + miptex->offset, miptex->width * miptex->height * 4);
+    }
+}
+
+/*
+ * Hashes the entities other than lights (shadow casters, per-model
+ * settings). The worldspawn sun keys are left out: the suns they make have
+ * their own keys, and the -skydome domes are always recomputed.
+ */
+static void
+LightCache_AddEntities(lightcache_hash_t *hash, const mbsp_t *bsp)
+{
+    for (const entdict_t &entdict : EntData_Parse(bsp->dentdata)) {
+        const std::string &classname = entdict.get("classname");
+        if (classname.compare(0, 5, "light") == 0)
+            continue;
+        const bool worldspawn = (classname == "worldspawn");
+        for (const auto &epair : entdict) {
+            if (worldspawn && (epair.first.compare(0, 4, "_sun") == 0 || epair.first.compare(0, 3, "sun") == 0))
+                continue;
+            hash->addString(epair.first);
+            hash->addString(epair.second);
+        }
+        hash->addInt(-1);
+    }
+}
+
+/*
+ * Key for everything that can change the contribution of any light:
+ * geometry, textures, the non-light entities, global settings and command
+ * line options. Lights and suns have their own keys.
+ */
+uint64_t
+LightCache_GlobalKey(const mbsp_t *bsp, globalconfig_t &cfg)
+{
+    lightcache_hash_t hash;
+
+    hash.addInt(LIGHTCACHE_VERSION);
+    LightCache_AddGeometry(&hash, bsp);
+    LightCache_AddEntities(&hash, bsp);
+    LightCache_AddSettings(&hash, cfg.settings(), true);
+
+    hash.addInt(oversample);
+    hash.addFloat(fadegate);
+    hash.addInt(dirt_in_use);
+    hash.addInt(numDirtVectors);
+    hash.addInt(novisapprox);
+    hash.addInt(pvscull);
+    hash.addInt(nolights);
+    hash.addInt(arghradcompat);
+    hash.addInt(texturefilter);
+    hash.addInt(static_cast<int>(tracer));
+
+    return hash.value();
+}
+
+static uint64_t
+LightCache_KeyForLight(const light_t &entity)
+{
+    lightcache_hash_t hash;
+
+    LightCache_AddSettings(&hash, const_cast<light_t &>(entity).settings(), false);
+    hash.addInt(entity.spotlight);
+    hash.addVecs(entity.spotvec, 3);
+    hash.addFloat(entity.spotfalloff);
+    hash.addFloat(entity.spotfalloff2);
+    hash.addInt(entity.projectedmip != nullptr);
+    hash.addFloats(entity.projectionmatrix, 16);
+
+    return hash.value();
+}
+
+static uint64_t
+LightCache_KeyForSun(const sun_t &sun)
+{
+    lightcache_hash_t hash;
+
+    hash.addVecs(sun.sunvec, 3);
+    hash.addVecs(&sun.sunlight, 1);
+    hash.addVecs(sun.sunlight_color, 3);
+    hash.addInt(sun.dirt);
+    hash.addFloat(sun.anglescale);
+    hash.addInt(sun.style);
+    hash.addString(sun.suntexture);
+
+    return hash.value();
+}
+
+uint64_t
+LightCache_FaceKey(const lightsurf_t *lightsurf)
+{
+    lightcache_hash_t hash;
+    const int numpoints = lightsurf->numpoints;
+
+    hash.addInt(Face_GetNum(lightsurf->bsp, lightsurf->face));
+    hash.addInt(lightsurf->face->texinfo);
+    hash.addVecs(lightsurf->plane.normal, 3);
+    hash.addVecs(&lightsurf->plane.dist, 1);
+    hash.addInt(lightsurf->curved);
+    hash.addInt(lightsurf->twosided);
+    hash.addInt(lightsurf->nodirt);
+    hash.addFloat(lightsurf->lightmapscale);
+    hash.addInt(numpoints);
+    hash.addVecs(lightsurf->points[0], 3 * numpoints);
+    hash.addVecs(lightsurf->normals[0], 3 * numpoints);
+    hash.add(lightsurf->occluded, sizeof(*lightsurf->occluded) * numpoints);
+    hash.addVecs(lightsurf->occlusion, numpoints);
+    hash.addInt(lightsurf->pvsbits.size());
+    hash.add(lightsurf->pvsbits.data(), sizeof(int) * lightsurf->pvsbits.size());
+
+    /* 0 is reserved for "no entry" */
+    return hash.value() ? hash.value() : 1;
+}
+
+uint64_t
+LightCache_LightKey(int lightnum)
+{
+    return lightcache_lightkeys.at(lightnum);
+}
+
+uint64_t
+LightCache_SunKey(int sunnum)
+{
+    return lightcache_sunkeys.at(sunnum);
+}
+
+bool
+LightCache_Active()
+{
+    return lightcache_active;
+}
+
+lightcache_face_t *
+LightCache_PreviousFace(int slot, uint64_t key)
+{
+    if (slot >= static_cast<int>(lightcache_previous.size()))
+        return nullptr;
+
+    lightcache_face_t *entry = &lightcache_previous[slot];
+    return (entry->key == key) ? entry : nullptr;
+}
+
+lightcache_face_t *
+LightCache_NewFace(int slot, uint64_t key)
+{
+    lightcache_face_t *entry = &lightcache_next.at(slot);
+    entry->key = key;
+    entry->sources.clear();
+    return entry;
+}
+
+/*
+ * ============================================================================
+ * FILE I/O
+ * ============================================================================
+ */
+
+static bool
+LightCache_Read(FILE *f, void *buffer, size_t size)
+{
+    return size == 0 || fread(buffer, size, 1, f) == 1;
+}
+
+template <typename T>
+static bool
+LightCache_Read(FILE *f, T *value)
+{
+    return LightCache_Read(f, value, sizeof(*value));
+}
+
+/* bytes left to read in f, which is filesize bytes long */
+static uint64_t
+LightCache_Remaining(FILE *f, long filesize)
+{
+    const long pos = ftell(f);
+    return (pos < 0 || pos > filesize) ? 0 : static_cast<uint64_t>(filesize - pos);
+}
+
+static long
+LightCache_FileSize(FILE *f)
+{
+    const long pos = ftell(f);
+    fseek(f, 0, SEEK_END);
+    const long size = ftell(f);
+    fseek(f, pos, SEEK_SET);
+    return size;
+}
+
+template <typename T>
+static void
+LightCache_Write(FILE *f, const T &value)
+{
+    SafeWrite(f, &value, sizeof(value));
+}
+
+/*
+ * The counts are checked against what is left of the file before anything
+ * is allocated for them, so a corrupt cache can't ask for gigabytes.
+ */
+static bool
+LightCache_ReadFaces(FILE *f, long filesize, std::vector<lightcache_face_t> *faces)
+{
+    /* key, traced, style, numsamples */
+    const uint64_t sourcesize = sizeof(uint64_t) + sizeof(int32_t) + sizeof(int32_t) + sizeof(uint32_t);
+
+    for (lightcache_face_t &face : *faces) {
+        uint32_t numsources;
+        if (!LightCache_Read(f, &face.key) || !LightCache_Read(f, &numsources))
+            return false;
+        if (numsources > LightCache_Remaining(f, filesize) / sourcesize)
+            return false;
+
+        face.sources.resize(numsources);
+        for (lightcache_source_t &source : face.sources) {
+            int32_t traced;
+            uint32_t numsamples;
+            if (!LightCache_Read(f, &source.key) || !LightCache_Read(f, &traced)
+                || !LightCache_Read(f, &source.style) || !LightCache_Read(f, &numsamples))
+                return false;
+
+            source.traced = (traced != 0);
+            if (numsamples > LightCache_Remaining(f, filesize) / sizeof(lightcache_sample_t))
+                return false;
+            source.samples.resize(numsamples);
+            if (!LightCache_Read(f, source.samples.data(), sizeof(lightcache_sample_t) * numsamples))
+                return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * ==============
+ * LightCache_Load
+ * ==============
+ */
+void
+LightCache_Load(const mbsp_t *bsp, globalconfig_t &cfg, const char *filename)
+{
+    logprint("--- LightCache_Load ---\n");
+
+    lightcache_globalkey = LightCache_GlobalKey(bsp, cfg);
+
+    lightcache_lightkeys.clear();
+    for (const light_t &entity : GetLights())
+        lightcache_lightkeys.push_back(LightCache_KeyForLight(entity));
+
+    lightcache_sunkeys.clear();
+    for (const sun_t &sun : GetSuns())
+        lightcache_sunkeys.push_back(LightCache_KeyForSun(sun));
+
+    const int numslots = LightCache_Slot(bsp->numfaces, false);
+    lightcache_previous.clear();
+    lightcache_next.assign(numslots, lightcache_face_t {});
+    lightcache_active = true;
+
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        logprint("No light cache %s, lighting everything\n", filename);
+        return;
+    }
+
+    lightcache_header_t header;
+    if (!LightCache_Read(f, &header)
+        || memcmp(header.ident, lightcache_ident, sizeof(lightcache_ident))
+        || header.version != LIGHTCACHE_VERSION
+        || header.numslots != numslots
+        || header.globalkey != lightcache_globalkey) {
+        logprint("Light cache %s is out of date, lighting everything\n", filename);
+        fclose(f);
+        return;
+    }
+
+    lightcache_previous.assign(numslots, lightcache_face_t {});
+    if (!LightCache_ReadFaces(f, LightCache_FileSize(f), &lightcache_previous)) {
+        logprint("WARNING: light cache %s is truncated or corrupt, ignoring it\n", filename);
+        lightcache_previous.clear();
+    } else {
+        logprint("Loaded light cache %s\n", filename);
+    }
+    fclose(f);
+}
+
+/*
+ * ==============
+ * LightCache_Save
+ *
+ * Writes the contributions recorded by this run. Faces that weren't
+ * lightmapped are written as empty entries.
+ * ==============
+ */
+void
+LightCache_Save(const char *filename)
+{
+    if (!lightcache_active)
+        return;
+
+    lightcache_header_t header;
+    memcpy(header.ident, lightcache_ident, sizeof(lightcache_ident));
+    header.version = LIGHTCACHE_VERSION;
+    header.numslots = static_cast<int32_t>(lightcache_next.size());
+    header.globalkey = lightcache_globalkey;
+
+    logprint("Writing %s\n", filename);
+    FILE *f = SafeOpenWrite(filename);
+    LightCache_Write(f, header);
+
+    for (const lightcache_face_t &face : lightcache_next) {
+        LightCache_Write(f, face.key);
+        LightCache_Write(f, static_cast<uint32_t>(face.sources.size()));
+        for (const lightcache_source_t &source : face.sources) {
+            LightCache_Write(f, source.key);
+            LightCache_Write(f, static_cast<int32_t>(source.traced));
+            LightCache_Write(f, source.style);
+            LightCache_Write(f, static_cast<uint32_t>(source.samples.size()));
+            if (!source.samples.empty())
+                SafeWrite(f, source.samples.data(), sizeof(lightcache_sample_t) * source.samples.size());
+        }
+    }
+    fclose(f);
+
+    lightcache_previous.clear();
+    lightcache_next.clear();
+    lightcache_active = false;
+}
+
+/*
+ * ============================================================================
+ * DIRT CACHE
+ * ============================================================================
+ */
+
+#define DIRTCACHE_VERSION 1
+
+static const char dirtcache_ident[8] = { 'D', 'T', 'C', 'A', 'C', 'H', 'E', '1' };
+
+typedef struct {
+    uint64_t key;       // 0 = no entry
+    std::vector<vec_t> occlusion;
+} dirtcache_face_t;
+
+static bool dirtcache_active = false;
+static uint64_t dirtcache_globalkey;
+
+/* loaded from the previous run, updated in place as faces are lit */
+static std::vector<dirtcache_face_t> dirtcache_faces;
+
+/* the dirt only depends on the geometry, shadow casters and dirt settings */
+uint64_t
+DirtCache_GlobalKey(const mbsp_t *bsp, const globalconfig_t &cfg)
+{
+    lightcache_hash_t hash;
+
+    hash.addInt(DIRTCACHE_VERSION);
+    LightCache_AddGeometry(&hash, bsp);
+    LightCache_AddEntities(&hash, bsp);
+    hash.addInt(cfg.dirtMode.intValue());
+    hash.addFloat(cfg.dirtDepth.floatValue());
+    hash.addFloat(cfg.dirtAngle.floatValue());
+    hash.addFloat(cfg.dirtThreshold.floatValue());
+    hash.addInt(numDirtVectors);
+    hash.addInt(texturefilter);
+
+    return hash.value();
+}
+
+uint64_t
+DirtCache_FaceKey(const lightsurf_t *lightsurf)
+{
+    lightcache_hash_t hash;
+    const int numpoints = lightsurf->numpoints;
+
+    hash.addInt(Face_GetNum(lightsurf->bsp, lightsurf->face));
+    hash.addInt(numpoints);
+    hash.addVecs(lightsurf->points[0], 3 * numpoints);
+    hash.addVecs(lightsurf->normals[0], 3 * numpoints);
+    hash.add(lightsurf->occluded, sizeof(*lightsurf->occluded) * numpoints);
+
+    /* 0 is reserved for "no entry" */
+    return hash.value() ? hash.value() : 1;
+}
+
+bool
+DirtCache_Active()
+{
+    return dirtcache_active;
+}
+
+bool
+DirtCache_Lookup(int slot, uint64_t key, vec_t *occlusion, int numpoints)
+{
+    const dirtcache_face_t &entry = dirtcache_faces.at(slot);
+    if (entry.key != key || static_cast<int>(entry.occlusion.size()) != numpoints)
+        return false;
+
+    memcpy(occlusion, entry.occlusion.data(), sizeof(*occlusion) * numpoints);
+    return true;
+}
+
+void
+DirtCache_Store(int slot, uint64_t key, const vec_t *occlusion, int numpoints)
+{
+    dirtcache_face_t &entry = dirtcache_faces.at(slot);
+    entry.key = key;
+    entry.occlusion.assign(occlusion, occlusion + numpoints);
+}
+
+/*
+ * ==============
+ * DirtCache_Load
+ * ==============
+ */
+void
+DirtCache_Load(const mbsp_t *bsp, const globalconfig_t &cfg, const char *filename)
+{
+    logprint("--- DirtCache_Load ---\n");
+
+    dirtcache_globalkey = DirtCache_GlobalKey(bsp, cfg);
+
+    const int numslots = LightCache_Slot(bsp->numfaces, false);
+    dirtcache_faces.assign(numslots, dirtcache_face_t {});
+    dirtcache_active = true;
+
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        logprint("No dirt cache %s, calculating all dirt\n", filename);
+        return;
+    }
+
+    lightcache_header_t header;
+    if (!LightCache_Read(f, &header)
+        || memcmp(header.ident, dirtcache_ident, sizeof(dirtcache_ident))
+        || header.version != DIRTCACHE_VERSION
+        || header.numslots != numslots
+        || header.globalkey != dirtcache_globalkey) {
+        logprint("Dirt cache %s is out of date, calculating all dirt\n", filename);
+        fclose(f);
+        return;
+    }
+
+    const long filesize = LightCache_FileSize(f);
+    bool ok = true;
+    for (dirtcache_face_t &face : dirtcache_faces) {
+        uint32_t numpoints;
+        if (!LightCache_Read(f, &face.key) || !LightCache_Read(f, &numpoints)
+            || numpoints > LightCache_Remaining(f, filesize) / sizeof(vec_t)) {
+            ok = false;
+            break;
+        }
+        face.occlusion.resize(numpoints);
+        if (!LightCache_Read(f, face.occlusion.data(), sizeof(vec_t) * numpoints)) {
+            ok = false;
+            break;
+        }
+    }
+    if (!ok) {
+        logprint("WARNING: dirt cache %s is truncated or corrupt, ignoring it\n", filename);
+        dirtcache_faces.assign(numslots, dirtcache_face_t {});
+    } else {
+        logprint("Loaded dirt cache %s\n", filename);
+    }
+    fclose(f);
+}
+
+void
+DirtCache_Save(const char *filename)
+{
+    if (!dirtcache_active)
+        return;
+
+    lightcache_header_t header;
+    memcpy(header.ident, dirtcache_ident, sizeof(dirtcache_ident));
+    header.version = DIRTCACHE_VERSION;
+    header.numslots = static_cast<int32_t>(dirtcache_faces.size());
+    header.globalkey = dirtcache_globalkey;
+
+    logprint("Writing %s\n", filename);
+    FILE *f = SafeOpenWrite(filename);
+    LightCache_Write(f, header);
+
+    for (const dirtcache_face_t &face : dirtcache_faces) {
+        LightCache_Write(f, face.key);
+        LightCache_Write(f, static_cast<uint32_t>(face.occlusion.size()));
+        if (!face.occlusion.empty())
+            SafeWrite(f, face.occlusion.data(), sizeof(vec_t) * face.occlusion.size());
+    }
+    fclose(f);
+
+    dirtcache_faces.clear();
+    dirtcache_active = false;
+}
@@ -40,7 +40,7 @@ WriteLitFile(const mbsp_t *bsp, facesup_t *facesup, const char *filename, int ve
     header.v1.ident[3] = 'T';
     header.v1.version = LittleLong(version);
     header.v2.numsurfs = LittleLong(bsp->numfaces);
-    header.v2.lmsamples = LittleLong(bsp->lightdatasize);
+    header.v2.lmsamples = LittleLong(lit_filesize / 3);
 
     logprint("Writing %s\n", litname);
     litfile = SafeOpenWrite(litname);
@@ -71,11 +71,11 @@ WriteLitFile(const mbsp_t *bsp, facesup_t *facesup, const char *filename, int ve
         SafeWrite(litfile, extents, 2*bsp->numfaces * sizeof(*extents));
         SafeWrite(litfile, styles, 4*bsp->numfaces * sizeof(*styles));
         SafeWrite(litfile, shifts, bsp->numfaces * sizeof(*shifts));
-        SafeWrite(litfile, lit_filebase, bsp->lightdatasize * 3);
-        SafeWrite(litfile, lux_filebase, bsp->lightdatasize * 3);
+        SafeWrite(litfile, lit_filebase, lit_filesize);
+        SafeWrite(litfile, lux_filebase, lit_filesize);
     }
     else
-        SafeWrite(litfile, lit_filebase, bsp->lightdatasize * 3);
+        SafeWrite(litfile, lit_filebase, lit_filesize);
     fclose(litfile);
 }
 
@@ -98,6 +98,6 @@ WriteLuxFile(const mbsp_t *bsp, const char *filename, int version)
 
     luxfile = SafeOpenWrite(luxname);
     SafeWrite(luxfile, &header.v1, sizeof(header.v1));
-    SafeWrite(luxfile, lux_filebase, bsp->lightdatasize * 3);
+    SafeWrite(luxfile, lux_filebase, lit_filesize);
     fclose(luxfile);
 }
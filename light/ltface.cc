@@ -24,6 +24,7 @@
 #include <light/entities.hh>
 #include <light/trace.hh>
 #include <light/ltface.hh>
+#include <light/lightcache.hh>
 
 #include <common/bsputils.hh>
 #include <common/qvec.hh>
@@ -31,6 +32,8 @@
 #include <cassert>
 #include <cmath>
 #include <algorithm>
+#include <memory>
+#include <queue>
 
 using namespace std;
 
@@ -38,6 +41,13 @@ std::atomic<uint32_t> total_light_rays, total_light_ray_hits, total_samplepoints
 std::atomic<uint32_t> total_bounce_rays, total_bounce_ray_hits;
 std::atomic<uint32_t> total_surflight_rays, total_surflight_ray_hits; //mxd
 std::atomic<uint32_t> fully_transparent_lightmaps;
+std::atomic<uint32_t> total_pvs_culled_pairs;
+std::atomic<uint32_t> total_lightcache_reused, total_lightcache_missed;
+std::atomic<uint32_t> total_dirtcache_reused, total_dirtcache_missed;
+std::atomic<uint64_t> total_dirt_rays, total_dirt_rays_saved;
+std::atomic<uint32_t> total_adaptive_texels, total_adaptive_refined;
+std::atomic<uint32_t> total_multiscale_texels, total_multiscale_traced;
+std::atomic<uint64_t> total_skydome_rays;
 
 /* ======================================================================== */
 
@@ -677,6 +687,206 @@ PositionSamplePointOnFace(const mbsp_t *bsp,
     return position_t(face, point, pointNormal);
 }
 
+/*
+ * =================
+ * lightsurf_arena_t
+ *
+ * Per-thread storage for the per-face lighting buffers and ray streams.
+ * Buffers only ever grow and are reused for the next face lit on the same
+ * thread, so LightFace doesn't touch the heap for every face.
+ * =================
+ */
+struct lightsurf_arena_t {
+    lightsurf_t lightsurf {};
+    
+    int capacity = 0; // sample points the buffers below can hold
+    vec3_t *points = nullptr;
+    vec3_t *normals = nullptr;
+    bool *occluded = nullptr;
+    int *realfacenums = nullptr;
+    vec_t *occlusion = nullptr;
+    vec3_t *dirt_ups = nullptr; // LightFace_CalculateDirt scratch
+    vec3_t *dirt_rts = nullptr;
+    vec_t *dirt_sumsq = nullptr; // adaptive dirt per-sample statistics
+    int *dirt_counts = nullptr;
+    bool *dirt_done = nullptr;
+    vec3_t *sub_points = nullptr; // LightFace_LightSubset compacted copies
+    vec3_t *sub_normals = nullptr;
+    bool *sub_occluded = nullptr;
+    int *sub_realfacenums = nullptr;
+    vec_t *sub_occlusion = nullptr;
+    std::vector<int> adaptive_indices; // LightFace_Adaptive scratch
+    std::vector<uint8_t> adaptive_refine;
+    std::vector<int> multiscale_styles; // LightFace_MultiScale fine texels, per style
+    std::vector<lightsample_t> multiscale_texels;
+    std::vector<uint8_t> multiscale_valid;
+    vec_t *sample_add = nullptr; // LightFace_Entity scratch
+    vec3_t *sample_dirs = nullptr;
+    vec_t *sample_dists = nullptr;
+    
+    int streamcapacity = 0;
+    raystream_occlusion_t *occlusion_stream = nullptr;
+    raystream_intersection_t *intersection_stream = nullptr;
+    raystream_occlusion_t *surflight_stream = nullptr; // SURFLIGHT_BATCH_RAYS, created on first use
+    
+    std::vector<std::pair<const surfacelight_t *, int>> surflight_candidates; // LightFace_SurfaceLight scratch
+    std::vector<qvec3f> surflight_colors;
+    std::vector<float> surflight_cdf;
+    
+    std::vector<int> nearbylights; // LightsTouchingBounds result for LightFace_Lights
+    std::vector<float> bounce_scales; // LightFace_BounceLight untinted ray scales
+    
+    /* WriteLightmaps scratch and WriteSingleLightmap image buffers */
+    std::vector<std::pair<float, const lightmap_t *>> sortable;
+    std::vector<const lightmap_t *> sorted;
+    std::vector<qvec4f> image;
+    std::vector<qvec4f> image_tmp;
+    std::vector<qvec4f> image_dir;
+    
+    /* lightmap sample buffers; the first lightmaps_used are in use by the current face */
+    std::vector<std::vector<lightsample_t>> lightmapsamples;
+    size_t lightmaps_used = 0;
+    
+    ~lightsurf_arena_t() {
+        free(points);
+        free(normals);
+        free(occluded);
+        free(realfacenums);
+        free(occlusion);
+        free(dirt_ups);
+        free(dirt_rts);
+        free(dirt_sumsq);
+        free(dirt_counts);
+        free(dirt_done);
+        free(sub_points);
+        free(sub_normals);
+        free(sub_occluded);
+        free(sub_realfacenums);
+        free(sub_occlusion);
+        free(sample_add);
+        free(sample_dirs);
+        free(sample_dists);
+        delete occlusion_stream;
+        delete intersection_stream;
+        delete surflight_stream;
+    }
+};
+
+static lightsurf_arena_t *
+LightsurfArena(void)
+{
+    static thread_local std::unique_ptr<lightsurf_arena_t> arena;
+    
+    if (!arena)
+        arena = std::make_unique<lightsurf_arena_t>();
+    return arena.get();
+}
+
+template <class T>
+static void
+Arena_Grow(T **buffer, int count)
+{
+    *buffer = static_cast<T *>(realloc(*buffer, count * sizeof(T)));
+    if (!*buffer)
+        Error("%s: allocation of %d bytes failed.", __func__, static_cast<int>(count * sizeof(T)));
+}
+
+/*
+ * Returns the thread's lightsurf_t, reset for a new face. The lightmap
+ * vector keeps its storage.
+ */
+static lightsurf_t *
+LightsurfArena_NewLightsurf(void)
+{
+    lightsurf_arena_t *arena = LightsurfArena();
+    
+    lightmapdict_t lightmaps = std::move(arena->lightsurf.lightmapsByStyle);
+    lightmaps.clear();
+    arena->lightmaps_used = 0;
+    
+    arena->lightsurf = lightsurf_t {};
+    arena->lightsurf.lightmapsByStyle = std::move(lightmaps);
+    return &arena->lightsurf;
+}
+
+/*
+ * Points the per-sample arrays of surf at arena storage for surf->numpoints
+ * samples, cleared to zero.
+ */
+static void
+LightsurfArena_AllocPoints(lightsurf_t *surf)
+{
+    lightsurf_arena_t *arena = LightsurfArena();
+    const int numpoints = surf->numpoints;
+    
+    if (arena->capacity < numpoints) {
+        const int capacity = qmax(numpoints, arena->capacity + arena->capacity / 2);
+        Arena_Grow(&arena->points, capacity);
+        Arena_Grow(&arena->normals, capacity);
+        Arena_Grow(&arena->occluded, capacity);
+        Arena_Grow(&arena->realfacenums, capacity);
+        Arena_Grow(&arena->occlusion, capacity);
+        Arena_Grow(&arena->dirt_ups, capacity);
+        Arena_Grow(&arena->dirt_rts, capacity);
+        Arena_Grow(&arena->dirt_sumsq, capacity);
+        Arena_Grow(&arena->dirt_counts, capacity);
+        Arena_Grow(&arena->dirt_done, capacity);
+        Arena_Grow(&arena->sub_points, capacity);
+        Arena_Grow(&arena->sub_normals, capacity);
+        Arena_Grow(&arena->sub_occluded, capacity);
+        Arena_Grow(&arena->sub_realfacenums, capacity);
+        Arena_Grow(&arena->sub_occlusion, capacity);
+        Arena_Grow(&arena->sample_add, capacity);
+        Arena_Grow(&arena->sample_dirs, capacity);
+        Arena_Grow(&arena->sample_dists, capacity);
+        arena->capacity = capacity;
+    }
+    
+    memset(arena->points, 0, numpoints * sizeof(*arena->points));
+    memset(arena->normals, 0, numpoints * sizeof(*arena->normals));
+    memset(arena->occluded, 0, numpoints * sizeof(*arena->occluded));
+    memset(arena->realfacenums, 0, numpoints * sizeof(*arena->realfacenums));
+    memset(arena->occlusion, 0, numpoints * sizeof(*arena->occlusion));
+    
+    surf->points = arena->points;
+    surf->normals = arena->normals;
+    surf->occluded = arena->occluded;
+    surf->realfacenums = arena->realfacenums;
+    surf->occlusion = arena->occlusion;
+}
+
+static void
+LightsurfArena_AllocRayStreams(lightsurf_t *surf)
+{
+    lightsurf_arena_t *arena = LightsurfArena();
+    
+    if (arena->streamcapacity < surf->numpoints) {
+        const int capacity = qmax(surf->numpoints, arena->streamcapacity + arena->streamcapacity / 2);
+        delete arena->occlusion_stream;
+        delete arena->intersection_stream;
+        arena->intersection_stream = MakeIntersectionRayStream(capacity);
+        arena->occlusion_stream = MakeOcclusionRayStream(capacity);
+        arena->streamcapacity = capacity;
+    }
+    
+    surf->intersection_stream = arena->intersection_stream;
+    surf->occlusion_stream = arena->occlusion_stream;
+}
+
+static lightsample_t *
+LightsurfArena_AllocSamples(int numpoints)
+{
+    lightsurf_arena_t *arena = LightsurfArena();
+    
+    if (arena->lightmaps_used == arena->lightmapsamples.size())
+        arena->lightmapsamples.emplace_back();
+    
+    std::vector<lightsample_t> &samples = arena->lightmapsamples[arena->lightmaps_used++];
+    if (samples.size() < static_cast<size_t>(numpoints))
+        samples.resize(numpoints);
+    return samples.data();
+}
+
 /*
  * =================
  * CalcPoints
@@ -704,13 +914,7 @@ CalcPoints(const modelinfo_t *modelinfo, const vec3_t offset, lightsurf_t *surf,
 
     /* Allocate surf->points */
     surf->numpoints = surf->width * surf->height;
-    surf->points = (vec3_t *) calloc(surf->numpoints, sizeof(vec3_t));
-    surf->normals = (vec3_t *) calloc(surf->numpoints, sizeof(vec3_t));
-    surf->occluded = (bool *)calloc(surf->numpoints, sizeof(bool));
-    surf->realfacenums = (int *)calloc(surf->numpoints, sizeof(int));
-    
-    const auto points = GLM_FacePoints(bsp, face);
-    const auto edgeplanes = GLM_MakeInwardFacingEdgePlanes(points);
+    LightsurfArena_AllocPoints(surf);
     
     for (int t = 0; t < surf->height; t++) {
         for (int s = 0; s < surf->width; s++) {
@@ -853,11 +1057,7 @@ Lightsurf_Init(const modelinfo_t *modelinfo, const bsp2_dface_t *face,
     VectorAdd(lightsurf->mins, modelinfo->offset, lightsurf->mins);
     VectorAdd(lightsurf->maxs, modelinfo->offset, lightsurf->maxs);
     
-    /* Allocate occlusion array */
-    lightsurf->occlusion = (float *) calloc(lightsurf->numpoints, sizeof(float));
-    
-    lightsurf->intersection_stream = MakeIntersectionRayStream(lightsurf->numpoints);
-    lightsurf->occlusion_stream = MakeOcclusionRayStream(lightsurf->numpoints);
+    LightsurfArena_AllocRayStreams(lightsurf);
     return true;
 }
 
@@ -865,12 +1065,11 @@ static void
 Lightmap_AllocOrClear(lightmap_t *lightmap, const lightsurf_t *lightsurf)
 {
     if (lightmap->samples == NULL) {
-        /* first use of this lightmap, allocate the storage for it. */
-        lightmap->samples = (lightsample_t *) calloc(lightsurf->numpoints, sizeof(lightsample_t));
-    } else {
-        /* clear only the data that is going to be merged to it. there's no point clearing more */
-        memset(lightmap->samples, 0, sizeof(*lightmap->samples)*lightsurf->numpoints);
+        /* first use of this lightmap, take storage for it from the thread's arena. */
+        lightmap->samples = LightsurfArena_AllocSamples(lightsurf->numpoints);
     }
+    /* clear only the data that is going to be merged to it. there's no point clearing more */
+    memset(lightmap->samples, 0, sizeof(*lightmap->samples)*lightsurf->numpoints);
 }
 
 static const lightmap_t *
@@ -1060,6 +1259,164 @@ GetLightContrib(const globalconfig_t &cfg, const light_t *entity, const vec3_t s
     *dist_out = dist;
 }
 
+/*
+ * ============================================================================
+ * SPECIALIZED SAMPLE LOOPS
+ *
+ * GetLightContrib works out the falloff formula, spotlight cone and angle
+ * handling again for every sample. LightSamples_Entity makes those choices
+ * once per light and runs a loop specialized for them over all the sample
+ * points. The loops avoid data-dependent branches so the compiler can
+ * vectorize them for whatever SSE/AVX level the build targets; otherwise
+ * they run as plain scalar code.
+ * ============================================================================
+ */
+
+enum class falloff_t {
+    LINEAR, LINEAR_FALLOFF, INVERSE, INVERSE2, INVERSE2A, INFINITE
+};
+
+struct lightsampleparams_t {
+    vec_t origin[3];
+    vec_t light;
+    vec_t falloff;      // LINEAR_FALLOFF: distance at which the light reaches 0
+    vec_t attenscale;   // scaledist * atten
+    vec_t anglescale;
+    vec_t spotvec[3];
+    vec_t spotfalloff, spotfalloff2;
+};
+
+// same as GetLightValue
+template <falloff_t F>
+static inline vec_t
+LightSample_Value(const lightsampleparams_t &p, vec_t dist)
+{
+    const vec_t value = p.attenscale * dist;
+    
+    switch (F) {
+    case falloff_t::LINEAR_FALLOFF:
+        return (p.falloff > dist) ? p.light * (1.0f - (dist / p.falloff)) : 0.0f;
+    case falloff_t::INFINITE:
+        return p.light;
+    case falloff_t::INVERSE:
+        return p.light / (value / LF_SCALE);
+    case falloff_t::INVERSE2A: {
+        const vec_t value2a = value + LF_SCALE;
+        return p.light / ((value2a * value2a) / (LF_SCALE * LF_SCALE));
+    }
+    case falloff_t::INVERSE2:
+        return p.light / ((value * value) / (LF_SCALE * LF_SCALE));
+    case falloff_t::LINEAR:
+    default:
+        return (p.light > 0) ? qmax(p.light - value, 0.0f) : qmin(p.light + value, 0.0f);
+    }
+}
+
+// same as GetDir + GetLightValueWithAngle, for every point at once
+template <falloff_t F, bool spotlight, bool absangle>
+static void
+LightSamples_Loop(const lightsampleparams_t &p, int numpoints, const vec3_t *points, const vec3_t *normals,
+                  vec_t *add_out, vec3_t *dir_out, vec_t *dist_out)
+{
+    for (int i = 0; i < numpoints; i++) {
+        vec_t dx = p.origin[0] - points[i][0];
+        vec_t dy = p.origin[1] - points[i][1];
+        vec_t dz = p.origin[2] - points[i][2];
+        const vec_t len = std::sqrt(dx * dx + dy * dy + dz * dz);
+        
+        // catch 0 distance between sample point and light, as GetLightContrib does
+        const bool tooclose = (len < 0.1f);
+        const vec_t invlen = tooclose ? 0.0f : (1.0f / len);
+        dx = tooclose ? 0.0f : dx * invlen;
+        dy = tooclose ? 0.0f : dy * invlen;
+        dz = tooclose ? 1.0f : dz * invlen;
+        const vec_t dist = tooclose ? 0.1f : len;
+        
+        vec_t angle = dx * normals[i][0] + dy * normals[i][1] + dz * normals[i][2];
+        if (absangle) {
+            angle = std::fabs(angle);
+        }
+        const vec_t facing = (angle < 0) ? 0.0f : 1.0f;
+        angle = (1.0f - p.anglescale) + (p.anglescale * angle);
+        
+        vec_t spotscale = 1.0f;
+        if (spotlight) {
+            const vec_t falloff = p.spotvec[0] * dx + p.spotvec[1] * dy + p.spotvec[2] * dz;
+            const vec_t interp = 1.0f - (falloff - p.spotfalloff2) / (p.spotfalloff - p.spotfalloff2);
+            spotscale = (falloff > p.spotfalloff) ? 0.0f : ((falloff > p.spotfalloff2) ? interp : 1.0f);
+        }
+        
+        add_out[i] = LightSample_Value<F>(p, dist) * angle * spotscale * facing;
+        dir_out[i][0] = dx;
+        dir_out[i][1] = dy;
+        dir_out[i][2] = dz;
+        dist_out[i] = dist;
+    }
+}
+
+typedef void (*lightsamplesfunc_t)(const lightsampleparams_t &p, int numpoints, const vec3_t *points, const vec3_t *normals,
+                                   vec_t *add_out, vec3_t *dir_out, vec_t *dist_out);
+
+template <falloff_t F>
+static lightsamplesfunc_t
+LightSamples_Select(bool spotlight, bool absangle)
+{
+    if (spotlight) {
+        return absangle ? LightSamples_Loop<F, true, true> : LightSamples_Loop<F, true, false>;
+    }
+    return absangle ? LightSamples_Loop<F, false, true> : LightSamples_Loop<F, false, false>;
+}
+
+/*
+ * Computes, for each of the points, what GetLightContrib would: the light
+ * value scaled by angle and spotlight cone (add_out), the direction to the
+ * light and the distance. Projected textures are not handled; the caller
+ * multiplies add_out by the light color.
+ */
+void
+LightSamples_Entity(const globalconfig_t &cfg, const light_t *entity, bool twosided,
+                    int numpoints, const vec3_t *points, const vec3_t *normals,
+                    vec_t *add_out, vec3_t *dir_out, vec_t *dist_out)
+{
+    lightsampleparams_t p;
+    VectorCopy(*entity->origin.vec3Value(), p.origin);
+    p.light = entity->light.floatValue();
+    p.falloff = entity->falloff.floatValue();
+    p.attenscale = cfg.scaledist.floatValue() * entity->atten.floatValue();
+    p.anglescale = entity->anglescale.floatValue();
+    VectorCopy(entity->spotvec, p.spotvec);
+    p.spotfalloff = entity->spotfalloff;
+    p.spotfalloff2 = entity->spotfalloff2;
+    
+    const bool spotlight = entity->spotlight;
+    const bool absangle = entity->bleed.boolValue() || twosided;
+    
+    lightsamplesfunc_t func;
+    switch (entity->getFormula()) {
+    case LF_LINEAR:
+        func = (p.falloff > 0.0f) ? LightSamples_Select<falloff_t::LINEAR_FALLOFF>(spotlight, absangle)
+                                  : LightSamples_Select<falloff_t::LINEAR>(spotlight, absangle);
+        break;
+    case LF_INVERSE:
+        func = LightSamples_Select<falloff_t::INVERSE>(spotlight, absangle);
+        break;
+    case LF_INVERSE2:
+        func = LightSamples_Select<falloff_t::INVERSE2>(spotlight, absangle);
+        break;
+    case LF_INVERSE2A:
+        func = LightSamples_Select<falloff_t::INVERSE2A>(spotlight, absangle);
+        break;
+    case LF_INFINITE:
+    case LF_LOCALMIN:
+        func = LightSamples_Select<falloff_t::INFINITE>(spotlight, absangle);
+        break;
+    default:
+        Error("Internal error: unknown light formula");
+    }
+    
+    func(p, numpoints, points, normals, add_out, dir_out, dist_out);
+}
+
 #define SQR(x) ((x)*(x))
 
 // this is the inverse of GetLightValue
@@ -1218,17 +1575,16 @@ Dirt_GetScaleFactor(const globalconfig_t &cfg, vec_t occlusion, const light_t *e
  * ================
  */
 static inline qboolean
-CullLight(const light_t *entity, const lightsurf_t *lightsurf)
+CullLight_Bounds(const globalconfig_t &cfg, const light_t *entity,
+                 const vec3_t mins, const vec3_t maxs, const vec3_t origin, vec_t radius)
 {
-    const globalconfig_t &cfg = *lightsurf->cfg;
-    
-    if (!novisapprox && AABBsDisjoint(entity->mins, entity->maxs, lightsurf->mins, lightsurf->maxs)) {
+    if (!novisapprox && AABBsDisjoint(entity->mins, entity->maxs, mins, maxs)) {
         return true;
     }
     
     vec3_t distvec;
-    VectorSubtract(*entity->origin.vec3Value(), lightsurf->origin, distvec);
-    const float dist = VectorLength(distvec) - lightsurf->radius;
+    VectorSubtract(*entity->origin.vec3Value(), origin, distvec);
+    const float dist = VectorLength(distvec) - radius;
     
     /* light is inside surface bounding sphere => can't cull */
     if (dist < 0) {
@@ -1241,149 +1597,578 @@ CullLight(const light_t *entity, const lightsurf_t *lightsurf)
     return fabs(GetLightValue(cfg, entity, dist)) <= fadegate;
 }
 
-static void Matrix4x4_CM_Transform4(const float *matrix, const float *vector, float *product)
+static inline qboolean
+CullLight(const light_t *entity, const lightsurf_t *lightsurf)
 {
-    product[0] = matrix[0]*vector[0] + matrix[4]*vector[1] + matrix[8]*vector[2] + matrix[12]*vector[3];
-    product[1] = matrix[1]*vector[0] + matrix[5]*vector[1] + matrix[9]*vector[2] + matrix[13]*vector[3];
-    product[2] = matrix[2]*vector[0] + matrix[6]*vector[1] + matrix[10]*vector[2] + matrix[14]*vector[3];
-    product[3] = matrix[3]*vector[0] + matrix[7]*vector[1] + matrix[11]*vector[2] + matrix[15]*vector[3];
+    return CullLight_Bounds(*lightsurf->cfg, entity, lightsurf->mins, lightsurf->maxs,
+                            lightsurf->origin, lightsurf->radius);
 }
-static qboolean Matrix4x4_CM_Project (const vec3_t in, vec3_t out, const float *modelviewproj)
-{
-    qboolean result = true;
 
-    float v[4], tempv[4];
-    tempv[0] = in[0];
-    tempv[1] = in[1];
-    tempv[2] = in[2];
-    tempv[3] = 1;
+/*
+ * ============================================================================
+ * PVS CULLING
+ *
+ * With -pvscull and a vis'd bsp, a light/face pair is rejected before any
+ * rays are pushed if none of the leafs the face (or its sample points) lie
+ * in is in the PVS of the leaf containing the light.  PVS bits are indexed
+ * by cluster for Q2 and by leafnum - 1 for Q1; leafs without a bit (solid,
+ * outside the world) disable culling for whatever touches them.
+ * ============================================================================
+ */
 
-    Matrix4x4_CM_Transform4(modelviewproj, tempv, v);
+struct pvscull_t {
+    int rowbytes = 0;
+    std::vector<int> leafbits;                   /* per leaf, -1 = no PVS bit */
+    std::vector<int> lightrows;                  /* per light, -1 = can't cull */
+    std::vector<std::vector<uint8_t>> rows;      /* decompressed PVS rows */
+    std::vector<int> faceleafs_start;            /* CSR over world faces... */
+    std::vector<int> faceleafs;                  /* ...of PVS bits, from dleaffaces */
+};
 
-    v[0] /= v[3];
-    v[1] /= v[3];
-    if (v[2] < 0)
-        result = false; //too close to the view
-    v[2] /= v[3];
+static pvscull_t pvscull_data;
 
-    out[0] = (1+v[0])/2;
-    out[1] = (1+v[1])/2;
-    out[2] = (1+v[2])/2;
-    if (out[2] > 1)
-        result = false; //beyond far clip plane
-    return result;
-}
-static qboolean LightFace_SampleMipTex(rgba_miptex_t *tex, const float *projectionmatrix, const vec3_t point, float *result) //mxd. miptex_t -> rgba_miptex_t
+/*
+ * Fills in which PVS bit each leaf maps to (-1 for none) and returns the
+ * size of a decompressed PVS row in bytes.
+ */
+static int
+PVS_MakeLeafBits(const mbsp_t *bsp, std::vector<int> *leafbits)
 {
-    //okay, yes, this is weird, yes we're using a vec3_t for a coord...
-    //this is because we're treating it like a cubemap. why? no idea.
-    float weight[4];
-    color_rgba pi[4];
-    color_rgba *data = (color_rgba*)((uint8_t*)tex + tex->offset);
+    leafbits->assign(bsp->numleafs, -1);
+    
+    if (bsp->loadversion->game->id == GAME_QUAKE_II) {
+        int numclusters = 0;
+        for (int i = 0; i < bsp->numleafs; i++) {
+            (*leafbits)[i] = bsp->dleafs[i].cluster;
+            numclusters = qmax(numclusters, bsp->dleafs[i].cluster + 1);
+        }
+        return (numclusters + 7) >> 3;
+    }
+    
+    int visleafs = BSP_GetWorldModel(bsp)->visleafs;
+    if (visleafs <= 0 || visleafs >= bsp->numleafs)
+        visleafs = bsp->numleafs - 1;
+    for (int i = 1; i <= visleafs; i++)
+        (*leafbits)[i] = i - 1;
+    return (visleafs + 7) >> 3;
+}
 
-    vec3_t coord;
-    if (!Matrix4x4_CM_Project(point, coord, projectionmatrix) || coord[0] <= 0 || coord[0] >= 1 || coord[1] <= 0 || coord[1] >= 1) {
-        VectorSet(result, 0, 0, 0);
-        return false; //mxd
+static void
+PVS_LeafsAtPoint_r(const mbsp_t *bsp, const int nodenum, const vec3_t point, std::vector<int> *leafs)
+{
+    if (nodenum < 0) {
+        leafs->push_back(-1 - nodenum);
+        return;
+    }
+    
+    const bsp2_dnode_t *node = BSP_GetNode(bsp, nodenum);
+    const vec_t dist = Plane_Dist(point, BSP_GetPlane(bsp, node->planenum));
+    
+    if (dist > 0.1) {
+        PVS_LeafsAtPoint_r(bsp, node->children[0], point, leafs);
+    } else if (dist < -0.1) {
+        PVS_LeafsAtPoint_r(bsp, node->children[1], point, leafs);
     } else {
-        float sfrac = (coord[0]) * (tex->width - 1); //mxd. We are sampling sbase+1 pixels, so multiplying by tex->width will result in an 1px overdraw, same for tbase
-        const int sbase = sfrac;
-        sfrac -= sbase;
-        float tfrac = (1-coord[1]) * (tex->height - 1);
-        const int tbase = tfrac;
-        tfrac -= tbase;
-
-        pi[0] = data[((sbase+0)%tex->width) + (tex->width*((tbase+0)%tex->height))];     weight[0] = (1-sfrac)*(1-tfrac);
-        pi[1] = data[((sbase+1)%tex->width) + (tex->width*((tbase+0)%tex->height))];     weight[1] = (sfrac)*(1-tfrac);
-        pi[2] = data[((sbase+0)%tex->width) + (tex->width*((tbase+1)%tex->height))];     weight[2] = (1-sfrac)*(tfrac);
-        pi[3] = data[((sbase+1)%tex->width) + (tex->width*((tbase+1)%tex->height))];     weight[3] = (sfrac)*(tfrac);
-        VectorSet(result, 0, 0, 0);
-        result[0]  = weight[0] * pi[0].r;
-        result[1]  = weight[0] * pi[0].g;
-        result[2]  = weight[0] * pi[0].b;
-        result[0] += weight[1] * pi[1].r;
-        result[1] += weight[1] * pi[1].g;
-        result[2] += weight[1] * pi[1].b;
-        result[0] += weight[2] * pi[2].r;
-        result[1] += weight[2] * pi[2].g;
-        result[2] += weight[2] * pi[2].b;
-        result[0] += weight[3] * pi[3].r;
-        result[1] += weight[3] * pi[3].g;
-        result[2] += weight[3] * pi[3].b;
-        VectorScale(result, 2, result);
-
-        return true; //mxd
+        // too close to the plane, take both sides
+        PVS_LeafsAtPoint_r(bsp, node->children[0], point, leafs);
+        PVS_LeafsAtPoint_r(bsp, node->children[1], point, leafs);
     }
 }
 
 /*
- * ================
- * GetDirectLighting
- *
- * Mesaures direct lighting at a point, currently only used for bounce lighting.
- * FIXME: factor out / merge with LightFace
- *
- * This gathers up how much a patch should bounce back into the level,
- * per-lightstyle.
- * ================
+ * Adds the PVS bits of the world leafs touching point to bits.
+ * Returns false if any of them has no bit.
  */
-std::map<int, qvec3f>
-GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t origin, const vec3_t normal)
+static bool
+PVS_BitsAtPoint(const mbsp_t *bsp, const vec3_t point, std::vector<int> *bits)
 {
-    std::map<int, qvec3f> result;
-
-    //mxd. Surface lights...
-    for (const surfacelight_t &vpl : SurfaceLights()) {
-        // Bounce light falloff. Uses light surface center and intensity based on face area
-        vec3_t surfpointToLightDir;
-        const float surfpointToLightDist = qmax(128.0f, GetDir(surfpointToLightDir, vpl.pos, surfpointToLightDir)); // Clamp away hotspots, also avoid division by 0...
-        const float angle = DotProduct(surfpointToLightDir, normal);
-        if (angle <= 0) continue;
-
-        // Exponential falloff
-        const float add = (vpl.totalintensity / SQR(surfpointToLightDist)) * angle;
-        if(add <= 0) continue;
-
-        // Write out the final color
-        vec3_t color;
-        VectorScale(vpl.color, add, color); // color_out is expected to be in [0..255] range, vpl->color is in [0..1] range.
-        VectorScale(color, cfg.surflightbouncescale.floatValue(), color);
+    std::vector<int> leafs;
+    PVS_LeafsAtPoint_r(bsp, BSP_GetWorldModel(bsp)->headnode[0], point, &leafs);
+    
+    for (const int leafnum : leafs) {
+        const int bit = pvscull_data.leafbits.at(leafnum);
+        if (bit == -1)
+            return false;
+        bits->push_back(bit);
+    }
+    return true;
+}
 
-        // NOTE: Skip negative lights, which would make no sense to bounce!
-        if (LightSample_Brightness(color) <= fadegate)
-            continue;
+static std::vector<uint8_t>
+PVS_LightRow(const mbsp_t *bsp, const light_t &light)
+{
+    std::vector<int> leafs;
+    PVS_LeafsAtPoint_r(bsp, BSP_GetWorldModel(bsp)->headnode[0], *light.origin.vec3Value(), &leafs);
+    
+    std::vector<uint8_t> row(pvscull_data.rowbytes, 0);
+    std::vector<uint8_t> leafrow(pvscull_data.rowbytes);
+    
+    for (const int leafnum : leafs) {
+        const mleaf_t *leaf = BSP_GetLeaf(bsp, leafnum);
+        const int bit = pvscull_data.leafbits.at(leafnum);
+        
+        if (bit == -1 || leaf->visofs < 0 || leaf->visofs >= bsp->visdatasize)
+            return {};
+        
+        DecompressRow(&bsp->dvisdata[leaf->visofs], pvscull_data.rowbytes, leafrow.data());
+        for (int i = 0; i < pvscull_data.rowbytes; i++)
+            row[i] |= leafrow[i];
+        row[bit >> 3] |= (1 << (bit & 7));
+    }
+    return row;
+}
 
-        if (!TestLight(vpl.pos, origin, nullptr).blocked)
-            continue;
+static bool
+PVS_LeafIsLiquid(const mbsp_t *bsp, const mleaf_t *leaf)
+{
+    if (bsp->loadversion->game->id == GAME_QUAKE_II)
+        return (leaf->contents & Q2_CONTENTS_LIQUID) != 0;
+    
+    return leaf->contents == CONTENTS_WATER
+        || leaf->contents == CONTENTS_SLIME
+        || leaf->contents == CONTENTS_LAVA;
+}
 
-        result[0] += vec3_t_to_glm(color);
+static int
+PVS_LeafAtPoint(const mbsp_t *bsp, const vec3_t point)
+{
+    int nodenum = BSP_GetWorldModel(bsp)->headnode[0];
+    while (nodenum >= 0) {
+        const bsp2_dnode_t *node = BSP_GetNode(bsp, nodenum);
+        const vec_t dist = Plane_Dist(point, BSP_GetPlane(bsp, node->planenum));
+        nodenum = node->children[dist >= 0 ? 0 : 1];
     }
-    
-    for (const light_t &entity : GetLights()) {
-        vec3_t surfpointToLightDir;
-        float surfpointToLightDist;
-        vec3_t color, normalcontrib;
+    return -1 - nodenum;
+}
 
-        if (entity.nostaticlight.boolValue()) {
-            continue;
-        }
+/*
+ * Returns false if the bsp was vis'd with liquids opaque. Checks the leafs
+ * on either side of the world's liquid surfaces: if liquids are
+ * transparent to vis, the liquid leaf sees the dry one. Also true if the
+ * map has no liquid surfaces with a PVS on both sides.
+ */
+static bool
+PVS_SeesThroughLiquids(const mbsp_t *bsp, const std::vector<int> &leafbits, const int rowbytes)
+{
+    const dmodelh2_t *world = BSP_GetWorldModel(bsp);
+    std::vector<uint8_t> row(rowbytes);
+    bool hasliquids = false;
+    
+    for (int i = world->firstface; i < world->firstface + world->numfaces; i++) {
+        const bsp2_dface_t *face = BSP_GetFace(bsp, i);
+        const plane_t plane = Face_Plane(bsp, face);
+        const qvec3f centroid = Face_Centroid(bsp, face);
         
-        // Skip styled lights if "bouncestyled" setting is off.
-        if (entity.style.intValue() != 0 && !cfg.bouncestyled.boolValue()) {
-            continue;
+        vec3_t front, back;
+        for (int j = 0; j < 3; j++) {
+            front[j] = centroid[j] + plane.normal[j];
+            back[j] = centroid[j] - plane.normal[j];
         }
         
-        GetLightContrib(cfg, &entity, normal, origin, false, color, surfpointToLightDir, normalcontrib, &surfpointToLightDist);
-        
-        VectorScale(color, entity.bouncescale.floatValue(), color);
+        const int frontleaf = PVS_LeafAtPoint(bsp, front);
+        const int backleaf = PVS_LeafAtPoint(bsp, back);
+        if (leafbits[frontleaf] == -1 || leafbits[backleaf] == -1)
+            continue;
         
-        // NOTE: Skip negative lights, which would make no sense to bounce!
-        if (LightSample_Brightness(color) <= fadegate) {
+        const bool frontliquid = PVS_LeafIsLiquid(bsp, BSP_GetLeaf(bsp, frontleaf));
+        if (frontliquid == PVS_LeafIsLiquid(bsp, BSP_GetLeaf(bsp, backleaf)))
             continue;
-        }
         
-        const hitresult_t hit = TestLight(*entity.origin.vec3Value(), origin, NULL);
-        if (!hit.blocked) {
+        const mleaf_t *liquid = BSP_GetLeaf(bsp, frontliquid ? frontleaf : backleaf);
+        const int drybit = leafbits[frontliquid ? backleaf : frontleaf];
+        if (liquid->visofs < 0 || liquid->visofs >= bsp->visdatasize)
+            continue;
+        
+        hasliquids = true;
+        DecompressRow(&bsp->dvisdata[liquid->visofs], rowbytes, row.data());
+        if (row[drybit >> 3] & (1 << (drybit & 7)))
+            return true;
+    }
+    return !hasliquids;
+}
+
+/*
+ * =============
+ * SetupPVSCulling
+ * =============
+ */
+void
+SetupPVSCulling(const mbsp_t *bsp)
+{
+    pvscull_data = pvscull_t {};
+    
+    if (!bsp->visdatasize || !bsp->numleafs) {
+        logprint("PVS culling: no visdata, disabled\n");
+        return;
+    }
+    
+    pvscull_data.rowbytes = PVS_MakeLeafBits(bsp, &pvscull_data.leafbits);
+    
+    /* vis'd with liquids opaque: lights seen through water would be culled */
+    if (!PVS_SeesThroughLiquids(bsp, pvscull_data.leafbits, pvscull_data.rowbytes)) {
+        pvscull_data = pvscull_t {};
+        logprint("PVS culling: liquids block vis, disabled\n");
+        return;
+    }
+    
+    /* decompress one row per light, sharing rows between lights in the same leaf */
+    std::map<std::vector<int>, int> rowforleafs;
+    int culllights = 0;
+    
+    for (const light_t &light : GetLights()) {
+        std::vector<int> leafs;
+        PVS_LeafsAtPoint_r(bsp, BSP_GetWorldModel(bsp)->headnode[0], *light.origin.vec3Value(), &leafs);
+        
+        auto it = rowforleafs.find(leafs);
+        if (it == rowforleafs.end()) {
+            std::vector<uint8_t> row = PVS_LightRow(bsp, light);
+            int rownum = -1;
+            if (!row.empty()) {
+                rownum = static_cast<int>(pvscull_data.rows.size());
+                pvscull_data.rows.push_back(std::move(row));
+            }
+            it = rowforleafs.emplace(leafs, rownum).first;
+        }
+        
+        pvscull_data.lightrows.push_back(it->second);
+        if (it->second != -1)
+            culllights++;
+    }
+    
+    /* invert the leafs' marksurfaces to get the leafs each face is in */
+    std::vector<std::vector<int>> faceleafs(bsp->numfaces);
+    for (int i = 0; i < bsp->numleafs; i++) {
+        const mleaf_t *leaf = &bsp->dleafs[i];
+        for (uint32_t j = 0; j < leaf->nummarksurfaces; j++) {
+            const uint32_t mark = leaf->firstmarksurface + j;
+            if (mark >= static_cast<uint32_t>(bsp->numleaffaces))
+                break;
+            const uint32_t facenum = bsp->dleaffaces[mark];
+            if (facenum < static_cast<uint32_t>(bsp->numfaces))
+                faceleafs[facenum].push_back(pvscull_data.leafbits[i]);
+        }
+    }
+    
+    pvscull_data.faceleafs_start.reserve(bsp->numfaces + 1);
+    for (const auto &bits : faceleafs) {
+        pvscull_data.faceleafs_start.push_back(static_cast<int>(pvscull_data.faceleafs.size()));
+        pvscull_data.faceleafs.insert(pvscull_data.faceleafs.end(), bits.begin(), bits.end());
+    }
+    pvscull_data.faceleafs_start.push_back(static_cast<int>(pvscull_data.faceleafs.size()));
+    
+    logprint("PVS culling: %d of %d lights in %d distinct PVS rows\n",
+             culllights, static_cast<int>(GetLights().size()),
+             static_cast<int>(pvscull_data.rows.size()));
+}
+
+/*
+ * The visible-bounds estimate for lights (EstimateVisibleBoundsAtPoint)
+ * uses the union of the bounds of the leafs in the PVS of the light's leaf
+ * when the bsp is vis'd, instead of firing rays.  Light passes through
+ * liquids, so this is only used if vis did too.
+ */
+struct pvsbounds_t {
+    int rowbytes = 0;
+    std::vector<int> leafbits;
+    std::vector<qvec3f> bitmins, bitmaxs;        /* per PVS bit, the union of its leafs */
+};
+
+static pvsbounds_t pvsbounds_data;
+
+/*
+ * =============
+ * SetupPVSBounds
+ * =============
+ */
+void
+SetupPVSBounds(const mbsp_t *bsp)
+{
+    pvsbounds_data = pvsbounds_t {};
+    
+    if (!bsp->visdatasize || !bsp->numleafs)
+        return;
+    
+    std::vector<int> leafbits;
+    const int rowbytes = PVS_MakeLeafBits(bsp, &leafbits);
+    
+    if (!PVS_SeesThroughLiquids(bsp, leafbits, rowbytes)) {
+        logprint("PVS bounds: liquids block vis, estimating light bounds with rays\n");
+        return;
+    }
+    
+    const int numbits = rowbytes * 8;
+    pvsbounds_data.bitmins.assign(numbits, qvec3f(FLT_MAX));
+    pvsbounds_data.bitmaxs.assign(numbits, qvec3f(-FLT_MAX));
+    
+    for (int i = 0; i < bsp->numleafs; i++) {
+        const int bit = leafbits[i];
+        if (bit == -1)
+            continue;
+        
+        const mleaf_t *leaf = &bsp->dleafs[i];
+        for (int j = 0; j < 3; j++) {
+            pvsbounds_data.bitmins[bit][j] = qmin(pvsbounds_data.bitmins[bit][j], leaf->mins[j]);
+            pvsbounds_data.bitmaxs[bit][j] = qmax(pvsbounds_data.bitmaxs[bit][j], leaf->maxs[j]);
+        }
+    }
+    
+    pvsbounds_data.rowbytes = rowbytes;
+    pvsbounds_data.leafbits = std::move(leafbits);
+}
+
+/*
+ * Sets mins/maxs to the bounds of everything in the PVS of the leafs
+ * touching point.  Returns false if there's no PVS to use there (not
+ * vis'd, or the point is in solid or outside the world).
+ */
+bool
+PVS_VisibleBoundsAtPoint(const mbsp_t *bsp, const vec3_t point, vec3_t mins, vec3_t maxs)
+{
+    if (!pvsbounds_data.rowbytes)
+        return false;
+    
+    std::vector<int> leafs;
+    PVS_LeafsAtPoint_r(bsp, BSP_GetWorldModel(bsp)->headnode[0], point, &leafs);
+    
+    std::vector<uint8_t> row(pvsbounds_data.rowbytes, 0);
+    std::vector<uint8_t> leafrow(pvsbounds_data.rowbytes);
+    
+    for (const int leafnum : leafs) {
+        const mleaf_t *leaf = BSP_GetLeaf(bsp, leafnum);
+        const int bit = pvsbounds_data.leafbits.at(leafnum);
+        
+        if (bit == -1 || leaf->visofs < 0 || leaf->visofs >= bsp->visdatasize)
+            return false;
+        
+        DecompressRow(&bsp->dvisdata[leaf->visofs], pvsbounds_data.rowbytes, leafrow.data());
+        for (int i = 0; i < pvsbounds_data.rowbytes; i++)
+            row[i] |= leafrow[i];
+        row[bit >> 3] |= (1 << (bit & 7));
+    }
+    
+    AABB_Init(mins, maxs, point);
+    for (int i = 0; i < pvsbounds_data.rowbytes; i++) {
+        if (!row[i])
+            continue;
+        for (int j = 0; j < 8; j++) {
+            if (!(row[i] & (1 << j)))
+                continue;
+            const int bit = (i << 3) + j;
+            for (int k = 0; k < 3; k++) {
+                mins[k] = qmin(mins[k], static_cast<vec_t>(pvsbounds_data.bitmins[bit][k]));
+                maxs[k] = qmax(maxs[k], static_cast<vec_t>(pvsbounds_data.bitmaxs[bit][k]));
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Fills in lightsurf->pvsbits with the PVS bits of the face's leafs and of
+ * the leafs containing its sample points. Left empty (no culling) if any
+ * of them has no bit.
+ */
+static void
+Lightsurf_SetupPVS(const mbsp_t *bsp, const bsp2_dface_t *face, lightsurf_t *lightsurf)
+{
+    std::vector<int> &bits = lightsurf->pvsbits;
+    bits.clear();
+    
+    if (!pvscull || pvscull_data.rows.empty())
+        return;
+    
+    const int facenum = Face_GetNum(bsp, face);
+    for (int i = pvscull_data.faceleafs_start[facenum]; i < pvscull_data.faceleafs_start[facenum + 1]; i++) {
+        if (pvscull_data.faceleafs[i] == -1) {
+            bits.clear();
+            return;
+        }
+        bits.push_back(pvscull_data.faceleafs[i]);
+    }
+    
+    for (int i = 0; i < lightsurf->numpoints; i++) {
+        if (lightsurf->occluded[i])
+            continue;
+        if (!PVS_BitsAtPoint(bsp, lightsurf->points[i], &bits)) {
+            bits.clear();
+            return;
+        }
+    }
+    
+    std::sort(bits.begin(), bits.end());
+    bits.erase(std::unique(bits.begin(), bits.end()), bits.end());
+}
+
+/*
+ * Returns true if no leaf of lightsurf is in the PVS of the light's leaf.
+ */
+static bool
+CullLight_PVS(const light_t *entity, const lightsurf_t *lightsurf)
+{
+    if (lightsurf->pvsbits.empty())
+        return false;
+    
+    const size_t lightnum = entity - GetLights().data();
+    if (lightnum >= pvscull_data.lightrows.size())
+        return false;
+    
+    const int rownum = pvscull_data.lightrows[lightnum];
+    if (rownum == -1)
+        return false;
+    
+    const std::vector<uint8_t> &row = pvscull_data.rows[rownum];
+    for (const int bit : lightsurf->pvsbits) {
+        if (row[bit >> 3] & (1 << (bit & 7)))
+            return false;
+    }
+    
+    total_pvs_culled_pairs++;
+    return true;
+}
+
+static void Matrix4x4_CM_Transform4(const float *matrix, const float *vector, float *product)
+{
+    product[0] = matrix[0]*vector[0] + matrix[4]*vector[1] + matrix[8]*vector[2] + matrix[12]*vector[3];
+    product[1] = matrix[1]*vector[0] + matrix[5]*vector[1] + matrix[9]*vector[2] + matrix[13]*vector[3];
+    product[2] = matrix[2]*vector[0] + matrix[6]*vector[1] + matrix[10]*vector[2] + matrix[14]*vector[3];
+    product[3] = matrix[3]*vector[0] + matrix[7]*vector[1] + matrix[11]*vector[2] + matrix[15]*vector[3];
+}
+static qboolean Matrix4x4_CM_Project (const vec3_t in, vec3_t out, const float *modelviewproj)
+{
+    qboolean result = true;
+
+    float v[4], tempv[4];
+    tempv[0] = in[0];
+    tempv[1] = in[1];
+    tempv[2] = in[2];
+    tempv[3] = 1;
+
+    Matrix4x4_CM_Transform4(modelviewproj, tempv, v);
+
+    v[0] /= v[3];
+    v[1] /= v[3];
+    if (v[2] < 0)
+        result = false; //too close to the view
+    v[2] /= v[3];
+
+    out[0] = (1+v[0])/2;
+    out[1] = (1+v[1])/2;
+    out[2] = (1+v[2])/2;
+    if (out[2] > 1)
+        result = false; //beyond far clip plane
+    return result;
+}
+static qboolean LightFace_SampleMipTex(rgba_miptex_t *tex, const float *projectionmatrix, const vec3_t point, float *result) //mxd. miptex_t -> rgba_miptex_t
+{
+    //okay, yes, this is weird, yes we're using a vec3_t for a coord...
+    //this is because we're treating it like a cubemap. why? no idea.
+    float weight[4];
+    color_rgba pi[4];
+    color_rgba *data = (color_rgba*)((uint8_t*)tex + tex->offset);
+
+    vec3_t coord;
+    if (!Matrix4x4_CM_Project(point, coord, projectionmatrix) || coord[0] <= 0 || coord[0] >= 1 || coord[1] <= 0 || coord[1] >= 1) {
+        VectorSet(result, 0, 0, 0);
+        return false; //mxd
+    } else {
+        float sfrac = (coord[0]) * (tex->width - 1); //mxd. We are sampling sbase+1 pixels, so multiplying by tex->width will result in an 1px overdraw, same for tbase
+        const int sbase = sfrac;
+        sfrac -= sbase;
+        float tfrac = (1-coord[1]) * (tex->height - 1);
+        const int tbase = tfrac;
+        tfrac -= tbase;
+
+        pi[0] = data[((sbase+0)%tex->width) + (tex->width*((tbase+0)%tex->height))];     weight[0] = (1-sfrac)*(1-tfrac);
+        pi[1] = data[((sbase+1)%tex->width) + (tex->width*((tbase+0)%tex->height))];     weight[1] = (sfrac)*(1-tfrac);
+        pi[2] = data[((sbase+0)%tex->width) + (tex->width*((tbase+1)%tex->height))];     weight[2] = (1-sfrac)*(tfrac);
+        pi[3] = data[((sbase+1)%tex->width) + (tex->width*((tbase+1)%tex->height))];     weight[3] = (sfrac)*(tfrac);
+        VectorSet(result, 0, 0, 0);
+        result[0]  = weight[0] * pi[0].r;
+        result[1]  = weight[0] * pi[0].g;
+        result[2]  = weight[0] * pi[0].b;
+        result[0] += weight[1] * pi[1].r;
+        result[1] += weight[1] * pi[1].g;
+        result[2] += weight[1] * pi[1].b;
+        result[0] += weight[2] * pi[2].r;
+        result[1] += weight[2] * pi[2].g;
+        result[2] += weight[2] * pi[2].b;
+        result[0] += weight[3] * pi[3].r;
+        result[1] += weight[3] * pi[3].g;
+        result[2] += weight[3] * pi[3].b;
+        VectorScale(result, 2, result);
+
+        return true; //mxd
+    }
+}
+
+/*
+ * ================
+ * GetDirectLighting
+ *
+ * Mesaures direct lighting at a point, currently only used for bounce lighting.
+ * FIXME: factor out / merge with LightFace
+ *
+ * This gathers up how much a patch should bounce back into the level,
+ * per-lightstyle.
+ * ================
+ */
+stylecolors_t
+GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t origin, const vec3_t normal)
+{
+    stylecolors_t result;
+
+    //mxd. Surface lights...
+    for (const surfacelight_t &vpl : SurfaceLights()) {
+        // Bounce light falloff. Uses light surface center and intensity based on face area
+        vec3_t surfpointToLightDir;
+        const float surfpointToLightDist = qmax(128.0f, GetDir(surfpointToLightDir, vpl.pos, surfpointToLightDir)); // Clamp away hotspots, also avoid division by 0...
+        const float angle = DotProduct(surfpointToLightDir, normal);
+        if (angle <= 0) continue;
+
+        // Exponential falloff
+        const float add = (vpl.totalintensity / SQR(surfpointToLightDist)) * angle;
+        if(add <= 0) continue;
+
+        // Write out the final color
+        vec3_t color;
+        VectorScale(vpl.color, add, color); // color_out is expected to be in [0..255] range, vpl->color is in [0..1] range.
+        VectorScale(color, cfg.surflightbouncescale.floatValue(), color);
+
+        // NOTE: Skip negative lights, which would make no sense to bounce!
+        if (LightSample_Brightness(color) <= fadegate)
+            continue;
+
+        if (!TestLight(vpl.pos, origin, nullptr).blocked)
+            continue;
+
+        result.add(0, vec3_t_to_glm(color));
+    }
+    
+    for (const light_t &entity : GetLights()) {
+        vec3_t surfpointToLightDir;
+        float surfpointToLightDist;
+        vec3_t color, normalcontrib;
+
+        if (entity.nostaticlight.boolValue()) {
+            continue;
+        }
+        
+        // Skip styled lights if "bouncestyled" setting is off.
+        if (entity.style.intValue() != 0 && !cfg.bouncestyled.boolValue()) {
+            continue;
+        }
+        
+        GetLightContrib(cfg, &entity, normal, origin, false, color, surfpointToLightDir, normalcontrib, &surfpointToLightDist);
+        
+        VectorScale(color, entity.bouncescale.floatValue(), color);
+        
+        // NOTE: Skip negative lights, which would make no sense to bounce!
+        if (LightSample_Brightness(color) <= fadegate) {
+            continue;
+        }
+        
+        const hitresult_t hit = TestLight(*entity.origin.vec3Value(), origin, NULL);
+        if (!hit.blocked) {
             continue;
         }
         
@@ -1393,7 +2178,7 @@ GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t ori
             lightstyle = hit.passedSwitchableShadowStyle;
         }
 
-        result[lightstyle] += vec3_t_to_glm(color);
+        result.add(lightstyle, vec3_t_to_glm(color));
     }
     
     for (const sun_t &sun : GetSuns()) {
@@ -1440,13 +2225,108 @@ GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t ori
         }
 
         const qvec3f sunContrib = vec3_t_to_glm(sun.sunlight_color) * (cosangle * sun.sunlight / 255.0f);
-        result[lightstyle] += sunContrib;
+        result.add(lightstyle, sunContrib);
     }
     
     return result;
 }
 
 
+/*
+ * ============================================================================
+ * LIGHT CACHE
+ * ============================================================================
+ */
+
+/* -lightcache state for the lightsurf being lit */
+typedef struct {
+    lightcache_face_t *previous;    // previous run's entry for this face, or nullptr
+    std::vector<bool> used;         // previous->sources that were already replayed
+    size_t next;                    // where to start looking for the next source
+    lightcache_face_t *record;      // this run's entry
+} lightcache_state_t;
+
+static void
+LightCache_RecordSample(lightcache_source_t *record, int style, int point, const vec3_t color, const vec3_t direction)
+{
+    lightcache_sample_t sample;
+    sample.style = style;
+    sample.point = point;
+    VectorCopy(color, sample.color);
+    VectorCopy(direction, sample.direction);
+    record->samples.push_back(sample);
+}
+
+/*
+ * Repeats the lightmap additions of a cached source with the same
+ * Lightmap_ForStyle / Lightmap_Save calls LightFace_Entity and
+ * LightFace_Sky made, so the lightmaps end up bit-identical.
+ */
+static void
+LightCache_Replay(const lightcache_source_t &source, const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    if (!source.traced)
+        return;
+    
+    int cached_style = source.style;
+    lightmap_t *cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+    
+    for (const lightcache_sample_t &cached : source.samples) {
+        if (cached.style != cached_style) {
+            cached_style = cached.style;
+            cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+        }
+        
+        lightsample_t *sample = &cached_lightmap->samples[cached.point];
+        
+        VectorAdd(sample->color, cached.color, sample->color);
+        VectorAdd(sample->direction, cached.direction, sample->direction);
+        
+        Lightmap_Save(lightmaps, lightsurf, cached_lightmap, cached_style);
+    }
+}
+
+/*
+ * If the previous run recorded a source with this key for the face, replays
+ * it, carries it over to this run's entry and returns true. Lights usually
+ * come in the same order as last time, so the search starts after the last
+ * match.
+ */
+static bool
+LightCache_TryReplay(lightcache_state_t *cache, uint64_t key, const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    if (cache->previous == nullptr)
+        return false;
+    
+    const size_t n = cache->previous->sources.size();
+    for (size_t k = 0; k < n; k++) {
+        const size_t index = (cache->next + k) % n;
+        lightcache_source_t &source = cache->previous->sources[index];
+        if (cache->used[index] || source.key != key)
+            continue;
+        
+        LightCache_Replay(source, lightsurf, lightmaps);
+        cache->used[index] = true;
+        cache->next = index + 1;
+        cache->record->sources.push_back(std::move(source));
+        total_lightcache_reused++;
+        return true;
+    }
+    return false;
+}
+
+static lightcache_source_t *
+LightCache_NewSource(lightcache_state_t *cache, uint64_t key)
+{
+    lightcache_source_t source {};
+    source.key = key;
+    source.traced = false;
+    source.style = 0;
+    cache->record->sources.push_back(std::move(source));
+    total_lightcache_missed++;
+    return &cache->record->sources.back();
+}
+
 /*
  * ================
  * LightFace_Entity
@@ -1455,7 +2335,8 @@ GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t ori
 static void
 LightFace_Entity(const mbsp_t *bsp,
                  const light_t *entity,
-                lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+                lightsurf_t *lightsurf, lightmapdict_t *lightmaps,
+                 lightcache_source_t *record)
 {
     const globalconfig_t &cfg = *lightsurf->cfg;
     const modelinfo_t *modelinfo = lightsurf->modelinfo;
@@ -1479,12 +2360,25 @@ LightFace_Entity(const mbsp_t *bsp,
         return;
     }
 
+    /* skip lights the surface can't see according to the PVS */
+    if (CullLight_PVS(entity, lightsurf)) {
+        return;
+    }
+
     /*
      * Check it for real
      */
     raystream_occlusion_t *rs = lightsurf->occlusion_stream;
     rs->clearPushedRays();
     
+    /* all of the points in one pass, except for projected textures */
+    const lightsurf_arena_t *arena = LightsurfArena();
+    const bool batched = (entity->projectedmip == nullptr);
+    if (batched) {
+        LightSamples_Entity(cfg, entity, lightsurf->twosided, lightsurf->numpoints, lightsurf->points, lightsurf->normals,
+                            arena->sample_add, arena->sample_dirs, arena->sample_dists);
+    }
+    
     for (int i = 0; i < lightsurf->numpoints; i++) {
         const vec_t *surfpoint = lightsurf->points[i];
         const vec_t *surfnorm = lightsurf->normals[i];
@@ -1496,7 +2390,15 @@ LightFace_Entity(const mbsp_t *bsp,
         float surfpointToLightDist;
         vec3_t color, normalcontrib;
         
-        GetLightContrib(cfg, entity, surfnorm, surfpoint, lightsurf->twosided, color, surfpointToLightDir, normalcontrib, &surfpointToLightDist);
+        if (batched) {
+            const vec_t add = arena->sample_add[i];
+            VectorCopy(arena->sample_dirs[i], surfpointToLightDir);
+            surfpointToLightDist = arena->sample_dists[i];
+            VectorScale(*entity->color.vec3Value(), add * (1.0f / 255.0f), color);
+            VectorScale(surfpointToLightDir, add, normalcontrib);
+        } else {
+            GetLightContrib(cfg, entity, surfnorm, surfpoint, lightsurf->twosided, color, surfpointToLightDir, normalcontrib, &surfpointToLightDist);
+        }
  
         const float occlusion = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], entity, surfpointToLightDist, lightsurf);
         VectorScale(color, occlusion, color);
@@ -1515,16 +2417,26 @@ LightFace_Entity(const mbsp_t *bsp,
     
     int cached_style = entity->style.intValue();
     lightmap_t *cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+    if (record) {
+        record->traced = true;
+        record->style = cached_style;
+    }
     
     const int N = rs->numPushedRays();
+    const bool *occluded = rs->getPushedRaysOccluded();
+    const int *pointindices = rs->getPushedRayPointIndices();
+    const int *dynamicstyles = rs->getPushedRayDynamicStyles();
+    const vec3_t *colors = rs->getPushedRayColors();
+    const vec3_t *normalcontribs = rs->getPushedRayNormalContribs();
+    
     for (int j = 0; j < N; j++) {
-        if (rs->getPushedRayOccluded(j)) {
+        if (occluded[j]) {
             continue;
         }
 
         total_light_ray_hits++;
         
-        int i = rs->getPushedRayPointIndex(j);
+        int i = pointindices[j];
         
         // check if we hit a dynamic shadow caster (only applies to style 0 lights)
         //
@@ -1539,7 +2451,7 @@ LightFace_Entity(const mbsp_t *bsp,
         // (if any), and handle it here.
         int desired_style = entity->style.intValue();
         if (desired_style == 0) {
-            desired_style = rs->getPushedRayDynamicStyle(j);
+            desired_style = dynamicstyles[j];
         }
         
         // if necessary, switch which lightmap we are writing to.
@@ -1550,14 +2462,14 @@ LightFace_Entity(const mbsp_t *bsp,
         
         lightsample_t *sample = &cached_lightmap->samples[i];
         
-        vec3_t color, normalcontrib;
-        rs->getPushedRayColor(j, color);
-        rs->getPushedRayNormalContrib(j, normalcontrib);
-
-        VectorAdd(sample->color, color, sample->color);
-        VectorAdd(sample->direction, normalcontrib, sample->direction);
+        VectorAdd(sample->color, colors[j], sample->color);
+        VectorAdd(sample->direction, normalcontribs[j], sample->direction);
         
         Lightmap_Save(lightmaps, lightsurf, cached_lightmap, cached_style);
+        
+        if (record) {
+            LightCache_RecordSample(record, cached_style, i, colors[j], normalcontribs[j]);
+        }
     }
 }
 
@@ -1567,7 +2479,8 @@ LightFace_Entity(const mbsp_t *bsp,
  * =============
  */
 static void
-LightFace_Sky(const sun_t *sun, const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+LightFace_Sky(const sun_t *sun, const lightsurf_t *lightsurf, lightmapdict_t *lightmaps,
+              lightcache_source_t *record)
 {
     const globalconfig_t &cfg = *lightsurf->cfg;
     const modelinfo_t *modelinfo = lightsurf->modelinfo;
@@ -1630,10 +2543,20 @@ LightFace_Sky(const sun_t *sun, const lightsurf_t *lightsurf, lightmapdict_t *li
     /* if sunlight is set, use a style 0 light map */
     int cached_style = sun->style;
     lightmap_t *cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+    if (record) {
+        record->traced = true;
+        record->style = cached_style;
+    }
     
     const int N = rs->numPushedRays();
+    const hittype_t *hittypes = rs->getPushedRayHitTypes();
+    const int *pointindices = rs->getPushedRayPointIndices();
+    const int *dynamicstyles = rs->getPushedRayDynamicStyles();
+    const vec3_t *colors = rs->getPushedRayColors();
+    const vec3_t *normalcontribs = rs->getPushedRayNormalContribs();
+    
     for (int j = 0; j < N; j++) {
-        if (rs->getPushedRayHitType(j) != hittype_t::SKY) {
+        if (hittypes[j] != hittype_t::SKY) {
             continue;
         }
 
@@ -1647,12 +2570,12 @@ LightFace_Sky(const sun_t *sun, const lightsurf_t *lightsurf, lightmapdict_t *li
             }
         }
 
-        const int i = rs->getPushedRayPointIndex(j);
+        const int i = pointindices[j];
         
         // check if we hit a dynamic shadow caster
         int desired_style = sun->style;
         if (desired_style == 0) {
-            desired_style = rs->getPushedRayDynamicStyle(j);
+            desired_style = dynamicstyles[j];
         }
         
         // if necessary, switch which lightmap we are writing to.
@@ -1663,14 +2586,201 @@ LightFace_Sky(const sun_t *sun, const lightsurf_t *lightsurf, lightmapdict_t *li
 
         lightsample_t *sample = &cached_lightmap->samples[i];
         
-        vec3_t color, normalcontrib;
-        rs->getPushedRayColor(j, color);
-        rs->getPushedRayNormalContrib(j, normalcontrib);
-        
-        VectorAdd(sample->color, color, sample->color);
-        VectorAdd(sample->direction, normalcontrib, sample->direction);
+        VectorAdd(sample->color, colors[j], sample->color);
+        VectorAdd(sample->direction, normalcontribs[j], sample->direction);
         
         Lightmap_Save(lightmaps, lightsurf, cached_lightmap, cached_style);
+        
+        if (record) {
+            LightCache_RecordSample(record, cached_style, i, colors[j], normalcontribs[j]);
+        }
+    }
+}
+
+static void
+LightFace_EntityCached(const mbsp_t *bsp, const light_t *entity, lightsurf_t *lightsurf,
+                       lightmapdict_t *lightmaps, lightcache_state_t *cache)
+{
+    if (cache == nullptr) {
+        LightFace_Entity(bsp, entity, lightsurf, lightmaps, nullptr);
+        return;
+    }
+    
+    const uint64_t key = LightCache_LightKey(entity - GetLights().data());
+    if (!LightCache_TryReplay(cache, key, lightsurf, lightmaps))
+        LightFace_Entity(bsp, entity, lightsurf, lightmaps, LightCache_NewSource(cache, key));
+}
+
+static void
+LightFace_SkyCached(const sun_t *sun, const lightsurf_t *lightsurf,
+                    lightmapdict_t *lightmaps, lightcache_state_t *cache)
+{
+    if (cache == nullptr) {
+        LightFace_Sky(sun, lightsurf, lightmaps, nullptr);
+        return;
+    }
+    
+    const uint64_t key = LightCache_SunKey(sun - GetSuns().data());
+    if (!LightCache_TryReplay(cache, key, lightsurf, lightmaps))
+        LightFace_Sky(sun, lightsurf, lightmaps, LightCache_NewSource(cache, key));
+}
+
+/*
+ * =============
+ * SkyDome_Value
+ *
+ * Light one -skydome ray in direction dir adds to sample point i from the
+ * given dome, the per-ray equivalent of LightFace_Sky's value.
+ * =============
+ */
+static inline float
+SkyDome_Value(const globalconfig_t &cfg, const skydome_t &dome, const lightsurf_t *lightsurf,
+              int i, const vec3_t dir, float raylight)
+{
+    float angle = DotProduct(dir, lightsurf->normals[i]);
+    if (lightsurf->twosided && angle < 0)
+        angle = -angle;
+    angle = qmax(0.0f, angle);
+
+    angle = (1.0 - dome.anglescale) + dome.anglescale * angle;
+    float value = angle * dome.light * raylight;
+    if (dome.dirt) {
+        value *= Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], NULL, 0.0, lightsurf);
+    }
+    return value;
+}
+
+/*
+ * =============
+ * LightFace_SkyDomes
+ *
+ * Lights the face from every -skydome dome in one pass. Each sample point
+ * traces the rays of GetSkyDomeDirs() once per hemisphere, rotated about the
+ * vertical by a per-point fraction of a grid cell, and a ray that reaches the
+ * sky adds its share of every dome in that hemisphere whose _suntexture
+ * matches the sky face that was hit.
+ * =============
+ */
+static void
+LightFace_SkyDomes(const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    const std::vector<skydome_t> &domes = GetSkyDomes();
+    if (domes.empty())
+        return;
+
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    const modelinfo_t *modelinfo = lightsurf->modelinfo;
+    const plane_t *plane = &lightsurf->plane;
+    const std::vector<qvec3f> &dirs = GetSkyDomeDirs();
+    const float raylight = 1.0f / dirs.size();
+    const float anglestep = SkyDome_AngleStep();
+
+    raystream_intersection_t *rs = lightsurf->intersection_stream;
+    int cached_style = -1;
+    lightmap_t *cached_lightmap = nullptr;
+
+    for (int lower = 0; lower < 2; lower++) {
+        bool inuse = false;
+        for (const skydome_t &dome : domes)
+            inuse |= (dome.lower == static_cast<bool>(lower));
+        if (!inuse)
+            continue;
+
+        for (const qvec3f &basedir : dirs) {
+            rs->clearPushedRays();
+
+            for (int i = 0; i < lightsurf->numpoints; i++) {
+                if (lightsurf->occluded[i])
+                    continue;
+
+                /* golden ratio sequence, so neighbouring points get well spread rotations */
+                const float rotation = fmod(i * 0.618034f, 1.0f) * anglestep;
+                const float c = cos(rotation);
+                const float s = sin(rotation);
+                vec3_t dir;
+                dir[0] = c * basedir[0] - s * basedir[1];
+                dir[1] = s * basedir[0] + c * basedir[1];
+                dir[2] = lower ? -basedir[2] : basedir[2];
+
+                /* same test as LightFace_Sky's "surface facing away from sun" */
+                if (DotProduct(dir, plane->normal) < -ANGLE_EPSILON && !lightsurf->curved && !lightsurf->twosided)
+                    continue;
+
+                bool visible = false;
+                for (const skydome_t &dome : domes) {
+                    if (dome.lower != static_cast<bool>(lower))
+                        continue;
+                    const float value = SkyDome_Value(cfg, dome, lightsurf, i, dir, raylight);
+                    if (fabs(value * LightSample_Brightness(vec3_t_to_glm(dome.color)) / 255.0f) > fadegate) {
+                        visible = true;
+                        break;
+                    }
+                }
+                if (!visible)
+                    continue;
+
+                rs->pushRay(i, lightsurf->points[i], dir, MAX_SKY_DIST);
+            }
+
+            const int N = rs->numPushedRays();
+            if (N == 0)
+                continue;
+
+            // we need to know which sky face was hit, so test intersection (not occlusion)
+            rs->tracePushedRaysIntersection(modelinfo);
+            total_skydome_rays += N;
+
+            const hittype_t *hittypes = rs->getPushedRayHitTypes();
+            const int *pointindices = rs->getPushedRayPointIndices();
+            const int *dynamicstyles = rs->getPushedRayDynamicStyles();
+
+            for (int j = 0; j < N; j++) {
+                if (hittypes[j] != hittype_t::SKY)
+                    continue;
+
+                const int i = pointindices[j];
+                vec3_t dir;
+                rs->getPushedRayDir(j, dir);
+                int suntexture = -2; // not looked up yet
+
+                for (const skydome_t &dome : domes) {
+                    if (dome.lower != static_cast<bool>(lower))
+                        continue;
+
+                    // check if we hit the wrong texture
+                    if (dome.suntexture != -1) {
+                        if (suntexture == -2)
+                            suntexture = SkyDome_TextureForFace(Face_GetNum(lightsurf->bsp, rs->getPushedRayHitFace(j)));
+                        if (suntexture != dome.suntexture)
+                            continue;
+                    }
+
+                    const float value = SkyDome_Value(cfg, dome, lightsurf, i, dir, raylight);
+                    vec3_t color, normalcontrib;
+                    VectorScale(dome.color, value / 255.0, color);
+                    VectorScale(dir, 16384 * value, normalcontrib);
+                    if (fabs(LightSample_Brightness(color)) <= fadegate)
+                        continue;
+
+                    // check if we hit a dynamic shadow caster
+                    int desired_style = dome.style;
+                    if (desired_style == 0)
+                        desired_style = dynamicstyles[j];
+
+                    // if necessary, switch which lightmap we are writing to.
+                    if (desired_style != cached_style) {
+                        cached_style = desired_style;
+                        cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+                    }
+
+                    lightsample_t *sample = &cached_lightmap->samples[i];
+                    VectorAdd(sample->color, color, sample->color);
+                    VectorAdd(sample->direction, normalcontrib, sample->direction);
+
+                    Lightmap_Save(lightmaps, lightsurf, cached_lightmap, cached_style);
+                }
+            }
+        }
     }
 }
 
@@ -1730,7 +2840,7 @@ LightFace_Min(const mbsp_t *bsp, const bsp2_dface_t *face,
             continue;
         }
 
-        if (CullLight(&entity, lightsurf)) {
+        if (CullLight(&entity, lightsurf) || CullLight_PVS(&entity, lightsurf)) {
             continue;
         }
         
@@ -1843,7 +2953,7 @@ LightFace_BounceLightsDebug(const lightsurf_t *lightsurf, lightmapdict_t *lightm
     // reset all lightmaps to black (lazily)
     Lightmap_ClearAll(lightmaps);
     
-    const std::vector<int> &vpls = BounceLightsForFaceNum(Face_GetNum(lightsurf->bsp, lightsurf->face));
+    const bouncelightnums_t vpls = BounceLightsForFaceNum(Face_GetNum(lightsurf->bsp, lightsurf->face));
     const std::vector<bouncelight_t> &all_vpls = BounceLights();
     
     /* Overwrite each point with the emitted color... */
@@ -1957,44 +3067,238 @@ GetSurfaceLighting(const globalconfig_t &cfg, const surfacelight_t *vpl, const q
     // Get light contribution
     result = SurfaceLight_ColorAtDist(cfg, vpl->intensity, vec3_t_to_glm(vpl->color), dist);
 
-    // Apply angle scale
-    const qvec3f resultscaled = result * dotProductFactor;
+    // Apply angle scale
+    const qvec3f resultscaled = result * dotProductFactor;
+
+    Q_assert(!std::isnan(resultscaled[0]) && !std::isnan(resultscaled[1]) && !std::isnan(resultscaled[2]));
+    return resultscaled;
+}
+
+static inline bool
+BounceLight_SphereCull(const mbsp_t *bsp, const bouncelight_t *vpl, const lightsurf_t *lightsurf)
+{
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    
+    if (!novisapprox && AABBsDisjoint(vpl->mins, vpl->maxs, lightsurf->mins, lightsurf->maxs))
+        return true;
+    
+    const qvec3f dir = vec3_t_to_glm(lightsurf->origin) - vpl->pos; // vpl -> sample point
+    const float dist = qv::length(dir) + lightsurf->radius;
+    
+    // get light contribution
+    const qvec3f color = BounceLight_ColorAtDist(cfg, vpl->area, vpl->componentwiseMaxColor, dist);
+    
+    return LightSample_Brightness(color) < 0.25f;
+}
+
+static bool //mxd
+SurfaceLight_SphereCull(const surfacelight_t *vpl, const lightsurf_t *lightsurf)
+{
+    if (!novisapprox && AABBsDisjoint(vpl->mins, vpl->maxs, lightsurf->mins, lightsurf->maxs))
+        return true;
+
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    const qvec3f dir = vec3_t_to_glm(lightsurf->origin) - vec3_t_to_glm(vpl->pos); // vpl -> sample point
+    const float dist = qv::length(dir) + lightsurf->radius;
+
+    // Get light contribution
+    const qvec3f color = SurfaceLight_ColorAtDist(cfg, vpl->totalintensity, vec3_t_to_glm(vpl->color), dist);
+
+    return LightSample_Brightness(color) < 0.25f;
+}
+
+/*
+ * Traces one bounce light (or an aggregate standing in for a group of them)
+ * against the sample points of lightsurf.
+ *
+ * The falloff and angle terms don't depend on the style, so each ray is
+ * traced once carrying the colorless contribution, and the result is
+ * scattered into every style's lightmap scaled by that style's color.
+ */
+static void
+LightFace_BounceLight(const bouncelight_t &vpl, const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    
+    raystream_occlusion_t *rs = lightsurf->occlusion_stream;
+    rs->clearPushedRays();
+    
+    /* the ray colors come back tinted by glass; the cutoff below uses these */
+    std::vector<float> &untinted = LightsurfArena()->bounce_scales;
+    untinted.clear();
+    
+    for (int i = 0; i < lightsurf->numpoints; i++) {
+        if (lightsurf->occluded[i])
+            continue;
+        
+        qvec3f dir = vec3_t_to_glm(lightsurf->points[i]) - vpl.pos; // vpl -> sample point
+        const float dist = qv::length(dir);
+        if (dist == 0.0f)
+            continue; // FIXME: nudge or something
+        dir /= dist;
+        
+        const qvec3f scale = GetIndirectLighting(cfg, &vpl, qvec3f(1.0f), dir, dist, vec3_t_to_glm(lightsurf->points[i]), vec3_t_to_glm(lightsurf->normals[i]));
+        
+        bool bright = false;
+        for (const auto &styleColor : vpl.colorByStyle) {
+            if (LightSample_Brightness(styleColor.second * scale[0]) >= 0.25) {
+                bright = true;
+                break;
+            }
+        }
+        if (!bright)
+            continue;
+        
+        vec3_t vplPos, vplDir, vplScale;
+        glm_to_vec3_t(vpl.pos, vplPos);
+        glm_to_vec3_t(dir, vplDir);
+        glm_to_vec3_t(scale, vplScale);
+        
+        rs->pushRay(i, vplPos, vplDir, dist, vplScale);
+        untinted.push_back(scale[0]);
+    }
+    
+    if (!rs->numPushedRays())
+        return;
+    
+    total_bounce_rays += rs->numPushedRays();
+    rs->tracePushedRaysOcclusion(lightsurf->modelinfo);
+    
+    const int N = rs->numPushedRays();
+    const bool *occluded = rs->getPushedRaysOccluded();
+    const int *pointindices = rs->getPushedRayPointIndices();
+    const vec3_t *scales = rs->getPushedRayColors();
+    
+    for (const auto &styleColor : vpl.colorByStyle) {
+        bool hit = false;
+        const int style = styleColor.first;
+        const qvec3f &color = styleColor.second;
+        
+        lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, style, lightsurf);
+        
+        for (int j = 0; j < N; j++) {
+            if (occluded[j])
+                continue;
+            
+            // cut off dim contributions before the glass tint, like the per-style tracing did
+            if (LightSample_Brightness(color * untinted[j]) < 0.25)
+                continue;
+            
+            // per component: glass may have tinted the ray
+            const vec_t *scale = scales[j];
+            const qvec3f indirectv(color[0] * scale[0], color[1] * scale[1], color[2] * scale[2]);
+            
+            const int i = pointindices[j];
+            vec3_t indirect;
+            glm_to_vec3_t(indirectv, indirect);
+            
+            Q_assert(!std::isnan(indirect[0]));
+            
+            /* Use dirt scaling on the indirect lighting.
+             * Except, not in bouncedebug mode.
+             */
+            if (debugmode != debugmode_bounce) {
+                const vec_t dirtscale = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], NULL, 0.0, lightsurf);
+                VectorScale(indirect, dirtscale, indirect);
+            }
+            
+            lightsample_t *sample = &lightmap->samples[i];
+            VectorAdd(sample->color, indirect, sample->color);
+            
+            hit = true;
+            ++total_bounce_ray_hits;
+        }
+        
+        // If this style of this bounce light contributed anything, save.
+        if (hit)
+            Lightmap_Save(lightmaps, lightsurf, lightmap, style);
+    }
+}
+
+/*
+ * Brightness of a light tree node at the point of lightsurf's bounds closest
+ * to the node's bounds; an upper bound on what any of its bounce lights can
+ * contribute (ignoring the angle terms, which are <= 1).
+ */
+static float
+BounceLightNode_Bound(const globalconfig_t &cfg, const bouncelightnode_t &node, const lightsurf_t *lightsurf)
+{
+    vec3_t gap;
+    for (int i = 0; i < 3; i++) {
+        gap[i] = qmax(0.0, qmax(node.mins[i] - lightsurf->maxs[i], lightsurf->mins[i] - node.maxs[i]));
+    }
+    
+    const qvec3f color = BounceLight_ColorAtDist(cfg, node.light.area, node.light.componentwiseMaxColor, VectorLength(gap));
+    return LightSample_Brightness(color);
+}
 
-    Q_assert(!std::isnan(resultscaled[0]) && !std::isnan(resultscaled[1]) && !std::isnan(resultscaled[2]));
-    return resultscaled;
+static float
+BounceLightNode_Estimate(const globalconfig_t &cfg, const bouncelightnode_t &node, const lightsurf_t *lightsurf)
+{
+    const float dist = qv::length(vec3_t_to_glm(lightsurf->origin) - node.light.pos);
+    const qvec3f color = BounceLight_ColorAtDist(cfg, node.light.area, node.light.componentwiseMaxColor, dist);
+    return LightSample_Brightness(color);
 }
 
-static inline bool
-BounceLight_SphereCull(const mbsp_t *bsp, const bouncelight_t *vpl, const lightsurf_t *lightsurf)
+/*
+ * Picks a cut through the bounce light tree for lightsurf, lightcuts style:
+ * starting from the root, the node with the largest error bound is replaced
+ * by its children until every node's bound is within bouncecuterror of the
+ * estimated total. Nodes that can't reach lightsurf are dropped on the way.
+ */
+static std::vector<int>
+BounceLightCut(const mbsp_t *bsp, const lightsurf_t *lightsurf)
 {
     const globalconfig_t &cfg = *lightsurf->cfg;
+    const std::vector<bouncelightnode_t> &tree = BounceLightTree();
+    const float maxerror = cfg.bouncecuterror.floatValue();
     
-    if (!novisapprox && AABBsDisjoint(vpl->mins, vpl->maxs, lightsurf->mins, lightsurf->maxs))
-        return true;
+    std::priority_queue<std::pair<float, int>> heap; // (error bound, node)
+    std::vector<int> cut;
+    float total = 0;
     
-    const qvec3f dir = vec3_t_to_glm(lightsurf->origin) - vpl->pos; // vpl -> sample point
-    const float dist = qv::length(dir) + lightsurf->radius;
+    auto addNode = [&](int nodenum) {
+        const bouncelightnode_t &node = tree[nodenum];
+        
+        if (node.vplnum != -1) {
+            // a single bounce light is evaluated exactly
+            if (!BounceLight_SphereCull(bsp, &node.light, lightsurf)) {
+                cut.push_back(nodenum);
+                total += BounceLightNode_Estimate(cfg, node, lightsurf);
+            }
+            return;
+        }
+        
+        if (!novisapprox && AABBsDisjoint(node.light.mins, node.light.maxs, lightsurf->mins, lightsurf->maxs))
+            return;
+        
+        const float bound = BounceLightNode_Bound(cfg, node, lightsurf);
+        if (bound < 0.25f)
+            return;
+        
+        heap.emplace(bound, nodenum);
+        total += BounceLightNode_Estimate(cfg, node, lightsurf);
+    };
     
-    // get light contribution
-    const qvec3f color = BounceLight_ColorAtDist(cfg, vpl->area, vpl->componentwiseMaxColor, dist);
+    if (!tree.empty())
+        addNode(0);
     
-    return LightSample_Brightness(color) < 0.25f;
-}
-
-static bool //mxd
-SurfaceLight_SphereCull(const surfacelight_t *vpl, const lightsurf_t *lightsurf)
-{
-    if (!novisapprox && AABBsDisjoint(vpl->mins, vpl->maxs, lightsurf->mins, lightsurf->maxs))
-        return true;
-
-    const globalconfig_t &cfg = *lightsurf->cfg;
-    const qvec3f dir = vec3_t_to_glm(lightsurf->origin) - vec3_t_to_glm(vpl->pos); // vpl -> sample point
-    const float dist = qv::length(dir) + lightsurf->radius;
-
-    // Get light contribution
-    const qvec3f color = SurfaceLight_ColorAtDist(cfg, vpl->totalintensity, vec3_t_to_glm(vpl->color), dist);
-
-    return LightSample_Brightness(color) < 0.25f;
+    while (!heap.empty()) {
+        const std::pair<float, int> top = heap.top();
+        if (top.first <= maxerror * total)
+            break;
+        
+        heap.pop();
+        const bouncelightnode_t &node = tree[top.second];
+        total -= BounceLightNode_Estimate(cfg, node, lightsurf);
+        addNode(node.children[0]);
+        addNode(node.children[1]);
+    }
+    
+    for (; !heap.empty(); heap.pop())
+        cut.push_back(heap.top().second);
+    
+    return cut;
 }
 
 static void
@@ -2010,279 +3314,228 @@ LightFace_Bounce(const mbsp_t *bsp, const bsp2_dface_t *face, const lightsurf_t
           || debugmode == debugmode_none))
         return;
     
-#if 1
+    if (cfg.bouncecuterror.floatValue() > 0) {
+        for (const int nodenum : BounceLightCut(bsp, lightsurf)) {
+            LightFace_BounceLight(BounceLightTree()[nodenum].light, lightsurf, lightmaps);
+        }
+        return;
+    }
+    
     for (const bouncelight_t &vpl : BounceLights()) {
         if (BounceLight_SphereCull(bsp, &vpl, lightsurf))
             continue;
-            
-        // FIXME: This will trace the same ray multiple times, once per style,
-        // if the bouncelight is hitting a face with multiple styles.
-        for (const auto &styleColor : vpl.colorByStyle) {
-            bool hit = false;
-            const int style = styleColor.first;
-            const qvec3f &color = styleColor.second;
-            
-            raystream_occlusion_t *rs = lightsurf->occlusion_stream;
-            rs->clearPushedRays();
-            
-            for (int i = 0; i < lightsurf->numpoints; i++) {
-                if (lightsurf->occluded[i])
-                    continue;
-                
-                qvec3f dir = vec3_t_to_glm(lightsurf->points[i]) - vpl.pos; // vpl -> sample point
-                const float dist = qv::length(dir);
-                if (dist == 0.0f)
-                    continue; // FIXME: nudge or something
-                dir /= dist;
-                
-                const qvec3f indirect = GetIndirectLighting(cfg, &vpl, color, dir, dist, vec3_t_to_glm(lightsurf->points[i]), vec3_t_to_glm(lightsurf->normals[i]));
-                
-                if (LightSample_Brightness(indirect) < 0.25)
-                    continue;
-                
-                vec3_t vplPos, vplDir, vplColor;
-                glm_to_vec3_t(vpl.pos, vplPos);
-                glm_to_vec3_t(dir, vplDir);
-                glm_to_vec3_t(indirect, vplColor);
-                
-                rs->pushRay(i, vplPos, vplDir, dist, vplColor);
-            }
-            
-            if (!rs->numPushedRays())
-                continue;
-            
-            total_bounce_rays += rs->numPushedRays();
-            rs->tracePushedRaysOcclusion(lightsurf->modelinfo);
-            
-            lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, style, lightsurf);
-            
-            const int N = rs->numPushedRays();
-            for (int j = 0; j < N; j++) {
-                if (rs->getPushedRayOccluded(j))
-                    continue;
-                
-                const int i = rs->getPushedRayPointIndex(j);
-                vec3_t indirect = {0};
-                rs->getPushedRayColor(j, indirect);
-                
-                Q_assert(!std::isnan(indirect[0]));
-                
-                /* Use dirt scaling on the indirect lighting.
-                 * Except, not in bouncedebug mode.
-                 */
-                if (debugmode != debugmode_bounce) {
-                    const vec_t dirtscale = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], NULL, 0.0, lightsurf);
-                    VectorScale(indirect, dirtscale, indirect);
-                }
-                
-                lightsample_t *sample = &lightmap->samples[i];
-                VectorAdd(sample->color, indirect, sample->color);
-                
-                hit = true;
-                ++total_bounce_ray_hits;
-            }
-            
-            // If this style of this bounce light contributed anything, save.
-            if (hit)
-                Lightmap_Save(lightmaps, lightsurf, lightmap, style);
-        }
+        
+        LightFace_BounceLight(vpl, lightsurf, lightmaps);
     }
+}
 
-#else
+/* rays traced per call by LightFace_SurfaceLight */
+static const int SURFLIGHT_BATCH_RAYS = 16384;
 
-    lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, 0, lightsurf);
+/*
+ * Ray from a surface light point to a sample point. The start is moved off
+ * the surface light along its normal by offset (-1 to measure the light,
+ * +1 to trace from, see LightFace_SurfaceLight).
+ */
+static inline float
+SurfaceLight_Ray(const surfacelight_t &vpl, const qvec3f &lightpoint, float offset,
+                 const qvec3f &samplepos, const qvec3f &samplenormal, qvec3f *pos, qvec3f *dir)
+{
+    *pos = lightpoint + vpl.surfnormal * offset;
+    *dir = samplepos - *pos;
+    const float dist = qv::length(*dir);
 
-    const int N=1024;
-    raystream_t *rs = MakeRayStream(N);
+    if (dist == 0.0f)
+        *dir = samplenormal;
+    else
+        *dir /= dist;
+    return dist;
+}
 
-    for (int i = 0; i < lightsurf->numpoints; i++) {
-        if (lightsurf->occluded[i])
+/*
+ * Contribution of one surface light point to sample point i, ignoring
+ * occlusion. Returns false if it's too small to bother tracing.
+ */
+static inline bool
+SurfaceLight_PointContrib(const globalconfig_t &cfg, const surfacelight_t &vpl, const qvec3f &lightpoint,
+                          const lightsurf_t *lightsurf, int i, qvec3f *color)
+{
+    const qvec3f lightsurf_pos = vec3_t_to_glm(lightsurf->points[i]);
+    const qvec3f lightsurf_normal = vec3_t_to_glm(lightsurf->normals[i]);
+
+    // Push 1 unit behind the surflight (fixes darkening near surflight face on neighbouring faces)
+    qvec3f pos, dir;
+    const float dist = SurfaceLight_Ray(vpl, lightpoint, -1.0f, lightsurf_pos, lightsurf_normal, &pos, &dir);
+
+    *color = GetSurfaceLighting(cfg, &vpl, dir, dist, lightsurf_normal);
+    return LightSample_Brightness(*color) >= 0.01f; // Each point contributes very little to the final result
+}
+
+static void
+SurfaceLight_PushRay(raystream_occlusion_t *rs, const surfacelight_t &vpl, const qvec3f &lightpoint,
+                     const lightsurf_t *lightsurf, int i, const qvec3f &color)
+{
+    // Push 1 unit in front of the surflight, so embree can properly process it ...
+    qvec3f pos, dir;
+    const float dist = SurfaceLight_Ray(vpl, lightpoint, 1.0f, vec3_t_to_glm(lightsurf->points[i]),
+                                        vec3_t_to_glm(lightsurf->normals[i]), &pos, &dir);
+
+    vec3_t vplPos, vplDir, vplColor;
+    glm_to_vec3_t(pos, vplPos);
+    glm_to_vec3_t(dir, vplDir);
+    glm_to_vec3_t(color, vplColor);
+
+    rs->pushRay(i, vplPos, vplDir, dist, vplColor);
+}
+
+/* traces the pushed rays and adds the unoccluded ones to the lightmap */
+static void
+SurfaceLight_TraceBatch(raystream_occlusion_t *rs, const lightsurf_t *lightsurf, lightmap_t *lightmap, bool *hit)
+{
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    const int numrays = rs->numPushedRays();
+    if (!numrays)
+        return;
+
+    total_surflight_rays += numrays;
+    rs->tracePushedRaysOcclusion(lightsurf->modelinfo);
+
+    const bool *occluded = rs->getPushedRaysOccluded();
+    const int *pointindices = rs->getPushedRayPointIndices();
+    const vec3_t *colors = rs->getPushedRayColors();
+
+    for (int j = 0; j < numrays; j++) {
+        if (occluded[j])
             continue;
-        
-        const qvec3f surfpoint = vec3_t_to_glm(lightsurf->points[i]);
-        const qvec3f surfnormal = vec3_t_to_glm(lightsurf->normals[i]);
-        
-        const qmat3x3f rotationMatrix = RotateFromUpToSurfaceNormal(surfnormal);
-        
-        rs->clearPushedRays();
-        
-        
-        for (int j=0; j<N; j++) {
-            const qvec3f randomDirInUpCoordSystem = CosineWeightedHemisphereSample(Random(), Random());
-            const qvec3f rayDir = rotationMatrix * randomDirInUpCoordSystem;
-            
-            if (!(qv::dot(rayDir, surfnormal) > -0.01)) {
-                //printf("bad dot\n");
-            }
-            
-            rs->pushRay(i, surfpoint, rayDir, 8192);
-        }
-        
-        rs->tracePushedRaysIntersection(lightsurf->modelinfo);
-        
-        qvec3f colorAvg(0);
-        int Nhits = 0;
-        
-        for (int j=0; j<N; j++) {
-            if (rs->getPushedRayHitType(j) == hittype_t::SKY)
-                continue;
-        
-            const bsp2_dface_t *face = rs->getPushedRayHitFace(j);
-            if (face == nullptr)
-                continue;
-            
-            const int fnum = Face_GetNum(bsp, face);
-            const auto lights = BounceLightsForFaceNum(fnum); // FIXME: Slow
-            if (lights.empty())
-                continue;
-            
-            Q_assert(lights.size() == 1);
-            const bouncelight_t &vpl = lights[0];
-            
-            const auto it = vpl.colorByStyle.find(0);
-            if (it == vpl.colorByStyle.end())
-                continue;
-            const qvec3f color = it->second;
-            
-            const qvec3f raydir = rs->getPushedRayDir(j);
-            if (!(qv::dot(raydir, surfnormal) > -0.01)) {
-                //printf("bad dot\n");
-                continue;
-            }
-            
-            if (!(fabs(1.0f - qv::length(raydir)) < 0.1)) {
-                //printf("bad raydir: %f %f %f (len %f)\n", raydir.x, raydir.y, raydir.z, qv::length(raydir));
-                continue;
-            }
-            
-            const float dist = rs->getPushedRayHitDist(j);
-            if (dist <= 0) {
-                //printf("bad dist\n");
-                continue;
-            }
-            
-            const qplane3f plane = Face_Plane_E(bsp, face);
-            float scale = qv::dot(plane.normal(), -raydir);
-            if (scale < 0)
-                scale = 0;
-            
-            //const qvec3f indirect = GetIndirectLighting(cfg, &vpl, color, -raydir, dist, surfpoint, surfnormal);
-            
-            Q_assert(!std::isnan(color.x));
-            Q_assert(!std::isnan(color.y));
-            Q_assert(!std::isnan(color.z));
-            
-            colorAvg += (color * scale * 255.0f);
-            Nhits++;
-        }
-        
-        if (Nhits) {
-            colorAvg /= Nhits;
-        
-            lightsample_t *sample = &lightmap->samples[i];
-        
-            vec3_t indirectTmp;
-            glm_to_vec3_t(colorAvg, indirectTmp);
-            VectorAdd(sample->color, indirectTmp, sample->color);
-        }
+
+        const int i = pointindices[j];
+        vec3_t indirect;
+        VectorCopy(colors[j], indirect);
+
+        Q_assert(!std::isnan(indirect[0]));
+
+        // Use dirt scaling on the surface lighting.
+        const vec_t dirtscale = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], nullptr, 0.0, lightsurf);
+        VectorScale(indirect, dirtscale, indirect);
+
+        lightsample_t *sample = &lightmap->samples[i];
+        VectorAdd(sample->color, indirect, sample->color);
+
+        *hit = true;
+        ++total_surflight_ray_hits;
     }
-    
-    Lightmap_Save(lightmaps, lightsurf, lightmap, 0);
-    delete rs;
 
-#endif
+    rs->clearPushedRays();
 }
 
+/*
+ * Surface lights. Rays from every surface light point to every sample point
+ * it reaches go through one large ray stream instead of a trace call per
+ * point. With -surflight_samples n, each sample point instead traces n rays
+ * to points picked in proportion to their unoccluded contribution, so the
+ * ray count no longer grows with the number of surface light points.
+ */
 static void //mxd
 LightFace_SurfaceLight(const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
 {
     const globalconfig_t &cfg = *lightsurf->cfg;
+    lightsurf_arena_t *arena = LightsurfArena();
 
+    std::vector<std::pair<const surfacelight_t *, int>> &candidates = arena->surflight_candidates;
+    candidates.clear();
     for (const surfacelight_t &vpl : SurfaceLights()) {
         if (SurfaceLight_SphereCull(&vpl, lightsurf))
             continue;
+        for (int c = 0; c < static_cast<int>(vpl.points.size()); c++)
+            candidates.emplace_back(&vpl, c);
+    }
+    if (candidates.empty())
+        return;
 
-        raystream_occlusion_t *rs = lightsurf->occlusion_stream;
+    if (!arena->surflight_stream)
+        arena->surflight_stream = MakeOcclusionRayStream(SURFLIGHT_BATCH_RAYS);
+    raystream_occlusion_t *rs = arena->surflight_stream;
+    rs->clearPushedRays();
+
+    const int lightmapstyle = 0;
+    lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, lightmapstyle, lightsurf);
+    bool hit = false;
+
+    if (surflight_samples == 0 || static_cast<int>(candidates.size()) <= surflight_samples) {
+        /* every point against every sample */
+        for (const auto &candidate : candidates) {
+            const surfacelight_t &vpl = *candidate.first;
+            const qvec3f &lightpoint = vpl.points[candidate.second];
 
-        for (int c = 0; c < vpl.points.size(); c++) {
-            rs->clearPushedRays();
-            
             for (int i = 0; i < lightsurf->numpoints; i++) {
                 if (lightsurf->occluded[i])
                     continue;
 
-                const qvec3f lightsurf_pos = vec3_t_to_glm(lightsurf->points[i]);
-                const qvec3f lightsurf_normal = vec3_t_to_glm(lightsurf->normals[i]);
-
-                // Push 1 unit behind the surflight (fixes darkening near surflight face on neighbouring faces)
-                qvec3f pos = vpl.points[c] - vpl.surfnormal; 
-                qvec3f dir = lightsurf_pos - pos;
-                float dist = qv::length(dir);
-
-                if (dist == 0.0f)
-                    dir = lightsurf_normal;
-                else
-                    dir /= dist;
-
-                const qvec3f indirect = GetSurfaceLighting(cfg, &vpl, dir, dist, lightsurf_normal);
-                if (LightSample_Brightness(indirect) < 0.01f) // Each point contributes very little to the final result
+                qvec3f indirect;
+                if (!SurfaceLight_PointContrib(cfg, vpl, lightpoint, lightsurf, i, &indirect))
                     continue;
 
-                // Push 1 unit in front of the surflight, so embree can properly process it ...
-                pos = vpl.points[c] + vpl.surfnormal;
-                dir = lightsurf_pos - pos;
-                dist = qv::length(dir);
-
-                if (dist == 0.0f)
-                    dir = lightsurf_normal;
-                else
-                    dir /= dist;
-
-                vec3_t vplPos, vplDir, vplColor;
-                glm_to_vec3_t(pos, vplPos);
-                glm_to_vec3_t(dir, vplDir);
-                glm_to_vec3_t(indirect, vplColor);
-
-                rs->pushRay(i, vplPos, vplDir, dist, vplColor);
+                if (rs->numPushedRays() == SURFLIGHT_BATCH_RAYS)
+                    SurfaceLight_TraceBatch(rs, lightsurf, lightmap, &hit);
+                SurfaceLight_PushRay(rs, vpl, lightpoint, lightsurf, i, indirect);
             }
+        }
+    } else {
+        /* surflight_samples rays per sample, importance sampled */
+        const int numcandidates = static_cast<int>(candidates.size());
+        const int n = surflight_samples;
+        std::vector<qvec3f> &colors = arena->surflight_colors;
+        std::vector<float> &cdf = arena->surflight_cdf;
+        colors.resize(numcandidates);
+        cdf.resize(numcandidates);
 
-            if (!rs->numPushedRays())
+        for (int i = 0; i < lightsurf->numpoints; i++) {
+            if (lightsurf->occluded[i])
                 continue;
 
-            total_surflight_rays += rs->numPushedRays();
-            rs->tracePushedRaysOcclusion(lightsurf->modelinfo);
-
-            const int lightmapstyle = 0;
-            lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, lightmapstyle, lightsurf);
+            float total = 0;
+            for (int j = 0; j < numcandidates; j++) {
+                const surfacelight_t &vpl = *candidates[j].first;
+                if (!SurfaceLight_PointContrib(cfg, vpl, vpl.points[candidates[j].second], lightsurf, i, &colors[j]))
+                    colors[j] = qvec3f(0);
+                total += LightSample_Brightness(colors[j]);
+                cdf[j] = total;
+            }
+            if (total <= 0)
+                continue;
 
-            bool hit = false;
-            const int numrays = rs->numPushedRays();
-            for (int j = 0; j < numrays; j++) {
-                if (rs->getPushedRayOccluded(j))
+            /* stratified, with a golden ratio offset per sample point */
+            const float offset = fmod(i * 0.618034f, 1.0f);
+            int j = 0;
+            for (int k = 0; k < n; ) {
+                const float u = (k + offset) / n * total;
+                while (j < numcandidates - 1 && cdf[j] <= u)
+                    j++;
+
+                // strata landing on the same point share one ray
+                int count = 1;
+                for (k++; k < n && (k + offset) / n * total < cdf[j]; k++)
+                    count++;
+
+                // color / pdf, pdf = brightness / total per pick
+                const float brightness = LightSample_Brightness(colors[j]);
+                if (brightness <= 0)
                     continue;
+                const qvec3f color = colors[j] * (total * count / (brightness * n));
 
-                const int i = rs->getPushedRayPointIndex(j);
-                vec3_t indirect = { 0 };
-                rs->getPushedRayColor(j, indirect);
-
-                Q_assert(!std::isnan(indirect[0]));
-
-                // Use dirt scaling on the surface lighting.
-                const vec_t dirtscale = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], nullptr, 0.0, lightsurf);
-                VectorScale(indirect, dirtscale, indirect);
-
-                lightsample_t *sample = &lightmap->samples[i];
-                VectorAdd(sample->color, indirect, sample->color);
-
-                hit = true;
-                ++total_surflight_ray_hits;
+                if (rs->numPushedRays() == SURFLIGHT_BATCH_RAYS)
+                    SurfaceLight_TraceBatch(rs, lightsurf, lightmap, &hit);
+                const surfacelight_t &vpl = *candidates[j].first;
+                SurfaceLight_PushRay(rs, vpl, vpl.points[candidates[j].second], lightsurf, i, color);
             }
-
-            // If surface light contributed anything, save.
-            if (hit)
-                Lightmap_Save(lightmaps, lightsurf, lightmap, lightmapstyle);
         }
     }
+
+    SurfaceLight_TraceBatch(rs, lightsurf, lightmap, &hit);
+
+    // If surface light contributed anything, save.
+    if (hit)
+        Lightmap_Save(lightmaps, lightsurf, lightmap, lightmapstyle);
 }
 
 static void
@@ -2360,7 +3613,13 @@ LightFace_DebugNeighbours(lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
 #define DIRT_NUM_ELEVATION_STEPS    3
 #define DIRT_NUM_VECTORS            ( DIRT_NUM_ANGLE_STEPS * DIRT_NUM_ELEVATION_STEPS )
 
+/* adaptive dirt: vectors are traced in rounds, each a stratified subset of the hemisphere */
+#define DIRT_NUM_ROUNDS             4
+#define DIRT_MIN_ROUNDS             2
+#define DIRT_ROUND_VECTORS          ( DIRT_NUM_VECTORS / DIRT_NUM_ROUNDS )
+
 static vec3_t dirtVectors[ DIRT_NUM_VECTORS ];
+static int dirtOrder[ DIRT_NUM_VECTORS ];
 int numDirtVectors = 0;
 
 /*
@@ -2430,8 +3689,27 @@ void SetupDirt(globalconfig_t &cfg) {
         }
     }
 
+    /* 
+     * order for adaptive dirt: round r takes every DIRT_NUM_ROUNDS'th angle
+     * step starting at the bit-reversed r, with all elevations, so the
+     * first rounds cover the hemisphere evenly
+     */
+    static const int roundOffsets[ DIRT_NUM_ROUNDS ] = { 0, 2, 1, 3 };
+    int k = 0;
+    for ( int r = 0; r < DIRT_NUM_ROUNDS; r++ ) {
+        for ( int i = roundOffsets[ r ]; i < DIRT_NUM_ANGLE_STEPS; i += DIRT_NUM_ROUNDS ) {
+            for ( int j = 0; j < DIRT_NUM_ELEVATION_STEPS; j++ ) {
+                dirtOrder[ k++ ] = i * DIRT_NUM_ELEVATION_STEPS + j;
+            }
+        }
+    }
+    Q_assert( k == numDirtVectors );
+
     /* emit some statistics */
     logprint("%9d dirtmap vectors\n", numDirtVectors );
+    if ( cfg.dirtThreshold.floatValue() > 0 ) {
+        logprint("%9g adaptive dirt threshold\n", cfg.dirtThreshold.floatValue() );
+    }
 }
 
 // from q3map2
@@ -2533,6 +3811,100 @@ DirtAtPoint(const globalconfig_t &cfg, raystream_intersection_t *rs, const vec3_
     return occlusion;
 }
 
+/*
+ * ============
+ * LightFace_CalculateDirtAdaptive
+ *
+ * Traces the dirt vectors in DIRT_NUM_ROUNDS stratified rounds. Each ray is
+ * traced for all of the face's unfinished samples in one batch. After
+ * DIRT_MIN_ROUNDS, a sample stops once the 95% confidence interval of its
+ * occlusion estimate is narrower than +/- _dirtthreshold, e.g. on open
+ * floors where every ray misses.
+ * ============
+ */
+static void
+LightFace_CalculateDirtAdaptive(lightsurf_t *lightsurf, const vec3_t *myUps, const vec3_t *myRts)
+{
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    const float depth = cfg.dirtDepth.floatValue();
+    const float threshold = cfg.dirtThreshold.floatValue();
+    const int numpoints = lightsurf->numpoints;
+
+    lightsurf_arena_t *arena = LightsurfArena();
+    vec_t *sums = lightsurf->occlusion;
+    vec_t *sumsq = arena->dirt_sumsq;
+    int *counts = arena->dirt_counts;
+    bool *done = arena->dirt_done;
+    
+    for (int i = 0; i < numpoints; i++) {
+        sumsq[i] = 0;
+        counts[i] = 0;
+        done[i] = lightsurf->occluded[i];
+    }
+    
+    raystream_intersection_t *rs = lightsurf->intersection_stream;
+    uint64_t rays = 0, saved = 0;
+    
+    for (int round = 0; round < DIRT_NUM_ROUNDS; round++) {
+        for (int k = 0; k < DIRT_ROUND_VECTORS; k++) {
+            const int j = dirtOrder[round * DIRT_ROUND_VECTORS + k];
+            rs->clearPushedRays();
+            
+            for (int i = 0; i < numpoints; i++) {
+                if (done[i])
+                    continue;
+                
+                vec3_t dirtvec;
+                GetDirtVector(cfg, j, dirtvec);
+                
+                vec3_t dir;
+                TransformToTangentSpace(lightsurf->normals[i], myUps[i], myRts[i], dirtvec, dir);
+                
+                rs->pushRay(i, lightsurf->points[i], dir, depth);
+            }
+            if (!rs->numPushedRays())
+                break;
+            
+            rs->tracePushedRaysIntersection(lightsurf->modelinfo);
+            rays += rs->numPushedRays();
+            
+            for (int m = 0; m < rs->numPushedRays(); m++) {
+                const int i = rs->getPushedRayPointIndex(m);
+                float value = 0;
+                if (rs->getPushedRayHitType(m) == hittype_t::SOLID) {
+                    value = 1 - qmin(depth, rs->getPushedRayHitDist(m)) / depth;
+                }
+                sums[i] += value;
+                sumsq[i] += value * value;
+                counts[i]++;
+            }
+        }
+        
+        if (round + 1 < DIRT_MIN_ROUNDS || round + 1 == DIRT_NUM_ROUNDS)
+            continue;
+        
+        for (int i = 0; i < numpoints; i++) {
+            if (done[i])
+                continue;
+            
+            const int n = counts[i];
+            const vec_t mean = sums[i] / n;
+            const vec_t variance = qmax(static_cast<vec_t>(0), (sumsq[i] - n * mean * mean) / (n - 1));
+            if (1.96f * sqrt(variance / n) < threshold) {
+                done[i] = true;
+                saved += numDirtVectors - n;
+            }
+        }
+    }
+    
+    for (int i = 0; i < numpoints; i++) {
+        lightsurf->occlusion[i] = counts[i] ? sums[i] / counts[i] : 0;
+    }
+    
+    total_dirt_rays += rays;
+    total_dirt_rays_saved += saved;
+}
+
 /*
  * ============
  * LightFace_CalculateDirt
@@ -2547,8 +3919,9 @@ LightFace_CalculateDirt(lightsurf_t *lightsurf)
 
     // batch implementation:
 
-    vec3_t *myUps = (vec3_t *) calloc(lightsurf->numpoints, sizeof(vec3_t));
-    vec3_t *myRts = (vec3_t *) calloc(lightsurf->numpoints, sizeof(vec3_t));
+    lightsurf_arena_t *arena = LightsurfArena();
+    vec3_t *myUps = arena->dirt_ups;
+    vec3_t *myRts = arena->dirt_rts;
     
     // init
     for (int i = 0; i < lightsurf->numpoints; i++) {
@@ -2560,6 +3933,11 @@ LightFace_CalculateDirt(lightsurf_t *lightsurf)
         GetUpRtVecs(lightsurf->normals[i], myUps[i], myRts[i]);
     }
 
+    if (cfg.dirtThreshold.floatValue() > 0) {
+        LightFace_CalculateDirtAdaptive(lightsurf, myUps, myRts);
+        return;
+    }
+
     for (int j=0; j<numDirtVectors; j++) {
         raystream_intersection_t *rs = lightsurf->intersection_stream;
         rs->clearPushedRays();
@@ -2581,6 +3959,7 @@ LightFace_CalculateDirt(lightsurf_t *lightsurf)
         
         // trace the batch. need closest hit for dirt, so intersection.
         rs->tracePushedRaysIntersection(lightsurf->modelinfo);
+        total_dirt_rays += rs->numPushedRays();
         
         // accumulate hitdists
         for (int k = 0; k < rs->numPushedRays(); k++) {
@@ -2599,9 +3978,6 @@ LightFace_CalculateDirt(lightsurf_t *lightsurf)
         vec_t avgHitdist = lightsurf->occlusion[i] / (float)numDirtVectors;
         lightsurf->occlusion[i] = 1 - (avgHitdist / cfg.dirtDepth.floatValue());
     }
-
-    free(myUps);
-    free(myRts);
 }
 
 // clamps negative values. applies gamma and rangescale. clamps values over 255
@@ -2738,38 +4114,41 @@ DumpDownscaledLightmap(const mbsp_t *bsp, const bsp2_dface_t *face, int w, int h
     WritePPM(std::string{fname}, w, h, rgbdata.data());
 }
 
-static std::vector<qvec4f>
-LightmapColorsToGLMVector(const lightsurf_t *lightsurf, const lightmap_t *lm)
+/*
+ * The image helpers below write into caller-provided vectors, so the
+ * per-thread buffers in the lightsurf arena keep their storage between faces.
+ */
+static void
+LightmapColorsToGLMVector(const lightsurf_t *lightsurf, const lightmap_t *lm, std::vector<qvec4f> *res)
 {
-    std::vector<qvec4f> res;
+    res->clear();
     for (int i=0; i<lightsurf->numpoints; i++) {
         const vec_t *color = lm->samples[i].color;
         const float alpha = lightsurf->occluded[i] ? 0.0f : 1.0f;
-        res.emplace_back(color[0], color[1], color[2], alpha); //mxd. https://clang.llvm.org/extra/clang-tidy/checks/modernize-use-emplace.html
+        res->emplace_back(color[0], color[1], color[2], alpha); //mxd. https://clang.llvm.org/extra/clang-tidy/checks/modernize-use-emplace.html
     }
-    return res;
 }
 
-static std::vector<qvec4f>
-LightmapNormalsToGLMVector(const lightsurf_t *lightsurf, const lightmap_t *lm)
+static void
+LightmapNormalsToGLMVector(const lightsurf_t *lightsurf, const lightmap_t *lm, std::vector<qvec4f> *res)
 {
-    std::vector<qvec4f> res;
+    res->clear();
     for (int i=0; i<lightsurf->numpoints; i++) {
         const vec_t *color = lm->samples[i].direction;
         const float alpha = lightsurf->occluded[i] ? 0.0f : 1.0f;
-        res.emplace_back(color[0], color[1], color[2], alpha); //mxd. https://clang.llvm.org/extra/clang-tidy/checks/modernize-use-emplace.html
+        res->emplace_back(color[0], color[1], color[2], alpha); //mxd. https://clang.llvm.org/extra/clang-tidy/checks/modernize-use-emplace.html
     }
-    return res;
 }
 
 static std::vector<qvec4f>
 LightmapToGLMVector(const mbsp_t *bsp, const lightsurf_t *lightsurf)
 {
+    std::vector<qvec4f> res;
     const lightmap_t *lm = Lightmap_ForStyle_ReadOnly(lightsurf, 0);
     if (lm != nullptr) {
-        return LightmapColorsToGLMVector(lightsurf, lm);
+        LightmapColorsToGLMVector(lightsurf, lm, &res);
     }
-    return std::vector<qvec4f>();
+    return res;
 }
 
 static qvec3f
@@ -2803,17 +4182,20 @@ void GLMVector_LinearToGamma(std::vector<qvec3f> &vec) {
 // - If all the samples in the filter kernel have alpha=0, write a sample with alpha=0
 //   (but still average the colors, important so that minlight still works properly
 //    for bmodels that go outside of the world).
-static std::vector<qvec4f>
-IntegerDownsampleImage(const std::vector<qvec4f> &input, int w, int h, int factor)
+static void
+IntegerDownsampleImage(const std::vector<qvec4f> &input, int w, int h, int factor, std::vector<qvec4f> *output)
 {
     Q_assert(factor >= 1);
-    if (factor == 1)
-        return input;
+    if (factor == 1) {
+        *output = input;
+        return;
+    }
     
     const int outw = w/factor;
     const int outh = h/factor;
     
-    std::vector<qvec4f> res(static_cast<size_t>(outw * outh));
+    std::vector<qvec4f> &res = *output;
+    res.resize(static_cast<size_t>(outw * outh));
     
     for (int y=0; y<outh; y++) {
         for (int x=0; x<outw; x++) {
@@ -2867,16 +4249,14 @@ IntegerDownsampleImage(const std::vector<qvec4f> &input, int w, int h, int facto
             }
         }
     }
-    
-    return res;
 }
 
-static std::vector<qvec4f>
-FloodFillTransparent(const std::vector<qvec4f> &input, int w, int h)
+static void
+FloodFillTransparent(std::vector<qvec4f> *image, int w, int h)
 {
     // transparent pixels take the average of their neighbours.
     
-    std::vector<qvec4f> res(input);
+    std::vector<qvec4f> &res = *image;
     
     while (1) {
         int unhandled_pixels = 0;
@@ -2923,7 +4303,7 @@ FloodFillTransparent(const std::vector<qvec4f> &input, int w, int h)
             }
         }
         
-        if (unhandled_pixels == input.size()) {
+        if (unhandled_pixels == res.size()) {
             //logprint("FloodFillTransparent: warning, fully transparent lightmap\n");
             fully_transparent_lightmaps++;
             break;
@@ -2932,14 +4312,12 @@ FloodFillTransparent(const std::vector<qvec4f> &input, int w, int h)
         if (unhandled_pixels == 0)
             break; // all done
     }
-    
-    return res;
 }
 
-static std::vector<qvec4f>
-HighlightSeams(const std::vector<qvec4f> &input, int w, int h)
+static void
+HighlightSeams(std::vector<qvec4f> *image, int w, int h)
 {
-    std::vector<qvec4f> res(input);
+    std::vector<qvec4f> &res = *image;
 
     for (int y=0; y<h; y++) {
         for (int x=0; x<w; x++) {
@@ -2951,14 +4329,13 @@ HighlightSeams(const std::vector<qvec4f> &input, int w, int h)
             }
         }
     }
-    
-    return res;
 }
 
-static std::vector<qvec4f>
-BoxBlurImage(const std::vector<qvec4f> &input, int w, int h, int radius)
+static void
+BoxBlurImage(const std::vector<qvec4f> &input, int w, int h, int radius, std::vector<qvec4f> *output)
 {
-    std::vector<qvec4f> res(input.size());
+    std::vector<qvec4f> &res = *output;
+    res.resize(input.size());
     
     for (int y=0; y<h; y++) {
         for (int x=0; x<w; x++) {
@@ -3016,8 +4393,6 @@ BoxBlurImage(const std::vector<qvec4f> &input, int w, int h, int radius)
             }
         }
     }
-    
-    return res;
 }
 
 static void
@@ -3064,16 +4439,19 @@ WriteLightmaps(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const
             }
             // if we didn't find a matching lightmap, just don't write anything
 
-            out += (actual_width * actual_height);
-            lit += (actual_width * actual_height * 3);
-            lux += (actual_width * actual_height * 3);
+            // any of these can be null when that output isn't being written
+            if (out) out += (actual_width * actual_height);
+            if (lit) lit += (actual_width * actual_height * 3);
+            if (lux) lux += (actual_width * actual_height * 3);
         }
 
         return;
     }
 
     // intermediate collection for sorting lightmaps
-    std::vector<std::pair<float, const lightmap_t *>> sortable;
+    lightsurf_arena_t *arena = LightsurfArena();
+    std::vector<std::pair<float, const lightmap_t *>> &sortable = arena->sortable;
+    sortable.clear();
     
     for (const lightmap_t &lightmap : *lightmaps) {
         // skip un-saved lightmaps
@@ -3095,7 +4473,8 @@ WriteLightmaps(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const
     std::sort(sortable.begin(), sortable.end());
     std::reverse(sortable.begin(), sortable.end());
     
-    std::vector<const lightmap_t *> sorted;
+    std::vector<const lightmap_t *> &sorted = arena->sorted;
+    sorted.clear();
     for (const auto &pair : sortable) {
         if (sorted.size() == MAXLIGHTMAPS) {
             logprint("WARNING: Too many light styles on a face\n"
@@ -3141,23 +4520,9 @@ WriteLightmaps(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const
 
     const int size = (lightsurf->texsize[0] + 1) * (lightsurf->texsize[1] + 1);
 
+    /* lightofs is assigned once all faces are lit, see AssignFileSpace */
     uint8_t *out, *lit, *lux;
-    GetFileSpace(&out, &lit, &lux, size * numstyles);
-
-    int lightofs;
-
-    // Q2/HL native colored lightmaps
-    if (bsp->loadversion->game->has_rgb_lightmap) {
-        lightofs = lit - lit_filebase;
-    } else {
-        lightofs = out - filebase;
-    }
-
-    if (facesup) {
-        facesup->lightofs = lightofs;
-    } else {
-        face->lightofs = lightofs;
-    }
+    GetFileSpace(Face_GetNum(bsp, face), facesup != nullptr, &out, &lit, &lux, size * numstyles);
 
     // sanity check that we don't save a lightmap for a non-lightmapped face
     {
@@ -3172,121 +4537,544 @@ WriteLightmaps(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const
 
         WriteSingleLightmap(bsp, face, lightsurf, lm, actual_width, actual_height, out, lit, lux);
 
-        out += (actual_width * actual_height);
-        lit += (actual_width * actual_height * 3);
-        lux += (actual_width * actual_height * 3);
+        // any of these can be null when that output isn't being written
+        if (out) out += (actual_width * actual_height);
+        if (lit) lit += (actual_width * actual_height * 3);
+        if (lux) lux += (actual_width * actual_height * 3);
+    }
+}
+
+/**
+ * - Writes (actual_width * actual_height) bytes to `out`
+ * - Writes (actual_width * actual_height * 3) bytes to `lit`
+ * - Writes (actual_width * actual_height * 3) bytes to `lux`
+ * Null buffers are skipped.
+ */
+static void
+WriteSingleLightmap(const mbsp_t *bsp,
+                    const bsp2_dface_t *face,
+                    const lightsurf_t *lightsurf,
+                    const lightmap_t *lm,
+                    const int actual_width, const int actual_height,
+                    uint8_t *out, uint8_t *lit, uint8_t *lux)
+{
+        const int oversampled_width = actual_width * oversample;
+        const int oversampled_height = actual_height * oversample;
+
+        // allocate new float buffers for the output colors and directions
+        // these are the actual output width*height, without oversampling.
+        
+        lightsurf_arena_t *arena = LightsurfArena();
+        std::vector<qvec4f> &fullres = arena->image;
+        std::vector<qvec4f> &tmp = arena->image_tmp;
+        LightmapColorsToGLMVector(lightsurf, lm, &fullres);
+        
+        if (debug_highlightseams) {
+            HighlightSeams(&fullres, oversampled_width, oversampled_height);
+        }
+        
+        // removes all transparent pixels by averaging from adjacent pixels
+        FloodFillTransparent(&fullres, oversampled_width, oversampled_height);
+        
+        if (softsamples > 0) {
+            BoxBlurImage(fullres, oversampled_width, oversampled_height, softsamples, &tmp);
+            fullres.swap(tmp);
+        }
+        
+        std::vector<qvec4f> &output_color = tmp;
+        IntegerDownsampleImage(fullres, oversampled_width, oversampled_height, oversample, &output_color);
+        
+        std::vector<qvec4f> &output_dir = arena->image_dir;
+        if (lux) { //mxd. Skip when lux isn't needed
+            LightmapNormalsToGLMVector(lightsurf, lm, &fullres);
+            IntegerDownsampleImage(fullres, oversampled_width, oversampled_height, oversample, &output_dir);
+        }
+        
+        // copy from the float buffers to byte buffers in .bsp / .lit / .lux
+        
+        for (int t = 0; t < actual_height; t++) {
+            for (int s = 0; s < actual_width; s++) {
+                const int sampleindex = (t * actual_width) + s;
+                qvec4f color = output_color.at(sampleindex);
+                
+                if (lit) {
+                    *lit++ = color[0];
+                    *lit++ = color[1];
+                    *lit++ = color[2];
+                }
+                
+                /* Take the max() of the 3 components to get the value to write to the
+                .bsp lightmap. this avoids issues with some engines
+                that require the lit and internal lightmap to have the same
+                intensity. (MarkV, some QW engines)
+                     
+                This must be max(), see LightNormalize in MarkV 1036.
+                */
+                float light = qmax(qmax(color[0], color[1]), color[2]);
+                if (light < 0) light = 0;
+                if (light > 255) light = 255;
+                if (out)
+                    *out++ = light;
+                
+                if (lux) {
+                    vec3_t temp;
+                    int v;
+                    const qvec4f &direction = output_dir.at(sampleindex);
+                    temp[0] = qv::dot(qvec3f(direction), vec3_t_to_glm(lightsurf->snormal));
+                    temp[1] = qv::dot(qvec3f(direction), vec3_t_to_glm(lightsurf->tnormal));
+                    temp[2] = qv::dot(qvec3f(direction), vec3_t_to_glm(lightsurf->plane.normal));
+                    
+                    if (!temp[0] && !temp[1] && !temp[2])
+                        VectorSet(temp, 0, 0, 1);
+                    else
+                        VectorNormalize(temp);
+                    
+                    v = (temp[0]+1)*128;  *lux++ = (v>255)?255:v;
+                    v = (temp[1]+1)*128;  *lux++ = (v>255)?255:v;
+                    v = (temp[2]+1)*128;  *lux++ = (v>255)?255:v;
+                }
+            }
+        }
+}
+
+/*
+ * ================
+ * EstimateLightFaceCost
+ *
+ * Cheap estimate of the work LightFace will do for a face, without
+ * tracing anything: sample points (including oversampling) times the
+ * number of lights, suns and dirt rays that will be traced from them.
+ * Used to schedule the most expensive faces first.
+ * ================
+ */
+float
+EstimateLightFaceCost(const mbsp_t *bsp, const bsp2_dface_t *face, const facesup_t *facesup, const globalconfig_t &cfg)
+{
+    const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
+    if (modelinfo == nullptr)
+        return 0;
+    if (face->numedges < 3)
+        return 0;
+    if (!Face_IsLightmapped(bsp, face))
+        return 0;
+
+    const char *texname = Face_TextureName(bsp, face);
+    if (!Q_strcasecmp(texname, "trigger") || !Q_strcasecmp(texname, "skip"))
+        return 0;
+
+    /* same extents and bounding sphere CalcFaceExtents computes */
+    const gtexinfo_t *tex = &bsp->texinfo[face->texinfo];
+    vec_t texmins[2] = { VECT_MAX, VECT_MAX };
+    vec_t texmaxs[2] = { -VECT_MAX, -VECT_MAX };
+    vec3_t mins, maxs, origin;
+    ClearBounds(mins, maxs);
+    for (int i = 0; i < face->numedges; i++) {
+        vec3_t point;
+        vec_t texcoord[2];
+        glm_to_vec3_t(Face_PointAtIndex_E(bsp, face, i), point);
+        WorldToTexCoord(point, tex, texcoord);
+        for (int j = 0; j < 2; j++) {
+            texmins[j] = qmin(texmins[j], texcoord[j]);
+            texmaxs[j] = qmax(texmaxs[j], texcoord[j]);
+        }
+        VectorAdd(point, modelinfo->offset, point);
+        AddPointToBounds(point, mins, maxs);
+    }
+    VectorAdd(mins, maxs, origin);
+    VectorScale(origin, 0.5f, origin);
+    vec3_t extent;
+    VectorSubtract(maxs, origin, extent);
+    const vec_t radius = VectorLength(extent);
+
+    const float lmscale = facesup ? facesup->lmscale : modelinfo->lightmapscale;
+    float samples = oversample * oversample;
+    for (int j = 0; j < 2; j++)
+        samples *= ceil(texmaxs[j] / lmscale) - floor(texmins[j] / lmscale) + 1;
+
+    /* one unit for minlight / scaling / writing the lightmap */
+    float passes = 1;
+
+    if (dirt_in_use)
+        passes += numDirtVectors;
+
+    const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
+    if (modelinfo->lightignore.boolValue()
+        || (extended_flags.extended & TEX_EXFLAG_LIGHTIGNORE) != 0)
+        return samples * passes;
+
+    static thread_local std::vector<int> nearbylights;
+    LightsTouchingBounds(mins, maxs, &nearbylights);
+    for (const int lightnum : nearbylights) {
+        const light_t &entity = GetLights()[lightnum];
+        if (entity.getFormula() == LF_LOCALMIN)
+            continue;
+        if (entity.nostaticlight.boolValue())
+            continue;
+        if (CullLight_Bounds(cfg, &entity, mins, maxs, origin, radius))
+            continue;
+        passes += 1;
+    }
+
+    vec3_t normal;
+    glm_to_vec3_t(Face_Normal_E(bsp, face), normal);
+    for (const sun_t &sun : GetSuns()) {
+        if (sun.dome != -1)
+            continue;
+        vec3_t incoming;
+        VectorCopy(sun.sunvec, incoming);
+        VectorNormalize(incoming);
+        if (DotProduct(incoming, normal) < -ANGLE_EPSILON)
+            continue;
+        passes += 1;
+    }
+    for (int lower = 0; lower < 2; lower++) {
+        for (const skydome_t &dome : GetSkyDomes()) {
+            if (dome.lower == static_cast<bool>(lower)) {
+                passes += GetSkyDomeDirs().size();
+                break;
+            }
+        }
+    }
+
+    return samples * passes;
+}
+
+/*
+ * ============
+ * LightFace_Lights
+ *
+ * Calculates the dirt for the lightsurf's sample points and adds all of the
+ * lighting to them. usecaches is false when lighting a subset of the face's
+ * points, which the -lightcache / -dirtcache entries don't describe.
+ * ============
+ */
+static void
+LightFace_Lights(const mbsp_t *bsp, const bsp2_dface_t *face, const facesup_t *facesup,
+                 lightsurf_t *lightsurf, lightmapdict_t *lightmaps, bool usecaches)
+{
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    const modelinfo_t *modelinfo = lightsurf->modelinfo;
+    
+    /* calculate dirt (ambient occlusion) but don't use it yet */
+    if (dirt_in_use && (debugmode != debugmode_phong)) {
+        if (usecaches && DirtCache_Active()) {
+            const int slot = LightCache_Slot(Face_GetNum(bsp, face), facesup != nullptr);
+            const uint64_t key = DirtCache_FaceKey(lightsurf);
+            if (DirtCache_Lookup(slot, key, lightsurf->occlusion, lightsurf->numpoints)) {
+                total_dirtcache_reused++;
+            } else {
+                LightFace_CalculateDirt(lightsurf);
+                DirtCache_Store(slot, key, lightsurf->occlusion, lightsurf->numpoints);
+                total_dirtcache_missed++;
+            }
+        } else {
+            LightFace_CalculateDirt(lightsurf);
+        }
+    }
+
+    /*
+     * The lighting procedure is: cast all positive lights, fix
+     * minlight levels, then cast all negative lights. Finally, we
+     * clamp any values that may have gone negative.
+     */
+
+    if (debugmode == debugmode_none) {
+        
+        total_samplepoints += lightsurf->numpoints;
+
+        const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
+
+        /* only lights whose influence volume touches the face or its sample points */
+        vec3_t lightmins, lightmaxs;
+        VectorCopy(lightsurf->mins, lightmins);
+        VectorCopy(lightsurf->maxs, lightmaxs);
+        for (int i = 0; i < lightsurf->numpoints; i++) {
+            AddPointToBounds(lightsurf->points[i], lightmins, lightmaxs);
+        }
+        std::vector<int> &nearbylights = LightsurfArena()->nearbylights;
+        LightsTouchingBounds(lightmins, lightmaxs, &nearbylights);
+        Lightsurf_SetupPVS(bsp, face, lightsurf);
+        
+        /* -lightcache: replay the lights that haven't changed, record the rest */
+        lightcache_state_t cachestate {};
+        lightcache_state_t *cache = nullptr;
+        if (usecaches && LightCache_Active()) {
+            const int slot = LightCache_Slot(Face_GetNum(bsp, face), facesup != nullptr);
+            const uint64_t key = LightCache_FaceKey(lightsurf);
+            cachestate.previous = LightCache_PreviousFace(slot, key);
+            if (cachestate.previous)
+                cachestate.used.assign(cachestate.previous->sources.size(), false);
+            cachestate.record = LightCache_NewFace(slot, key);
+            cache = &cachestate;
+        }
+        
+        /* positive lights */
+        if (!(modelinfo->lightignore.boolValue()
+              || (extended_flags.extended & TEX_EXFLAG_LIGHTIGNORE) != 0)) {
+            for (const int lightnum : nearbylights)
+            {
+                const light_t &entity = GetLights()[lightnum];
+                if (entity.getFormula() == LF_LOCALMIN)
+                    continue;
+                if (entity.nostaticlight.boolValue())
+                    continue;
+                if (entity.light.floatValue() > 0)
+                    LightFace_EntityCached(bsp, &entity, lightsurf, lightmaps, cache);
+            }
+            for ( const sun_t &sun : GetSuns() )
+                if (sun.sunlight > 0 && sun.dome == -1)
+                    LightFace_SkyCached(&sun, lightsurf, lightmaps, cache);
+            LightFace_SkyDomes(lightsurf, lightmaps);
+
+            //mxd. Add surface lights...
+            LightFace_SurfaceLight(lightsurf, lightmaps);
+
+            /* add indirect lighting */
+            LightFace_Bounce(bsp, face, lightsurf, lightmaps);
+        }
+        
+        /* minlight - Use Q2 surface light, or the greater of global or model minlight. */
+        const gtexinfo_t *texinfo = Face_Texinfo(bsp, face); //mxd. Surface lights...
+        if (texinfo != nullptr && texinfo->value > 0 && texinfo->flags.native & Q2_SURF_LIGHT) {
+            vec3_t color;
+            Face_LookupTextureColor(bsp, face, color);
+            LightFace_Min(bsp, face, color, texinfo->value * 2.0f, lightsurf, lightmaps); // Playing by the eye here... 2.0 == 256 / 128; 128 is the light value, at which the surface is renered fullbright, when using arghrad3
+        } else if (lightsurf->minlight > cfg.minlight.floatValue()) {
+            LightFace_Min(bsp, face, lightsurf->minlight_color, lightsurf->minlight, lightsurf, lightmaps);
+        } else {
+            const float light = cfg.minlight.floatValue();
+            vec3_t color;
+            VectorCopy(*cfg.minlight_color.vec3Value(), color);
+            
+            LightFace_Min(bsp, face, color, light, lightsurf, lightmaps);
+        }
+
+        /* negative lights */
+        if (!(modelinfo->lightignore.boolValue()
+              || (extended_flags.extended & TEX_EXFLAG_LIGHTIGNORE) != 0)) {
+            for (const int lightnum : nearbylights)
+            {
+                const light_t &entity = GetLights()[lightnum];
+                if (entity.getFormula() == LF_LOCALMIN)
+                    continue;
+                if (entity.nostaticlight.boolValue())
+                    continue;
+                if (entity.light.floatValue() < 0)
+                    LightFace_EntityCached(bsp, &entity, lightsurf, lightmaps, cache);
+            }
+            for (const sun_t &sun : GetSuns())
+                if (sun.sunlight < 0 && sun.dome == -1)
+                    LightFace_SkyCached(&sun, lightsurf, lightmaps, cache);
+        }
+    }
+}
+
+/*
+ * ============
+ * LightFace_LightSubset
+ *
+ * Lights the given sample points of lightsurf through a compacted copy of
+ * it, and returns the copy's lightmaps (one sample per index).
+ * ============
+ */
+static lightmapdict_t
+LightFace_LightSubset(const mbsp_t *bsp, const bsp2_dface_t *face, const facesup_t *facesup,
+                      const lightsurf_t *lightsurf, const std::vector<int> &indices)
+{
+    lightsurf_arena_t *arena = LightsurfArena();
+    const int count = static_cast<int>(indices.size());
+    
+    lightsurf_t sub = *lightsurf;
+    sub.lightmapsByStyle.clear();
+    sub.numpoints = count;
+    sub.points = arena->sub_points;
+    sub.normals = arena->sub_normals;
+    sub.occluded = arena->sub_occluded;
+    sub.realfacenums = arena->sub_realfacenums;
+    sub.occlusion = arena->sub_occlusion;
+    
+    for (int k = 0; k < count; k++) {
+        const int i = indices[k];
+        VectorCopy(lightsurf->points[i], sub.points[k]);
+        VectorCopy(lightsurf->normals[i], sub.normals[k]);
+        sub.occluded[k] = lightsurf->occluded[i];
+        sub.realfacenums[k] = lightsurf->realfacenums[i];
+        sub.occlusion[k] = 0;
     }
+    
+    LightFace_Lights(bsp, face, facesup, &sub, &sub.lightmapsByStyle, false);
+    return std::move(sub.lightmapsByStyle);
 }
 
-/**
- * - Writes (actual_width * actual_height) bytes to `out`
- * - Writes (actual_width * actual_height * 3) bytes to `lit`
- * - Writes (actual_width * actual_height * 3) bytes to `lux`
+/*
+ * ============
+ * LightFace_Adaptive
+ *
+ * -adaptive with -extra / -extra4: lights one sample per texel first, then
+ * only traces the full oversample x oversample grid for texels that are
+ * partly occluded, or where the light isn't close to linear across the
+ * texel and its neighbours: the texel is more than adaptive_threshold away
+ * from the average of its two neighbours along a row or column, in any
+ * style. That catches shadow edges and light cutoffs but not smooth
+ * falloff, which the downsample handles fine. Where there's only one
+ * neighbour along an axis (face edges, occluded texels) the texel is
+ * compared with it directly against twice the threshold, since a step
+ * shows up at half its height in the average. The other texels copy their
+ * single sample to the whole grid, so WriteLightmaps downsamples as usual.
+ * ============
  */
 static void
-WriteSingleLightmap(const mbsp_t *bsp,
-                    const bsp2_dface_t *face,
-                    const lightsurf_t *lightsurf,
-                    const lightmap_t *lm,
-                    const int actual_width, const int actual_height,
-                    uint8_t *out, uint8_t *lit, uint8_t *lux)
+LightFace_Adaptive(const mbsp_t *bsp, const bsp2_dface_t *face, const facesup_t *facesup,
+                   lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
 {
-        const int oversampled_width = actual_width * oversample;
-        const int oversampled_height = actual_height * oversample;
-
-        // allocate new float buffers for the output colors and directions
-        // these are the actual output width*height, without oversampling.
-        
-        std::vector<qvec4f> fullres = LightmapColorsToGLMVector(lightsurf, lm);
-        
-        if (debug_highlightseams) {
-            fullres = HighlightSeams(fullres, oversampled_width, oversampled_height);
+    lightsurf_arena_t *arena = LightsurfArena();
+    const int factor = oversample;
+    const int subsamples = factor * factor;
+    const int width = lightsurf->width;
+    const int texwidth = lightsurf->width / factor;
+    const int texheight = lightsurf->height / factor;
+    const int numtexels = texwidth * texheight;
+    const int center = (factor / 2) * factor + (factor / 2);
+    
+    std::vector<int> &indices = arena->adaptive_indices;
+    std::vector<uint8_t> &refine = arena->adaptive_refine;
+    
+    /* index of subsample sub (row major within the texel) of a texel */
+    const auto FinePoint = [=](int texel, int sub) {
+        const int x = (texel % texwidth) * factor + (sub % factor);
+        const int y = (texel / texwidth) * factor + (sub / factor);
+        return y * width + x;
+    };
+    
+    /* pass 1: the subsample nearest each texel's center */
+    indices.clear();
+    for (int t = 0; t < numtexels; t++) {
+        indices.push_back(FinePoint(t, center));
+    }
+    const lightmapdict_t coarse = LightFace_LightSubset(bsp, face, facesup, lightsurf, indices);
+    
+    for (const lightmap_t &lm : coarse) {
+        if (lm.style == 255)
+            continue;
+        lightmap_t *full = Lightmap_ForStyle(lightmaps, lm.style, lightsurf);
+        for (int t = 0; t < numtexels; t++) {
+            for (int sub = 0; sub < subsamples; sub++) {
+                full->samples[FinePoint(t, sub)] = lm.samples[t];
+            }
         }
-        
-        // removes all transparent pixels by averaging from adjacent pixels
-        fullres = FloodFillTransparent(fullres, oversampled_width, oversampled_height);
-        
-        if (softsamples > 0) {
-            fullres = BoxBlurImage(fullres, oversampled_width, oversampled_height, softsamples);
+        Lightmap_Save(lightmaps, lightsurf, full, lm.style);
+    }
+    
+    /* find the texels to supersample */
+    refine.assign(numtexels, 0);
+    for (int t = 0; t < numtexels; t++) {
+        int numoccluded = 0;
+        for (int sub = 0; sub < subsamples; sub++) {
+            numoccluded += lightsurf->occluded[FinePoint(t, sub)];
         }
-        
-        const std::vector<qvec4f> output_color = IntegerDownsampleImage(fullres, oversampled_width, oversampled_height, oversample);
-        const std::vector<qvec4f> output_dir = (lux ? IntegerDownsampleImage(LightmapNormalsToGLMVector(lightsurf, lm), oversampled_width, oversampled_height, oversample) : *new std::vector<qvec4f>); //mxd. Skip when lux isn't needed
-        
-        // copy from the float buffers to byte buffers in .bsp / .lit / .lux
-        
-        for (int t = 0; t < actual_height; t++) {
-            for (int s = 0; s < actual_width; s++) {
-                const int sampleindex = (t * actual_width) + s;
-                qvec4f color = output_color.at(sampleindex);
+        if (numoccluded > 0 && numoccluded < subsamples) {
+            refine[t] = 1;
+        }
+    }
+    
+    static const int axes[2][2] = { {1, 0}, {0, 1} };
+    for (const lightmap_t &lm : coarse) {
+        if (lm.style == 255)
+            continue;
+        for (int t = 0; t < numtexels; t++) {
+            if (lightsurf->occluded[FinePoint(t, center)])
+                continue;
+            
+            const int tx = t % texwidth;
+            const int ty = t / texwidth;
+            const float brightness = LightSample_Brightness(lm.samples[t].color);
+            
+            for (const auto &axis : axes) {
+                const int x0 = tx - axis[0], y0 = ty - axis[1];
+                const int x1 = tx + axis[0], y1 = ty + axis[1];
+                const int n0 = y0 * texwidth + x0;
+                const int n1 = y1 * texwidth + x1;
+                const bool have0 = x0 >= 0 && y0 >= 0 && !lightsurf->occluded[FinePoint(n0, center)];
+                const bool have1 = x1 < texwidth && y1 < texheight && !lightsurf->occluded[FinePoint(n1, center)];
+                if (!have0 && !have1)
+                    continue;
                 
-                *lit++ = color[0];
-                *lit++ = color[1];
-                *lit++ = color[2];
+                if (!have0 || !have1) {
+                    const int n = have0 ? n0 : n1;
+                    if (fabs(brightness - LightSample_Brightness(lm.samples[n].color)) > 2 * adaptive_threshold) {
+                        refine[t] = 1;
+                        refine[n] = 1;
+                    }
+                    continue;
+                }
                 
-                /* Take the max() of the 3 components to get the value to write to the
-                .bsp lightmap. this avoids issues with some engines
-                that require the lit and internal lightmap to have the same
-                intensity. (MarkV, some QW engines)
-                     
-                This must be max(), see LightNormalize in MarkV 1036.
-                */
-                float light = qmax(qmax(color[0], color[1]), color[2]);
-                if (light < 0) light = 0;
-                if (light > 255) light = 255;
-                *out++ = light;
+                /* the second difference: zero for a linear gradient */
+                const float b0 = LightSample_Brightness(lm.samples[n0].color);
+                const float b1 = LightSample_Brightness(lm.samples[n1].color);
+                if (fabs(brightness - 0.5f * (b0 + b1)) <= adaptive_threshold)
+                    continue;
                 
-                if (lux) {
-                    vec3_t temp;
-                    int v;
-                    const qvec4f &direction = output_dir.at(sampleindex);
-                    temp[0] = qv::dot(qvec3f(direction), vec3_t_to_glm(lightsurf->snormal));
-                    temp[1] = qv::dot(qvec3f(direction), vec3_t_to_glm(lightsurf->tnormal));
-                    temp[2] = qv::dot(qvec3f(direction), vec3_t_to_glm(lightsurf->plane.normal));
-                    
-                    if (!temp[0] && !temp[1] && !temp[2])
-                        VectorSet(temp, 0, 0, 1);
-                    else
-                        VectorNormalize(temp);
-                    
-                    v = (temp[0]+1)*128;  *lux++ = (v>255)?255:v;
-                    v = (temp[1]+1)*128;  *lux++ = (v>255)?255:v;
-                    v = (temp[2]+1)*128;  *lux++ = (v>255)?255:v;
-                }
+                /* the edge is between this texel and the neighbour it differs from most */
+                refine[t] = 1;
+                refine[(fabs(brightness - b0) > fabs(brightness - b1)) ? n0 : n1] = 1;
             }
         }
-}
-
-static void LightFaceShutdown(lightsurf_t *lightsurf)
-{
-    for (auto &lm : lightsurf->lightmapsByStyle) {
-        free(lm.samples);
     }
     
-    free(lightsurf->points);
-    free(lightsurf->normals);
-    free(lightsurf->occlusion);
-    free(lightsurf->occluded);
-    free(lightsurf->realfacenums);
+    /* pass 2: the rest of the subsamples of those texels, pass 1 already has the center */
+    indices.clear();
+    for (int t = 0; t < numtexels; t++) {
+        if (!refine[t])
+            continue;
+        for (int sub = 0; sub < subsamples; sub++) {
+            if (sub != center)
+                indices.push_back(FinePoint(t, sub));
+        }
+    }
+    
+    total_adaptive_texels += numtexels;
+    total_adaptive_refined += static_cast<uint32_t>(indices.size() / (subsamples - 1));
+    
+    if (indices.empty())
+        return;
     
-    delete lightsurf->occlusion_stream;
-    delete lightsurf->intersection_stream;
+    const lightmapdict_t fine = LightFace_LightSubset(bsp, face, facesup, lightsurf, indices);
     
-    delete lightsurf;
+    /* the refined samples replace the copied texel values in every style */
+    for (lightmap_t &lm : *lightmaps) {
+        if (lm.style == 255)
+            continue;
+        for (const int i : indices) {
+            VectorClear(lm.samples[i].color);
+            VectorClear(lm.samples[i].direction);
+        }
+    }
+    for (const lightmap_t &lm : fine) {
+        if (lm.style == 255)
+            continue;
+        lightmap_t *full = Lightmap_ForStyle(lightmaps, lm.style, lightsurf);
+        for (size_t k = 0; k < indices.size(); k++) {
+            full->samples[indices[k]] = lm.samples[k];
+        }
+        Lightmap_Save(lightmaps, lightsurf, full, lm.style);
+    }
 }
 
 /*
  * ============
- * LightFace
+ * LightFace_Begin
+ *
+ * Clears the face's (or facesup's) lightmap info and sets up the thread's
+ * lightsurf for it. Returns nullptr if the face gets no lightmap.
  * ============
  */
-void
-LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globalconfig_t &cfg)
+static lightsurf_t *
+LightFace_Begin(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globalconfig_t &cfg)
 {
     /* Find the correct model offset */
     const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
     if (modelinfo == nullptr) {
-        return;
+        return nullptr;
     }    
     
     /* One extra lightmap is allocated to simplify handling overflow */
@@ -3311,23 +5099,23 @@ LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globa
 
     /* don't bother with degenerate faces */
     if (face->numedges < 3)
-        return;
+        return nullptr;
 
     if (!Face_IsLightmapped(bsp, face))
-        return;
+        return nullptr;
 
     const char *texname = Face_TextureName(bsp, face);
 
     /* don't save lightmaps for "trigger" texture */
     if (!Q_strcasecmp(texname, "trigger"))
-        return;
+        return nullptr;
     
     /* don't save lightmaps for "skip" texture */
     if (!Q_strcasecmp(texname, "skip"))
-        return;
+        return nullptr;
     
     /* all good, this face is going to be lightmapped. */
-    lightsurf_t *lightsurf = new lightsurf_t {};
+    lightsurf_t *lightsurf = LightsurfArena_NewLightsurf();
     lightsurf->cfg = &cfg;
     
     /* if liquid doesn't have the TEX_SPECIAL flag set, the map was qbsp'ed with
@@ -3340,82 +5128,22 @@ LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globa
     
     if (!Lightsurf_Init(modelinfo, face, bsp, lightsurf, facesup)) {
         /* invalid texture axes */
-        return;
+        return nullptr;
     }
-    lightmapdict_t *lightmaps = &lightsurf->lightmapsByStyle;
-
-    /* calculate dirt (ambient occlusion) but don't use it yet */
-    if (dirt_in_use && (debugmode != debugmode_phong))
-        LightFace_CalculateDirt(lightsurf);
-
-    /*
-     * The lighting procedure is: cast all positive lights, fix
-     * minlight levels, then cast all negative lights. Finally, we
-     * clamp any values that may have gone negative.
-     */
-
-    if (debugmode == debugmode_none) {
-        
-        total_samplepoints += lightsurf->numpoints;
-
-        const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
-
-        /* positive lights */
-        if (!(modelinfo->lightignore.boolValue()
-              || (extended_flags.extended & TEX_EXFLAG_LIGHTIGNORE) != 0)) {
-            for (const auto &entity : GetLights())
-            {
-                if (entity.getFormula() == LF_LOCALMIN)
-                    continue;
-                if (entity.nostaticlight.boolValue())
-                    continue;
-                if (entity.light.floatValue() > 0)
-                    LightFace_Entity(bsp, &entity, lightsurf, lightmaps);
-            }
-            for ( const sun_t &sun : GetSuns() )
-                if (sun.sunlight > 0)
-                    LightFace_Sky (&sun, lightsurf, lightmaps);
-
-            //mxd. Add surface lights...
-            LightFace_SurfaceLight(lightsurf, lightmaps);
-
-            /* add indirect lighting */
-            LightFace_Bounce(bsp, face, lightsurf, lightmaps);
-        }
-        
-        /* minlight - Use Q2 surface light, or the greater of global or model minlight. */
-        const gtexinfo_t *texinfo = Face_Texinfo(bsp, face); //mxd. Surface lights...
-        if (texinfo != nullptr && texinfo->value > 0 && texinfo->flags.native & Q2_SURF_LIGHT) {
-            vec3_t color;
-            Face_LookupTextureColor(bsp, face, color);
-            LightFace_Min(bsp, face, color, texinfo->value * 2.0f, lightsurf, lightmaps); // Playing by the eye here... 2.0 == 256 / 128; 128 is the light value, at which the surface is renered fullbright, when using arghrad3
-        } else if (lightsurf->minlight > cfg.minlight.floatValue()) {
-            LightFace_Min(bsp, face, lightsurf->minlight_color, lightsurf->minlight, lightsurf, lightmaps);
-        } else {
-            const float light = cfg.minlight.floatValue();
-            vec3_t color;
-            VectorCopy(*cfg.minlight_color.vec3Value(), color);
-            
-            LightFace_Min(bsp, face, color, light, lightsurf, lightmaps);
-        }
+    return lightsurf;
+}
 
-        /* negative lights */
-        if (!(modelinfo->lightignore.boolValue()
-              || (extended_flags.extended & TEX_EXFLAG_LIGHTIGNORE) != 0)) {
-            for (const auto &entity : GetLights())
-            {
-                if (entity.getFormula() == LF_LOCALMIN)
-                    continue;
-                if (entity.nostaticlight.boolValue())
-                    continue;
-                if (entity.light.floatValue() < 0)
-                    LightFace_Entity(bsp, &entity, lightsurf, lightmaps);
-            }
-            for (const sun_t &sun : GetSuns())
-                if (sun.sunlight < 0)
-                    LightFace_Sky (&sun, lightsurf, lightmaps);
-        }
-    }
+/*
+ * ============
+ * LightFace_End
+ *
+ * Debug overrides, gamma / rangescale, and writing the lightmaps out.
+ * ============
+ */
+static void
+LightFace_End(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, lightsurf_t *lightsurf)
+{
+    lightmapdict_t *lightmaps = &lightsurf->lightmapsByStyle;
     
     /* bounce debug */
     // TODO: add a BounceDebug function that clear the lightmap to make the code more clear
@@ -3442,6 +5170,226 @@ LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globa
     LightFace_ScaleAndClamp(lightsurf, lightmaps);
     
     WriteLightmaps(bsp, face, facesup, lightsurf, lightmaps);
+}
+
+static void
+LightFace_LightAll(const mbsp_t *bsp, const bsp2_dface_t *face, const facesup_t *facesup, lightsurf_t *lightsurf)
+{
+    lightmapdict_t *lightmaps = &lightsurf->lightmapsByStyle;
+    
+    if (adaptive && oversample > 1 && debugmode == debugmode_none)
+        LightFace_Adaptive(bsp, face, facesup, lightsurf, lightmaps);
+    else
+        LightFace_Lights(bsp, face, facesup, lightsurf, lightmaps, true);
+}
+
+/*
+ * ============
+ * LightFace
+ * ============
+ */
+void
+LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globalconfig_t &cfg)
+{
+    lightsurf_t *lightsurf = LightFace_Begin(bsp, face, facesup, cfg);
+    if (!lightsurf)
+        return;
+    
+    LightFace_LightAll(bsp, face, facesup, lightsurf);
+    LightFace_End(bsp, face, facesup, lightsurf);
+}
+
+/*
+ * ============
+ * LightFace_MultiScale
+ *
+ * Lights a face whose facesup_t has a different lightmap scale than the
+ * face itself. Only the finer lightmap is traced; each coarse texel is box
+ * filtered from the fine texels its footprint overlaps, weighted by the
+ * overlap, so any ratio of scales works. Without -extra the coarse texel is
+ * a point sample, so it copies the fine texel at the same spot if there is
+ * one. Coarse texels that aren't covered that way, or only see occluded
+ * fine texels, are traced. This removes most of the coarse pass, but that
+ * pass only has 1/ratio^2 of the fine one's texels, so the saving is far
+ * less than half.
+ * ============
+ */
+void
+LightFace_MultiScale(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globalconfig_t &cfg)
+{
+    const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
+    if (modelinfo == nullptr)
+        return;
+    
+    const bool supisfine = facesup->lmscale < modelinfo->lightmapscale;
+    const float ratio = supisfine ? (modelinfo->lightmapscale / facesup->lmscale) : (facesup->lmscale / modelinfo->lightmapscale);
+    
+    if (debugmode != debugmode_none || ratio < 1.001f) {
+        LightFace(bsp, face, nullptr, cfg);
+        LightFace(bsp, face, facesup, cfg);
+        return;
+    }
+    
+    facesup_t *finesup = supisfine ? facesup : nullptr;
+    facesup_t *coarsesup = supisfine ? nullptr : facesup;
+    
+    lightsurf_t *lightsurf = LightFace_Begin(bsp, face, finesup, cfg);
+    if (!lightsurf) {
+        // same outcome for the coarse scale, this just clears its lightmap info
+        LightFace(bsp, face, coarsesup, cfg);
+        return;
+    }
+    
+    LightFace_LightAll(bsp, face, finesup, lightsurf);
+    
+    /* keep one linear sample per fine texel (the mean of its unoccluded subsamples) */
+    lightsurf_arena_t *arena = LightsurfArena();
+    std::vector<int> &styles = arena->multiscale_styles;
+    std::vector<lightsample_t> &texels = arena->multiscale_texels;
+    std::vector<uint8_t> &valid = arena->multiscale_valid;
+    
+    const int finetexmins[2] = { lightsurf->texmins[0], lightsurf->texmins[1] };
+    const int finewidth = lightsurf->texsize[0] + 1;
+    const int fineheight = lightsurf->texsize[1] + 1;
+    const int numfinetexels = finewidth * fineheight;
+    
+    const auto SubsamplePoint = [](const lightsurf_t *surf, int texel, int sub) {
+        const int texwidth = surf->texsize[0] + 1;
+        const int x = (texel % texwidth) * oversample + (sub % oversample);
+        const int y = (texel / texwidth) * oversample + (sub / oversample);
+        return y * surf->width + x;
+    };
+    const int subsamples = oversample * oversample;
+    
+    valid.assign(numfinetexels, 0);
+    for (int t = 0; t < numfinetexels; t++) {
+        for (int sub = 0; sub < subsamples; sub++) {
+            if (!lightsurf->occluded[SubsamplePoint(lightsurf, t, sub)]) {
+                valid[t] = 1;
+                break;
+            }
+        }
+    }
+    
+    styles.clear();
+    texels.clear();
+    for (const lightmap_t &lm : lightsurf->lightmapsByStyle) {
+        if (lm.style == 255)
+            continue;
+        styles.push_back(lm.style);
+        for (int t = 0; t < numfinetexels; t++) {
+            lightsample_t mean {};
+            int count = 0;
+            for (int sub = 0; sub < subsamples; sub++) {
+                const int i = SubsamplePoint(lightsurf, t, sub);
+                if (lightsurf->occluded[i])
+                    continue;
+                VectorAdd(mean.color, lm.samples[i].color, mean.color);
+                VectorAdd(mean.direction, lm.samples[i].direction, mean.direction);
+                count++;
+            }
+            if (count > 1) {
+                VectorScale(mean.color, 1.0f / count, mean.color);
+                VectorScale(mean.direction, 1.0f / count, mean.direction);
+            }
+            texels.push_back(mean);
+        }
+    }
+    
+    LightFace_End(bsp, face, finesup, lightsurf);
+    
+    /* the coarse lightsurf reuses the thread's buffers, so the fine one is gone from here on */
+    lightsurf = LightFace_Begin(bsp, face, coarsesup, cfg);
+    if (!lightsurf)
+        return;
+    
+    /*
+     * Fine texels along one axis under the coarse texel at fine grid position
+     * p, and how much of each the footprint covers. The footprint is a point
+     * without oversampling, which only matches a fine texel if p is on the grid.
+     */
+    std::vector<float> weightsx, weightsy;
+    const auto Footprint = [&](float p, int finesize, int *first, std::vector<float> *weights) {
+        weights->clear();
+        if (oversample == 1) {
+            const int nearest = static_cast<int>(floor(p + 0.5f));
+            *first = nearest;
+            if (fabs(p - nearest) < 0.01f && nearest >= 0 && nearest < finesize)
+                weights->push_back(1.0f);
+            return;
+        }
+        const float half = ratio * 0.5f;
+        *first = qmax(0, static_cast<int>(ceil(p - half - 0.5f)));
+        const int last = qmin(finesize - 1, static_cast<int>(floor(p + half + 0.5f)));
+        for (int x = *first; x <= last; x++)
+            weights->push_back(qmax(0.0f, qmin(x + 0.5f, p + half) - qmax(x - 0.5f, p - half)));
+    };
+    
+    const int coarsewidth = lightsurf->texsize[0] + 1;
+    const int numcoarsetexels = coarsewidth * (lightsurf->texsize[1] + 1);
+    std::vector<int> &indices = arena->adaptive_indices;
+    indices.clear();
+    
+    for (int t = 0; t < numcoarsetexels; t++) {
+        // position of the coarse texel on the fine grid
+        int firstx, firsty;
+        Footprint(ratio * (lightsurf->texmins[0] + t % coarsewidth) - finetexmins[0], finewidth, &firstx, &weightsx);
+        Footprint(ratio * (lightsurf->texmins[1] + t / coarsewidth) - finetexmins[1], fineheight, &firsty, &weightsy);
+        
+        float totalweight = 0;
+        for (size_t dy = 0; dy < weightsy.size(); dy++) {
+            for (size_t dx = 0; dx < weightsx.size(); dx++) {
+                if (valid[(firsty + dy) * finewidth + firstx + dx])
+                    totalweight += weightsx[dx] * weightsy[dy];
+            }
+        }
+        
+        if (totalweight <= 0) {
+            for (int sub = 0; sub < subsamples; sub++)
+                indices.push_back(SubsamplePoint(lightsurf, t, sub));
+            continue;
+        }
+        
+        for (size_t s = 0; s < styles.size(); s++) {
+            const lightsample_t *finestyle = &texels[s * numfinetexels];
+            lightsample_t filtered {};
+            for (size_t dy = 0; dy < weightsy.size(); dy++) {
+                for (size_t dx = 0; dx < weightsx.size(); dx++) {
+                    const int fine = (firsty + dy) * finewidth + firstx + dx;
+                    if (!valid[fine])
+                        continue;
+                    const float weight = weightsx[dx] * weightsy[dy] / totalweight;
+                    VectorMA(filtered.color, weight, finestyle[fine].color, filtered.color);
+                    VectorMA(filtered.direction, weight, finestyle[fine].direction, filtered.direction);
+                }
+            }
+            
+            lightmap_t *lm = Lightmap_ForStyle(&lightsurf->lightmapsByStyle, styles[s], lightsurf);
+            for (int sub = 0; sub < subsamples; sub++)
+                lm->samples[SubsamplePoint(lightsurf, t, sub)] = filtered;
+            Lightmap_Save(&lightsurf->lightmapsByStyle, lightsurf, lm, styles[s]);
+        }
+        
+        // the filtered value already accounts for occlusion, keep WriteLightmaps from flood filling over it
+        for (int sub = 0; sub < subsamples; sub++)
+            lightsurf->occluded[SubsamplePoint(lightsurf, t, sub)] = false;
+    }
+    
+    total_multiscale_texels += numcoarsetexels;
+    total_multiscale_traced += static_cast<uint32_t>(indices.size() / subsamples);
+    
+    if (!indices.empty()) {
+        const lightmapdict_t traced = LightFace_LightSubset(bsp, face, coarsesup, lightsurf, indices);
+        for (const lightmap_t &lm : traced) {
+            if (lm.style == 255)
+                continue;
+            lightmap_t *full = Lightmap_ForStyle(&lightsurf->lightmapsByStyle, lm.style, lightsurf);
+            for (size_t k = 0; k < indices.size(); k++) {
+                full->samples[indices[k]] = lm.samples[k];
+            }
+            Lightmap_Save(&lightsurf->lightmapsByStyle, lightsurf, full, lm.style);
+        }
+    }
     
-    LightFaceShutdown(lightsurf);
+    LightFace_End(bsp, face, coarsesup, lightsurf);
 }
@@ -39,9 +39,22 @@
 #include <string>
 
 #include <common/qvec.hh>
+#include <common/aabb.hh>
+#include <common/threads.hh>
 
 using namespace std;
 
+static const bsp2_dface_t *s_faces;                 // bsp->dfaces, for face pointer -> face number
+
+static inline int
+FaceIndex(const bsp2_dface_t *face)
+{
+    return static_cast<int>(face - s_faces);
+}
+
+/* face bounds grown by 1 unit, keyed by face number; lets FacesOverlappingEdge_r skip distant faces */
+static std::vector<aabb3f> faceBounds;
+
 static neighbour_t
 FaceOverlapsEdge(const vec3_t p0, const vec3_t p1, const mbsp_t *bsp, const bsp2_dface_t *f)
 {
@@ -59,7 +72,7 @@ FaceOverlapsEdge(const vec3_t p0, const vec3_t p1, const mbsp_t *bsp, const bsp2
 }
 
 static void
-FacesOverlappingEdge_r(const vec3_t p0, const vec3_t p1, const mbsp_t *bsp, int nodenum, vector<neighbour_t> *result)
+FacesOverlappingEdge_r(const vec3_t p0, const vec3_t p1, const aabb3f &edgebounds, const mbsp_t *bsp, int nodenum, vector<neighbour_t> *result)
 {
     if (nodenum < 0) {
         // we don't do anything for leafs.
@@ -76,6 +89,10 @@ FacesOverlappingEdge_r(const vec3_t p0, const vec3_t p1, const mbsp_t *bsp, int
     	// check all faces on this node.
         for (int i=0; i<node->numfaces; i++) {
             const bsp2_dface_t *face = BSP_GetFace(bsp, node->firstface + i);
+            if (!faceBounds.empty() && faceBounds[node->firstface + i].disjoint(edgebounds)) {
+                // LinesOverlap needs an edge of `face` within ON_EPSILON of p0-p1
+                continue;
+            }
             const auto neighbour = FaceOverlapsEdge(p0, p1, bsp, face);
             if (neighbour.face != nullptr) {
                 result->push_back(neighbour);
@@ -88,12 +105,12 @@ FacesOverlappingEdge_r(const vec3_t p0, const vec3_t p1, const mbsp_t *bsp, int
     // It could be on this plane, but also on some other plane further down
     // the front (or back) side.
     if (p0dist > -0.1 || p1dist > -0.1) {
-        FacesOverlappingEdge_r(p0, p1, bsp, node->children[0], result);
+        FacesOverlappingEdge_r(p0, p1, edgebounds, bsp, node->children[0], result);
     }
     
     // recurse down back
     if (p0dist < 0.1 || p1dist < 0.1) {
-        FacesOverlappingEdge_r(p0, p1, bsp, node->children[1], result);
+        FacesOverlappingEdge_r(p0, p1, edgebounds, bsp, node->children[1], result);
     }
 }
 
@@ -105,7 +122,8 @@ vector<neighbour_t>
 FacesOverlappingEdge(const vec3_t p0, const vec3_t p1, const mbsp_t *bsp, const dmodel_t *model)
 {
     vector<neighbour_t> result;
-    FacesOverlappingEdge_r(p0, p1, bsp, model->headnode[0], &result);
+    const aabb3f edgebounds = aabb3f(vec3_t_to_glm(p0), vec3_t_to_glm(p0)).expand(vec3_t_to_glm(p1));
+    FacesOverlappingEdge_r(p0, p1, edgebounds, bsp, model->headnode[0], &result);
     return result;
 }
 
@@ -172,77 +190,99 @@ AngleBetweenPoints(const qvec3f &p1, const qvec3f &p2, const qvec3f &p3)
 }
 
 static bool s_builtPhongCaches;
-static std::map<const bsp2_dface_t *, std::vector<qvec3f>> vertex_normals;
-static std::set<int> interior_verts;
-static map<const bsp2_dface_t *, set<const bsp2_dface_t *>> smoothFaces;
-static map<int, vector<const bsp2_dface_t *>> vertsToFaces;
-static map<int, vector<const bsp2_dface_t *>> planesToFaces;
-static edgeToFaceMap_t EdgeToFaceMap;
+
+/*
+ * The phong lookup tables are stored flat (CSR-style): the entries for key i
+ * are items[offsets[i]] .. items[offsets[i + 1] - 1]. Face lists are kept in
+ * face number order, which is also the order the std::set/std::map versions
+ * of these tables used to iterate in, so the smoothed normals come out the same.
+ */
+static std::vector<int> planeFacesOffsets;          // keyed by plane number
+static std::vector<const bsp2_dface_t *> planeFaces;
+static std::vector<int> vertFacesOffsets;           // keyed by vertex number
+static std::vector<const bsp2_dface_t *> vertFaces;
+static std::vector<int> smoothFacesOffsets;         // keyed by face number
+static std::vector<const bsp2_dface_t *> smoothFaces;
+
+/// directed edge (v0 -> v1), v0 is the key of the table it is stored in
+struct edge_face_t {
+    int v1;
+    const bsp2_dface_t *face;
+};
+static std::vector<int> edgeFacesOffsets;           // keyed by v0
+static std::vector<edge_face_t> edgeFaces;
+
+static std::vector<int> faceVertsOffsets;           // keyed by face number
+static std::vector<qvec3f> vertex_normals;          // indexed through faceVertsOffsets
+static std::vector<uint8_t> interior_verts;         // keyed by vertex number
 static vector<face_cache_t> FaceCache;
 
-vector<const bsp2_dface_t *> FacesUsingVert(int vertnum)
+static face_span_t
+FaceSpan(const std::vector<int> &offsets, const std::vector<const bsp2_dface_t *> &items, int key)
 {
-    const auto &vertsToFaces_const = vertsToFaces;
+    if (key < 0 || key + 1 >= static_cast<int>(offsets.size()))
+        return {};
     
-    auto it = vertsToFaces_const.find(vertnum);
-    if (it != vertsToFaces_const.end())
-        return it->second;
-    return {};
+    const bsp2_dface_t *const *base = items.data();
+    return face_span_t(base + offsets[key], base + offsets[key + 1]);
 }
 
-const edgeToFaceMap_t &GetEdgeToFaceMap()
+/* converts per-key counts (stored at offsets[key + 1]) into offsets */
+static void
+CountsToOffsets(std::vector<int> &offsets)
 {
-    Q_assert(s_builtPhongCaches);
-    return EdgeToFaceMap;
+    for (size_t i = 1; i < offsets.size(); i++) {
+        offsets[i] += offsets[i - 1];
+    }
+}
+
+face_span_t FacesUsingVert(int vertnum)
+{
+    return FaceSpan(vertFacesOffsets, vertFaces, vertnum);
 }
 
-// Uses `smoothFaces` static var
 bool FacesSmoothed(const bsp2_dface_t *f1, const bsp2_dface_t *f2)
 {
     Q_assert(s_builtPhongCaches);
     
-    const auto &facesIt = smoothFaces.find(f1);
-    if (facesIt == smoothFaces.end())
-        return false;
-    
-    const set<const bsp2_dface_t *> &faceSet = facesIt->second;
-    if (faceSet.find(f2) == faceSet.end())
-        return false;
-    
-    return true;
+    // the face lists are sorted, and all faces live in the one bsp->dfaces array
+    const face_span_t faces = GetSmoothFaces(f1);
+    return std::binary_search(faces.begin(), faces.end(), f2);
 }
 
-const std::set<const bsp2_dface_t *> &GetSmoothFaces(const bsp2_dface_t *face)
+face_span_t GetSmoothFaces(const bsp2_dface_t *face)
 {
     Q_assert(s_builtPhongCaches);
     
-    static std::set<const bsp2_dface_t *> empty;
-    const auto it = smoothFaces.find(face);
-    
-    if (it == smoothFaces.end())
-        return empty;
-    
-    return it->second;
+    return FaceSpan(smoothFacesOffsets, smoothFaces, FaceIndex(face));
 }
 
-const std::vector<const bsp2_dface_t *> &GetPlaneFaces(const bsp2_dface_t *face)
+face_span_t GetPlaneFaces(const bsp2_dface_t *face)
 {
     Q_assert(s_builtPhongCaches);
     
-    static std::vector<const bsp2_dface_t *> empty;
-    const auto it = planesToFaces.find(face->planenum);
-    
-    if (it == planesToFaces.end())
-        return empty;
-    
-    return it->second;
+    return FaceSpan(planeFacesOffsets, planeFaces, face->planenum);
 }
 
 
+/* global vertex index -> smoothed normal, for the handful of verts around one face */
+using smoothed_normals_t = std::vector<std::pair<int, qvec3f>>;
+
+static qvec3f &
+SmoothedNormalForVert(smoothed_normals_t &smoothed_normals, int v)
+{
+    for (auto &pair : smoothed_normals) {
+        if (pair.first == v)
+            return pair.second;
+    }
+    smoothed_normals.emplace_back(v, qvec3f(0,0,0));
+    return smoothed_normals.back().second;
+}
+
 /* given a triangle, just adds the contribution from the triangle to the given vertexes normals, based upon angles at the verts.
  * v1, v2, v3 are global vertex indices */
 static void
-AddTriangleNormals(std::map<int, qvec3f> &smoothed_normals, const qvec3f &norm, const mbsp_t *bsp, int v1, int v2, int v3)
+AddTriangleNormals(smoothed_normals_t &smoothed_normals, const qvec3f &norm, const mbsp_t *bsp, int v1, int v2, int v3)
 {
     const qvec3f p1 = Vertex_GetPos_E(bsp, v1);
     const qvec3f p2 = Vertex_GetPos_E(bsp, v2);
@@ -256,38 +296,37 @@ AddTriangleNormals(std::map<int, qvec3f> &smoothed_normals, const qvec3f &norm,
     
     weight = AngleBetweenPoints(p2, p1, p3);
     weight *= areaweight;
-    smoothed_normals[v1] = smoothed_normals[v1] + (norm * weight);
+    qvec3f &n1 = SmoothedNormalForVert(smoothed_normals, v1);
+    n1 = n1 + (norm * weight);
 
     weight = AngleBetweenPoints(p1, p2, p3);
     weight *= areaweight;
-    smoothed_normals[v2] = smoothed_normals[v2] + (norm * weight);
+    qvec3f &n2 = SmoothedNormalForVert(smoothed_normals, v2);
+    n2 = n2 + (norm * weight);
 
     weight = AngleBetweenPoints(p1, p3, p2);
     weight *= areaweight;
-    smoothed_normals[v3] = smoothed_normals[v3] + (norm * weight);
+    qvec3f &n3 = SmoothedNormalForVert(smoothed_normals, v3);
+    n3 = n3 + (norm * weight);
 }
 
 /* access the final phong-shaded vertex normal */
 const qvec3f GetSurfaceVertexNormal(const mbsp_t *bsp, const bsp2_dface_t *f, const int vertindex)
 {
     Q_assert(s_builtPhongCaches);
+    Q_assert(vertindex >= 0 && vertindex < f->numedges);
     
-    // handle degenerate faces
-    const auto it = vertex_normals.find(f);
-    if (it == vertex_normals.end()) {
-        return qvec3f(0,0,0);
-    }
-    const auto &face_normals_vec = it->second;
-    return face_normals_vec.at(vertindex);
+    // degenerate faces have all-zero normals
+    return vertex_normals[faceVertsOffsets[FaceIndex(f)] + vertindex];
 }
 
 static bool
-FacesOnSamePlane(const std::vector<const bsp2_dface_t *> &faces)
+FacesOnSamePlane(const face_span_t &faces)
 {
     if (faces.empty()) {
         return false;
     }
-    const int32_t planenum = faces.at(0)->planenum;
+    const int32_t planenum = faces[0]->planenum;
     for (auto face : faces) {
         if (face->planenum != planenum) {
             return false;
@@ -304,101 +343,104 @@ Face_EdgeIndexSmoothed(const mbsp_t *bsp, const bsp2_dface_t *f, const int edgei
     const int v0 = Face_VertexAtIndex(bsp, f, edgeindex);
     const int v1 = Face_VertexAtIndex(bsp, f, (edgeindex + 1) % f->numedges);
 
-    auto it = EdgeToFaceMap.find(make_pair(v1, v0));
-    if (it != EdgeToFaceMap.end()) {
-        for (const bsp2_dface_t *neighbour : it->second) {
-            if (neighbour == f) {
-                // Invalid face, e.g. with vertex numbers: [0, 1, 0, 2]
-                continue;
-            }
-
-            const bool sameplane = (neighbour->planenum == f->planenum
-                                    && neighbour->side == f->side);
+    // look for faces using the reverse edge, v1 -> v0
+    for (int i = edgeFacesOffsets[v1]; i < edgeFacesOffsets[v1 + 1]; i++) {
+        const edge_face_t &edge = edgeFaces[i];
+        if (edge.v1 != v0)
+            continue;
+        
+        const bsp2_dface_t *neighbour = edge.face;
+        if (neighbour == f) {
+            // Invalid face, e.g. with vertex numbers: [0, 1, 0, 2]
+            continue;
+        }
 
-            // Check if these faces are smoothed or on the same plane
-            if (!(FacesSmoothed(f, neighbour) || sameplane)) {
-                continue;
-            }
+        const bool sameplane = (neighbour->planenum == f->planenum
+                                && neighbour->side == f->side);
 
-            return neighbour;
+        // Check if these faces are smoothed or on the same plane
+        if (!(FacesSmoothed(f, neighbour) || sameplane)) {
+            continue;
         }
+
+        return neighbour;
     }
     return nullptr;
+}
+
+/**
+ * Returns true if edge j of f is skipped by the "directed edge -> faces" table:
+ * repeated verts (ad_swampy.bsp has faces with those), or the same directed
+ * edge appearing earlier on the same face.
+ */
+static bool
+Face_EdgeIsDegenerate(const mbsp_t *bsp, const bsp2_dface_t *f, int j)
+{
+    const int v0 = Face_VertexAtIndex(bsp, f, j);
+    const int v1 = Face_VertexAtIndex(bsp, f, (j + 1) % f->numedges);
     
-#if 0
-    if (smoothFaces.find(f) == smoothFaces.end()) {
-        return nullptr;
-    }
-    
-    int v0 = Face_VertexAtIndex(bsp, f, edgeindex);
-    int v1 = Face_VertexAtIndex(bsp, f, (edgeindex + 1) % f->numedges);
-    
-    const auto &v0_faces = vertsToFaces.at(v0);
-    const auto &v1_faces = vertsToFaces.at(v1);
+    if (v0 == v1)
+        return true;
     
-    // find a face f2 that has both verts v0 and v1
-    for (auto f2 : v0_faces) {
-        if (f2 == f)
-            continue;
-        if (find(v1_faces.begin(), v1_faces.end(), f2) != v1_faces.end()) {
-            const auto &f_smoothfaces = smoothFaces.at(f);
-            bool smoothed = (f_smoothfaces.find(f2) != f_smoothfaces.end());
-            return smoothed ? f2 : nullptr;
+    for (int k = 0; k < j; k++) {
+        if (Face_VertexAtIndex(bsp, f, k) == v0
+            && Face_VertexAtIndex(bsp, f, (k + 1) % f->numedges) == v1) {
+            return true;
         }
     }
-    return nullptr;
-#endif
+    return false;
 }
 
-static edgeToFaceMap_t MakeEdgeToFaceMap(const mbsp_t *bsp)
+/*
+ * Builds the plane -> faces, vert -> faces and directed edge -> faces tables
+ * with counting sorts over the faces in order, so each face list comes out
+ * sorted by face number.
+ */
+static void
+MakeFaceTables(const mbsp_t *bsp)
 {
-    edgeToFaceMap_t result;
+    planeFacesOffsets.assign(bsp->numplanes + 1, 0);
+    vertFacesOffsets.assign(bsp->numvertexes + 1, 0);
+    edgeFacesOffsets.assign(bsp->numvertexes + 1, 0);
+    faceVertsOffsets.assign(bsp->numfaces + 1, 0);
     
     for (int i = 0; i < bsp->numfaces; i++) {
         const bsp2_dface_t *f = BSP_GetFace(bsp, i);
-        
-        // walk edges
+        planeFacesOffsets[f->planenum + 1]++;
+        faceVertsOffsets[i + 1] = f->numedges;
         for (int j = 0; j < f->numedges; j++) {
-            const int v0 = Face_VertexAtIndex(bsp, f, j);
-            const int v1 = Face_VertexAtIndex(bsp, f, (j + 1) % f->numedges);
-            
-            if (v0 == v1) {
-                // ad_swampy.bsp has faces with repeated verts...
-                continue;
-            }
-            
-            const auto edge = make_pair(v0, v1);
-            auto &edgeFacesRef = result[edge];
-            
-            if (find(begin(edgeFacesRef), end(edgeFacesRef), f) != end(edgeFacesRef)) {
-                // another sort of degenerate face where the same edge A->B appears more than once on the face
-                continue;
+            const int v = Face_VertexAtIndex(bsp, f, j);
+            vertFacesOffsets[v + 1]++;
+            if (!Face_EdgeIsDegenerate(bsp, f, j)) {
+                edgeFacesOffsets[v + 1]++;
             }
-            edgeFacesRef.push_back(f);
         }
     }
+    CountsToOffsets(planeFacesOffsets);
+    CountsToOffsets(vertFacesOffsets);
+    CountsToOffsets(edgeFacesOffsets);
+    CountsToOffsets(faceVertsOffsets);
     
-    return result;
-}
-
-static vector<qvec3f> Face_VertexNormals(const mbsp_t *bsp, const bsp2_dface_t *face)
-{
-    vector<qvec3f> normals;
-    for (int i=0; i<face->numedges; i++) {
-        const qvec3f n = GetSurfaceVertexNormal(bsp, face, i);
-        normals.push_back(n);
-    }
-    return normals;
-}
-
-static vector<face_cache_t> MakeFaceCache(const mbsp_t *bsp)
-{
-    vector<face_cache_t> result;
-    for (int i=0; i<bsp->numfaces; i++) {
-        const bsp2_dface_t *face = BSP_GetFace(bsp, i);
-        result.push_back(face_cache_t{bsp, face, Face_VertexNormals(bsp, face)});
+    planeFaces.resize(planeFacesOffsets.back());
+    vertFaces.resize(vertFacesOffsets.back());
+    edgeFaces.resize(edgeFacesOffsets.back());
+    
+    std::vector<int> planeCursor(planeFacesOffsets.begin(), planeFacesOffsets.end() - 1);
+    std::vector<int> vertCursor(vertFacesOffsets.begin(), vertFacesOffsets.end() - 1);
+    std::vector<int> edgeCursor(edgeFacesOffsets.begin(), edgeFacesOffsets.end() - 1);
+    
+    for (int i = 0; i < bsp->numfaces; i++) {
+        const bsp2_dface_t *f = BSP_GetFace(bsp, i);
+        planeFaces[planeCursor[f->planenum]++] = f;
+        for (int j = 0; j < f->numedges; j++) {
+            const int v = Face_VertexAtIndex(bsp, f, j);
+            vertFaces[vertCursor[v]++] = f;
+            if (!Face_EdgeIsDegenerate(bsp, f, j)) {
+                const int v1 = Face_VertexAtIndex(bsp, f, (j + 1) % f->numedges);
+                edgeFaces[edgeCursor[v]++] = edge_face_t { v1, f };
+            }
+        }
     }
-    return result;
 }
 
 /**
@@ -416,79 +458,29 @@ static int Q2_FacePhongValue(const mbsp_t *bsp, const bsp2_dface_t *face) {
     return 0;
 }
 
-void
-CalculateVertexNormals(const mbsp_t *bsp)
+/* returns the faces sharing a vertex with f that f should be smoothed with, sorted by face number */
+static std::vector<const bsp2_dface_t *>
+Face_FindSmoothFaces(const mbsp_t *bsp, const bsp2_dface_t *f,
+                     const std::vector<qvec3f> &faceNormals, const std::vector<qvec3f> &faceCentroids)
 {
-    logprint("--- %s ---\n", __func__);
-
-    Q_assert(!s_builtPhongCaches);
-    s_builtPhongCaches = true;
-    
-    EdgeToFaceMap = MakeEdgeToFaceMap(bsp);
-    
-    // read _phong and _phong_angle from entities for compatiblity with other qbsp's, at the expense of no
-    // support on func_detail/func_group
-    for (int i=0; i<bsp->nummodels; i++) {
-        const modelinfo_t *info = ModelInfoForModel(bsp, i);
-        const uint8_t phongangle_byte = (uint8_t) qmax(0, qmin(255, (int)rint(info->getResolvedPhongAngle())));
-
-        if (!phongangle_byte)
-            continue;
-        
-        for (int j=info->model->firstface; j < info->model->firstface + info->model->numfaces; j++) {
-            const bsp2_dface_t *f = BSP_GetFace(bsp, j);
-            
-            extended_texinfo_flags[f->texinfo].phong_angle = phongangle_byte;
-        }
-    }
+    std::vector<const bsp2_dface_t *> result;
     
-    // build "plane -> faces" map
-    for (int i = 0; i < bsp->numfaces; i++) {
-        const bsp2_dface_t *f = BSP_GetFace(bsp, i);
-        planesToFaces[f->planenum].push_back(f);
+    // any face normal within this many degrees can be smoothed with this face
+    const int f_phong_angle = extended_texinfo_flags[f->texinfo].phong_angle;
+    int f_phong_angle_concave = extended_texinfo_flags[f->texinfo].phong_angle_concave;
+    if (f_phong_angle_concave == 0) {
+        f_phong_angle_concave = f_phong_angle;
     }
+    const bool f_wants_phong = (f_phong_angle || f_phong_angle_concave);
     
-    // build "vert index -> faces" map
-    for (int i = 0; i < bsp->numfaces; i++) {
-        const bsp2_dface_t *f = BSP_GetFace(bsp, i);
-        for (int j = 0; j < f->numedges; j++) {
-            const int v = Face_VertexAtIndex(bsp, f, j);
-            vertsToFaces[v].push_back(f);
-        }
-    }
-    
-    // track "interior" verts, these are in the middle of a face, and mess up normal interpolation
-    for (int i=0; i<bsp->numvertexes; i++) {
-        auto &faces = vertsToFaces[i];
-        if (faces.size() > 1 && FacesOnSamePlane(faces)) {
-            interior_verts.insert(i);
-        }
-    }
-    //printf("CalculateVertexNormals: %d interior verts\n", (int)interior_verts.size());
-    
-    // build the "face -> faces to smooth with" map
-    for (int i = 0; i < bsp->numfaces; i++) {
-        const bsp2_dface_t *f = BSP_GetFace(const_cast<mbsp_t *>(bsp), i);
-        
-        const auto f_points = GLM_FacePoints(bsp, f);
-        const qvec3f f_norm = Face_Normal_E(bsp, f);
+    if (f_wants_phong) {
+        const qvec3f &f_norm = faceNormals[FaceIndex(f)];
         const qplane3f f_plane = Face_Plane_E(bsp, f);
         
-        // any face normal within this many degrees can be smoothed with this face
-        const int f_phong_angle = extended_texinfo_flags[f->texinfo].phong_angle;
-        int f_phong_angle_concave = extended_texinfo_flags[f->texinfo].phong_angle_concave;
-        if (f_phong_angle_concave == 0) {
-            f_phong_angle_concave = f_phong_angle;
-        }
-        const bool f_wants_phong = (f_phong_angle || f_phong_angle_concave);
-        
-        if (!f_wants_phong)
-            continue;
-        
         for (int j = 0; j < f->numedges; j++) {
             const int v = Face_VertexAtIndex(bsp, f, j);
             // walk over all faces incident to f (we will walk over neighbours multiple times, doesn't matter)
-            for (const bsp2_dface_t *f2 : vertsToFaces[v]) {
+            for (const bsp2_dface_t *f2 : FacesUsingVert(v)) {
                 if (f2 == f)
                     continue;
                 
@@ -503,9 +495,8 @@ CalculateVertexNormals(const mbsp_t *bsp)
                 if (!f2_wants_phong)
                     continue;
                 
-                const auto f2_points = GLM_FacePoints(bsp, f2);
-                const qvec3f f2_centroid = GLM_PolyCentroid(f2_points);
-                const qvec3f f2_norm = Face_Normal_E(bsp, f2);
+                const qvec3f &f2_centroid = faceCentroids[FaceIndex(f2)];
+                const qvec3f &f2_norm = faceNormals[FaceIndex(f2)];
                 
                 const vec_t cosangle = qv::dot(f_norm, f2_norm);
                 
@@ -517,23 +508,18 @@ CalculateVertexNormals(const mbsp_t *bsp)
 
                 // check the angle between the face normals
                 if (cosangle >= cosmaxangle) {
-                    smoothFaces[f].insert(f2);
+                    result.push_back(f2);
                 }
             }
         }
     }
     
-    // Q2: build the "face -> faces to smooth with" map
-    for (int i = 0; i < bsp->numfaces; i++) {
-        const bsp2_dface_t *f = BSP_GetFace(const_cast<mbsp_t *>(bsp), i);
-        const int f_phongValue = Q2_FacePhongValue(bsp, f);
-        if (f_phongValue == 0)
-            continue;
-
+    // Q2: smooth with faces sharing the same phong value
+    const int f_phongValue = Q2_FacePhongValue(bsp, f);
+    if (f_phongValue != 0) {
         for (int j = 0; j < f->numedges; j++) {
             const int v = Face_VertexAtIndex(bsp, f, j);
-            // walk over all faces incident to f (we will walk over neighbours multiple times, doesn't matter)
-            for (const bsp2_dface_t *f2 : vertsToFaces[v]) {
+            for (const bsp2_dface_t *f2 : FacesUsingVert(v)) {
                 if (f2 == f)
                     continue;
 
@@ -542,14 +528,111 @@ CalculateVertexNormals(const mbsp_t *bsp)
                     continue;
 
                 // we've already checked f_phongValue is nonzero, so smooth these two faces.
-                smoothFaces[f].insert(f2);
+                result.push_back(f2);
             }
         }
     }
+    
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+/* computes the smoothed vertex normals of f, storing them in vertex_normals */
+static void
+Face_SmoothVertexNormals(const mbsp_t *bsp, const bsp2_dface_t *f, const std::vector<qvec3f> &faceNormals)
+{
+    const face_span_t neighboursToSmooth = GetSmoothFaces(f);
+    const qvec3f &f_norm = faceNormals[FaceIndex(f)]; // get the face normal
+    
+    // global vertex index -> smoothed normal
+    smoothed_normals_t smoothedNormals;
+    
+    // walk f and neighboursToSmooth
+    for (size_t k = 0; k <= neighboursToSmooth.size(); k++) {
+        const bsp2_dface_t *f2 = (k == 0) ? f : neighboursToSmooth[k - 1];
+        const qvec3f &f2_norm = faceNormals[FaceIndex(f2)];
+        
+        /* now just walk around the surface as a triangle fan */
+        int v1, v2, v3;
+        v1 = Face_VertexAtIndex(bsp, f2, 0);
+        v2 = Face_VertexAtIndex(bsp, f2, 1);
+        for (int j = 2; j < f2->numedges; j++)
+        {
+            v3 = Face_VertexAtIndex(bsp, f2, j);
+            AddTriangleNormals(smoothedNormals, f2_norm, bsp, v1, v2, v3);
+            v2 = v3;
+        }
+    }
+    
+    // normalize vertex normals (NOTE: updates smoothedNormals)
+    for (auto &pair : smoothedNormals) {
+        const qvec3f vertNormal = pair.second;
+        if (0 == qv::length(vertNormal)) {
+            // this happens when there are colinear vertices, which give zero-area triangles,
+            // so there is no contribution to the normal of the triangle in the middle of the
+            // line. Not really an error, just set it to use the face normal.
+            pair.second = f_norm;
+        }
+        else
+        {
+            pair.second = qv::normalize(vertNormal);
+        }
+    }
+    
+    // sanity check
+    if (neighboursToSmooth.empty()) {
+        for (const auto &vertIndexNormalPair : smoothedNormals) {
+            Q_assert(GLMVectorCompare(vertIndexNormalPair.second, f_norm, EQUAL_EPSILON));
+        }
+    }
+    
+    // now, record all of the smoothed normals that are actually part of `f`
+    qvec3f *out = &vertex_normals[faceVertsOffsets[FaceIndex(f)]];
+    for (int j=0; j<f->numedges; j++) {
+        const int v = Face_VertexAtIndex(bsp, f, j);
+        out[j] = SmoothedNormalForVert(smoothedNormals, v);
+    }
+}
+
+void
+CalculateVertexNormals(const mbsp_t *bsp)
+{
+    logprint("--- %s ---\n", __func__);
+
+    Q_assert(!s_builtPhongCaches);
+    s_builtPhongCaches = true;
+    s_faces = bsp->dfaces;
+    
+    // read _phong and _phong_angle from entities for compatiblity with other qbsp's, at the expense of no
+    // support on func_detail/func_group
+    for (int i=0; i<bsp->nummodels; i++) {
+        const modelinfo_t *info = ModelInfoForModel(bsp, i);
+        const uint8_t phongangle_byte = (uint8_t) qmax(0, qmin(255, (int)rint(info->getResolvedPhongAngle())));
 
-    // finally do the smoothing for each face
-    for (int i = 0; i < bsp->numfaces; i++)
-    {
+        if (!phongangle_byte)
+            continue;
+        
+        for (int j=info->model->firstface; j < info->model->firstface + info->model->numfaces; j++) {
+            const bsp2_dface_t *f = BSP_GetFace(bsp, j);
+            
+            extended_texinfo_flags[f->texinfo].phong_angle = phongangle_byte;
+        }
+    }
+    
+    // build the "plane -> faces", "vert index -> faces" and "edge -> faces" tables
+    MakeFaceTables(bsp);
+    
+    // track "interior" verts, these are in the middle of a face, and mess up normal interpolation
+    interior_verts.assign(bsp->numvertexes, 0);
+    for (int i=0; i<bsp->numvertexes; i++) {
+        const face_span_t faces = FacesUsingVert(i);
+        if (faces.size() > 1 && FacesOnSamePlane(faces)) {
+            interior_verts[i] = 1;
+        }
+    }
+    
+    for (int i = 0; i < bsp->numfaces; i++) {
         const bsp2_dface_t *f = BSP_GetFace(bsp, i);
         if (f->numedges < 3) {
             logprint("%s: face %d is degenerate with %d edges\n", __func__, i, f->numedges);
@@ -558,78 +641,60 @@ CalculateVertexNormals(const mbsp_t *bsp)
                 Face_PointAtIndex(bsp, f, j, pt);
                 logprint("                         vert at %f %f %f\n", pt[0], pt[1], pt[2]);
             }
-            continue;
-        }
-        
-        const auto &neighboursToSmooth = smoothFaces[f];
-        const qvec3f f_norm = Face_Normal_E(bsp, f); // get the face normal
-        
-        // gather up f and neighboursToSmooth
-        std::vector<const bsp2_dface_t *> fPlusNeighbours;
-        fPlusNeighbours.push_back(f);
-        for (auto neighbour : neighboursToSmooth) {
-            fPlusNeighbours.push_back(neighbour);
-        }
-        
-        // global vertex index -> smoothed normal
-        std::map<int, qvec3f> smoothedNormals;
-
-        // walk fPlusNeighbours
-        for (auto f2 : fPlusNeighbours) {
-            const qvec3f f2_norm = Face_Normal_E(bsp, f2);
-            
-            /* now just walk around the surface as a triangle fan */
-            int v1, v2, v3;
-            v1 = Face_VertexAtIndex(bsp, f2, 0);
-            v2 = Face_VertexAtIndex(bsp, f2, 1);
-            for (int j = 2; j < f2->numedges; j++)
-            {
-                v3 = Face_VertexAtIndex(bsp, f2, j);
-                AddTriangleNormals(smoothedNormals, f2_norm, bsp, v1, v2, v3);
-                v2 = v3;
-            }
         }
-        
-        // normalize vertex normals (NOTE: updates smoothedNormals map)
-        for (auto &pair : smoothedNormals) {
-            const int vertIndex = pair.first;
-            const qvec3f vertNormal = pair.second;
-            if (0 == qv::length(vertNormal)) {
-                // this happens when there are colinear vertices, which give zero-area triangles,
-                // so there is no contribution to the normal of the triangle in the middle of the
-                // line. Not really an error, just set it to use the face normal.
-#if 0
-                logprint("Failed to calculate normal for vertex %d at (%f %f %f)\n",
-                         vertIndex,
-                         bsp->dvertexes[vertIndex].point[0],
-                         bsp->dvertexes[vertIndex].point[1],
-                         bsp->dvertexes[vertIndex].point[2]);
-#endif
-                pair.second = f_norm;
-            }
-            else
-            {
-                pair.second = qv::normalize(vertNormal);
+    }
+    
+    // per-face normals, centroids and bounds, read many times by the neighbour tests below
+    std::vector<qvec3f> faceNormals(bsp->numfaces);
+    std::vector<qvec3f> faceCentroids(bsp->numfaces);
+    std::vector<aabb3f> bounds(bsp->numfaces, aabb3f(qvec3f(0), qvec3f(0)));
+    ParallelFor(0, bsp->numfaces, [&](int i) {
+        const bsp2_dface_t *f = BSP_GetFace(bsp, i);
+        const std::vector<qvec3f> points = GLM_FacePoints(bsp, f);
+        faceNormals[i] = Face_Normal_E(bsp, f);
+        faceCentroids[i] = GLM_PolyCentroid(points);
+        if (!points.empty()) {
+            aabb3f b(points[0], points[0]);
+            for (const qvec3f &point : points) {
+                b = b.expand(point);
             }
+            bounds[i] = b.grow(qvec3f(1, 1, 1));
+        } else {
+            // no edges; leave it to FaceOverlapsEdge, which rejects it
+            bounds[i] = aabb3f(qvec3f(-FLT_MAX), qvec3f(FLT_MAX));
         }
-        
-        // sanity check
-        if (!neighboursToSmooth.size()) {
-            for (auto vertIndexNormalPair : smoothedNormals) {
-                Q_assert(GLMVectorCompare(vertIndexNormalPair.second, f_norm, EQUAL_EPSILON));
-            }
+    });
+    faceBounds = std::move(bounds);
+    
+    // build the "face -> faces to smooth with" table
+    std::vector<std::vector<const bsp2_dface_t *>> faceSmoothLists(bsp->numfaces);
+    ParallelFor(0, bsp->numfaces, [&](int i) {
+        faceSmoothLists[i] = Face_FindSmoothFaces(bsp, BSP_GetFace(bsp, i), faceNormals, faceCentroids);
+    });
+    
+    smoothFacesOffsets.assign(bsp->numfaces + 1, 0);
+    for (int i = 0; i < bsp->numfaces; i++) {
+        smoothFacesOffsets[i + 1] = static_cast<int>(faceSmoothLists[i].size());
+    }
+    CountsToOffsets(smoothFacesOffsets);
+    smoothFaces.resize(smoothFacesOffsets.back());
+    for (int i = 0; i < bsp->numfaces; i++) {
+        std::copy(faceSmoothLists[i].begin(), faceSmoothLists[i].end(), smoothFaces.begin() + smoothFacesOffsets[i]);
+    }
+    faceSmoothLists = {};
+
+    // finally do the smoothing for each face, and build the face cache
+    vertex_normals.assign(faceVertsOffsets.back(), qvec3f(0,0,0));
+    FaceCache.resize(bsp->numfaces);
+    ParallelFor(0, bsp->numfaces, [&](int i) {
+        const bsp2_dface_t *f = BSP_GetFace(bsp, i);
+        if (f->numedges >= 3) {
+            Face_SmoothVertexNormals(bsp, f, faceNormals);
         }
         
-        // now, record all of the smoothed normals that are actually part of `f`
-        for (int j=0; j<f->numedges; j++) {
-            int v = Face_VertexAtIndex(bsp, f, j);
-            Q_assert(smoothedNormals.find(v) != smoothedNormals.end());
-            
-            vertex_normals[f].push_back(smoothedNormals[v]);
-        }
-    }
-    
-    FaceCache = MakeFaceCache(bsp);
+        const qvec3f *normals = &vertex_normals[faceVertsOffsets[i]];
+        FaceCache[i] = face_cache_t(bsp, f, std::vector<qvec3f>(normals, normals + f->numedges));
+    });
 }
 
 const face_cache_t &FaceCacheForFNum(int fnum)
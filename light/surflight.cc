@@ -163,7 +163,7 @@ MakeSurfaceLightsThread(void *arg)
         VectorSet(l.maxs, 0, 0, 0);
 
         if (!novisapprox)
-            EstimateVisibleBoundsAtPoint(facemidpoint, l.mins, l.maxs);
+            EstimateVisibleBoundsAtPoint(bsp, facemidpoint, l.mins, l.maxs);
 
         // Store light...
         unique_lock<mutex> lck{ surfacelights_lock };
@@ -1,9 +1,58 @@
 #include "gtest/gtest.h"
 
+#include <atomic>
 #include <string>
+#include <vector>
 #include <common/cmdlib.hh>
+#include <common/threads.hh>
 
 TEST(common, StripFilename) {
     ASSERT_EQ("/home/foo", StrippedFilename("/home/foo/bar.txt"));
     ASSERT_EQ("", StrippedFilename("bar.txt"));
 }
+
+TEST(common, ParallelFor) {
+    const int saved_numthreads = numthreads;
+    numthreads = 4;
+
+    std::vector<std::atomic<int>> visits(1000);
+    ParallelFor(0, 1000, [&](int i) {
+        visits[i]++;
+    });
+    for (auto &v : visits) {
+        ASSERT_EQ(1, v.load());
+    }
+
+    std::atomic<int> items { 0 };
+    ParallelForRange(10, 1000, 7, [&](int begin, int end) {
+        ASSERT_LE(end - begin, 7);
+        items += end - begin;
+    });
+    ASSERT_EQ(990, items.load());
+
+    numthreads = saved_numthreads;
+}
+
+static std::atomic<int> runthreads_sum;
+
+static void *RunThreadsOnTestThread(void *arg)
+{
+    while (1) {
+        const int i = GetThreadWork();
+        if (i == -1)
+            break;
+        runthreads_sum += i;
+    }
+    return nullptr;
+}
+
+TEST(common, RunThreadsOn) {
+    const int saved_numthreads = numthreads;
+    numthreads = 4;
+
+    runthreads_sum = 0;
+    RunThreadsOn(5, 100, RunThreadsOnTestThread, nullptr);
+    ASSERT_EQ(4940, runthreads_sum.load());
+
+    numthreads = saved_numthreads;
+}
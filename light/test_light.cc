@@ -1,6 +1,7 @@
 #include "gtest/gtest.h"
 
 #include <light/light.hh>
+#include <light/lightcache.hh>
 
 #include <random>
 #include <algorithm> // for std::sort
@@ -1013,6 +1014,13 @@ TEST(mathlib, octree_basic) {
         std::sort(objsTouchingObj_i_octree.begin(), objsTouchingObj_i_octree.end());
         EXPECT_EQ(objsTouchingObj_i, objsTouchingObj_i_octree);
     }
+    
+    // the overload that reuses the caller's vector gives the same sorted result
+    vector<int> reused { -1, -1, -1 };
+    for (int i=0; i<N; i++) {
+        octree.queryTouchingBBox(objs[i].first, &reused);
+        EXPECT_EQ(objsTouchingObjs_octree[i], reused);
+    }
 }
 
 TEST(qvec, matrix2x2inv) {
@@ -1098,4 +1106,140 @@ TEST(trace, clamp_texcoord) {
     EXPECT_EQ(0, clamp_texcoord(-127.5f, 128));
     EXPECT_EQ(0, clamp_texcoord(-128.0f, 128));
     EXPECT_EQ(127, clamp_texcoord(-129.0f, 128));
-}
\ No newline at end of file
+}
+
+TEST(light, stylecolors_sorted) {
+    stylecolors_t colors;
+    EXPECT_TRUE(colors.empty());
+    
+    for (int style : {5, 0, 3}) {
+        colors.add(style, qvec3f(style + 1));
+    }
+    colors.add(3, qvec3f(1));
+    
+    ASSERT_EQ(3, colors.size());
+    const int expected_styles[] = {0, 3, 5};
+    const float expected_red[] = {1, 5, 6};
+    int i = 0;
+    for (const auto &styleColor : colors) {
+        EXPECT_EQ(expected_styles[i], styleColor.first);
+        EXPECT_FLOAT_EQ(expected_red[i], styleColor.second[0]);
+        i++;
+    }
+    
+    EXPECT_EQ(colors.end(), colors.find(1));
+    EXPECT_EQ(5, colors.find(5)->first);
+}
+
+TEST(light, stylecolors_spill) {
+    stylecolors_t colors;
+    const int numstyles = 2 * STYLECOLORS_INLINE + 1;
+    
+    // odd styles first, so the even ones are inserted between them after spilling
+    for (int i = 1; i < numstyles; i += 2) {
+        colors.add(i, qvec3f(i));
+    }
+    stylecolors_t inlinecopy = colors;
+    for (int i = 0; i < numstyles; i += 2) {
+        colors.add(i, qvec3f(i));
+    }
+    colors.add(numstyles - 1, qvec3f(1));
+    
+    // nothing is dropped
+    ASSERT_EQ(numstyles, colors.size());
+    int i = 0;
+    for (const auto &styleColor : colors) {
+        EXPECT_EQ(i, styleColor.first);
+        EXPECT_FLOAT_EQ((i == numstyles - 1) ? i + 1 : i, styleColor.second[0]);
+        i++;
+    }
+    
+    // copies own their entries, inline or spilled
+    stylecolors_t spilledcopy = colors;
+    colors.add(0, qvec3f(100));
+    EXPECT_FLOAT_EQ(0, spilledcopy.find(0)->second[0]);
+    EXPECT_EQ(STYLECOLORS_INLINE, inlinecopy.size());
+    EXPECT_EQ(inlinecopy.end(), inlinecopy.find(0));
+}
+
+/*
+ * The RGBA texture lump is rebuilt on every run, with uninitialized bytes
+ * after each texture name. Builds the lump a run would make for one 2x2
+ * texture, with those bytes set to garbage.
+ */
+static vector<uint8_t> MakeRGBATextureLump(uint8_t garbage, uint8_t pixel)
+{
+    const size_t headersize = 8; // nummiptex + dataofs[1]
+    const int numpixels = 2 * 2;
+    vector<uint8_t> lump(headersize + sizeof(rgba_miptex_t) + numpixels * 4, pixel);
+    
+    const int32_t header[2] = { 1, static_cast<int32_t>(headersize) };
+    memcpy(lump.data(), header, sizeof(header));
+    
+    rgba_miptex_t miptex;
+    memset(&miptex, garbage, sizeof(miptex));
+    strcpy(miptex.name, "metal5_2");
+    miptex.width = 2;
+    miptex.height = 2;
+    miptex.offset = sizeof(rgba_miptex_t);
+    memcpy(lump.data() + headersize, &miptex, sizeof(miptex));
+    return lump;
+}
+
+TEST(lightcache, DirtCacheKeyStableBetweenRuns) {
+    globalconfig_t cfg;
+    char entities[] = "{\n\"classname\" \"worldspawn\"\n}\n";
+    
+    auto key = [&](vector<uint8_t> &lump) {
+        mbsp_t bsp {};
+        bsp.loadversion = &bspver_q1;
+        bsp.dentdata = entities;
+        bsp.entdatasize = sizeof(entities);
+        bsp.drgbatexdata = reinterpret_cast<dmiptexlump_t *>(lump.data());
+        bsp.rgbatexdatasize = static_cast<int>(lump.size());
+        return DirtCache_GlobalKey(&bsp, cfg);
+    };
+    
+    vector<uint8_t> run1 = MakeRGBATextureLump(0xaa, 128);
+    vector<uint8_t> run2 = MakeRGBATextureLump(0x55, 128);
+    vector<uint8_t> edited = MakeRGBATextureLump(0xaa, 64);
+    
+    EXPECT_EQ(key(run1), key(run2));
+    EXPECT_NE(key(run1), key(edited));
+}
+
+TEST(lightcache, GlobalKeysIncludeTextureFilter) {
+    globalconfig_t cfg;
+    char entities[] = "{\n\"classname\" \"worldspawn\"\n}\n";
+    
+    mbsp_t bsp {};
+    bsp.loadversion = &bspver_q1;
+    bsp.dentdata = entities;
+    bsp.entdatasize = sizeof(entities);
+    
+    const bool saved = texturefilter;
+    texturefilter = false;
+    const uint64_t lightkey = LightCache_GlobalKey(&bsp, cfg);
+    const uint64_t dirtkey = DirtCache_GlobalKey(&bsp, cfg);
+    texturefilter = true;
+    EXPECT_NE(lightkey, LightCache_GlobalKey(&bsp, cfg));
+    EXPECT_NE(dirtkey, DirtCache_GlobalKey(&bsp, cfg));
+    texturefilter = saved;
+}
+
+TEST(lightcache, LightCacheKeyIncludesTracer) {
+    globalconfig_t cfg;
+    char entities[] = "{\n\"classname\" \"worldspawn\"\n}\n";
+    
+    mbsp_t bsp {};
+    bsp.loadversion = &bspver_q1;
+    bsp.dentdata = entities;
+    bsp.entdatasize = sizeof(entities);
+    
+    const tracer_t saved = tracer;
+    tracer = tracer_t::EMBREE;
+    const uint64_t embreekey = LightCache_GlobalKey(&bsp, cfg);
+    tracer = tracer_t::BVH;
+    EXPECT_NE(embreekey, LightCache_GlobalKey(&bsp, cfg));
+    tracer = saved;
+}
@@ -1,3 +1,150 @@
 #include "gtest/gtest.h"
 
+#include <light/light.hh>
+#include <light/entities.hh>
 #include <light/ltface.hh>
+
+#include <random>
+#include <vector>
+
+using namespace std;
+
+static void
+MakeSamplePoints(int numpoints, vector<qvec3f> *points, vector<qvec3f> *normals)
+{
+    std::mt19937 engine(1234);
+    std::uniform_real_distribution<float> pos(-512.0f, 512.0f);
+    std::uniform_real_distribution<float> dir(-1.0f, 1.0f);
+    
+    points->clear();
+    normals->clear();
+    for (int i = 0; i < numpoints; i++) {
+        points->push_back(qvec3f(pos(engine), pos(engine), pos(engine)));
+        normals->push_back(qv::normalize(qvec3f(dir(engine), dir(engine), dir(engine) + 2.0f)));
+    }
+    // one point right on top of the light
+    (*points)[0] = qvec3f(0, 0, 0);
+}
+
+static void
+MakeLight(light_t *light, int formula, bool spotlight, float falloff)
+{
+    const vec3_t origin = {0, 0, 0};
+    const vec3_t color = {255, 128, 64};
+    
+    light->origin.setVec3Value(origin);
+    light->color.setVec3Value(color);
+    light->light.setFloatValue(300);
+    light->formula.setFloatValue(formula);
+    light->falloff.setFloatValue(falloff);
+    light->anglescale.setFloatValue(0.5);
+    
+    if (spotlight) {
+        light->spotlight = true;
+        VectorSet(light->spotvec, 0, 0, -1);
+        light->spotfalloff = -cos(DEG2RAD(20.0));
+        light->spotfalloff2 = -cos(DEG2RAD(40.0));
+    }
+}
+
+static void
+LightSamples_Reference(const globalconfig_t &cfg, const light_t *light, bool twosided,
+                       const vector<qvec3f> &points, const vector<qvec3f> &normals,
+                       vector<vec_t> *add, vector<qvec3f> *dirs, vector<vec_t> *dists)
+{
+    for (size_t i = 0; i < points.size(); i++) {
+        vec3_t point, normal, color, dir, normalcontrib;
+        float dist;
+        glm_to_vec3_t(points[i], point);
+        glm_to_vec3_t(normals[i], normal);
+        
+        GetLightContrib(cfg, light, normal, point, twosided, color, dir, normalcontrib, &dist);
+        
+        add->push_back(DotProduct(normalcontrib, dir));
+        dirs->push_back(vec3_t_to_glm(dir));
+        dists->push_back(dist);
+    }
+}
+
+TEST(ltface, LightSamplesMatchGetLightContrib) {
+    globalconfig_t cfg;
+    vector<qvec3f> points, normals;
+    MakeSamplePoints(1024, &points, &normals);
+    
+    const int formulas[] = { LF_LINEAR, LF_INVERSE, LF_INVERSE2, LF_INFINITE, LF_INVERSE2A };
+    
+    for (const int formula : formulas) {
+        for (const bool spotlight : { false, true }) {
+            for (const bool twosided : { false, true }) {
+                for (const float falloff : { 0.0f, 400.0f }) {
+                    light_t light;
+                    MakeLight(&light, formula, spotlight, falloff);
+                    
+                    vector<vec_t> refadd, refdists;
+                    vector<qvec3f> refdirs;
+                    LightSamples_Reference(cfg, &light, twosided, points, normals, &refadd, &refdirs, &refdists);
+                    
+                    vector<vec_t> add(points.size()), dists(points.size());
+                    vector<qvec3f> dirs(points.size());
+                    LightSamples_Entity(cfg, &light, twosided, static_cast<int>(points.size()),
+                                        reinterpret_cast<const vec3_t *>(points.data()),
+                                        reinterpret_cast<const vec3_t *>(normals.data()),
+                                        add.data(), reinterpret_cast<vec3_t *>(dirs.data()), dists.data());
+                    
+                    for (size_t i = 0; i < points.size(); i++) {
+                        const float tolerance = 1e-4f * qmax(1.0f, fabs(refadd[i]));
+                        ASSERT_NEAR(refadd[i], add[i], tolerance) << "formula " << formula << " point " << i;
+                        ASSERT_NEAR(refdists[i], dists[i], 1e-3f);
+                        for (int j = 0; j < 3; j++) {
+                            ASSERT_NEAR(refdirs[i][j], dirs[i][j], 1e-5f);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Not a correctness test: times the per-sample GetLightContrib path
+ * against LightSamples_Entity over the same points and prints both.
+ * Disabled by default; run it with --gtest_also_run_disabled_tests.
+ */
+TEST(ltface, DISABLED_LightSamplesBenchmark) {
+    globalconfig_t cfg;
+    vector<qvec3f> points, normals;
+    MakeSamplePoints(4096, &points, &normals);
+    
+    vector<vec3_t> apoints(points.size()), anormals(points.size());
+    for (size_t i = 0; i < points.size(); i++) {
+        glm_to_vec3_t(points[i], apoints[i]);
+        glm_to_vec3_t(normals[i], anormals[i]);
+    }
+    
+    light_t light;
+    MakeLight(&light, LF_INVERSE2, true, 0);
+    
+    const int iterations = 200;
+    vector<vec_t> add(points.size()), dists(points.size());
+    vector<vec3_t> dirs(points.size());
+    vec_t sink = 0;
+    
+    const double start = I_FloatTime();
+    for (int n = 0; n < iterations; n++) {
+        for (size_t i = 0; i < points.size(); i++) {
+            vec3_t color, normalcontrib;
+            GetLightContrib(cfg, &light, anormals[i], apoints[i], false, color, dirs[i], normalcontrib, &dists[i]);
+            sink += color[0];
+        }
+    }
+    const double mid = I_FloatTime();
+    for (int n = 0; n < iterations; n++) {
+        LightSamples_Entity(cfg, &light, false, static_cast<int>(points.size()), apoints.data(), anormals.data(),
+                            add.data(), dirs.data(), dists.data());
+        sink += add[n];
+    }
+    const double end = I_FloatTime();
+    
+    printf("%d samples x %d: GetLightContrib %.3f ms, LightSamples_Entity %.3f ms (%g)\n",
+           static_cast<int>(points.size()), iterations, (mid - start) * 1000.0, (end - mid) * 1000.0, sink);
+}
@@ -0,0 +1,641 @@
+#include "gtest/gtest.h"
+
+#include <light/light.hh>
+#include <light/trace.hh>
+#include <light/trace_bvh.hh>
+#include <light/entities.hh>
+#include <light/ltface.hh>
+#include <common/bsputils.hh>
+#ifdef HAVE_EMBREE
+#include <light/trace_embree.hh>
+#endif
+
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+extern std::vector<modelinfo_t *> modelinfo;
+
+/*
+ * A tiny in-memory bsp for the tracer tests: quads (32x32 ones facing +x
+ * unless given corners), one texture each, grouped into models. Rays are
+ * cast along the x axis. setVis optionally gives the world two vis'd leafs.
+ */
+class testscene_t {
+private:
+    struct quad_t {
+        int model;
+        qvec3f corners[4];
+        const char *texname;
+        color_rgba pixel;
+    };
+
+    vector<quad_t> quads;
+    vector<dplane_t> planes;
+    vector<bsp2_dnode_t> nodes;
+    vector<mleaf_t> leafs;
+    vector<uint8_t> visdata;
+    vector<dmodel_t> models;
+    vector<dvertex_t> vertexes;
+    vector<bsp2_dedge_t> edges;
+    vector<int32_t> surfedges;
+    vector<bsp2_dface_t> faces;
+    vector<gtexinfo_t> texinfos;
+    vector<uint8_t> texlump;
+    vector<uint8_t> rgbatexlump;
+
+public:
+    mbsp_t bsp {};
+
+    testscene_t() {
+        addModel(); // world
+    }
+
+    ~testscene_t() {
+        for (modelinfo_t *info : modelinfo)
+            delete info;
+        modelinfo.clear();
+        free(extended_texinfo_flags);
+        extended_texinfo_flags = nullptr;
+        texturefilter = false;
+    }
+
+    /* settings can be changed until build() */
+    modelinfo_t *addModel() {
+        models.push_back(dmodel_t {});
+        modelinfo.push_back(new modelinfo_t(&bsp, nullptr, 16.0f));
+        return modelinfo.back();
+    }
+
+    /* quads must be added in model order; returns the face number */
+    int addQuad(int model, float x, const char *texname, color_rgba pixel = {255, 255, 255, 255}) {
+        const qvec3f corners[4] = { {x, -16, -16}, {x, 16, -16}, {x, 16, 16}, {x, -16, 16} };
+        return addQuad(model, corners, texname, pixel);
+    }
+
+    int addQuad(int model, const qvec3f (&corners)[4], const char *texname, color_rgba pixel = {255, 255, 255, 255}) {
+        Q_assert(quads.empty() || quads.back().model <= model);
+        quads.push_back({model, {corners[0], corners[1], corners[2], corners[3]}, texname, pixel});
+        return static_cast<int>(quads.size()) - 1;
+    }
+
+    /*
+     * Splits the world at x = splitx into leaf 1 (below) and leaf 2 (above),
+     * which fill mins/maxs between them. Each leaf's PVS has the other one
+     * only if open.
+     */
+    void setVis(float splitx, const qvec3f &mins, const qvec3f &maxs, bool open) {
+        dplane_t split {};
+        split.normal[0] = 1;
+        split.dist = splitx;
+        split.type = PLANE_X;
+        planes.push_back(split);
+
+        bsp2_dnode_t node {};
+        node.planenum = 0;
+        node.children[0] = -3;
+        node.children[1] = -2;
+        nodes.push_back(node);
+
+        leafs.assign(3, mleaf_t {});
+        leafs[0].contents = CONTENTS_SOLID;
+        leafs[0].visofs = -1;
+        for (int i = 1; i <= 2; i++) {
+            leafs[i].contents = CONTENTS_EMPTY;
+            leafs[i].visofs = i - 1;
+            for (int j = 0; j < 3; j++) {
+                leafs[i].mins[j] = mins[j];
+                leafs[i].maxs[j] = maxs[j];
+            }
+        }
+        leafs[1].maxs[0] = splitx;
+        leafs[2].mins[0] = splitx;
+
+        // one byte rows, none of them zero, so there is no run-length coding
+        visdata = { static_cast<uint8_t>(open ? 3 : 1), static_cast<uint8_t>(open ? 3 : 2) };
+        models.at(0).visleafs = 2;
+    }
+
+    void build() {
+        const int numquads = static_cast<int>(quads.size());
+
+        edges.push_back(bsp2_dedge_t {}); // edge 0 is never used
+        const int firstplane = static_cast<int>(planes.size());
+        for (int i = 0; i < numquads; i++) {
+            const quad_t &quad = quads[i];
+
+            const uint32_t firstvert = static_cast<uint32_t>(vertexes.size());
+            for (int j = 0; j < 4; j++) {
+                vertexes.push_back({{quad.corners[j][0], quad.corners[j][1], quad.corners[j][2]}});
+                surfedges.push_back(static_cast<int32_t>(edges.size()));
+                edges.push_back({{firstvert + j, firstvert + (j + 1) % 4}});
+            }
+
+            const qvec3f normal = qv::normalize(qv::cross(quad.corners[1] - quad.corners[0], quad.corners[2] - quad.corners[0]));
+            dplane_t plane {};
+            for (int j = 0; j < 3; j++)
+                plane.normal[j] = normal[j];
+            plane.dist = qv::dot(normal, quad.corners[0]);
+            plane.type = PLANE_ANYX;
+            planes.push_back(plane);
+
+            bsp2_dface_t face {};
+            face.planenum = firstplane + i;
+            face.firstedge = 4 * i;
+            face.numedges = 4;
+            face.texinfo = i;
+            face.lightofs = -1;
+            faces.push_back(face);
+
+            gtexinfo_t texinfo {};
+            texinfo.miptex = i;
+            texinfos.push_back(texinfo);
+
+            dmodel_t &model = models.at(quad.model);
+            if (!model.numfaces)
+                model.firstface = i;
+            model.numfaces++;
+        }
+
+        // texture names, and 1x1 RGBA textures for -texturefilter
+        const size_t header = sizeof(int32_t) * (1 + numquads);
+        texlump.assign(header + sizeof(miptex_t) * numquads, 0);
+        rgbatexlump.assign(header + (sizeof(rgba_miptex_t) + sizeof(color_rgba)) * numquads, 0);
+        memcpy(texlump.data(), &numquads, sizeof(int32_t));
+        memcpy(rgbatexlump.data(), &numquads, sizeof(int32_t));
+        for (int i = 0; i < numquads; i++) {
+            const int32_t ofs = static_cast<int32_t>(header + sizeof(miptex_t) * i);
+            miptex_t miptex {};
+            strcpy(miptex.name, quads[i].texname);
+            miptex.width = miptex.height = 16;
+            memcpy(texlump.data() + sizeof(int32_t) * (1 + i), &ofs, sizeof(ofs));
+            memcpy(texlump.data() + ofs, &miptex, sizeof(miptex));
+
+            const int32_t rgbaofs = static_cast<int32_t>(header + (sizeof(rgba_miptex_t) + sizeof(color_rgba)) * i);
+            rgba_miptex_t rgbamiptex {};
+            strcpy(rgbamiptex.name, quads[i].texname);
+            rgbamiptex.width = rgbamiptex.height = 1;
+            rgbamiptex.offset = sizeof(rgba_miptex_t);
+            memcpy(rgbatexlump.data() + sizeof(int32_t) * (1 + i), &rgbaofs, sizeof(rgbaofs));
+            memcpy(rgbatexlump.data() + rgbaofs, &rgbamiptex, sizeof(rgbamiptex));
+            memcpy(rgbatexlump.data() + rgbaofs + sizeof(rgbamiptex), &quads[i].pixel, sizeof(color_rgba));
+        }
+
+        bsp.loadversion = &bspver_q1;
+        bsp.nummodels = static_cast<int>(models.size());
+        bsp.dmodels = models.data();
+        bsp.numvertexes = static_cast<int>(vertexes.size());
+        bsp.dvertexes = vertexes.data();
+        bsp.numedges = static_cast<int>(edges.size());
+        bsp.dedges = edges.data();
+        bsp.numsurfedges = static_cast<int>(surfedges.size());
+        bsp.dsurfedges = surfedges.data();
+        bsp.numfaces = numquads;
+        bsp.dfaces = faces.data();
+        bsp.numplanes = static_cast<int>(planes.size());
+        bsp.dplanes = planes.data();
+        bsp.numnodes = static_cast<int>(nodes.size());
+        bsp.dnodes = nodes.data();
+        bsp.numleafs = static_cast<int>(leafs.size());
+        bsp.dleafs = leafs.data();
+        bsp.visdatasize = static_cast<int>(visdata.size());
+        bsp.dvisdata = visdata.data();
+        bsp.numtexinfo = numquads;
+        bsp.texinfo = texinfos.data();
+        bsp.texdatasize = static_cast<int>(texlump.size());
+        bsp.dtexdata = reinterpret_cast<dmiptexlump_t *>(texlump.data());
+        bsp.rgbatexdatasize = static_cast<int>(rgbatexlump.size());
+        bsp.drgbatexdata = reinterpret_cast<dmiptexlump_t *>(rgbatexlump.data());
+
+        for (size_t i = 0; i < models.size(); i++)
+            modelinfo[i]->model = &bsp.dmodels[i];
+
+        free(extended_texinfo_flags);
+        extended_texinfo_flags = static_cast<surfflags_t *>(calloc(qmax(numquads, 1), sizeof(surfflags_t)));
+
+        tracer = tracer_t::BVH;
+        MakeTnodes(&bsp);
+    }
+
+    const modelinfo_t *world() const { return modelinfo[0]; }
+    const bsp2_dface_t *face(int facenum) const { return &bsp.dfaces[facenum]; }
+};
+
+/*
+ * rays are kept off the quads' diagonals.
+ * NOTE: despite its name, hitresult_t::blocked is true when the ray got through
+ */
+static const vec3_t ray_start = {0, 3, 5};
+static const vec3_t ray_end = {128, 3, 5};
+
+TEST(trace_bvh, EmptyScene) {
+    testscene_t scene;
+    scene.build();
+
+    const hitresult_t light = BVH_TestLight(ray_start, ray_end, nullptr);
+    EXPECT_TRUE(light.blocked);
+
+    const vec3_t dir = {1, 0, 0};
+    const bsp2_dface_t unset {};
+    const bsp2_dface_t *face = &unset;
+    const hitresult_t sky = BVH_TestSky(ray_start, dir, nullptr, &face);
+    EXPECT_FALSE(sky.blocked);
+    EXPECT_EQ(nullptr, face);
+}
+
+TEST(trace_bvh, HitDistance) {
+    testscene_t scene;
+    const int near = scene.addQuad(0, 64, "wall");
+    scene.addQuad(0, 96, "wall");
+    scene.build();
+
+    raystream_intersection_t *rs = BVH_MakeIntersectionRayStream(2);
+    vec3_t dir = {1, 0.125, 0};
+    const vec_t len = VectorNormalize(dir);
+    rs->pushRay(0, ray_start, dir, 1000);
+    const vec3_t back = {-1, 0, 0};
+    rs->pushRay(1, ray_start, back, 1000);
+    rs->tracePushedRaysIntersection(scene.world());
+
+    EXPECT_EQ(hittype_t::SOLID, rs->getPushedRayHitType(0));
+    EXPECT_NEAR(64 * len, rs->getPushedRayHitDist(0), 0.01);
+    EXPECT_EQ(scene.face(near), rs->getPushedRayHitFace(0));
+
+    EXPECT_EQ(hittype_t::NONE, rs->getPushedRayHitType(1));
+    EXPECT_EQ(nullptr, rs->getPushedRayHitFace(1));
+    delete rs;
+}
+
+TEST(trace_bvh, ShadowSelf) {
+    testscene_t scene;
+    modelinfo_t *self = scene.addModel();
+    self->shadowself.setFloatValue(1);
+    scene.addQuad(1, 64, "wall");
+    scene.build();
+
+    EXPECT_TRUE(BVH_TestLight(ray_start, ray_end, nullptr).blocked);
+    EXPECT_TRUE(BVH_TestLight(ray_start, ray_end, scene.world()).blocked);
+    EXPECT_FALSE(BVH_TestLight(ray_start, ray_end, self).blocked);
+}
+
+TEST(trace_bvh, ShadowWorldOnly) {
+    testscene_t scene;
+    modelinfo_t *worldonly = scene.addModel();
+    worldonly->shadowworldonly.setFloatValue(1);
+    modelinfo_t *other = scene.addModel();
+    scene.addQuad(1, 64, "wall");
+    scene.build();
+
+    EXPECT_TRUE(BVH_TestLight(ray_start, ray_end, nullptr).blocked);
+    EXPECT_FALSE(BVH_TestLight(ray_start, ray_end, scene.world()).blocked);
+    EXPECT_TRUE(BVH_TestLight(ray_start, ray_end, other).blocked);
+    EXPECT_TRUE(BVH_TestLight(ray_start, ray_end, worldonly).blocked);
+}
+
+TEST(trace_bvh, SwitchableShadow) {
+    testscene_t scene;
+    modelinfo_t *door = scene.addModel();
+    door->switchableshadow.setFloatValue(1);
+    door->switchshadstyle.setFloatValue(33);
+    scene.addQuad(1, 64, "wall");
+    scene.build();
+
+    const hitresult_t result = BVH_TestLight(ray_start, ray_end, scene.world());
+    EXPECT_TRUE(result.blocked);
+    EXPECT_EQ(33, result.passedSwitchableShadowStyle);
+
+    raystream_occlusion_t *rs = BVH_MakeOcclusionRayStream(1);
+    const vec3_t dir = {1, 0, 0};
+    rs->pushRay(0, ray_start, dir, 128);
+    rs->tracePushedRaysOcclusion(scene.world());
+    EXPECT_FALSE(rs->getPushedRayOccluded(0));
+    EXPECT_EQ(33, rs->getPushedRayDynamicStyle(0));
+    delete rs;
+}
+
+TEST(trace_bvh, Fence) {
+    for (const bool filter : {false, true}) {
+        for (const uint8_t alpha : {0, 255}) {
+            testscene_t scene;
+            scene.addQuad(0, 64, "{fence", {0, 0, 0, alpha});
+            texturefilter = filter;
+            scene.build();
+
+            // without -texturefilter every fence texel is transparent
+            const bool occluded = filter && alpha == 255;
+            EXPECT_EQ(!occluded, BVH_TestLight(ray_start, ray_end, scene.world()).blocked);
+        }
+    }
+}
+
+TEST(trace_bvh, Glass) {
+    testscene_t scene;
+    modelinfo_t *glass = scene.addModel();
+    glass->shadow.setFloatValue(1);
+    glass->alpha.setFloatValue(0.5);
+    scene.addQuad(1, 64, "window", {255, 0, 0, 128});
+    texturefilter = true;
+    scene.build();
+
+    EXPECT_TRUE(BVH_TestLight(ray_start, ray_end, scene.world()).blocked);
+
+    // only rays leaving through the back of the glass are tinted
+    raystream_occlusion_t *rs = BVH_MakeOcclusionRayStream(2);
+    const vec3_t white = {255, 255, 255};
+    const vec3_t forward = {1, 0, 0};
+    const vec3_t back = {-1, 0, 0};
+    rs->pushRay(0, ray_start, forward, 128, white);
+    rs->pushRay(1, ray_end, back, 128, white);
+    rs->tracePushedRaysOcclusion(scene.world());
+
+    vec3_t color;
+    EXPECT_FALSE(rs->getPushedRayOccluded(0));
+    rs->getPushedRayColor(0, color);
+    EXPECT_FLOAT_EQ(255, color[1]);
+
+    EXPECT_FALSE(rs->getPushedRayOccluded(1));
+    rs->getPushedRayColor(1, color);
+    EXPECT_LT(color[1], 255);
+    EXPECT_GT(color[0], color[1]);
+    delete rs;
+}
+
+TEST(trace_bvh, TestSkyFace) {
+    testscene_t scene;
+    const int sky = scene.addQuad(0, 64, "sky1");
+    scene.addQuad(0, -64, "wall");
+    modelinfo_t *door = scene.addModel();
+    door->switchableshadow.setFloatValue(1);
+    door->switchshadstyle.setFloatValue(40);
+    scene.addQuad(1, 32, "door");
+    scene.build();
+
+    const vec3_t forward = {2, 0, 0}; // not normalized
+    const bsp2_dface_t *face = nullptr;
+    hitresult_t result = BVH_TestSky(ray_start, forward, scene.world(), &face);
+    EXPECT_TRUE(result.blocked);
+    EXPECT_EQ(40, result.passedSwitchableShadowStyle);
+    EXPECT_EQ(scene.face(sky), face);
+
+    const vec3_t back = {-1, 0, 0};
+    result = BVH_TestSky(ray_start, back, scene.world(), &face);
+    EXPECT_FALSE(result.blocked);
+    EXPECT_EQ(nullptr, face);
+}
+
+/*
+ * With masks, shadowself / shadowworldonly faces skip Trace_FilterHit. The
+ * mask test must reject exactly the hits the filter would have rejected.
+ */
+TEST(trace, MasksMatchFilter) {
+    testscene_t scene;
+    scene.addQuad(0, 0, "wall");
+
+    vector<const modelinfo_t *> sources { nullptr };
+    auto addModel = [&](bool shadowself, bool shadowworldonly) {
+        modelinfo_t *model = scene.addModel();
+        model->shadowself.setFloatValue(shadowself);
+        model->shadowworldonly.setFloatValue(shadowworldonly);
+        scene.addQuad(static_cast<int>(sources.size()), 0, "wall");
+        sources.push_back(model);
+    };
+    // two more _shadowself models than there are mask bits
+    for (int i = 0; i < TRACE_MAX_SELF_MASKS + 2; i++)
+        addModel(true, false);
+    addModel(false, true);
+    addModel(true, true);
+    addModel(false, false); // casts no shadows, but rays start on it
+    scene.build();
+
+    tracefaces_t nomasks;
+    Trace_ClassifyFaces(&scene.bsp, false, &nomasks);
+    EXPECT_TRUE(nomasks.worldonly.empty());
+    EXPECT_TRUE(nomasks.self.empty());
+    EXPECT_EQ(TRACE_MAX_SELF_MASKS + 4, static_cast<int>(nomasks.filter.size()));
+    for (unsigned raymask : nomasks.raymasks)
+        EXPECT_EQ(TRACE_MASK_ALWAYS, raymask);
+    Trace_FreeFaces(&nomasks);
+
+    tracefaces_t faces;
+    Trace_ClassifyFaces(&scene.bsp, true, &faces);
+    ASSERT_EQ(TRACE_MAX_SELF_MASKS, static_cast<int>(faces.self.size()));
+    EXPECT_EQ(1u, faces.worldonly.size());
+    // the 2 self models past the last mask bit, and the shadowself + shadowworldonly one
+    EXPECT_EQ(3u, faces.filter.size());
+
+    vector<pair<const bsp2_dface_t *, unsigned>> masked;
+    for (const bsp2_dface_t *face : faces.worldonly)
+        masked.emplace_back(face, TRACE_MASK_WORLDONLY);
+    for (size_t i = 0; i < faces.self.size(); i++) {
+        for (const bsp2_dface_t *face : faces.self[i])
+            masked.emplace_back(face, 1u << (TRACE_MASK_SELF_FIRST + i));
+    }
+
+    const vec3_t hitpoint = {0, 3, 5};
+    const vec3_t dir = {1, 0, 0};
+    const vec3_t normal = {1, 0, 0};
+    for (const modelinfo_t *self : sources) {
+        const unsigned raymask = self ? faces.raymasks[self->model - scene.bsp.dmodels] : TRACE_MASK_ALWAYS;
+        for (const auto &entry : masked) {
+            const modelinfo_t *hitmodel = ModelInfoForFace(&scene.bsp, Face_GetNum(&scene.bsp, entry.first));
+            const filterhit_t filter = Trace_FilterHit(self, hitmodel, entry.first, hitpoint, dir, normal);
+            EXPECT_EQ(filter.accept, (raymask & entry.second) != 0);
+        }
+    }
+    Trace_FreeFaces(&faces);
+}
+
+/*
+ * Two 64 unit rooms side by side along x, vis'd as one box split at x = 64.
+ * With a wall between them, neither room's PVS has the other one.
+ */
+static void
+BuildTwoRooms(testscene_t *scene, bool wall)
+{
+    const qvec3f walls[][4] = {
+        { {0, -32, -32}, {0, 32, -32}, {0, 32, 32}, {0, -32, 32} },
+        { {128, -32, -32}, {128, 32, -32}, {128, 32, 32}, {128, -32, 32} },
+        { {0, -32, -32}, {128, -32, -32}, {128, -32, 32}, {0, -32, 32} },
+        { {0, 32, -32}, {128, 32, -32}, {128, 32, 32}, {0, 32, 32} },
+        { {0, -32, -32}, {128, -32, -32}, {128, 32, -32}, {0, 32, -32} },
+        { {0, -32, 32}, {128, -32, 32}, {128, 32, 32}, {0, 32, 32} },
+        { {64, -32, -32}, {64, 32, -32}, {64, 32, 32}, {64, -32, 32} },
+    };
+    for (int i = 0; i < (wall ? 7 : 6); i++)
+        scene->addQuad(0, walls[i], "wall");
+    scene->setVis(64, qvec3f(0, -32, -32), qvec3f(128, 32, 32), !wall);
+    scene->build();
+}
+
+/* EstimateVisibleBoundsAtPoint from the scene's PVS, or with it hidden, from rays */
+static void
+VisibleBounds(testscene_t *scene, bool usepvs, const vec3_t point, vec3_t mins, vec3_t maxs)
+{
+    const int visdatasize = scene->bsp.visdatasize;
+
+    scene->bsp.visdatasize = usepvs ? visdatasize : 0;
+    SetupPVSBounds(&scene->bsp);
+    EstimateVisibleBoundsAtPoint(&scene->bsp, point, mins, maxs);
+
+    // don't leave the PVS bounds set up for the other tests
+    scene->bsp.visdatasize = 0;
+    SetupPVSBounds(&scene->bsp);
+    scene->bsp.visdatasize = visdatasize;
+}
+
+TEST(visbounds, PVSMatchesRays) {
+    const vec3_t point = {16, 3, 5};
+
+    for (const bool wall : {true, false}) {
+        testscene_t scene;
+        BuildTwoRooms(&scene, wall);
+
+        vec3_t pvsmins, pvsmaxs, raymins, raymaxs;
+        VisibleBounds(&scene, true, point, pvsmins, pvsmaxs);
+        VisibleBounds(&scene, false, point, raymins, raymaxs);
+
+        // the ray estimate is the box of the ray hits, grown by 25% of its size on each side
+        for (int i = 0; i < 3; i++) {
+            const vec_t grow = (raymaxs[i] - raymins[i]) / 6;
+            EXPECT_NEAR(raymins[i] + grow, pvsmins[i], 0.5);
+            EXPECT_NEAR(raymaxs[i] - grow, pvsmaxs[i], 0.5);
+        }
+        EXPECT_FLOAT_EQ(wall ? 64 : 128, pvsmaxs[0]);
+    }
+}
+
+#ifdef HAVE_EMBREE
+/*
+ * Every mask and filter case at once, built for the BVH tracer: sky and
+ * fence in the world, then _shadowself, _shadowworldonly, switchable shadow
+ * and glass bmodels along the x axis. sources gets every ray source.
+ */
+static void
+BuildEveryCase(testscene_t *scene, vector<const modelinfo_t *> *sources)
+{
+    scene->addQuad(0, 200, "sky1");
+    scene->addQuad(0, -200, "wall");
+    scene->addQuad(0, 20, "{fence", {0, 0, 0, 255});
+
+    *sources = { nullptr, scene->world() };
+    const char *keys[] = { "shadowself", "shadowworldonly", "switchableshadow", "alpha" };
+    for (int i = 0; i < 4; i++) {
+        modelinfo_t *model = scene->addModel();
+        model->shadow.setFloatValue(i == 3);
+        model->shadowself.setFloatValue(i == 0);
+        model->shadowworldonly.setFloatValue(i == 1);
+        model->switchableshadow.setFloatValue(i == 2);
+        model->switchshadstyle.setFloatValue(i == 2 ? 35 : 0);
+        model->alpha.setFloatValue(i == 3 ? 0.5f : 1.0f);
+        scene->addQuad(i + 1, -150 + 100 * i, keys[i], {255, 0, 0, 128});
+        sources->push_back(model);
+    }
+    texturefilter = true;
+    scene->build();
+}
+
+TEST(trace_bvh, MatchesEmbree) {
+    testscene_t scene;
+    vector<const modelinfo_t *> sources;
+    BuildEveryCase(&scene, &sources);
+
+    struct traced_t {
+        hitresult_t light, sky;
+        const bsp2_dface_t *skyface;
+    };
+    auto traceAll = [&]() {
+        vector<traced_t> results;
+        for (const modelinfo_t *self : sources) {
+            for (float x = -175; x <= 175; x += 50) {
+                for (const float dirx : {-1.0f, 1.0f}) {
+                    const vec3_t start = {x, 3, 5};
+                    const vec3_t stop = {x + 300 * dirx, 3, 5};
+                    const vec3_t dir = {dirx, 0, 0};
+                    traced_t traced;
+                    traced.light = TestLight(start, stop, self);
+                    traced.sky = TestSky(start, dir, self, &traced.skyface);
+                    results.push_back(traced);
+                }
+            }
+        }
+        return results;
+    };
+
+    const vector<traced_t> bvh = traceAll();
+    tracer = tracer_t::EMBREE;
+    MakeTnodes(&scene.bsp);
+    const vector<traced_t> embree = traceAll();
+
+    ASSERT_EQ(bvh.size(), embree.size());
+    for (size_t i = 0; i < bvh.size(); i++) {
+        EXPECT_EQ(embree[i].light.blocked, bvh[i].light.blocked) << i;
+        EXPECT_EQ(embree[i].light.passedSwitchableShadowStyle, bvh[i].light.passedSwitchableShadowStyle) << i;
+        EXPECT_EQ(embree[i].sky.blocked, bvh[i].sky.blocked) << i;
+        EXPECT_EQ(embree[i].sky.passedSwitchableShadowStyle, bvh[i].sky.passedSwitchableShadowStyle) << i;
+        EXPECT_EQ(embree[i].skyface, bvh[i].skyface) << i;
+    }
+}
+/* the SoA streams, with and without -sortrays, against the BVH streams */
+TEST(trace_bvh, MatchesEmbreeStreams) {
+    testscene_t scene;
+    vector<const modelinfo_t *> sources;
+    BuildEveryCase(&scene, &sources);
+    tracer = tracer_t::EMBREE;
+    MakeTnodes(&scene.bsp);
+
+    // enough rays for -sortrays to kick in; y != z keeps them off the diagonals
+    const int numrays = 256;
+    vector<qvec3f> origins, dirs;
+    for (int i = 0; i < numrays; i++) {
+        origins.push_back(qvec3f(-190 + (i * 37) % 380, 3 + i % 5, 9 + i % 3));
+        dirs.push_back(qvec3f((i & 1) ? 1 : -1, 0, 0));
+    }
+
+    const vec3_t white = {255, 255, 255};
+    for (const bool sorted : {false, true}) {
+        sortrays = sorted;
+        for (const modelinfo_t *self : sources) {
+            raystream_occlusion_t *bvh = BVH_MakeOcclusionRayStream(numrays);
+            raystream_occlusion_t *embree = Embree_MakeOcclusionRayStream(numrays);
+            raystream_intersection_t *bvhhit = BVH_MakeIntersectionRayStream(numrays);
+            raystream_intersection_t *embreehit = Embree_MakeIntersectionRayStream(numrays);
+            for (int i = 0; i < numrays; i++) {
+                vec3_t origin, dir;
+                glm_to_vec3_t(origins[i], origin);
+                glm_to_vec3_t(dirs[i], dir);
+                bvh->pushRay(i, origin, dir, 300, white);
+                embree->pushRay(i, origin, dir, 300, white);
+                bvhhit->pushRay(i, origin, dir, 300);
+                embreehit->pushRay(i, origin, dir, 300);
+            }
+            bvh->tracePushedRaysOcclusion(self);
+            embree->tracePushedRaysOcclusion(self);
+            bvhhit->tracePushedRaysIntersection(self);
+            embreehit->tracePushedRaysIntersection(self);
+
+            for (int i = 0; i < numrays; i++) {
+                EXPECT_EQ(bvh->getPushedRayPointIndex(i), embree->getPushedRayPointIndex(i));
+                EXPECT_EQ(bvh->getPushedRayOccluded(i), embree->getPushedRayOccluded(i)) << i;
+                EXPECT_EQ(bvh->getPushedRayDynamicStyle(i), embree->getPushedRayDynamicStyle(i)) << i;
+                vec3_t bvhcolor, embreecolor;
+                bvh->getPushedRayColor(i, bvhcolor);
+                embree->getPushedRayColor(i, embreecolor);
+                for (int k = 0; k < 3; k++)
+                    EXPECT_NEAR(bvhcolor[k], embreecolor[k], 0.01) << i;
+
+                EXPECT_EQ(bvhhit->getPushedRayHitType(i), embreehit->getPushedRayHitType(i)) << i;
+                EXPECT_EQ(bvhhit->getPushedRayHitFace(i), embreehit->getPushedRayHitFace(i)) << i;
+                if (bvhhit->getPushedRayHitType(i) != hittype_t::NONE) {
+                    EXPECT_NEAR(bvhhit->getPushedRayHitDist(i), embreehit->getPushedRayHitDist(i), 0.01) << i;
+                }
+            }
+            delete bvh;
+            delete embree;
+            delete bvhhit;
+            delete embreehit;
+        }
+    }
+    sortrays = false;
+}
+#endif
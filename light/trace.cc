@@ -21,10 +21,15 @@
 #include <light/trace.hh>
 #include <light/ltface.hh>
 #include <common/bsputils.hh>
+#include <light/trace_bvh.hh>
 #ifdef HAVE_EMBREE
 #include <light/trace_embree.hh>
 #endif
 #include <cassert>
+#include <climits>
+#include <cstring>
+
+using namespace polylib;
 
 /*
  * ============================================================================
@@ -50,58 +55,605 @@ uint32_t clamp_texcoord(vec_t in, uint32_t width)
     }
 }
 
+/*
+ * Lookup tables for the fence / glass ray filters, built once by MakeTnodes
+ * after the textures are loaded, so a hit doesn't have to resolve the face's
+ * texinfo and RGBA miptex. Only built with -texturefilter.
+ */
+typedef struct {
+    uint32_t width, height;
+    const color_rgba *pixels;
+    std::vector<uint64_t> opaque;   // 1 bit per texel, set if alpha is 255
+} texcoverage_t;
+
+typedef struct {
+    float vecs[2][4];               // the texinfo's s/t vectors
+    int texnum;                     // into texcoverage, -1 if the face has no texture
+} facetexcoords_t;
+
+static std::vector<texcoverage_t> texcoverage;
+static std::vector<facetexcoords_t> facetexcoords;
+
+static void
+SetupTextureCoverage(const mbsp_t *bsp)
+{
+    texcoverage.clear();
+    facetexcoords.clear();
+    
+    if (!texturefilter || !bsp->rgbatexdatasize)
+        return;
+    
+    const dmiptexlump_t *miplump = bsp->drgbatexdata;
+    texcoverage.resize(miplump->nummiptex);
+    for (int i = 0; i < miplump->nummiptex; i++) {
+        texcoverage_t &cov = texcoverage[i];
+        cov.width = cov.height = 0;
+        cov.pixels = nullptr;
+        
+        const int offset = miplump->dataofs[i];
+        if (offset < 0)
+            continue;
+        
+        const rgba_miptex_t *miptex = (const rgba_miptex_t *)((const uint8_t *)miplump + offset);
+        if (!miptex->width || !miptex->height)
+            continue;
+        
+        cov.width = miptex->width;
+        cov.height = miptex->height;
+        cov.pixels = (const color_rgba *)((const uint8_t *)miptex + miptex->offset);
+        
+        const size_t numpixels = static_cast<size_t>(cov.width) * cov.height;
+        cov.opaque.assign((numpixels + 63) / 64, 0);
+        for (size_t j = 0; j < numpixels; j++) {
+            if (cov.pixels[j].a == 255)
+                cov.opaque[j >> 6] |= 1ULL << (j & 63);
+        }
+    }
+    
+    facetexcoords.resize(bsp->numfaces);
+    for (int i = 0; i < bsp->numfaces; i++) {
+        facetexcoords_t &ftc = facetexcoords[i];
+        const gtexinfo_t *tex = Face_Texinfo(bsp, &bsp->dfaces[i]);
+        
+        ftc.texnum = -1;
+        if (tex == nullptr)
+            continue;
+        
+        memcpy(ftc.vecs, tex->vecs, sizeof(ftc.vecs));
+        if (tex->miptex >= 0 && tex->miptex < static_cast<int>(texcoverage.size())
+            && texcoverage[tex->miptex].pixels != nullptr)
+            ftc.texnum = tex->miptex;
+    }
+}
+
+/* Texel index of point on the face, or -1 if the face has no texture */
+static inline int64_t
+FaceTexel(int facenum, const vec3_t point, const texcoverage_t **cov_out)
+{
+    if (facenum < 0 || facenum >= static_cast<int>(facetexcoords.size()))
+        return -1;
+    
+    const facetexcoords_t &ftc = facetexcoords[facenum];
+    if (ftc.texnum == -1)
+        return -1;
+    
+    const texcoverage_t &cov = texcoverage[ftc.texnum];
+    const vec_t s = DotProduct(point, ftc.vecs[0]) + ftc.vecs[0][3];
+    const vec_t t = DotProduct(point, ftc.vecs[1]) + ftc.vecs[1][3];
+    const uint32_t x = clamp_texcoord(s, cov.width);
+    const uint32_t y = clamp_texcoord(t, cov.height);
+    
+    *cov_out = &cov;
+    return static_cast<int64_t>(cov.width) * y + x;
+}
+
+bool
+Face_TexelOpaque(int facenum, const vec3_t point)
+{
+    const texcoverage_t *cov;
+    const int64_t texel = FaceTexel(facenum, point, &cov);
+    if (texel < 0)
+        return true;
+    
+    return (cov->opaque[texel >> 6] >> (texel & 63)) & 1;
+}
+
+color_rgba
+Face_SampleTexel(int facenum, const vec3_t point)
+{
+    const texcoverage_t *cov;
+    const int64_t texel = FaceTexel(facenum, point, &cov);
+    if (texel < 0)
+        return color_rgba{};
+    
+    return cov->pixels[texel];
+}
+
 color_rgba //mxd. int -> color_rgba
 SampleTexture(const bsp2_dface_t *face, const mbsp_t *bsp, const vec3_t point)
 {
-    color_rgba sample{};
-    if (!bsp->rgbatexdatasize)
-        return sample;
+    return Face_SampleTexel(Face_GetNum(bsp, face), point);
+}
+
+/*
+ * ============================================================================
+ * SHARED BY THE TRACER BACKENDS
+ * ============================================================================
+ */
+
+static const mbsp_t *bsp_static;
+
+/**
+ * Returns 1.0 unless a custom alpha value is set.
+ * The priority is: "_light_alpha" (read from extended_texinfo_flags), then "alpha"
+ */
+static float
+Face_Alpha(const modelinfo_t *modelinfo, const bsp2_dface_t *face)
+{
+    const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];  
+
+    // for _light_alpha, 0 is considered unset
+    const float alpha_float = (float)extended_flags.light_alpha / (float)UCHAR_MAX;
+    if (alpha_float != 0.0f) {
+        return alpha_float;
+    }
+
+    // next check modelinfo alpha (defaults to 1.0)
+    return modelinfo->alpha.floatValue();
+}
+
+// building faces for skip-textured bmodels
+
+static plane_t
+Node_Plane(const mbsp_t *bsp, const bsp2_dnode_t *node, bool side)
+{
+    const dplane_t *dplane = &bsp->dplanes[node->planenum];
+    plane_t plane;
+    
+    VectorCopy(dplane->normal, plane.normal);
+    plane.dist = dplane->dist;
+    
+    if (side) {
+        VectorScale(plane.normal, -1, plane.normal);
+        plane.dist *= -1.0f;
+    }
+    
+    return plane;
+}
+
+/**
+ * `planes` all of the node planes that bound this leaf, facing inward.
+ */
+static std::vector<winding_t *>
+Leaf_MakeFaces(const mbsp_t *bsp, const mleaf_t *leaf, const std::vector<plane_t> &planes)
+{
+    std::vector<winding_t *> result;
+    
+    for (const plane_t &plane : planes) {
+        // flip the inward-facing split plane to get the outward-facing plane of the face we're constructing
+        plane_t faceplane;
+        VectorScale(plane.normal, -1, faceplane.normal);
+        faceplane.dist = -plane.dist;
+        
+        winding_t *winding = BaseWindingForPlane(faceplane.normal, faceplane.dist);
+        
+        // clip `winding` by all of the other planes
+        for (const plane_t &plane2 : planes) {
+            if (&plane2 == &plane)
+                continue;
+            
+            winding_t *front = nullptr;
+            winding_t *back = nullptr;
+            
+            // frees winding.
+            ClipWinding(winding, plane2.normal, plane2.dist, &front, &back);
+            
+            // discard the back, continue clipping the front part
+            free(back);
+            winding = front;
+            
+            // check if everything was clipped away
+            if (winding == nullptr)
+                break;
+        }
+        
+        if (winding == nullptr) {
+            //logprint("WARNING: winding clipped away\n");
+        } else {
+            result.push_back(winding);
+        }
+    }
+    
+    return result;
+}
+
+static void
+FreeWindings(std::vector<winding_t *> &windings)
+{
+    for (winding_t *winding : windings) {
+        free(winding);
+    }
+    windings.clear();
+}
+
+static void
+MakeFaces_r(const mbsp_t *bsp, const int nodenum, std::vector<plane_t> *planes, std::vector<winding_t *> *result)
+{
+    if (nodenum < 0) {
+        const int leafnum = -nodenum - 1;
+        const mleaf_t *leaf = &bsp->dleafs[leafnum];
+        
+        if ((bsp->loadversion->game->id == GAME_QUAKE_II) ? (leaf->contents & Q2_CONTENTS_SOLID) : leaf->contents == CONTENTS_SOLID) {
+            std::vector<winding_t *> leaf_windings = Leaf_MakeFaces(bsp, leaf, *planes);
+            for (winding_t *w : leaf_windings) {
+                result->push_back(w);
+            }
+        }
+        return;
+    }
+ 
+    const bsp2_dnode_t *node = &bsp->dnodes[nodenum];
+
+    // go down the front side
+    const plane_t front = Node_Plane(bsp, node, false);
+    planes->push_back(front);
+    MakeFaces_r(bsp, node->children[0], planes, result);
+    planes->pop_back();
+    
+    // go down the back side
+    const plane_t back = Node_Plane(bsp, node, true);
+    planes->push_back(back);
+    MakeFaces_r(bsp, node->children[1], planes, result);
+    planes->pop_back();
+}
 
-    // FIXME: re-enable the following code
-    return sample;
-#if 0
-    const auto *miptex = Face_Miptex(bsp, face);
+static std::vector<winding_t *>
+MakeFaces(const mbsp_t *bsp, const dmodel_t *model)
+{
+    std::vector<winding_t *> result;
+    std::vector<plane_t> planes;
+    MakeFaces_r(bsp, model->headnode[0], &planes, &result);
+    Q_assert(planes.empty());
+    
+    return result;
+}
+
+/*
+ * =============
+ * Trace_ClassifyFaces
+ *
+ * Sorts the shadow casting faces by how rays treat them. Without masks,
+ * everything that only shadows some rays goes through the filter.
+ * =============
+ */
+void
+Trace_ClassifyFaces(const mbsp_t *bsp, bool usemasks, tracefaces_t *out)
+{
+    std::vector<const bsp2_dface_t *> &skyfaces = out->sky;
+    std::vector<const bsp2_dface_t *> &solidfaces = out->solid;
+    std::vector<const bsp2_dface_t *> &filterfaces = out->filter;
+    std::vector<const bsp2_dface_t *> &switchablefaces = out->switchable;
+    std::vector<const bsp2_dface_t *> &worldonlyfaces = out->worldonly;
+    std::vector<std::vector<const bsp2_dface_t *>> &selffaces = out->self;
+    std::vector<unsigned> &model_raymasks = out->raymasks;
     
-    if (miptex == nullptr)
-        return sample;
+    model_raymasks.assign(bsp->nummodels, TRACE_MASK_ALWAYS);
     
-    const gtexinfo_t *tex = &bsp->texinfo[face->texinfo];
+    // check all modelinfos
+    for (int mi = 0; mi<bsp->nummodels; mi++) {
+        const modelinfo_t *model = ModelInfoForModel(bsp, mi);
+        
+        const bool isWorld = model->isWorld();
+        const bool shadow = model->shadow.boolValue();
+        const bool shadowself = model->shadowself.boolValue();
+        const bool shadowworldonly = model->shadowworldonly.boolValue();
+        const bool switchableshadow = model->switchableshadow.boolValue();
 
-    vec_t texcoord[2];
-    WorldToTexCoord(point, tex, texcoord);
+        if (usemasks && isWorld)
+            model_raymasks[mi] |= TRACE_MASK_WORLDONLY;
+        
+        if (!(isWorld || shadow || shadowself || shadowworldonly || switchableshadow))
+            continue;
+        
+        // index into selffaces, assigned when the model's first masked face is found
+        int selfslot = -1;
+        
+        for (int i=0; i<model->model->numfaces; i++) {
+            const bsp2_dface_t *face = BSP_GetFace(bsp, model->model->firstface + i);
+            
+            // check for TEX_NOSHADOW
+            const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
+            if (extended_flags.extended & TEX_EXFLAG_NOSHADOW)
+                continue;
+            
+            // handle switchableshadow
+            if (switchableshadow) {
+                if (shadowself || shadowworldonly) {
+                    filterfaces.push_back(face);
+                } else {
+                    switchablefaces.push_back(face);
+                }
+                continue;
+            }
+            
+            const int contents_or_surf_flags = Face_ContentsOrSurfaceFlags(bsp, face); //mxd
+            const gtexinfo_t *texinfo = Face_Texinfo(bsp, face);
+            const bool is_q2 = bsp->loadversion->game->id == GAME_QUAKE_II;
 
-    const int x = clamp_texcoord(texcoord[0], miptex->width);
-    const int y = clamp_texcoord(texcoord[1], miptex->height);
-    assert (x >= 0);
-    assert (y >= 0);
+            //mxd. Skip NODRAW faces, but not SKY ones (Q2's sky01.wal has both flags set)
+            if(is_q2 && (contents_or_surf_flags & Q2_SURF_NODRAW) && !(contents_or_surf_flags & Q2_SURF_SKY))
+                continue;
+            
+            // handle glass / water 
+            const float alpha = Face_Alpha(model, face);
+            if (alpha < 1.0f
+                || (is_q2 && (contents_or_surf_flags & Q2_SURF_TRANSLUCENT))) { //mxd. Both fence and transparent textures are done using SURF_TRANS flags in Q2
+                filterfaces.push_back(face);
+                continue;
+            }
+            
+            // fence
+            const char *texname = Face_TextureName(bsp, face);
+            if (texname[0] == '{') {
+                filterfaces.push_back(face);
+                continue;
+            }
+            
+            // handle sky
+            if (is_q2) {
+                // Q2: arghrad compat: sky faces only emit sunlight if:
+                // sky flag set, light flag set, value nonzero
+                if ((contents_or_surf_flags & Q2_SURF_SKY) != 0
+                    && (!arghradcompat || ((contents_or_surf_flags & Q2_SURF_LIGHT) != 0
+                    && texinfo->value != 0)))
+                {
+                    skyfaces.push_back(face);
+                    continue;
+                }
+            } else {
+                // Q1
+                if (!Q_strncasecmp("sky", texname, 3)) {
+                    skyfaces.push_back(face);
+                    continue;
+                }
+            }
+            
+            // liquids
+            if (/* texname[0] == '*' */ ContentsOrSurfaceFlags_IsTranslucent(bsp, contents_or_surf_flags)) { //mxd
+                if (!isWorld) {
+                    // world liquids never cast shadows; shadow casting bmodel liquids do
+                    solidfaces.push_back(face);
+                }
+                continue;
+            }
+            
+            // solid faces
+            
+            if (isWorld || shadow){
+                solidfaces.push_back(face);
+            } else {
+                // shadowself or shadowworldonly
+                Q_assert(shadowself || shadowworldonly);
+                if (usemasks && shadowself && !shadowworldonly) {
+                    if (selfslot == -1 && selffaces.size() < TRACE_MAX_SELF_MASKS) {
+                        selfslot = static_cast<int>(selffaces.size());
+                        selffaces.emplace_back();
+                        model_raymasks[mi] |= 1u << (TRACE_MASK_SELF_FIRST + selfslot);
+                    }
+                    if (selfslot != -1) {
+                        selffaces[selfslot].push_back(face);
+                    } else {
+                        // out of mask bits
+                        filterfaces.push_back(face);
+                    }
+                } else if (usemasks && shadowworldonly && !shadowself) {
+                    worldonlyfaces.push_back(face);
+                } else {
+                    filterfaces.push_back(face);
+                }
+            }
+        }
+    }
+
+    /* Special handling of skip-textured bmodels */
+    std::vector<winding_t *> &skipwindings = out->skipwindings;
+    for (const modelinfo_t *model : tracelist) {
+        if (model->model->numfaces == 0) {
+            std::vector<winding_t *> windings = MakeFaces(bsp, model->model);
+            for (auto &w : windings) {
+                skipwindings.push_back(w);
+            }
+        }
+    }
     
-    // FIXME: this is broken - palette index? color?
-    // see: https://github.com/ericwa/ericw-tools/commit/0661098bc57d09b9961aa8314c52545a8f89a1e1#diff-dff5fe3d0288e49cabf1e7bc8fb28819c513be54cb7bbcdbea8b52ee0efd6bf5
-    color_rgba *data = (color_rgba*)((uint8_t*)miptex + miptex->offset);
-    sample = data[(miptex->width * y) + x];
+    int numselffaces = 0;
+    for (const auto &faces : selffaces)
+        numselffaces += faces.size();
+    
+    logprint("Trace_ClassifyFaces:\n");
+    logprint("\t%d sky faces\n", (int)skyfaces.size());
+    logprint("\t%d solid faces\n", (int)solidfaces.size());
+    logprint("\t%d filtered faces\n", (int)filterfaces.size());
+    logprint("\t%d switchable shadow faces\n", (int)switchablefaces.size());
+    logprint("\t%d shadowworldonly faces\n", (int)worldonlyfaces.size());
+    logprint("\t%d shadowself faces in %d models\n", numselffaces, (int)selffaces.size());
+    logprint("\t%d shadow-casting skip faces\n", (int)skipwindings.size());
+}
 
-    return sample;
-#endif
+void
+Trace_FreeFaces(tracefaces_t *faces)
+{
+    FreeWindings(faces->skipwindings);
+}
+
+/*
+ * =============
+ * Trace_FilterHit
+ *
+ * Decides a ray hit on a face from tracefaces_t::filter: model membership
+ * for what masks couldn't express, switchable shadows, fences and glass.
+ * =============
+ */
+filterhit_t
+Trace_FilterHit(const modelinfo_t *self, const modelinfo_t *hit_modelinfo, const bsp2_dface_t *face,
+                const vec3_t hitpoint, const vec3_t raydir, const vec3_t hitnormal)
+{
+    filterhit_t result {};
+    
+    if (!hit_modelinfo) {
+        // we hit a "skip" face with no associated model
+        // reject hit (???)
+        return result;
+    }
+    
+    if (hit_modelinfo->shadowworldonly.boolValue()) {
+        // we hit "_shadowworldonly" "1" geometry. Ignore the hit unless we are from world.
+        if (!self || !self->isWorld()) {
+            return result;
+        }
+    }
+    
+    if (hit_modelinfo->shadowself.boolValue()) {
+        // only casts shadows on itself
+        if (self != hit_modelinfo) {
+            return result;
+        }
+    }
+    
+    if (hit_modelinfo->switchableshadow.boolValue()) {
+        // we hit a dynamic shadow caster. reject the hit, but store the
+        // info about what we hit.
+        result.dynamicstyle = hit_modelinfo->switchshadstyle.intValue();
+        return result;
+    }
+    
+    // test fence textures and glass
+    float alpha = Face_Alpha(hit_modelinfo, face);
+
+    //mxd
+    bool isFence, isGlass;
+    if(bsp_static->loadversion->game->id == GAME_QUAKE_II) {
+        const int surf_flags = Face_ContentsOrSurfaceFlags(bsp_static, face);
+        isFence = ((surf_flags & Q2_SURF_TRANSLUCENT) == Q2_SURF_TRANSLUCENT); // KMQuake 2-specific. Use texture alpha chanel when both flags are set.
+        isGlass = !isFence && (surf_flags & Q2_SURF_TRANSLUCENT);
+        if(isGlass)
+            alpha = (surf_flags & Q2_SURF_TRANS33 ? 0.66f : 0.33f);
+    } else {
+        const char *name = Face_TextureName(bsp_static, face);
+        isFence = (name[0] == '{');
+        isGlass = (alpha < 1.0f);
+    }
+    
+    if (isFence || isGlass) {
+        const int facenum = Face_GetNum(bsp_static, face);
+        
+        if (!isGlass) {
+            // fence: only the coverage bit is needed. without -texturefilter
+            // every texel is transparent, as with the old SampleTexture stub
+            result.accept = texturefilter && Face_TexelOpaque(facenum, hitpoint);
+            return result;
+        }
+        
+        // hit glass...
+        const color_rgba sample = Face_SampleTexel(facenum, hitpoint); //mxd. Palette index -> color_rgba
+        
+        //mxd. Adjust alpha by texture alpha?
+        if (sample.a < 255)
+            alpha = sample.a / 255.0f;
+
+        vec3_t rayDir, hitNormal;
+        VectorCopy(raydir, rayDir);
+        VectorCopy(hitnormal, hitNormal);
+        VectorNormalize(rayDir);
+        VectorNormalize(hitNormal);
+        
+        const vec_t raySurfaceCosAngle = DotProduct(rayDir, hitNormal);
+        
+        // only pick up the color of the glass on the _exiting_ side of the glass.
+        // (we currently trace "backwards", from surface point --> light source)
+        if (raySurfaceCosAngle < 0) {
+            result.glass = true;
+            result.opacity = alpha;
+            VectorSet(result.glasscolor, sample.r / 255.0f, sample.g / 255.0f, sample.b / 255.0f);
+        }
+        
+        // reject hit
+        return result;
+    }
+    
+    // accept hit
+    result.accept = true;
+    return result;
+}
+
+/* Tints a ray's color by passing through glass, see Trace_FilterHit */
+void
+Trace_TintRayColor(vec3_t color, float opacity, const vec3_t glasscolor)
+{
+    // clamp opacity
+    opacity = qmin(qmax(0.0f, opacity), 1.0f);
+    
+    Q_assert(glasscolor[0] >= 0.0 && glasscolor[0] <= 1.0);
+    Q_assert(glasscolor[1] >= 0.0 && glasscolor[1] <= 1.0);
+    Q_assert(glasscolor[2] >= 0.0 && glasscolor[2] <= 1.0);
+    
+    //multiply ray color by glass color
+    vec3_t tinted;
+    for (int i=0; i<3; i++) {
+        tinted[i] = color[i] * glasscolor[i];
+    }
+    
+    // lerp between original ray color and fully tinted, based on opacity
+    vec3_t lerped = {0.0, 0.0, 0.0};
+    VectorMA(lerped, opacity, tinted, lerped);
+    VectorMA(lerped, 1.0-opacity, color, lerped);
+    
+    // use the lerped color
+    VectorCopy(lerped, color);
 }
 
 hitresult_t TestSky(const vec3_t start, const vec3_t dirn, const modelinfo_t *self, const bsp2_dface_t **face_out)
 {
-    return Embree_TestSky(start, dirn, self, face_out);
+#ifdef HAVE_EMBREE
+    if (tracer == tracer_t::EMBREE)
+        return Embree_TestSky(start, dirn, self, face_out);
+#endif
+    return BVH_TestSky(start, dirn, self, face_out);
 }
 
 hitresult_t TestLight(const vec3_t start, const vec3_t stop, const modelinfo_t *self)
 {
-    return Embree_TestLight(start, stop, self);
+#ifdef HAVE_EMBREE
+    if (tracer == tracer_t::EMBREE)
+        return Embree_TestLight(start, stop, self);
+#endif
+    return BVH_TestLight(start, stop, self);
 }
 
 raystream_intersection_t *MakeIntersectionRayStream(int maxrays) {
-    return Embree_MakeIntersectionRayStream(maxrays);
+#ifdef HAVE_EMBREE
+    if (tracer == tracer_t::EMBREE)
+        return Embree_MakeIntersectionRayStream(maxrays);
+#endif
+    return BVH_MakeIntersectionRayStream(maxrays);
 }
 raystream_occlusion_t* MakeOcclusionRayStream(int maxrays) {
-    return Embree_MakeOcclusionRayStream(maxrays);
+#ifdef HAVE_EMBREE
+    if (tracer == tracer_t::EMBREE)
+        return Embree_MakeOcclusionRayStream(maxrays);
+#endif
+    return BVH_MakeOcclusionRayStream(maxrays);
 }
 
 void MakeTnodes(const mbsp_t *bsp)
 {
-    Embree_TraceInit(bsp);
+    bsp_static = bsp;
+    SetupTextureCoverage(bsp);
+#ifdef HAVE_EMBREE
+    if (tracer == tracer_t::EMBREE) {
+        Embree_TraceInit(bsp);
+        return;
+    }
+#endif
+    BVH_TraceInit(bsp);
 }
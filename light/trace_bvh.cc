@@ -0,0 +1,880 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/light.hh>
+#include <light/trace_bvh.hh>
+#include <common/bsputils.hh>
+#include <common/polylib.hh>
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace polylib;
+
+/*
+ * ============================================================================
+ * GEOMETRY
+ * ============================================================================
+ */
+
+/* how a ray treats a triangle once it passes the mask test, see tracefaces_t */
+enum class bvhkind_t : uint8_t {
+    SKY,
+    SOLID,
+    FILTER,
+    SWITCHABLE
+};
+
+/* a triangle, set up for Moller-Trumbore */
+typedef struct {
+    float v0[3];
+    float e1[3];    // v1 - v0
+    float e2[3];    // v2 - v0
+} bvhtri_t;
+
+typedef struct {
+    const bsp2_dface_t *face;       // null for skip-textured bmodels
+    const modelinfo_t *modelinfo;
+    unsigned mask;
+    int style;                      // switchshadstyle of SWITCHABLE triangles
+    bvhkind_t kind;
+} bvhtriinfo_t;
+
+/*
+ * 4-wide node, child boxes stored by axis so one SSE op tests all four.
+ * count > 0: leaf, triangles [child, child + count); count == 0: inner node
+ * child. Unused slots have a zero mask, which no ray matches.
+ */
+typedef struct {
+    alignas(16) float bmin[3][4];
+    alignas(16) float bmax[3][4];
+    alignas(16) unsigned mask[4];  // union of the triangle masks below each child
+    int32_t child[4];
+    int32_t count[4];
+} bvhnode_t;
+
+static const int BVH_LEAF_SIZE = 4;     // always split above this...
+static const int BVH_MAX_LEAF = 16;     // ...and never stop above this
+static const int BVH_BINS = 16;
+static const int BVH_STACK_SIZE = 256;
+
+static std::vector<bvhnode_t> bvh_nodes;
+static std::vector<bvhtri_t> bvh_tris;
+static std::vector<bvhtriinfo_t> bvh_triinfo;
+static std::vector<unsigned> bvh_raymasks;  // indexed by model number
+static const mbsp_t *bvh_bsp;
+
+/* Mask for rays cast from the given model, see TRACE_MASK_ALWAYS */
+static unsigned
+BVH_RayMask(const modelinfo_t *self)
+{
+    if (self == nullptr || bvh_raymasks.empty())
+        return TRACE_MASK_ALWAYS;
+    return bvh_raymasks[self->model - bvh_bsp->dmodels];
+}
+
+/*
+ * ============================================================================
+ * BUILDING
+ * ============================================================================
+ */
+
+typedef struct {
+    float min[3], max[3];
+} bvhbox_t;
+
+static inline void
+Box_Clear(bvhbox_t *box)
+{
+    for (int k = 0; k < 3; k++) {
+        box->min[k] = std::numeric_limits<float>::max();
+        box->max[k] = -std::numeric_limits<float>::max();
+    }
+}
+
+static inline void
+Box_Add(bvhbox_t *box, const bvhbox_t &other)
+{
+    for (int k = 0; k < 3; k++) {
+        box->min[k] = qmin(box->min[k], other.min[k]);
+        box->max[k] = qmax(box->max[k], other.max[k]);
+    }
+}
+
+static inline float
+Box_HalfArea(const bvhbox_t &box)
+{
+    if (box.min[0] > box.max[0])
+        return 0;
+    const float dx = box.max[0] - box.min[0];
+    const float dy = box.max[1] - box.min[1];
+    const float dz = box.max[2] - box.min[2];
+    return dx * dy + dy * dz + dz * dx;
+}
+
+typedef struct {
+    std::vector<bvhbox_t> bounds;   // per triangle
+    std::vector<float> centroids;   // 3 per triangle
+    std::vector<uint32_t> order;    // triangle indices, partitioned in place
+} bvhbuild_t;
+
+static bvhbox_t
+BVH_RangeBounds(const bvhbuild_t &b, int begin, int end, unsigned *mask_out)
+{
+    bvhbox_t box;
+    Box_Clear(&box);
+    unsigned mask = 0;
+    for (int i = begin; i < end; i++) {
+        Box_Add(&box, b.bounds[b.order[i]]);
+        mask |= bvh_triinfo[b.order[i]].mask;
+    }
+    if (mask_out)
+        *mask_out = mask;
+    return box;
+}
+
+/*
+ * Splits order[begin, end) in two with a binned SAH. Returns false if the
+ * range should stay a leaf.
+ */
+static bool
+BVH_SplitRange(bvhbuild_t &b, int begin, int end, const bvhbox_t &box, int *mid)
+{
+    const int count = end - begin;
+    if (count <= BVH_LEAF_SIZE)
+        return false;
+
+    bvhbox_t cbox;
+    Box_Clear(&cbox);
+    for (int i = begin; i < end; i++) {
+        const float *c = &b.centroids[3 * b.order[i]];
+        for (int k = 0; k < 3; k++) {
+            cbox.min[k] = qmin(cbox.min[k], c[k]);
+            cbox.max[k] = qmax(cbox.max[k], c[k]);
+        }
+    }
+
+    int axis = 0;
+    for (int k = 1; k < 3; k++) {
+        if (cbox.max[k] - cbox.min[k] > cbox.max[axis] - cbox.min[axis])
+            axis = k;
+    }
+    const float extent = cbox.max[axis] - cbox.min[axis];
+    if (extent <= 0) {
+        // all centroids coincide, split the list in half
+        *mid = begin + count / 2;
+        return true;
+    }
+
+    const float scale = BVH_BINS / extent;
+    auto binForTri = [&](uint32_t tri) {
+        const int bin = static_cast<int>((b.centroids[3 * tri + axis] - cbox.min[axis]) * scale);
+        return qmin(qmax(bin, 0), BVH_BINS - 1);
+    };
+
+    bvhbox_t binbox[BVH_BINS];
+    int bincount[BVH_BINS] = {};
+    for (int i = 0; i < BVH_BINS; i++)
+        Box_Clear(&binbox[i]);
+    for (int i = begin; i < end; i++) {
+        const int bin = binForTri(b.order[i]);
+        Box_Add(&binbox[bin], b.bounds[b.order[i]]);
+        bincount[bin]++;
+    }
+
+    // cost of splitting after each bin: right side swept from the top
+    float rightcost[BVH_BINS];
+    bvhbox_t acc;
+    Box_Clear(&acc);
+    int accn = 0;
+    for (int i = BVH_BINS - 1; i > 0; i--) {
+        Box_Add(&acc, binbox[i]);
+        accn += bincount[i];
+        rightcost[i - 1] = Box_HalfArea(acc) * accn;
+    }
+
+    float bestcost = std::numeric_limits<float>::max();
+    int bestbin = -1;
+    Box_Clear(&acc);
+    accn = 0;
+    for (int i = 0; i < BVH_BINS - 1; i++) {
+        Box_Add(&acc, binbox[i]);
+        accn += bincount[i];
+        const float cost = Box_HalfArea(acc) * accn + rightcost[i];
+        if (accn > 0 && accn < count && cost < bestcost) {
+            bestcost = cost;
+            bestbin = i;
+        }
+    }
+
+    if (bestbin == -1) {
+        *mid = begin + count / 2;
+        return true;
+    }
+
+    // stop if splitting costs more than testing every triangle
+    if (count <= BVH_MAX_LEAF && bestcost >= Box_HalfArea(box) * count)
+        return false;
+
+    auto it = std::partition(b.order.begin() + begin, b.order.begin() + end,
+                             [&](uint32_t tri) { return binForTri(tri) <= bestbin; });
+    *mid = static_cast<int>(it - b.order.begin());
+    return true;
+}
+
+/* Builds the node for order[begin, end), returns its index */
+static int
+BVH_BuildNode(bvhbuild_t &b, int begin, int end)
+{
+    typedef struct {
+        int begin, end;
+        bvhbox_t box;
+        unsigned mask;
+        bool leaf;
+    } childrange_t;
+
+    // split the range into up to four, always splitting the largest child
+    childrange_t ranges[4];
+    int numranges = 1;
+    ranges[0].begin = begin;
+    ranges[0].end = end;
+    ranges[0].box = BVH_RangeBounds(b, begin, end, &ranges[0].mask);
+    ranges[0].leaf = false;
+
+    while (numranges < 4) {
+        int best = -1;
+        for (int i = 0; i < numranges; i++) {
+            if (ranges[i].leaf || ranges[i].end - ranges[i].begin <= BVH_LEAF_SIZE)
+                continue;
+            if (best == -1 || Box_HalfArea(ranges[i].box) > Box_HalfArea(ranges[best].box))
+                best = i;
+        }
+        if (best == -1)
+            break;
+
+        childrange_t &r = ranges[best];
+        int mid;
+        if (!BVH_SplitRange(b, r.begin, r.end, r.box, &mid)) {
+            r.leaf = true;
+            continue;
+        }
+
+        childrange_t &right = ranges[numranges++];
+        right.begin = mid;
+        right.end = r.end;
+        right.box = BVH_RangeBounds(b, mid, r.end, &right.mask);
+        right.leaf = false;
+        r.end = mid;
+        r.box = BVH_RangeBounds(b, r.begin, mid, &r.mask);
+    }
+
+    const int nodenum = static_cast<int>(bvh_nodes.size());
+    bvh_nodes.emplace_back();
+    {
+        bvhnode_t &node = bvh_nodes[nodenum];
+        for (int i = 0; i < 4; i++) {
+            for (int k = 0; k < 3; k++) {
+                node.bmin[k][i] = 0;
+                node.bmax[k][i] = 0;
+            }
+            node.mask[i] = 0;
+            node.child[i] = -1;
+            node.count[i] = 0;
+        }
+    }
+
+    for (int i = 0; i < numranges; i++) {
+        const childrange_t &r = ranges[i];
+        const int count = r.end - r.begin;
+        if (count == 0)
+            continue;
+
+        int child, childcount;
+        if (r.leaf || count <= BVH_LEAF_SIZE) {
+            child = r.begin;
+            childcount = count;
+        } else {
+            child = BVH_BuildNode(b, r.begin, r.end); // may reallocate bvh_nodes
+            childcount = 0;
+        }
+
+        bvhnode_t &node = bvh_nodes[nodenum];
+        for (int k = 0; k < 3; k++) {
+            // pad so axial faces don't fall through the box test on rounding
+            const float pad = 0.01f + 1e-6f * qmax(fabs(r.box.min[k]), fabs(r.box.max[k]));
+            node.bmin[k][i] = r.box.min[k] - pad;
+            node.bmax[k][i] = r.box.max[k] + pad;
+        }
+        node.mask[i] = r.mask;
+        node.child[i] = child;
+        node.count[i] = childcount;
+    }
+
+    return nodenum;
+}
+
+static void
+BVH_AddTriangle(bvhbuild_t &b, const vec_t *p0, const vec_t *p1, const vec_t *p2,
+                const bvhtriinfo_t &info)
+{
+    bvhtri_t tri;
+    bvhbox_t box;
+    Box_Clear(&box);
+    for (int k = 0; k < 3; k++) {
+        tri.v0[k] = p0[k];
+        tri.e1[k] = p1[k] - p0[k];
+        tri.e2[k] = p2[k] - p0[k];
+
+        box.min[k] = qmin(qmin(p0[k], p1[k]), p2[k]);
+        box.max[k] = qmax(qmax(p0[k], p1[k]), p2[k]);
+        b.centroids.push_back((box.min[k] + box.max[k]) * 0.5f);
+    }
+
+    bvh_tris.push_back(tri);
+    bvh_triinfo.push_back(info);
+    b.bounds.push_back(box);
+}
+
+static void
+BVH_AddFaces(bvhbuild_t &b, const mbsp_t *bsp, const std::vector<const bsp2_dface_t *> &faces,
+             bvhkind_t kind, unsigned mask)
+{
+    for (const bsp2_dface_t *face : faces) {
+        if (face->numedges < 3)
+            continue;
+
+        bvhtriinfo_t info;
+        info.face = face;
+        // NOTE: can be null for "skip" faces
+        info.modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
+        info.mask = mask;
+        info.style = (kind == bvhkind_t::SWITCHABLE && info.modelinfo) ? info.modelinfo->switchshadstyle.intValue() : 0;
+        info.kind = kind;
+
+        // same fan as the Embree geometry, so glass sees the same winding
+        const vec_t *p0 = GetSurfaceVertexPoint(bsp, face, 0);
+        for (int j = 2; j < face->numedges; j++) {
+            BVH_AddTriangle(b, GetSurfaceVertexPoint(bsp, face, j - 1), GetSurfaceVertexPoint(bsp, face, j), p0, info);
+        }
+    }
+}
+
+void
+BVH_TraceInit(const mbsp_t *bsp)
+{
+    bvh_bsp = bsp;
+    bvh_nodes.clear();
+    bvh_tris.clear();
+    bvh_triinfo.clear();
+
+    tracefaces_t faces;
+    Trace_ClassifyFaces(bsp, true, &faces);
+    bvh_raymasks = faces.raymasks;
+
+    bvhbuild_t b;
+    BVH_AddFaces(b, bsp, faces.sky, bvhkind_t::SKY, TRACE_MASK_ALWAYS);
+    BVH_AddFaces(b, bsp, faces.solid, bvhkind_t::SOLID, TRACE_MASK_ALWAYS);
+    BVH_AddFaces(b, bsp, faces.filter, bvhkind_t::FILTER, TRACE_MASK_ALWAYS);
+    BVH_AddFaces(b, bsp, faces.switchable, bvhkind_t::SWITCHABLE, TRACE_MASK_ALWAYS);
+    BVH_AddFaces(b, bsp, faces.worldonly, bvhkind_t::SOLID, TRACE_MASK_WORLDONLY);
+    for (size_t i = 0; i < faces.self.size(); i++)
+        BVH_AddFaces(b, bsp, faces.self[i], bvhkind_t::SOLID, 1u << (TRACE_MASK_SELF_FIRST + i));
+
+    for (const winding_t *w : faces.skipwindings) {
+        const bvhtriinfo_t info { nullptr, nullptr, TRACE_MASK_ALWAYS, 0, bvhkind_t::SOLID };
+        for (int j = 2; j < w->numpoints; j++)
+            BVH_AddTriangle(b, w->p[j - 1], w->p[j], w->p[0], info);
+    }
+
+    Trace_FreeFaces(&faces);
+
+    const int numtris = static_cast<int>(bvh_tris.size());
+    b.order.resize(numtris);
+    for (int i = 0; i < numtris; i++)
+        b.order[i] = i;
+
+    BVH_BuildNode(b, 0, numtris);
+
+    // store the triangles in leaf order
+    std::vector<bvhtri_t> tris(numtris);
+    std::vector<bvhtriinfo_t> triinfo(numtris);
+    for (int i = 0; i < numtris; i++) {
+        tris[i] = bvh_tris[b.order[i]];
+        triinfo[i] = bvh_triinfo[b.order[i]];
+    }
+    bvh_tris.swap(tris);
+    bvh_triinfo.swap(triinfo);
+
+    logprint("BVH_TraceInit: %d triangles, %d nodes\n", numtris, static_cast<int>(bvh_nodes.size()));
+}
+
+/*
+ * ============================================================================
+ * TRAVERSAL
+ * ============================================================================
+ */
+
+typedef struct {
+    float org[3];
+    float dir[3];       // can be un-normalized, distances are in units of its length
+    float invdir[3];
+    float tfar;         // shortened to the closest accepted hit
+    unsigned mask;
+    const modelinfo_t *self;
+    vec_t *color;       // tinted by glass, may be null
+    int dynamicstyle;
+    int hittri;         // -1 if nothing was hit
+} bvhray_t;
+
+static void
+BVH_SetupRay(bvhray_t *ray, const vec3_t start, const vec3_t dir, vec_t dist, const modelinfo_t *self, vec_t *color)
+{
+    for (int k = 0; k < 3; k++) {
+        ray->org[k] = start[k];
+        ray->dir[k] = dir[k];
+        // keep the slab test free of 0 * inf
+        const float d = (fabs(dir[k]) > 1e-20f) ? dir[k] : (dir[k] < 0 ? -1e-20f : 1e-20f);
+        ray->invdir[k] = 1.0f / d;
+    }
+    ray->tfar = dist;
+    ray->mask = BVH_RayMask(self);
+    ray->self = self;
+    ray->color = color;
+    ray->dynamicstyle = 0;
+    ray->hittri = -1;
+}
+
+static inline bool
+BVH_IntersectTri(const bvhtri_t &tri, const bvhray_t &ray, float *t_out)
+{
+    const float *e1 = tri.e1, *e2 = tri.e2, *d = ray.dir;
+
+    const float p[3] = { d[1] * e2[2] - d[2] * e2[1],
+                         d[2] * e2[0] - d[0] * e2[2],
+                         d[0] * e2[1] - d[1] * e2[0] };
+    const float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    if (det == 0)
+        return false;
+    const float invdet = 1.0f / det;
+
+    const float s[3] = { ray.org[0] - tri.v0[0], ray.org[1] - tri.v0[1], ray.org[2] - tri.v0[2] };
+    const float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invdet;
+    if (u < 0 || u > 1)
+        return false;
+
+    const float q[3] = { s[1] * e1[2] - s[2] * e1[1],
+                         s[2] * e1[0] - s[0] * e1[2],
+                         s[0] * e1[1] - s[1] * e1[0] };
+    const float v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * invdet;
+    if (v < 0 || u + v > 1)
+        return false;
+
+    const float t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * invdet;
+    if (t <= 0 || t >= ray.tfar)
+        return false;
+
+    *t_out = t;
+    return true;
+}
+
+/*
+ * Decides a candidate hit like the Embree filters do. Returns true if the
+ * hit blocks the ray.
+ */
+static inline bool
+BVH_AcceptHit(bvhray_t *ray, int tri, float t)
+{
+    const bvhtriinfo_t &info = bvh_triinfo[tri];
+
+    switch (info.kind) {
+    case bvhkind_t::SKY:
+    case bvhkind_t::SOLID:
+        return true;
+    case bvhkind_t::SWITCHABLE:
+        ray->dynamicstyle = info.style;
+        return false;
+    case bvhkind_t::FILTER:
+        break;
+    }
+
+    const bvhtri_t &bt = bvh_tris[tri];
+    vec3_t hitpoint, dir, normal;
+    for (int k = 0; k < 3; k++) {
+        hitpoint[k] = ray->org[k] + t * ray->dir[k];
+        dir[k] = ray->dir[k];
+    }
+    // same orientation as Embree's geometric normal
+    normal[0] = bt.e1[1] * bt.e2[2] - bt.e1[2] * bt.e2[1];
+    normal[1] = bt.e1[2] * bt.e2[0] - bt.e1[0] * bt.e2[2];
+    normal[2] = bt.e1[0] * bt.e2[1] - bt.e1[1] * bt.e2[0];
+
+    const filterhit_t result = Trace_FilterHit(ray->self, info.modelinfo, info.face, hitpoint, dir, normal);
+    if (result.dynamicstyle)
+        ray->dynamicstyle = result.dynamicstyle;
+    if (result.glass && ray->color)
+        Trace_TintRayColor(ray->color, result.opacity, result.glasscolor);
+    return result.accept;
+}
+
+/*
+ * Traces the ray through the BVH. With occlusion, stops at the first hit
+ * that blocks it and returns true; otherwise finds the closest (ray->tfar,
+ * ray->hittri) and returns whether there was one.
+ */
+template<bool occlusion>
+static bool
+BVH_Trace(bvhray_t *ray)
+{
+    if (bvh_nodes.empty())
+        return false;
+
+    struct stackentry_t {
+        int32_t child;
+        int32_t count;
+        float tmin;
+    };
+    stackentry_t stack[BVH_STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = { 0, 0, 0.0f };
+
+#ifdef __SSE2__
+    const __m128 ox = _mm_set1_ps(ray->org[0]);
+    const __m128 oy = _mm_set1_ps(ray->org[1]);
+    const __m128 oz = _mm_set1_ps(ray->org[2]);
+    const __m128 ix = _mm_set1_ps(ray->invdir[0]);
+    const __m128 iy = _mm_set1_ps(ray->invdir[1]);
+    const __m128 iz = _mm_set1_ps(ray->invdir[2]);
+    const __m128i raymask = _mm_set1_epi32(static_cast<int>(ray->mask));
+#endif
+
+    while (sp > 0) {
+        const stackentry_t entry = stack[--sp];
+        if (entry.tmin > ray->tfar)
+            continue;
+
+        if (entry.count > 0) {
+            for (int i = entry.child; i < entry.child + entry.count; i++) {
+                if (!(bvh_triinfo[i].mask & ray->mask))
+                    continue;
+                float t;
+                if (!BVH_IntersectTri(bvh_tris[i], *ray, &t))
+                    continue;
+                if (!BVH_AcceptHit(ray, i, t))
+                    continue;
+                if (occlusion)
+                    return true;
+                ray->tfar = t;
+                ray->hittri = i;
+            }
+            continue;
+        }
+
+        const bvhnode_t &node = bvh_nodes[entry.child];
+        alignas(16) float tmin[4];
+        int hits;
+
+#ifdef __SSE2__
+        const __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmin[0]), ox), ix);
+        const __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmax[0]), ox), ix);
+        const __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmin[1]), oy), iy);
+        const __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmax[1]), oy), iy);
+        const __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmin[2]), oz), iz);
+        const __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmax[2]), oz), iz);
+
+        const __m128 near4 = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+                                        _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_setzero_ps()));
+        const __m128 far4 = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+                                       _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(ray->tfar)));
+        _mm_store_ps(tmin, near4);
+
+        const __m128i masked = _mm_and_si128(_mm_load_si128(reinterpret_cast<const __m128i *>(node.mask)), raymask);
+        const int maskmiss = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(masked, _mm_setzero_si128())));
+        hits = _mm_movemask_ps(_mm_cmple_ps(near4, far4)) & ~maskmiss;
+#else
+        hits = 0;
+        for (int i = 0; i < 4; i++) {
+            if (!(node.mask[i] & ray->mask))
+                continue;
+            float tnear = 0, tfar = ray->tfar;
+            for (int k = 0; k < 3; k++) {
+                const float t0 = (node.bmin[k][i] - ray->org[k]) * ray->invdir[k];
+                const float t1 = (node.bmax[k][i] - ray->org[k]) * ray->invdir[k];
+                tnear = qmax(tnear, qmin(t0, t1));
+                tfar = qmin(tfar, qmax(t0, t1));
+            }
+            tmin[i] = tnear;
+            if (tnear <= tfar)
+                hits |= 1 << i;
+        }
+#endif
+
+        if (!hits)
+            continue;
+
+        // push the far children first so the nearest is traced next
+        int order[4], n = 0;
+        for (int i = 0; i < 4; i++) {
+            if (!(hits & (1 << i)))
+                continue;
+            int j = n++;
+            while (j > 0 && tmin[order[j - 1]] < tmin[i]) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
+        }
+        Q_assert(sp + n <= BVH_STACK_SIZE);
+        for (int j = 0; j < n; j++) {
+            const int i = order[j];
+            stack[sp++] = { node.child[i], node.count[i], tmin[i] };
+        }
+    }
+
+    return !occlusion && ray->hittri != -1;
+}
+
+static hittype_t
+BVH_HitType(const bvhray_t &ray)
+{
+    if (ray.hittri == -1)
+        return hittype_t::NONE;
+    return (bvh_triinfo[ray.hittri].kind == bvhkind_t::SKY) ? hittype_t::SKY : hittype_t::SOLID;
+}
+
+//public
+hitresult_t BVH_TestLight(const vec3_t start, const vec3_t stop, const modelinfo_t *self)
+{
+    vec3_t dir;
+    VectorSubtract(stop, start, dir);
+    const vec_t dist = VectorNormalize(dir);
+
+    bvhray_t ray;
+    BVH_SetupRay(&ray, start, dir, dist, self, nullptr);
+    if (BVH_Trace<true>(&ray))
+        return {false, 0}; //fully occluded
+
+    // no obstruction (or a switchable shadow obstruction only)
+    return {true, ray.dynamicstyle};
+}
+
+//public
+hitresult_t BVH_TestSky(const vec3_t start, const vec3_t dirn, const modelinfo_t *self, const bsp2_dface_t **face_out)
+{
+    vec3_t dir_normalized;
+    VectorCopy(dirn, dir_normalized);
+    VectorNormalize(dir_normalized);
+
+    bvhray_t ray;
+    BVH_SetupRay(&ray, start, dir_normalized, MAX_SKY_DIST, self, nullptr);
+    BVH_Trace<false>(&ray);
+
+    const bool hit_sky = (BVH_HitType(ray) == hittype_t::SKY);
+    if (face_out)
+        *face_out = hit_sky ? bvh_triinfo[ray.hittri].face : nullptr;
+
+    return {hit_sky, ray.dynamicstyle};
+}
+
+/*
+ * ============================================================================
+ * RAY STREAMS
+ * ============================================================================
+ */
+
+class raystream_bvh_common_t : public virtual raystream_common_t {
+protected:
+    std::vector<bvhray_t> _rays;
+    std::vector<float> _rays_maxdist;
+    std::vector<int> _point_indices;
+    std::vector<vec3_t> _ray_colors;
+    std::vector<vec3_t> _ray_normalcontribs;
+    std::vector<int> _ray_dynamic_styles;
+    size_t _numrays;
+    size_t _maxrays;
+
+public:
+    raystream_bvh_common_t(int maxRays) :
+        _rays(maxRays),
+        _rays_maxdist(maxRays),
+        _point_indices(maxRays),
+        _ray_colors(maxRays),
+        _ray_normalcontribs(maxRays),
+        _ray_dynamic_styles(maxRays),
+        _numrays { 0 },
+        _maxrays { static_cast<size_t>(maxRays) } {}
+
+    void pushRay(int i, const vec_t *origin, const vec3_t dir, float dist, const vec_t *color = nullptr, const vec_t *normalcontrib = nullptr) override {
+        Q_assert(_numrays<_maxrays);
+        _rays_maxdist[_numrays] = dist;
+        _point_indices[_numrays] = i;
+        if (color) {
+            VectorCopy(color, _ray_colors[_numrays]);
+        } else {
+            VectorClear(_ray_colors[_numrays]);
+        }
+        if (normalcontrib) {
+            VectorCopy(normalcontrib, _ray_normalcontribs[_numrays]);
+        } else {
+            VectorClear(_ray_normalcontribs[_numrays]);
+        }
+        _ray_dynamic_styles[_numrays] = 0;
+        BVH_SetupRay(&_rays[_numrays], origin, dir, dist, nullptr, _ray_colors[_numrays]);
+        _numrays++;
+    }
+
+    size_t numPushedRays() override {
+        return _numrays;
+    }
+
+    int getPushedRayPointIndex(size_t j) override {
+        Q_assert(j < _maxrays);
+        return _point_indices[j];
+    }
+
+    void getPushedRayColor(size_t j, vec3_t out) override {
+        Q_assert(j < _maxrays);
+        VectorCopy(_ray_colors[j], out);
+    }
+
+    void getPushedRayNormalContrib(size_t j, vec3_t out) override {
+        Q_assert(j < _maxrays);
+        VectorCopy(_ray_normalcontribs[j], out);
+    }
+
+    int getPushedRayDynamicStyle(size_t j) override {
+        Q_assert(j < _maxrays);
+        return _ray_dynamic_styles[j];
+    }
+
+    void getPushedRayDir(size_t j, vec3_t out) override {
+        Q_assert(j < _maxrays);
+        for (int k = 0; k < 3; k++)
+            out[k] = _rays[j].dir[k];
+    }
+
+    const int *getPushedRayPointIndices() override {
+        return _point_indices.data();
+    }
+
+    const vec3_t *getPushedRayColors() override {
+        return _ray_colors.data();
+    }
+
+    const vec3_t *getPushedRayNormalContribs() override {
+        return _ray_normalcontribs.data();
+    }
+
+    const int *getPushedRayDynamicStyles() override {
+        return _ray_dynamic_styles.data();
+    }
+
+    void clearPushedRays() override {
+        _numrays = 0;
+    }
+
+protected:
+    /* Sets the mask / source model of every pushed ray before tracing */
+    void setRaySource(const modelinfo_t *self) {
+        const unsigned mask = BVH_RayMask(self);
+        for (size_t j = 0; j < _numrays; j++) {
+            _rays[j].mask = mask;
+            _rays[j].self = self;
+        }
+    }
+};
+
+class raystream_bvh_intersection_t : public raystream_bvh_common_t, public raystream_intersection_t {
+private:
+    std::vector<hittype_t> _hittypes;
+
+public:
+    raystream_bvh_intersection_t(int maxRays) :
+        raystream_bvh_common_t(maxRays),
+        _hittypes(maxRays) {}
+
+    void tracePushedRaysIntersection(const modelinfo_t *self) override {
+        setRaySource(self);
+        for (size_t j = 0; j < _numrays; j++) {
+            BVH_Trace<false>(&_rays[j]);
+            _hittypes[j] = BVH_HitType(_rays[j]);
+            _ray_dynamic_styles[j] = _rays[j].dynamicstyle;
+        }
+    }
+
+    float getPushedRayHitDist(size_t j) override {
+        Q_assert(j < _maxrays);
+        return _rays[j].tfar;
+    }
+
+    hittype_t getPushedRayHitType(size_t j) override {
+        Q_assert(j < _maxrays);
+        return _hittypes[j];
+    }
+
+    const hittype_t *getPushedRayHitTypes() override {
+        return _hittypes.data();
+    }
+
+    const bsp2_dface_t *getPushedRayHitFace(size_t j) override {
+        Q_assert(j < _maxrays);
+        const int tri = _rays[j].hittri;
+        return (tri == -1) ? nullptr : bvh_triinfo[tri].face;
+    }
+};
+
+class raystream_bvh_occlusion_t : public raystream_bvh_common_t, public raystream_occlusion_t {
+private:
+    std::vector<uint8_t> _occluded; // bool, without the vector<bool> packing
+
+public:
+    raystream_bvh_occlusion_t(int maxRays) :
+        raystream_bvh_common_t(maxRays),
+        _occluded(maxRays) {}
+
+    void tracePushedRaysOcclusion(const modelinfo_t *self) override {
+        setRaySource(self);
+        for (size_t j = 0; j < _numrays; j++) {
+            _occluded[j] = BVH_Trace<true>(&_rays[j]);
+            _ray_dynamic_styles[j] = _rays[j].dynamicstyle;
+        }
+    }
+
+    bool getPushedRayOccluded(size_t j) override {
+        Q_assert(j < _maxrays);
+        return _occluded[j];
+    }
+
+    const bool *getPushedRaysOccluded() override {
+        return reinterpret_cast<const bool *>(_occluded.data());
+    }
+};
+
+raystream_occlusion_t *BVH_MakeOcclusionRayStream(int maxrays)
+{
+    return new raystream_bvh_occlusion_t{maxrays};
+}
+
+raystream_intersection_t *BVH_MakeIntersectionRayStream(int maxrays)
+{
+    return new raystream_bvh_intersection_t{maxrays};
+}
@@ -26,6 +26,7 @@
 #include <embree3/rtcore.h>
 #include <embree3/rtcore_ray.h>
 #include <vector>
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <cstdlib>
@@ -65,27 +66,9 @@ struct ray_source_info : public RTCIntersectContext {
         }
 };
 
-/**
- * Returns 1.0 unless a custom alpha value is set.
- * The priority is: "_light_alpha" (read from extended_texinfo_flags), then "alpha"
- */
-static float
-Face_Alpha(const modelinfo_t *modelinfo, const bsp2_dface_t *face)
-{
-    const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];  
-
-    // for _light_alpha, 0 is considered unset
-    const float alpha_float = (float)extended_flags.light_alpha / (float)UCHAR_MAX;
-    if (alpha_float != 0.0f) {
-        return alpha_float;
-    }
-
-    // next check modelinfo alpha (defaults to 1.0)
-    return modelinfo->alpha.floatValue();
-}
-
 sceneinfo
-CreateGeometry(const mbsp_t *bsp, RTCDevice g_device, RTCScene scene, const std::vector<const bsp2_dface_t *> &faces)
+CreateGeometry(const mbsp_t *bsp, RTCDevice g_device, RTCScene scene, const std::vector<const bsp2_dface_t *> &faces,
+               unsigned mask = TRACE_MASK_ALWAYS)
 {
     // count triangles
     int numtris = 0;
@@ -97,9 +80,7 @@ CreateGeometry(const mbsp_t *bsp, RTCDevice g_device, RTCScene scene, const std:
     
     unsigned int geomID;
     RTCGeometry geom_0 = rtcNewGeometry (g_device, RTC_GEOMETRY_TYPE_TRIANGLE);
-    // we're not using masks, but they need to be set to something or else all rays miss
-    // if embree is compiled with them
-    rtcSetGeometryMask(geom_0, 1);
+    rtcSetGeometryMask(geom_0, mask);
     rtcSetGeometryBuildQuality(geom_0,RTC_BUILD_QUALITY_MEDIUM);
     rtcSetGeometryTimeStepCount(geom_0,1);
     geomID = rtcAttachGeometry(scene,geom_0);
@@ -167,7 +148,7 @@ CreateGeometryFromWindings(RTCDevice g_device, RTCScene scene, const std::vector
     unsigned int geomID;
     RTCGeometry geom_1 = rtcNewGeometry (g_device, RTC_GEOMETRY_TYPE_TRIANGLE);
     rtcSetGeometryBuildQuality(geom_1,RTC_BUILD_QUALITY_MEDIUM);
-    rtcSetGeometryMask(geom_1, 1);
+    rtcSetGeometryMask(geom_1, TRACE_MASK_ALWAYS);
     rtcSetGeometryTimeStepCount(geom_1,1);
     geomID = rtcAttachGeometry(scene,geom_1);
     rtcReleaseGeometry(geom_1);
@@ -216,6 +197,12 @@ RTCScene scene;
 sceneinfo skygeom;    // sky. always occludes.
 sceneinfo solidgeom;  // solids. always occludes.
 sceneinfo filtergeom; // conditional occluders.. needs to run ray intersection filter
+sceneinfo switchablegeom;           // switchable shadows. filter only records the style
+sceneinfo worldonlygeom;            // _shadowworldonly. masked, only rays from the world see it
+std::vector<sceneinfo> selfgeoms;   // _shadowself, one per model. masked, only rays from that model see it
+
+static std::vector<const sceneinfo *> sceneinfo_for_geomid;
+static std::vector<unsigned> model_raymasks; // indexed by model number
 
 static const mbsp_t *bsp_static;
 
@@ -227,16 +214,20 @@ void ErrorCallback(void* userptr, const RTCError code, const char* str)
 static const sceneinfo &
 Embree_SceneinfoForGeomID(unsigned int geomID)
 {
-    if (geomID == skygeom.geomID) {
-        return skygeom;
-    } else if (geomID == solidgeom.geomID) {
-        return solidgeom;
-    } else if (geomID == filtergeom.geomID) {
-        return filtergeom;
-    } else {
+    if (geomID >= sceneinfo_for_geomid.size() || sceneinfo_for_geomid[geomID] == nullptr) {
         Error("unexpected geomID");
         throw; //mxd. Added to silence compiler warning
     }
+    return *sceneinfo_for_geomid[geomID];
+}
+
+/* Mask for rays cast from the given model, see TRACE_MASK_ALWAYS */
+static unsigned
+Embree_RayMask(const modelinfo_t *self)
+{
+    if (self == nullptr || model_raymasks.empty())
+        return TRACE_MASK_ALWAYS;
+    return model_raymasks[self->model - bsp_static->dmodels];
 }
 
 const bsp2_dface_t *Embree_LookupFace(unsigned int geomID, unsigned int primID)
@@ -308,117 +299,59 @@ Embree_FilterFuncN(const struct RTCFilterFunctionNArguments* args)
         // unpack ray index
         const unsigned rayIndex = rayID;
         
-        const modelinfo_t *source_modelinfo = rsi->self;
         const modelinfo_t *hit_modelinfo = Embree_LookupModelinfo(geomID, primID);
-        if (!hit_modelinfo) {
-            // we hit a "skip" face with no associated model
-            // reject hit (???)
-            valid[i] = INVALID;
-            continue;
-        }
+        const bsp2_dface_t *face = Embree_LookupFace(geomID, primID);
         
-        if (hit_modelinfo->shadowworldonly.boolValue()) {
-            // we hit "_shadowworldonly" "1" geometry. Ignore the hit unless we are from world.
-            if (!source_modelinfo || !source_modelinfo->isWorld()) {
-                // reject hit
-                valid[i] = INVALID;
-                continue;
-            }
-        }
+        vec3_t hitpoint;
+        Embree_RayEndpoint(ray, N, i, hitpoint);
+        const vec3_t rayDir = {
+            RTCRayN_dir_x(ray, N, i),
+            RTCRayN_dir_y(ray, N, i),
+            RTCRayN_dir_z(ray, N, i)
+        };
+        const vec3_t potentialHitGeometryNormal = {
+            RTCHitN_Ng_x(potentialHit, N, i),
+            RTCHitN_Ng_y(potentialHit, N, i),
+            RTCHitN_Ng_z(potentialHit, N, i)
+        };
         
-        if (hit_modelinfo->shadowself.boolValue()) {
-            // only casts shadows on itself
-            if (source_modelinfo != hit_modelinfo) {
-                // reject hit
-                valid[i] = INVALID;
-                continue;
-            }
+        const filterhit_t result = Trace_FilterHit(rsi->self, hit_modelinfo, face, hitpoint, rayDir, potentialHitGeometryNormal);
+        if (result.dynamicstyle) {
+            AddDynamicOccluderToRay(context, rayIndex, result.dynamicstyle);
         }
-        
-        if (hit_modelinfo->switchableshadow.boolValue()) {
-            // we hit a dynamic shadow caster. reject the hit, but store the
-            // info about what we hit.
-            
-            const int style = hit_modelinfo->switchshadstyle.intValue();
-            
-            AddDynamicOccluderToRay(context, rayIndex, style);
-            
+        if (result.glass) {
+            AddGlassToRay(context, rayIndex, result.opacity, result.glasscolor);
+        }
+        if (!result.accept) {
             // reject hit
             valid[i] = INVALID;
             continue;
         }
         
-        // test fence textures and glass
-        const bsp2_dface_t *face = Embree_LookupFace(geomID, primID);
-        float alpha = Face_Alpha(hit_modelinfo, face);
-
-        //mxd
-        bool isFence, isGlass;
-        if(bsp_static->loadversion->game->id == GAME_QUAKE_II) {
-            const int surf_flags = Face_ContentsOrSurfaceFlags(bsp_static, face);
-            isFence = ((surf_flags & Q2_SURF_TRANSLUCENT) == Q2_SURF_TRANSLUCENT); // KMQuake 2-specific. Use texture alpha chanel when both flags are set.
-            isGlass = !isFence && (surf_flags & Q2_SURF_TRANSLUCENT);
-            if(isGlass)
-                alpha = (surf_flags & Q2_SURF_TRANS33 ? 0.66f : 0.33f);
-        } else {
-            const char *name = Face_TextureName(bsp_static, face);
-            isFence = (name[0] == '{');
-            isGlass = (alpha < 1.0f);
-        }
+        // accept hit
+        // (just need to leave the `valid` value set to VALID)
+    }
+}
+
+// switchable shadow casters never block a ray, they only record the style they would have blocked
+static void
+Embree_SwitchableFilterFuncN(const struct RTCFilterFunctionNArguments* args)
+{
+    const sceneinfo *info = static_cast<const sceneinfo *>(args->geometryUserPtr);
+    const unsigned int N = args->N;
+
+    for (size_t i=0; i<N; i++) {
+        if (args->valid[i] != -1)
+            continue;
         
-        if (isFence || isGlass) {
-            vec3_t hitpoint;
-            Embree_RayEndpoint(ray, N, i, hitpoint);
-            const color_rgba sample = SampleTexture(face, bsp_static, hitpoint); //mxd. Palette index -> color_rgba
+        const unsigned rayIndex = RTCRayN_id(args->ray, N, i);
+        const unsigned primID = RTCHitN_primID(args->hit, N, i);
+        const modelinfo_t *hit_modelinfo = info->triToModelinfo[primID];
         
-            if (isGlass) {
-                // hit glass...
-                
-                //mxd. Adjust alpha by texture alpha?
-                if (sample.a < 255)
-                    alpha = sample.a / 255.0f;
-
-                vec3_t rayDir = {
-                    RTCRayN_dir_x(ray, N, i),
-                    RTCRayN_dir_y(ray, N, i),
-                    RTCRayN_dir_z(ray, N, i)
-                };
-                vec3_t potentialHitGeometryNormal = {
-                    RTCHitN_Ng_x(potentialHit, N, i),
-                    RTCHitN_Ng_y(potentialHit, N, i),
-                    RTCHitN_Ng_z(potentialHit, N, i)
-                };
-                
-                VectorNormalize(rayDir);
-                VectorNormalize(potentialHitGeometryNormal);
-                
-                const vec_t raySurfaceCosAngle = DotProduct(rayDir, potentialHitGeometryNormal);
-                
-                // only pick up the color of the glass on the _exiting_ side of the glass.
-                // (we currently trace "backwards", from surface point --> light source)
-                if (raySurfaceCosAngle < 0) {
-                    vec3_t samplecolor { (float)sample.r, (float)sample.g, (float)sample.b };
-                    VectorScale(samplecolor, 1/255.0f, samplecolor);
-                    
-                    AddGlassToRay(context, rayIndex, alpha, samplecolor);
-                }
-                
-                // reject hit
-                valid[i] = INVALID;
-                continue;
-            }
-            
-            if (isFence) {
-                if (sample.a < 255) {
-                    // reject hit
-                    valid[i] = INVALID;
-                    continue;
-                }
-            }
-        }
+        AddDynamicOccluderToRay(args->context, rayIndex, hit_modelinfo->switchshadstyle.intValue());
         
-        // accept hit
-        // (just need to leave the `valid` value set to VALID)
+        // reject hit
+        args->valid[i] = 0;
     }
 }
 
@@ -482,227 +415,12 @@ ExportObj(const char *filename, const vector<winding_t *> &windings)
 
 #endif
 
-plane_t Node_Plane(const mbsp_t *bsp, const bsp2_dnode_t *node, bool side)
-{
-    const dplane_t *dplane = &bsp->dplanes[node->planenum];
-    plane_t plane;
-    
-    VectorCopy(dplane->normal, plane.normal);
-    plane.dist = dplane->dist;
-    
-    if (side) {
-        VectorScale(plane.normal, -1, plane.normal);
-        plane.dist *= -1.0f;
-    }
-    
-    return plane;
-}
-
-/**
- * `planes` all of the node planes that bound this leaf, facing inward.
- */
-std::vector<winding_t *>
-Leaf_MakeFaces(const mbsp_t *bsp, const mleaf_t *leaf, const std::vector<plane_t> &planes)
-{
-    std::vector<winding_t *> result;
-    
-    for (const plane_t &plane : planes) {
-        // flip the inward-facing split plane to get the outward-facing plane of the face we're constructing
-        plane_t faceplane;
-        VectorScale(plane.normal, -1, faceplane.normal);
-        faceplane.dist = -plane.dist;
-        
-        winding_t *winding = BaseWindingForPlane(faceplane.normal, faceplane.dist);
-        
-        // clip `winding` by all of the other planes
-        for (const plane_t &plane2 : planes) {
-            if (&plane2 == &plane)
-                continue;
-            
-            winding_t *front = nullptr;
-            winding_t *back = nullptr;
-            
-            // frees winding.
-            ClipWinding(winding, plane2.normal, plane2.dist, &front, &back);
-            
-            // discard the back, continue clipping the front part
-            free(back);
-            winding = front;
-            
-            // check if everything was clipped away
-            if (winding == nullptr)
-                break;
-        }
-        
-        if (winding == nullptr) {
-            //logprint("WARNING: winding clipped away\n");
-        } else {
-            result.push_back(winding);
-        }
-    }
-    
-    return result;
-}
-
-void FreeWindings(std::vector<winding_t *> &windings)
-{
-    for (winding_t *winding : windings) {
-        free(winding);
-    }
-    windings.clear();
-}
-
-void
-MakeFaces_r(const mbsp_t *bsp, const int nodenum, std::vector<plane_t> *planes, std::vector<winding_t *> *result)
-{
-    if (nodenum < 0) {
-        const int leafnum = -nodenum - 1;
-        const mleaf_t *leaf = &bsp->dleafs[leafnum];
-        
-        if ((bsp->loadversion->game->id == GAME_QUAKE_II) ? (leaf->contents & Q2_CONTENTS_SOLID) : leaf->contents == CONTENTS_SOLID) {
-            std::vector<winding_t *> leaf_windings = Leaf_MakeFaces(bsp, leaf, *planes);
-            for (winding_t *w : leaf_windings) {
-                result->push_back(w);
-            }
-        }
-        return;
-    }
- 
-    const bsp2_dnode_t *node = &bsp->dnodes[nodenum];
-
-    // go down the front side
-    const plane_t front = Node_Plane(bsp, node, false);
-    planes->push_back(front);
-    MakeFaces_r(bsp, node->children[0], planes, result);
-    planes->pop_back();
-    
-    // go down the back side
-    const plane_t back = Node_Plane(bsp, node, true);
-    planes->push_back(back);
-    MakeFaces_r(bsp, node->children[1], planes, result);
-    planes->pop_back();
-}
-
-std::vector<winding_t *>
-MakeFaces(const mbsp_t *bsp, const dmodel_t *model)
-{
-    std::vector<winding_t *> result;
-    std::vector<plane_t> planes;
-    MakeFaces_r(bsp, model->headnode[0], &planes, &result);
-    Q_assert(planes.empty());
-    
-    return result;
-}
-
 void
 Embree_TraceInit(const mbsp_t *bsp)
 {
     bsp_static = bsp;
     Q_assert(device == nullptr);
     
-    std::vector<const bsp2_dface_t *> skyfaces, solidfaces, filterfaces;
-    
-    // check all modelinfos
-    for (int mi = 0; mi<bsp->nummodels; mi++) {
-        const modelinfo_t *model = ModelInfoForModel(bsp, mi);
-        
-        const bool isWorld = model->isWorld();
-        const bool shadow = model->shadow.boolValue();
-        const bool shadowself = model->shadowself.boolValue();
-        const bool shadowworldonly = model->shadowworldonly.boolValue();
-        const bool switchableshadow = model->switchableshadow.boolValue();
-
-        if (!(isWorld || shadow || shadowself || shadowworldonly || switchableshadow))
-            continue;
-        
-        for (int i=0; i<model->model->numfaces; i++) {
-            const bsp2_dface_t *face = BSP_GetFace(bsp, model->model->firstface + i);
-            
-            // check for TEX_NOSHADOW
-            const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
-            if (extended_flags.extended & TEX_EXFLAG_NOSHADOW)
-                continue;
-            
-            // handle switchableshadow
-            if (switchableshadow) {
-                filterfaces.push_back(face);
-                continue;
-            }
-            
-            const int contents_or_surf_flags = Face_ContentsOrSurfaceFlags(bsp, face); //mxd
-            const gtexinfo_t *texinfo = Face_Texinfo(bsp, face);
-            const bool is_q2 = bsp->loadversion->game->id == GAME_QUAKE_II;
-
-            //mxd. Skip NODRAW faces, but not SKY ones (Q2's sky01.wal has both flags set)
-            if(is_q2 && (contents_or_surf_flags & Q2_SURF_NODRAW) && !(contents_or_surf_flags & Q2_SURF_SKY))
-                continue;
-            
-            // handle glass / water 
-            const float alpha = Face_Alpha(model, face);
-            if (alpha < 1.0f
-                || (is_q2 && (contents_or_surf_flags & Q2_SURF_TRANSLUCENT))) { //mxd. Both fence and transparent textures are done using SURF_TRANS flags in Q2
-                filterfaces.push_back(face);
-                continue;
-            }
-            
-            // fence
-            const char *texname = Face_TextureName(bsp, face);
-            if (texname[0] == '{') {
-                filterfaces.push_back(face);
-                continue;
-            }
-            
-            // handle sky
-            if (is_q2) {
-                // Q2: arghrad compat: sky faces only emit sunlight if:
-                // sky flag set, light flag set, value nonzero
-                if ((contents_or_surf_flags & Q2_SURF_SKY) != 0
-                    && (!arghradcompat || ((contents_or_surf_flags & Q2_SURF_LIGHT) != 0
-                    && texinfo->value != 0)))
-                {
-                    skyfaces.push_back(face);
-                    continue;
-                }
-            } else {
-                // Q1
-                if (!Q_strncasecmp("sky", texname, 3)) {
-                    skyfaces.push_back(face);
-                    continue;
-                }
-            }
-            
-            // liquids
-            if (/* texname[0] == '*' */ ContentsOrSurfaceFlags_IsTranslucent(bsp, contents_or_surf_flags)) { //mxd
-                if (!isWorld) {
-                    // world liquids never cast shadows; shadow casting bmodel liquids do
-                    solidfaces.push_back(face);
-                }
-                continue;
-            }
-            
-            // solid faces
-            
-            if (isWorld || shadow){
-                solidfaces.push_back(face);
-            } else {
-                // shadowself or shadowworldonly
-                Q_assert(shadowself || shadowworldonly);
-                filterfaces.push_back(face);
-            }
-        }
-    }
-
-    /* Special handling of skip-textured bmodels */
-    std::vector<winding_t *> skipwindings;
-    for (const modelinfo_t *model : tracelist) {
-        if (model->model->numfaces == 0) {
-            std::vector<winding_t *> windings = MakeFaces(bsp, model->model);
-            for (auto &w : windings) {
-                skipwindings.push_back(w);
-            }
-        }
-    }
-    
     device = rtcNewDevice (NULL);
     rtcSetDeviceErrorFunction(device,ErrorCallback,nullptr); //mxd. Changed from rtcDeviceSetErrorFunction to silence compiler warning...
     
@@ -712,27 +430,52 @@ Embree_TraceInit(const mbsp_t *bsp)
     const size_t ver_pat = rtcGetDeviceProperty (device,RTC_DEVICE_PROPERTY_VERSION_PATCH);
     logprint("Embree_TraceInit: Embree version: %d.%d.%d\n",
              static_cast<int>(ver_maj), static_cast<int>(ver_min), static_cast<int>(ver_pat));
-
+    
+    // without ray mask support every conditional occluder has to go through the filter
+    const bool usemasks = rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_RAY_MASK_SUPPORTED) != 0;
+    if (!usemasks)
+        logprint("Embree_TraceInit: ray masks not supported, using filter callbacks\n");
+    
+    tracefaces_t faces;
+    Trace_ClassifyFaces(bsp, usemasks, &faces);
+    model_raymasks = faces.raymasks;
+    
     scene = rtcNewScene(device);
     rtcSetSceneFlags(scene,RTC_SCENE_FLAG_NONE);
     rtcSetSceneBuildQuality(scene,RTC_BUILD_QUALITY_HIGH);
-    skygeom = CreateGeometry(bsp, device, scene, skyfaces);
-    solidgeom = CreateGeometry(bsp, device, scene, solidfaces);
-    filtergeom = CreateGeometry(bsp, device, scene, filterfaces);
-    CreateGeometryFromWindings(device, scene, skipwindings);
+    skygeom = CreateGeometry(bsp, device, scene, faces.sky);
+    solidgeom = CreateGeometry(bsp, device, scene, faces.solid);
+    filtergeom = CreateGeometry(bsp, device, scene, faces.filter);
+    switchablegeom = CreateGeometry(bsp, device, scene, faces.switchable);
+    worldonlygeom = CreateGeometry(bsp, device, scene, faces.worldonly, TRACE_MASK_WORLDONLY);
+    selfgeoms.clear();
+    for (size_t i = 0; i < faces.self.size(); i++)
+        selfgeoms.push_back(CreateGeometry(bsp, device, scene, faces.self[i], 1u << (TRACE_MASK_SELF_FIRST + i)));
+    CreateGeometryFromWindings(device, scene, faces.skipwindings);
     
     rtcSetGeometryIntersectFilterFunction(rtcGetGeometry(scene,filtergeom.geomID),Embree_FilterFuncN<filtertype_t::INTERSECTION>);
     rtcSetGeometryOccludedFilterFunction(rtcGetGeometry(scene,filtergeom.geomID),Embree_FilterFuncN<filtertype_t::OCCLUSION>);
     
+    RTCGeometry switchable = rtcGetGeometry(scene, switchablegeom.geomID);
+    rtcSetGeometryUserData(switchable, &switchablegeom);
+    rtcSetGeometryIntersectFilterFunction(switchable, Embree_SwitchableFilterFuncN);
+    rtcSetGeometryOccludedFilterFunction(switchable, Embree_SwitchableFilterFuncN);
+    
     rtcCommitScene(scene);
     
-    logprint("Embree_TraceInit:\n");
-    logprint("\t%d sky faces\n", (int)skyfaces.size());
-    logprint("\t%d solid faces\n", (int)solidfaces.size());
-    logprint("\t%d filtered faces\n", (int)filterfaces.size());
-    logprint("\t%d shadow-casting skip faces\n", (int)skipwindings.size());
+    sceneinfo_for_geomid.clear();
+    for (const sceneinfo *info : { &skygeom, &solidgeom, &filtergeom, &switchablegeom, &worldonlygeom }) {
+        if (info->geomID >= sceneinfo_for_geomid.size())
+            sceneinfo_for_geomid.resize(info->geomID + 1, nullptr);
+        sceneinfo_for_geomid[info->geomID] = info;
+    }
+    for (const sceneinfo &info : selfgeoms) {
+        if (info.geomID >= sceneinfo_for_geomid.size())
+            sceneinfo_for_geomid.resize(info.geomID + 1, nullptr);
+        sceneinfo_for_geomid[info.geomID] = &info;
+    }
     
-    FreeWindings(skipwindings);
+    Trace_FreeFaces(&faces);
 }
 
 static RTCRayHit SetupRay(unsigned rayindex, const vec3_t start, const vec3_t dir, vec_t dist)
@@ -749,7 +492,7 @@ static RTCRayHit SetupRay(unsigned rayindex, const vec3_t start, const vec3_t di
     ray.ray.time = 0.f; // not using
 
     ray.ray.tfar = dist;
-    ray.ray.mask = 1; // we're not using, but needs to be set if embree is compiled with masks
+    ray.ray.mask = TRACE_MASK_ALWAYS; // callers casting from a model set Embree_RayMask
     ray.ray.id = rayindex;
     ray.ray.flags = 0; // reserved
     
@@ -772,6 +515,7 @@ static RTCRayHit SetupRay_StartStop(const vec3_t start, const vec3_t stop)
 hitresult_t Embree_TestLight(const vec3_t start, const vec3_t stop, const modelinfo_t *self)
 {
     RTCRay ray = SetupRay_StartStop(start, stop).ray;
+    ray.mask = Embree_RayMask(self);
 
     ray_source_info ctx2(nullptr, self);
     rtcOccluded1(scene, &ctx2,&ray);
@@ -794,6 +538,7 @@ hitresult_t Embree_TestSky(const vec3_t start, const vec3_t dirn, const modelinf
     VectorNormalize(dir_normalized);
     
     RTCRayHit ray = SetupRay(0, start, dir_normalized, MAX_SKY_DIST);
+    ray.ray.mask = Embree_RayMask(self);
 
     ray_source_info ctx2(nullptr, self);
     rtcIntersect1(scene, &ctx2,&ray);
@@ -816,6 +561,7 @@ hitresult_t Embree_TestSky(const vec3_t start, const vec3_t dirn, const modelinf
 hittype_t Embree_DirtTrace(const vec3_t start, const vec3_t dirn, vec_t dist, const modelinfo_t *self, vec_t *hitdist_out, plane_t *hitplane_out, const bsp2_dface_t **face_out)
 {
     RTCRayHit ray = SetupRay(0, start, dirn, dist);
+    ray.ray.mask = Embree_RayMask(self);
     ray_source_info ctx2(nullptr, self);
     rtcIntersect1(scene, &ctx2,&ray);
     ray.hit.Ng_x = -ray.hit.Ng_x;
@@ -877,6 +623,120 @@ static void q_aligned_free(void *ptr)
 #endif
 }
 
+/*
+ * Ray geometry for a batch, in the SoA layout rtcOccludedNp/rtcIntersectNp
+ * expect. Embree repacks the stream into SIMD-width packets internally.
+ */
+struct raysoa_t {
+    float *org_x, *org_y, *org_z, *tnear;
+    float *dir_x, *dir_y, *dir_z, *time;
+    float *tfar;
+    unsigned *mask, *id, *flags;
+    
+    /* hit, only allocated for intersection streams */
+    float *Ng_x, *Ng_y, *Ng_z, *u, *v;
+    unsigned *primID, *geomID, *instID;
+    
+    raysoa_t(int maxRays, bool withHits) {
+        float **floats[] = { &org_x, &org_y, &org_z, &tnear, &dir_x, &dir_y, &dir_z, &time, &tfar,
+                             &Ng_x, &Ng_y, &Ng_z, &u, &v };
+        unsigned **uints[] = { &mask, &id, &flags, &primID, &geomID, &instID };
+        
+        for (float **f : floats)
+            *f = nullptr;
+        for (unsigned **ui : uints)
+            *ui = nullptr;
+        
+        for (int i = 0; i < (withHits ? 14 : 9); i++)
+            *floats[i] = static_cast<float *>(q_aligned_malloc(64, sizeof(float) * maxRays));
+        for (int i = 0; i < (withHits ? 6 : 3); i++)
+            *uints[i] = static_cast<unsigned *>(q_aligned_malloc(64, sizeof(unsigned) * maxRays));
+    }
+    
+    ~raysoa_t() {
+        for (float *f : { org_x, org_y, org_z, tnear, dir_x, dir_y, dir_z, time, tfar, Ng_x, Ng_y, Ng_z, u, v })
+            q_aligned_free(f);
+        for (unsigned *ui : { mask, id, flags, primID, geomID, instID })
+            q_aligned_free(ui);
+    }
+    
+    raysoa_t(const raysoa_t &) = delete;
+    raysoa_t &operator=(const raysoa_t &) = delete;
+    
+    void set(int slot, unsigned rayindex, const vec3_t start, const vec3_t dir, vec_t dist) {
+        org_x[slot] = start[0];
+        org_y[slot] = start[1];
+        org_z[slot] = start[2];
+        tnear[slot] = 0.f;
+        dir_x[slot] = dir[0]; // can be un-normalized
+        dir_y[slot] = dir[1];
+        dir_z[slot] = dir[2];
+        time[slot] = 0.f; // not using
+        tfar[slot] = dist;
+        mask[slot] = TRACE_MASK_ALWAYS; // set per batch by setRayMasks
+        id[slot] = rayindex;
+        flags[slot] = 0; // reserved
+        if (geomID) {
+            geomID[slot] = RTC_INVALID_GEOMETRY_ID;
+            primID[slot] = RTC_INVALID_GEOMETRY_ID;
+            instID[slot] = RTC_INVALID_GEOMETRY_ID;
+        }
+    }
+    
+    void copy(int dst, const raysoa_t &src, int srcslot) {
+        org_x[dst] = src.org_x[srcslot];
+        org_y[dst] = src.org_y[srcslot];
+        org_z[dst] = src.org_z[srcslot];
+        tnear[dst] = src.tnear[srcslot];
+        dir_x[dst] = src.dir_x[srcslot];
+        dir_y[dst] = src.dir_y[srcslot];
+        dir_z[dst] = src.dir_z[srcslot];
+        time[dst] = src.time[srcslot];
+        tfar[dst] = src.tfar[srcslot];
+        mask[dst] = src.mask[srcslot];
+        id[dst] = src.id[srcslot];
+        flags[dst] = src.flags[srcslot];
+        if (geomID) {
+            geomID[dst] = src.geomID[srcslot];
+            primID[dst] = src.primID[srcslot];
+            instID[dst] = src.instID[srcslot];
+        }
+    }
+    
+    RTCRayNp rayNp() const {
+        RTCRayNp r;
+        r.org_x = org_x; r.org_y = org_y; r.org_z = org_z; r.tnear = tnear;
+        r.dir_x = dir_x; r.dir_y = dir_y; r.dir_z = dir_z; r.time = time;
+        r.tfar = tfar;
+        r.mask = mask; r.id = id; r.flags = flags;
+        return r;
+    }
+    
+    RTCRayHitNp rayHitNp() const {
+        RTCRayHitNp rh;
+        rh.ray = rayNp();
+        rh.hit.Ng_x = Ng_x; rh.hit.Ng_y = Ng_y; rh.hit.Ng_z = Ng_z;
+        rh.hit.u = u; rh.hit.v = v;
+        rh.hit.primID = primID; rh.hit.geomID = geomID;
+        // no instancing is used, so every level shares one array
+        for (auto &level : rh.hit.instID)
+            level = instID;
+        return rh;
+    }
+};
+
+/* Spreads the low 10 bits of v out to every third bit */
+static uint32_t
+Morton_Spread(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
 class raystream_embree_common_t : public virtual raystream_common_t {
 public:
     float *_rays_maxdist;
@@ -890,21 +750,30 @@ public:
     // straight through).
     int *_ray_dynamic_styles;
     
+    // rays in push order; the id of each ray is its push index, which is
+    // what the filter callbacks use to find the payload above
+    raysoa_t _rays;
+    
+    // -sortrays: _sorted holds the batch in Morton order of origin (grouped
+    // by direction octant), _order[slot] the sort key and push index of each
+    // slot. The key is 3 octant bits above 30 Morton bits, so it's 64-bit.
+    raysoa_t _sorted;
+    std::vector<std::pair<uint64_t, int>> _order;
+    
     int _numrays;
     int _maxrays;
-//    streamstate_t _state;
     
 public:
-    raystream_embree_common_t(int maxRays) :
+    raystream_embree_common_t(int maxRays, bool withHits) :
         _rays_maxdist { new float[maxRays] },
         _point_indices { new int[maxRays] },
         _ray_colors { static_cast<vec3_t *>(calloc(maxRays, sizeof(vec3_t))) },
         _ray_normalcontribs { static_cast<vec3_t *>(calloc(maxRays, sizeof(vec3_t))) },
         _ray_dynamic_styles { new int[maxRays] },
+        _rays { maxRays, withHits },
+        _sorted { sortrays ? maxRays : 0, withHits },
         _numrays { 0 },
         _maxrays { maxRays } {}
-        //,
-        //_state { streamstate_t::READY } {}
     
     ~raystream_embree_common_t() {
         delete[] _rays_maxdist;
@@ -914,12 +783,26 @@ public:
         delete[] _ray_dynamic_styles;
     }
     
+    void pushRay(int i, const vec_t *origin, const vec3_t dir, float dist, const vec_t *color = nullptr, const vec_t *normalcontrib = nullptr) override {
+        Q_assert(_numrays<_maxrays);
+        _rays.set(_numrays, _numrays, origin, dir, dist);
+        _rays_maxdist[_numrays] = dist;
+        _point_indices[_numrays] = i;
+        if (color) {
+            VectorCopy(color, _ray_colors[_numrays]);
+        }
+        if (normalcontrib) {
+            VectorCopy(normalcontrib, _ray_normalcontribs[_numrays]);
+        }
+        _ray_dynamic_styles[_numrays] = 0;
+        _numrays++;
+    }
+    
     size_t numPushedRays() override {
         return _numrays;
     }
     
     int getPushedRayPointIndex(size_t j) override {
-       // Q_assert(_state != streamstate_t::READY);
         Q_assert(j < _maxrays);
         return _point_indices[j];
     }
@@ -939,85 +822,151 @@ public:
         return _ray_dynamic_styles[j];
     }
     
+    void getPushedRayDir(size_t j, vec3_t out) override {
+        Q_assert(j < _maxrays);
+        out[0] = _rays.dir_x[j];
+        out[1] = _rays.dir_y[j];
+        out[2] = _rays.dir_z[j];
+    }
+    
+    const int *getPushedRayPointIndices() override {
+        return _point_indices;
+    }
+    
+    const vec3_t *getPushedRayColors() override {
+        return _ray_colors;
+    }
+    
+    const vec3_t *getPushedRayNormalContribs() override {
+        return _ray_normalcontribs;
+    }
+    
+    const int *getPushedRayDynamicStyles() override {
+        return _ray_dynamic_styles;
+    }
+    
     void clearPushedRays() override {
         _numrays = 0;
-        //_state = streamstate_t::READY;
+    }
+    
+protected:
+    /* Masks every pushed ray as cast from self, see Embree_RayMask */
+    void setRayMasks(const modelinfo_t *self) {
+        const unsigned mask = Embree_RayMask(self);
+        for (int j = 0; j < _numrays; j++)
+            _rays.mask[j] = mask;
+    }
+    
+    /**
+     * Returns the SoA batch to hand to Embree: _rays, or with -sortrays a
+     * copy in _sorted ordered for coherence. Small batches aren't worth it.
+     */
+    const raysoa_t &raysToTrace() {
+        if (!sortrays || _numrays < 64)
+            return _rays;
+        
+        vec3_t mins, maxs;
+        ClearBounds(mins, maxs);
+        for (int j = 0; j < _numrays; j++) {
+            const vec3_t org = { _rays.org_x[j], _rays.org_y[j], _rays.org_z[j] };
+            AddPointToBounds(org, mins, maxs);
+        }
+        
+        vec3_t scale;
+        for (int k = 0; k < 3; k++)
+            scale[k] = (maxs[k] > mins[k]) ? (1023.0f / (maxs[k] - mins[k])) : 0.0f;
+        
+        _order.resize(_numrays);
+        for (int j = 0; j < _numrays; j++) {
+            const uint64_t octant = (_rays.dir_x[j] < 0 ? 1 : 0)
+                                  | (_rays.dir_y[j] < 0 ? 2 : 0)
+                                  | (_rays.dir_z[j] < 0 ? 4 : 0);
+            const uint32_t x = static_cast<uint32_t>((_rays.org_x[j] - mins[0]) * scale[0]);
+            const uint32_t y = static_cast<uint32_t>((_rays.org_y[j] - mins[1]) * scale[1]);
+            const uint32_t z = static_cast<uint32_t>((_rays.org_z[j] - mins[2]) * scale[2]);
+            
+            const uint32_t morton = Morton_Spread(x) | (Morton_Spread(y) << 1) | (Morton_Spread(z) << 2);
+            _order[j] = { (octant << 30) | morton, j };
+        }
+        std::sort(_order.begin(), _order.end());
+        
+        for (int slot = 0; slot < _numrays; slot++)
+            _sorted.copy(slot, _rays, _order[slot].second);
+        return _sorted;
+    }
+    
+    /* Copies the results of a traced _sorted batch back to push order */
+    void unsortRays(const raysoa_t &traced) {
+        if (&traced == &_rays)
+            return;
+        
+        for (int slot = 0; slot < _numrays; slot++)
+            _rays.copy(_order[slot].second, traced, slot);
     }
 };
 
 
 class raystream_embree_intersection_t : public raystream_embree_common_t, public raystream_intersection_t {
 public:
-    RTCRayHit *_rays;
+    hittype_t *_hittypes;
 public:
     raystream_embree_intersection_t(int maxRays) :
-    raystream_embree_common_t(maxRays),
-    _rays { static_cast<RTCRayHit *>(q_aligned_malloc(16, sizeof(RTCRayHit) * maxRays)) }
+    raystream_embree_common_t(maxRays, true),
+    _hittypes { new hittype_t[maxRays] }
     {}
 
     ~raystream_embree_intersection_t() {
-        q_aligned_free(_rays);
-    }
-
-    void pushRay(int i, const vec_t *origin, const vec3_t dir, float dist, const vec_t *color = nullptr, const vec_t *normalcontrib = nullptr) override {
-        Q_assert(_numrays<_maxrays);
-        const RTCRayHit rayHit = SetupRay(_numrays, origin, dir, dist);
-        _rays[_numrays] = rayHit;
-        _rays_maxdist[_numrays] = dist;
-        _point_indices[_numrays] = i;
-        if (color) {
-            VectorCopy(color, _ray_colors[_numrays]);
-        }
-        if (normalcontrib) {
-            VectorCopy(normalcontrib, _ray_normalcontribs[_numrays]);
-        }
-        _ray_dynamic_styles[_numrays] = 0;
-        _numrays++;
+        delete[] _hittypes;
     }
 
     void tracePushedRaysIntersection(const modelinfo_t *self) override {
         if (!_numrays)
             return;
         
+        setRayMasks(self);
+        const raysoa_t &rays = raysToTrace();
+        const RTCRayHitNp rayhits = rays.rayHitNp();
+        
         ray_source_info ctx2(this, self);
-        rtcIntersect1M(scene, &ctx2, _rays, _numrays, sizeof(_rays[0]));
-    }
-
-    void getPushedRayDir(size_t j, vec3_t out) override {
-        Q_assert(j < _maxrays);
-        out[0] = _rays[j].ray.dir_x;
-        out[1] = _rays[j].ray.dir_y;
-        out[2] = _rays[j].ray.dir_z;        
+        rtcIntersectNp(scene, &ctx2, &rayhits, _numrays);
+        
+        unsortRays(rays);
+        
+        for (int j = 0; j < _numrays; j++) {
+            const unsigned id = _rays.geomID[j];
+            if (id == RTC_INVALID_GEOMETRY_ID) {
+                _hittypes[j] = hittype_t::NONE;
+            } else if (id == skygeom.geomID) {
+                _hittypes[j] = hittype_t::SKY;
+            } else {
+                _hittypes[j] = hittype_t::SOLID;
+            }
+        }
     }
 
     float getPushedRayHitDist(size_t j) override {
         Q_assert(j < _maxrays);
-        return _rays[j].ray.tfar;
+        return _rays.tfar[j];
     }
 
     hittype_t getPushedRayHitType(size_t j) override {
         Q_assert(j < _maxrays);
-
-        const unsigned id = _rays[j].hit.geomID;
-        if (id == RTC_INVALID_GEOMETRY_ID) {
-            return hittype_t::NONE;
-        } else if (id == skygeom.geomID) {
-            return hittype_t::SKY;
-        } else {
-            return hittype_t::SOLID;
-        }
+        return _hittypes[j];
+    }
+    
+    const hittype_t *getPushedRayHitTypes() override {
+        return _hittypes;
     }
 
     const bsp2_dface_t *getPushedRayHitFace(size_t j) override {
         Q_assert(j < _maxrays);
         
-        const RTCRayHit &ray = _rays[j];
-        
-        if (ray.hit.geomID == RTC_INVALID_GEOMETRY_ID)
+        const unsigned geomID = _rays.geomID[j];
+        if (geomID == RTC_INVALID_GEOMETRY_ID)
             return nullptr;
         
-        const sceneinfo &si = Embree_SceneinfoForGeomID(ray.hit.geomID);
-        const bsp2_dface_t *face = si.triToFace.at(ray.hit.primID);
+        const sceneinfo &si = Embree_SceneinfoForGeomID(geomID);
+        const bsp2_dface_t *face = si.triToFace.at(_rays.primID[j]);
         Q_assert(face != nullptr);
         
         return face;
@@ -1026,53 +975,41 @@ public:
 
 class raystream_embree_occlusion_t : public raystream_embree_common_t, public raystream_occlusion_t {
 public:
-    RTCRay *_rays;
+    bool *_occluded;
 public:
     raystream_embree_occlusion_t(int maxRays) :
-    raystream_embree_common_t(maxRays),
-    _rays { static_cast<RTCRay *>(q_aligned_malloc(16, sizeof(RTCRay) * maxRays)) }
+    raystream_embree_common_t(maxRays, false),
+    _occluded { new bool[maxRays] }
     {}
 
     ~raystream_embree_occlusion_t() {
-        q_aligned_free(_rays);
-    }
-
-    void pushRay(int i, const vec_t *origin, const vec3_t dir, float dist, const vec_t *color = nullptr, const vec_t *normalcontrib = nullptr) override {
-        Q_assert(_numrays<_maxrays);
-        _rays[_numrays] = SetupRay(_numrays, origin, dir, dist).ray;
-        _rays_maxdist[_numrays] = dist;
-        _point_indices[_numrays] = i;
-        if (color) {
-            VectorCopy(color, _ray_colors[_numrays]);
-        }
-        if (normalcontrib) {
-            VectorCopy(normalcontrib, _ray_normalcontribs[_numrays]);
-        }
-        _ray_dynamic_styles[_numrays] = 0;
-        _numrays++;
+        delete[] _occluded;
     }
 
     void tracePushedRaysOcclusion(const modelinfo_t *self) override {
-        //Q_assert(_state == streamstate_t::READY);
-        
         if (!_numrays)
             return;
+        
+        setRayMasks(self);
+        const raysoa_t &rays = raysToTrace();
+        const RTCRayNp raysNp = rays.rayNp();
 
         ray_source_info ctx2(this, self);
-        rtcOccluded1M(scene, &ctx2, _rays, _numrays, sizeof(_rays[0]));
+        rtcOccludedNp(scene, &ctx2, &raysNp, _numrays);
+        
+        unsortRays(rays);
+        
+        for (int j = 0; j < _numrays; j++)
+            _occluded[j] = (_rays.tfar[j] < 0.0f);
     }
 
     bool getPushedRayOccluded(size_t j) override {
         Q_assert(j < _maxrays);
-        return (_rays[j].tfar < 0.0f);
+        return _occluded[j];
     }
-
-    void getPushedRayDir(size_t j, vec3_t out) override {
-        Q_assert(j < _maxrays);
-
-        out[0] = _rays[j].dir_x;
-        out[1] = _rays[j].dir_y;
-        out[2] = _rays[j].dir_z; 
+    
+    const bool *getPushedRaysOccluded() override {
+        return _occluded;
     }
 };
 
@@ -1096,31 +1033,9 @@ void AddGlassToRay(RTCIntersectContext* context, unsigned rayIndex, float opacit
         return;
     }
     
-    // clamp opacity
-    opacity = qmin(qmax(0.0f, opacity), 1.0f);
-    
     Q_assert(rayIndex < rs->_numrays);
     
-    Q_assert(glasscolor[0] >= 0.0 && glasscolor[0] <= 1.0);
-    Q_assert(glasscolor[1] >= 0.0 && glasscolor[1] <= 1.0);
-    Q_assert(glasscolor[2] >= 0.0 && glasscolor[2] <= 1.0);
-    
-    //multiply ray color by glass color
-    vec3_t tinted;
-    for (int i=0; i<3; i++) {
-        tinted[i] = rs->_ray_colors[rayIndex][i] * glasscolor[i];
-    }
-    
-    // lerp between original ray color and fully tinted, based on opacity
-    vec3_t lerped = {0.0, 0.0, 0.0};
-    VectorMA(lerped, opacity, tinted, lerped);
-    VectorMA(lerped, 1.0-opacity, rs->_ray_colors[rayIndex], lerped);
-    
-    // use the lerped color, scaled by (1-opacity) as the new ray color
-  //  VectorScale(lerped, (1.0f - opacity), rs->_ray_colors[rayIndex]);
-    
-    // use the lerped color
-    VectorCopy(lerped, rs->_ray_colors[rayIndex]);
+    Trace_TintRayColor(rs->_ray_colors[rayIndex], opacity, glasscolor);
 }
 
 void AddDynamicOccluderToRay(RTCIntersectContext* context, unsigned rayIndex, int style)
@@ -128,12 +128,84 @@ else
     sha256sum --strict --check qbsp-vis.sha256sum || exit 1
 fi
 
-# FIXME: light output is nondeterministic so we can't check the hashes currently
+# FIXME: light output hashes haven't been generated yet. The lightmap layout
+# no longer depends on the thread count, so no need for -threads 1.
 
 for bsp in ${HASH_CHECK_BSPS}; do
-    light -threads 1 ${bsp} || exit 1
+    light ${bsp} || exit 1
 done
 
+# RGB lightmaps: the .lit/.lux files and the RGBLIGHTING/LIGHTINGDIR
+# bspx lumps must be exactly as large as the (already RGB) lightdata lump
+cp e1m1-hlbsp.bsp e1m1-hlbsp-lit.bsp || exit 1
+light -lit -lux -bspx e1m1-hlbsp-lit.bsp || exit 1
+python3 - e1m1-hlbsp-lit <<'EOF' || exit 1
+import os, struct, sys
+stem = sys.argv[1]
+data = open(stem + '.bsp', 'rb').read()
+lumps = [struct.unpack_from('<ii', data, 4 + 8 * i) for i in range(15)]
+lightdatasize = lumps[8][1]
+bspx = (max(ofs + size for ofs, size in lumps) + 3) & ~3
+assert data[bspx:bspx + 4] == b'BSPX', 'missing BSPX header'
+sizes = {}
+for i in range(struct.unpack_from('<i', data, bspx + 4)[0]):
+    name, ofs, size = struct.unpack_from('<24sii', data, bspx + 8 + 32 * i)
+    sizes[name.rstrip(b'\0').decode()] = size
+sizes['.lit'] = os.path.getsize(stem + '.lit') - 8
+sizes['.lux'] = os.path.getsize(stem + '.lux') - 8
+for name in ('RGBLIGHTING', 'LIGHTINGDIR', '.lit', '.lux'):
+    assert sizes[name] == lightdatasize, f'{name}: {sizes[name]} bytes, expected {lightdatasize}'
+EOF
+
+# multi-scale lighting: with 8qu faces (_lmscale 0.5) under a 12qu world
+# scale, the 12qu lightmap is filtered from the 8qu one instead of traced.
+# It must stay close to lighting the map at 12qu directly.
+python3 - quake_map_source/DM1.map dm1-multiscale.map <<'EOF' || exit 1
+import sys
+text = open(sys.argv[1]).read()
+worldspawn = text.index('"classname" "worldspawn"')
+open(sys.argv[2], 'w').write(text[:worldspawn] + '"_lmscale" "0.5"\n"_lightmap_scale" "12"\n' + text[worldspawn:])
+EOF
+qbsp -noverbose dm1-multiscale.map || exit 1
+cp dm1-multiscale.bsp dm1-multiscale-direct.bsp || exit 1
+light -extra4 dm1-multiscale.bsp || exit 1
+light -extra4 -lmscale 12 dm1-multiscale-direct.bsp || exit 1
+python3 - dm1-multiscale.bsp dm1-multiscale-direct.bsp <<'EOF' || exit 1
+import math, struct, sys
+def lightmaps(path, scale=12):
+    data = open(path, 'rb').read()
+    lumps = [struct.unpack_from('<ii', data, 4 + 8 * i) for i in range(15)]
+    read = lambda lump, fmt: list(struct.iter_unpack(fmt, data[lumps[lump][0]:sum(lumps[lump])]))
+    verts, texinfo, faces = read(3, '<3f'), read(6, '<8fii'), read(7, '<hhihh4Bi')
+    edges, surfedges = read(12, '<HH'), read(13, '<i')
+    lightdata = data[lumps[8][0]:sum(lumps[8])]
+    result = []
+    for face in faces:
+        styles, lightofs = face[5:9], face[9]
+        if lightofs < 0:
+            result.append((styles, b''))
+            continue
+        vecs = texinfo[face[4]]
+        size = 1
+        for axis in range(2):
+            coords = []
+            for edge in surfedges[face[2]:face[2] + face[3]]:
+                v = verts[edges[edge[0]][0] if edge[0] >= 0 else edges[-edge[0]][1]]
+                coords.append(sum(v[k] * vecs[4 * axis + k] for k in range(3)) + vecs[4 * axis + 3])
+            size *= math.ceil(max(coords) / scale) - math.floor(min(coords) / scale) + 1
+        size *= sum(1 for style in styles if style != 255)
+        result.append((styles, lightdata[lightofs:lightofs + size]))
+    return result
+diffs = []
+for (styles_a, a), (styles_b, b) in zip(lightmaps(sys.argv[1]), lightmaps(sys.argv[2])):
+    if styles_a == styles_b:
+        diffs += [abs(x - y) for x, y in zip(a, b)]
+diffs.sort()
+mean, p99 = sum(diffs) / len(diffs), diffs[len(diffs) * 99 // 100]
+print(f'multi-scale vs direct 12qu lightmap: mean abs diff {mean:.3f}, 99th percentile {p99}')
+assert mean < 2 and p99 <= 24
+EOF
+
 # if [[ $UPDATE_HASHES -ne 0 ]]; then
 #     sha256sum ${HASH_CHECK_BSPS} > qbsp-vis-light.sha256sum || exit 1
 # else
@@ -1287,6 +1287,9 @@ main(int argc, char **argv)
         if (!strcmp(argv[i], "-threads")) {
             numthreads = atoi(argv[i + 1]);
             i++;
+        } else if (!strcmp(argv[i], "-threadaffinity")) {
+            logprint("thread affinity enabled\n");
+            threadaffinity = true;
         } else if (!strcmp(argv[i], "-fast")) {
             logprint("fastvis = true\n");
             fastvis = true;
@@ -1331,7 +1334,7 @@ main(int argc, char **argv)
     }
 
     if (i != argc - 1) {
-        printf("usage: vis [-threads #] [-level 0-4] [-fast] [-v|-vv] "
+        printf("usage: vis [-threads #] [-threadaffinity] [-level 0-4] [-fast] [-v|-vv] "
                "[-credits] bspfile\n");
         exit(1);
     }